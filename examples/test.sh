@@ -4,12 +4,18 @@
 resin add.rsn
 resin class.rsn
 resin closure.rsn
+resin deep_stack.rsn
 resin fib.rsn
 resin for.rsn
+resin fold.rsn
+resin for_clauses.rsn
 resin hello.rsn
 resin inheritance.rsn
 resin list.rsn
+resin long_list.rsn
 resin match.rsn
 resin math.rsn
 resin rectangle.rsn
-resin scope.rsn
\ No newline at end of file
+resin scope.rsn
+resin selectors.rsn
+resin shift.rsn
\ No newline at end of file
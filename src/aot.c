@@ -0,0 +1,895 @@
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "include/aot.h"
+
+#ifdef NATIVE_CODE
+
+#include "include/chunk.h"
+#include "include/compiler.h"
+#include "include/optimizer.h"
+#include "include/util.h"
+
+typedef struct {
+  ObjFunc** funcs;
+  int count;
+  int capacity;
+} FuncList;
+
+// The buffer grows with realloc, since it isn't part of the GC
+// heap.
+static void* growBuffer(void* buffer, size_t size) {
+  void* result = realloc(buffer, size);
+  if (result == NULL) {
+    printf("\nCould not allocate memory.\n");
+    exit(1);
+  }
+  return result;
+}
+
+// Numbers a script's functions as AotFunc says: the function,
+// then the functions among its constants, depth first.
+static void collectFuncs(FuncList* list, ObjFunc* func) {
+  if (list->count == list->capacity) {
+    list->capacity = list->capacity < 8 ? 8 : list->capacity * 2;
+    list->funcs = growBuffer(
+      list->funcs,
+      sizeof(ObjFunc*) * list->capacity
+    );
+  }
+  list->funcs[list->count++] = func;
+  ValueArray* constants = &func->chunk.constants;
+  for (int i = 0; i < constants->count; i++) {
+    if (IS_FUNC(constants->values[i])) {
+      collectFuncs(list, AS_FUNC(constants->values[i]));
+    }
+  }
+}
+
+static const char* opNames[] = {
+  #define OPCODE_NAME(name) #name,
+  OPCODES(OPCODE_NAME)
+  #undef OPCODE_NAME
+};
+
+typedef struct {
+  ObjFunc* func;
+  // Offsets a jump lands on, which get a label.
+  bool* targets;
+  char* text;
+  int count;
+  int capacity;
+  // Which of the prologue's locals the body uses.
+  bool usesAt;
+  bool usesCode;
+  bool usesConstants;
+} Emitter;
+
+static void emit(Emitter* e, const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(NULL, 0, format, args);
+  va_end(args);
+  if (e->count + length + 1 > e->capacity) {
+    while (e->count + length + 1 > e->capacity) {
+      e->capacity = e->capacity < 256 ? 256 : e->capacity * 2;
+    }
+    e->text = growBuffer(e->text, e->capacity);
+  }
+  va_start(args, format);
+  vsnprintf(e->text + e->count, length + 1, format, args);
+  va_end(args);
+  e->count += length;
+}
+
+static int readShort(uint8_t* at) {
+  return (at[0] << 8) | at[1];
+}
+
+// The first operand of an indexed instruction, short or _LONG.
+static int indexOperand(uint8_t* ins) {
+  switch (ins[0]) {
+    case OP_GET_LOCAL_LONG:
+    case OP_SET_LOCAL_LONG:
+      return readShort(&ins[1]);
+    case OP_CONST_LONG:
+    case OP_GET_GLOBAL_LONG:
+    case OP_DEF_GLOBAL_LONG:
+    case OP_SET_GLOBAL_LONG:
+    case OP_GET_PROP_LONG:
+    case OP_SET_PROP_LONG:
+    case OP_INVOKE_LONG:
+      return (ins[1] << 16) | (ins[2] << 8) | ins[3];
+    default:
+      return ins[1];
+  }
+}
+
+// Where the jump at 'offset' lands, or -1 if it isn't one.
+static int jumpTarget(uint8_t* ins, int offset) {
+  switch (ins[0]) {
+    case OP_JMP:
+    case OP_JMPF:
+    case OP_JMPF_POP:
+      return offset + 3 + readShort(&ins[1]);
+    case OP_LOOP:
+      return offset + 3 - readShort(&ins[1]);
+    case OP_JLT_LOCAL_CONST:
+      return offset + 5 + readShort(&ins[3]);
+    case OP_FOR_NUM:
+      return offset + 7 - readShort(&ins[5]);
+    default:
+      return -1;
+  }
+}
+
+// A switch's entries, as jitSwitch() numbers them: the miss, then
+// one per case. Returns how many there are.
+static int switchTargets(Chunk* chunk, int offset, int* targets) {
+  uint8_t* ins = &chunk->code[offset];
+  int end = offset + instructionLen(chunk, offset);
+  int count;
+  int first;
+  int stride;
+  if (ins[0] == OP_SWITCH_INT) {
+    count = readShort(&ins[5]);
+    first = 7;
+    stride = 2;
+  }
+  else {
+    count = readShort(&ins[2]);
+    first = 4;
+    stride = 5;
+  }
+  if (targets != NULL) {
+    for (int i = 0; i <= count; i++) {
+      targets[i] = end + readShort(&ins[first + i * stride]);
+    }
+  }
+  return count + 1;
+}
+
+static void markTargets(Emitter* e) {
+  Chunk* chunk = &e->func->chunk;
+  for (int offset = 0; offset < chunk->count;) {
+    uint8_t* ins = &chunk->code[offset];
+    int target = jumpTarget(ins, offset);
+    if (target != -1) {
+      e->targets[target] = true;
+    }
+    if (ins[0] == OP_SWITCH_INT || ins[0] == OP_SWITCH_STR) {
+      int count = switchTargets(chunk, offset, NULL);
+      int* entries = growBuffer(NULL, sizeof(int) * count);
+      switchTargets(chunk, offset, entries);
+      for (int i = 0; i < count; i++) {
+        e->targets[entries[i]] = true;
+      }
+      free(entries);
+    }
+    offset += instructionLen(chunk, offset);
+  }
+}
+
+// Writes constant 'index' as a C expression to 'out'. Numbers are
+// spelled out, so the C compiler can fold them.
+static void constExpr(Emitter* e, int index, char* out, size_t size) {
+  Value value = e->func->chunk.constants.values[index];
+  if (IS_INT(value)) {
+    snprintf(out, size, "INT_VAL(%lld)", (long long)AS_INT(value));
+  }
+  else if (IS_NUM(value) && isfinite(AS_NUM(value))) {
+    snprintf(out, size, "NUM_VAL(%a)", AS_NUM(value));
+  }
+  else {
+    e->usesConstants = true;
+    snprintf(out, size, "constants[%d]", index);
+  }
+}
+
+// Runs the instruction through jitStep(). With 'isElse', as the
+// slow path of the fast path before it.
+static void emitStep(Emitter* e, int offset, bool isElse) {
+  e->usesCode = true;
+  emit(
+    e,
+    "  %sif (aotStep(&sp, code + %d) == STEP_ERROR) {\n"
+    "    return JIT_ERROR;\n"
+    "  }\n",
+    isElse ? "else " : "", offset
+  );
+}
+
+// The slow path of an instruction that may jump to 'target'.
+static void emitStepJump(Emitter* e, int offset, int target) {
+  e->usesCode = true;
+  emit(
+    e,
+    "  else {\n"
+    "    StepResult result = aotStep(&sp, code + %d);\n"
+    "    if (result == STEP_ERROR) {\n"
+    "      return JIT_ERROR;\n"
+    "    }\n"
+    "    if (result == STEP_JUMP) {\n"
+    "      goto at%d;\n"
+    "    }\n"
+    "  }\n",
+    offset, target
+  );
+}
+
+// Hands the frame back to the interpreter at 'offset'.
+static void emitExit(Emitter* e, int offset) {
+  e->usesCode = true;
+  emit(
+    e,
+    "  frame->ip = code + %d;\n"
+    "  vm.stackTop = sp;\n"
+    "  return JIT_EXIT;\n",
+    offset
+  );
+}
+
+// The ArithOp for + - or *, as the C that names it.
+static const char* arithName(char op) {
+  switch (op) {
+    case '-': return "ARITH_SUB";
+    case '*': return "ARITH_MUL";
+    default: return "ARITH_ADD";
+  }
+}
+
+// a op b on the top two values. Two integers stay integers while
+// the result fits. DIV leaves a zero divisor to the slow path,
+// which reports it.
+static void emitArith(Emitter* e, int offset, char op) {
+  if (op != '/') {
+    emit(
+      e,
+      "  if (\n"
+      "    IS_INT(sp[-2]) && IS_INT(sp[-1]) &&\n"
+      "    intArith(%s, sp[-2], sp[-1], &sp[-2])\n"
+      "  ) {\n"
+      "    sp--;\n"
+      "  }\n",
+      arithName(op)
+    );
+  }
+  emit(
+    e,
+    "  %sif (IS_NUM(sp[-2]) && IS_NUM(sp[-1])%s) {\n"
+    "    sp[-2] = NUM_VAL(AS_NUM(sp[-2]) %c AS_NUM(sp[-1]));\n"
+    "    sp--;\n"
+    "  }\n",
+    op == '/' ? "" : "else ",
+    op == '/' ? " && AS_NUM(sp[-1]) != 0" : "", op
+  );
+  emitStep(e, offset, true);
+}
+
+// a op b on two integers, for % & | and ~, which is xor. A zero
+// divisor is left to the slow path.
+static void emitIntOp(Emitter* e, int offset, const char* op) {
+  emit(
+    e,
+    "  if (IS_INT(sp[-2]) && IS_INT(sp[-1])%s) {\n"
+    "    sp[-2] = INT_VAL(AS_INT(sp[-2]) %s AS_INT(sp[-1]));\n"
+    "    sp--;\n"
+    "  }\n",
+    op[0] == '%' ? " && AS_INT(sp[-1]) != 0" : "", op
+  );
+  emitStep(e, offset, true);
+}
+
+// Integers compare as integers, other numbers as doubles and
+// anything else as valsLt() and friends do.
+static void emitCompare(Emitter* e, const char* op, const char* fn) {
+  emit(
+    e,
+    "  if (IS_INT(sp[-2]) && IS_INT(sp[-1])) {\n"
+    "    sp[-2] = BOOL_VAL(AS_INT(sp[-2]) %s AS_INT(sp[-1]));\n"
+    "  }\n"
+    "  else if (IS_NUM(sp[-2]) && IS_NUM(sp[-1])) {\n"
+    "    sp[-2] = BOOL_VAL(AS_NUM(sp[-2]) %s AS_NUM(sp[-1]));\n"
+    "  }\n"
+    "  else {\n"
+    "    sp[-2] = BOOL_VAL(%s(sp[-2], sp[-1]));\n"
+    "  }\n"
+    "  sp--;\n",
+    op, op, fn
+  );
+}
+
+static void emitRegisterArith(Emitter* e, int offset) {
+  uint8_t* ins = &e->func->chunk.code[offset];
+  OpCode op = ins[0];
+  bool store =
+    op == OP_ADD_RRR || op == OP_SUB_RRR || op == OP_MUL_RRR ||
+    op == OP_ADD_RRK || op == OP_SUB_RRK || op == OP_MUL_RRK;
+  bool isConst =
+    op == OP_ADD_RK || op == OP_SUB_RK || op == OP_MUL_RK ||
+    op == OP_ADD_RRK || op == OP_SUB_RRK || op == OP_MUL_RRK;
+  char arith = '+';
+  if (op == OP_SUB_RR || op == OP_SUB_RK || op == OP_SUB_RRR || op == OP_SUB_RRK) {
+    arith = '-';
+  }
+  else if (op == OP_MUL_RR || op == OP_MUL_RK || op == OP_MUL_RRR || op == OP_MUL_RRK) {
+    arith = '*';
+  }
+  uint8_t* operands = store ? &ins[2] : &ins[1];
+  char b[64];
+  if (isConst) {
+    constExpr(e, operands[1], b, sizeof(b));
+  }
+  else {
+    snprintf(b, sizeof(b), "slots[%d]", operands[1]);
+  }
+  char dest[32];
+  char result[32];
+  if (store) {
+    snprintf(dest, sizeof(dest), "slots[%d] =", ins[1]);
+    snprintf(result, sizeof(result), "&slots[%d]", ins[1]);
+  }
+  else {
+    snprintf(dest, sizeof(dest), "*sp++ =");
+    snprintf(result, sizeof(result), "sp");
+  }
+  emit(
+    e,
+    "  if (\n"
+    "    IS_INT(slots[%d]) && IS_INT(%s) &&\n"
+    "    intArith(%s, slots[%d], %s, %s)\n"
+    "  ) {\n"
+    "%s"
+    "  }\n"
+    "  else if (IS_NUM(slots[%d]) && IS_NUM(%s)) {\n"
+    "    %s NUM_VAL(AS_NUM(slots[%d]) %c AS_NUM(%s));\n"
+    "  }\n",
+    operands[0], b, arithName(arith), operands[0], b, result,
+    store ? "" : "    sp++;\n",
+    operands[0], b, dest, operands[0], arith, b
+  );
+  emitStep(e, offset, true);
+}
+
+static void emitJumpLessLocalConst(Emitter* e, int offset) {
+  uint8_t* ins = &e->func->chunk.code[offset];
+  char b[64];
+  constExpr(e, ins[2], b, sizeof(b));
+  // Only one of the kinds can match the constant.
+  const char* kind = IS_INT(e->func->chunk.constants.values[ins[2]])
+    ? "INT" : "NUM";
+  emit(
+    e,
+    "  if (IS_%s(slots[%d]) && IS_%s(%s)) {\n"
+    "    if (!(AS_%s(slots[%d]) < AS_%s(%s))) {\n"
+    "      *sp++ = FALSE_VAL;\n"
+    "      goto at%d;\n"
+    "    }\n"
+    "  }\n",
+    kind, ins[1], kind, b, kind, ins[1], kind, b,
+    jumpTarget(ins, offset)
+  );
+  emitStepJump(e, offset, jumpTarget(ins, offset));
+}
+
+static void emitForNum(Emitter* e, int offset) {
+  uint8_t* ins = &e->func->chunk.code[offset];
+  Value* constants = e->func->chunk.constants.values;
+  int slot = ins[1];
+  Value step = constants[ins[2]];
+  int limit = ins[3];
+  uint8_t mode = ins[4];
+  int target = jumpTarget(ins, offset);
+  bool limitLocal = mode & FOR_NUM_LIMIT_LOCAL;
+  // An integer loop counts in integers, with an integer limit; any
+  // other kinds are left to the slow path.
+  bool isInt = IS_INT(step) && (limitLocal || IS_INT(constants[limit]));
+  if (
+    !isInt &&
+    (!IS_NUM(step) || (!limitLocal && !IS_NUM(constants[limit])))
+  ) {
+    e->usesCode = true;
+    emit(
+      e,
+      "  {\n"
+      "    StepResult result = aotStep(&sp, code + %d);\n"
+      "    if (result == STEP_ERROR) {\n"
+      "      return JIT_ERROR;\n"
+      "    }\n"
+      "    if (result == STEP_JUMP) {\n"
+      "      goto at%d;\n"
+      "    }\n"
+      "  }\n",
+      offset, target
+    );
+    return;
+  }
+  char stepExpr[64];
+  constExpr(e, ins[2], stepExpr, sizeof(stepExpr));
+  char limitExpr[64];
+  if (limitLocal) {
+    snprintf(limitExpr, sizeof(limitExpr), "slots[%d]", limit);
+  }
+  else {
+    constExpr(e, limit, limitExpr, sizeof(limitExpr));
+  }
+  const char* cmp;
+  switch (mode & FOR_NUM_CMP_MASK) {
+    case FOR_NUM_LT: cmp = "<"; break;
+    case FOR_NUM_LT_EQU: cmp = "<="; break;
+    case FOR_NUM_GT: cmp = ">"; break;
+    default: cmp = ">="; break;
+  }
+  // The limit may be the counter itself, so it's read after the
+  // store, as the interpreter does.
+  if (isInt) {
+    emit(
+      e,
+      "  if (\n"
+      "    IS_INT(slots[%d]) && IS_INT(%s) &&\n"
+      "    intArith(%s, slots[%d], %s, &slots[%d])\n"
+      "  ) {\n"
+      "    if (AS_INT(slots[%d]) %s AS_INT(%s)) {\n"
+      "      goto at%d;\n"
+      "    }\n"
+      "    *sp++ = FALSE_VAL;\n"
+      "  }\n",
+      slot, limitExpr,
+      mode & FOR_NUM_SUB ? "ARITH_SUB" : "ARITH_ADD", slot, stepExpr, slot,
+      slot, cmp, limitExpr,
+      target
+    );
+    emitStepJump(e, offset, target);
+    return;
+  }
+  emit(
+    e,
+    "  if (IS_NUM(slots[%d]) && IS_NUM(%s)) {\n"
+    "    slots[%d] = NUM_VAL(AS_NUM(slots[%d]) %c AS_NUM(%s));\n"
+    "    if (AS_NUM(slots[%d]) %s AS_NUM(%s)) {\n"
+    "      goto at%d;\n"
+    "    }\n"
+    "    *sp++ = FALSE_VAL;\n"
+    "  }\n",
+    slot, limitExpr,
+    slot, slot, mode & FOR_NUM_SUB ? '-' : '+', stepExpr,
+    slot, cmp, limitExpr,
+    target
+  );
+  emitStepJump(e, offset, target);
+}
+
+static void emitSwitch(Emitter* e, int offset) {
+  Chunk* chunk = &e->func->chunk;
+  int count = switchTargets(chunk, offset, NULL);
+  int* entries = growBuffer(NULL, sizeof(int) * count);
+  switchTargets(chunk, offset, entries);
+  e->usesCode = true;
+  emit(
+    e,
+    "  vm.stackTop = sp;\n"
+    "  switch (jitSwitch(code + %d)) {\n",
+    offset
+  );
+  for (int i = 1; i < count; i++) {
+    emit(e, "    case %d: goto at%d;\n", i, entries[i]);
+  }
+  emit(e, "    default: goto at%d;\n  }\n", entries[0]);
+  free(entries);
+}
+
+// Returns the top value. Closing upvalues is left to jitReturn(),
+// when any are open in this frame.
+static void emitReturn(Emitter* e) {
+  emit(
+    e,
+    "  if (vm.openUpvals != NULL && vm.openUpvals->location >= slots) {\n"
+    "    vm.stackTop = sp;\n"
+    "    jitReturn();\n"
+    "  }\n"
+    "  else {\n"
+    "    slots[0] = sp[-1];\n"
+    "    vm.stackTop = slots + 1;\n"
+    "    vm.frameCount--;\n"
+    "  }\n"
+    "  return JIT_RETURNED;\n"
+  );
+}
+
+// Runs a call through jitStep(). A callee with native code is
+// called straight from here, keeping the C stack to one frame per
+// call.
+static void emitCall(Emitter* e, int offset) {
+  e->usesAt = true;
+  e->usesCode = true;
+  emit(
+    e,
+    "  {\n"
+    "    StepResult result = aotStep(&sp, code + %d);\n"
+    "    if (result == STEP_ERROR) {\n"
+    "      return JIT_ERROR;\n"
+    "    }\n",
+    offset
+  );
+  if (e->func->chunk.code[offset] == OP_TAIL_CALL) {
+    emit(
+      e,
+      "    if (result == STEP_TAIL_CALL) {\n"
+      "      return JIT_TAIL_CALL;\n"
+      "    }\n"
+    );
+  }
+  emit(
+    e,
+    "    if (result == STEP_CALL && !aotCall(at)) {\n"
+    "      return JIT_ERROR;\n"
+    "    }\n"
+    "    frame = &vm.frames[at];\n"
+    "    slots = frame->slots;\n"
+    "    sp = vm.stackTop;\n"
+    "  }\n"
+  );
+}
+
+static void emitInstruction(Emitter* e, int offset) {
+  uint8_t* ins = &e->func->chunk.code[offset];
+  char value[64];
+  switch (ins[0]) {
+    case OP_CONST:
+    case OP_CONST_LONG:
+      constExpr(e, indexOperand(ins), value, sizeof(value));
+      emit(e, "  *sp++ = %s;\n", value);
+      break;
+    case OP_SMALLINT:
+      emit(e, "  *sp++ = INT_VAL(%d);\n", (int8_t)ins[1]);
+      break;
+    case OP_NIL: emit(e, "  *sp++ = NIL_VAL;\n"); break;
+    case OP_TRUE: emit(e, "  *sp++ = TRUE_VAL;\n"); break;
+    case OP_FALSE: emit(e, "  *sp++ = FALSE_VAL;\n"); break;
+    case OP_DUP:
+      emit(e, "  *sp = sp[-1];\n  sp++;\n");
+      break;
+    case OP_POP: emit(e, "  sp--;\n"); break;
+    case OP_GET_LOCAL:
+    case OP_GET_LOCAL_LONG:
+      emit(e, "  *sp++ = slots[%d];\n", indexOperand(ins));
+      break;
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_LONG:
+      emit(e, "  slots[%d] = sp[-1];\n", indexOperand(ins));
+      break;
+    case OP_GET_UPVAL:
+      emit(
+        e,
+        "  *sp++ = *frame->closure->upvals[%d]->location;\n",
+        ins[1]
+      );
+      break;
+    case OP_SET_UPVAL:
+      emit(
+        e,
+        "  *frame->closure->upvals[%d]->location = sp[-1];\n",
+        ins[1]
+      );
+      break;
+    case OP_GET_CAPTURE:
+      emit(e, "  *sp++ = frame->closure->captures[%d];\n", ins[1]);
+      break;
+    case OP_ADD:
+    case OP_ADD_NUM:
+      emitArith(e, offset, '+');
+      break;
+    case OP_SUB: emitArith(e, offset, '-'); break;
+    case OP_MUL: emitArith(e, offset, '*'); break;
+    case OP_DIV: emitArith(e, offset, '/'); break;
+    case OP_MOD: emitIntOp(e, offset, "%"); break;
+    case OP_BIT_AND: emitIntOp(e, offset, "&"); break;
+    case OP_BIT_OR: emitIntOp(e, offset, "|"); break;
+    case OP_BIT_XOR: emitIntOp(e, offset, "^"); break;
+    case OP_LT:
+    case OP_LT_NUM:
+      emitCompare(e, "<", "valsLt");
+      break;
+    case OP_LT_EQU:
+    case OP_LT_EQU_NUM:
+      emitCompare(e, "<=", "valsLtEqu");
+      break;
+    case OP_GT:
+    case OP_GT_NUM:
+      emitCompare(e, ">", "valsGt");
+      break;
+    case OP_GT_EQU:
+    case OP_GT_EQU_NUM:
+      emitCompare(e, ">=", "valsGtEqu");
+      break;
+    case OP_EQU:
+      emit(e, "  sp[-2] = BOOL_VAL(valsEqu(sp[-2], sp[-1]));\n  sp--;\n");
+      break;
+    case OP_NOT_EQU:
+      emit(e, "  sp[-2] = BOOL_VAL(valsNotEqu(sp[-2], sp[-1]));\n  sp--;\n");
+      break;
+    case OP_NOT:
+      emit(e, "  sp[-1] = BOOL_VAL(aotFalsey(sp[-1]));\n");
+      break;
+    case OP_NEGATE:
+      emit(
+        e,
+        "  if (IS_INT(sp[-1]) && AS_INT(sp[-1]) != INT_VAL_MIN) {\n"
+        "    sp[-1] = INT_VAL(-AS_INT(sp[-1]));\n"
+        "  }\n"
+        "  else if (IS_NUM(sp[-1])) {\n"
+        "    sp[-1] = NUM_VAL(-AS_NUM(sp[-1]));\n"
+        "  }\n"
+      );
+      emitStep(e, offset, true);
+      break;
+    case OP_JMP:
+    case OP_LOOP:
+      emit(e, "  goto at%d;\n", jumpTarget(ins, offset));
+      break;
+    case OP_JMPF:
+      emit(
+        e,
+        "  if (aotFalsey(sp[-1])) {\n    goto at%d;\n  }\n",
+        jumpTarget(ins, offset)
+      );
+      break;
+    case OP_JMPF_POP:
+      emit(
+        e,
+        "  if (aotFalsey(sp[-1])) {\n    goto at%d;\n  }\n  sp--;\n",
+        jumpTarget(ins, offset)
+      );
+      break;
+    case OP_JLT_LOCAL_CONST:
+      emitJumpLessLocalConst(e, offset);
+      break;
+    case OP_FOR_NUM:
+      emitForNum(e, offset);
+      break;
+    case OP_ADD_RR:
+    case OP_SUB_RR:
+    case OP_MUL_RR:
+    case OP_ADD_RK:
+    case OP_SUB_RK:
+    case OP_MUL_RK:
+    case OP_ADD_RRR:
+    case OP_SUB_RRR:
+    case OP_MUL_RRR:
+    case OP_ADD_RRK:
+    case OP_SUB_RRK:
+    case OP_MUL_RRK:
+      emitRegisterArith(e, offset);
+      break;
+    case OP_SWITCH_INT:
+    case OP_SWITCH_STR:
+      emitSwitch(e, offset);
+      break;
+    case OP_RETURN:
+      emitReturn(e);
+      break;
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    case OP_INVOKE:
+    case OP_INVOKE_LONG:
+    case OP_INVOKE_SUPER:
+    case OP_INVOKE_SUPER_LONG:
+      emitCall(e, offset);
+      break;
+    // The program compiles the same source into a fresh VM, so
+    // each global gets the same slot it has here.
+    case OP_GET_GLOBAL:
+    case OP_GET_GLOBAL_LONG:
+      emit(
+        e,
+        "  if (!IS_UNDEFINED(vm.globals[%d])) {\n"
+        "    *sp++ = vm.globals[%d];\n"
+        "  }\n",
+        indexOperand(ins), indexOperand(ins)
+      );
+      emitStep(e, offset, true);
+      break;
+    case OP_DEF_GLOBAL:
+    case OP_DEF_GLOBAL_LONG:
+      emit(e, "  vm.globals[%d] = *--sp;\n", indexOperand(ins));
+      break;
+    case OP_SET_GLOBAL:
+    case OP_SET_GLOBAL_LONG:
+      emit(
+        e,
+        "  if (!IS_UNDEFINED(vm.globals[%d])) {\n"
+        "    vm.globals[%d] = sp[-1];\n"
+        "  }\n",
+        indexOperand(ins), indexOperand(ins)
+      );
+      emitStep(e, offset, true);
+      break;
+    case OP_GET_PROP:
+    case OP_GET_PROP_LONG:
+    case OP_SET_PROP:
+    case OP_SET_PROP_LONG:
+    case OP_GET_LOCAL_PROP:
+    case OP_GET_SUPER:
+    case OP_GET_SUPER_LONG:
+    case OP_BUILD_LIST:
+    case OP_EXTEND_LIST:
+    case OP_INDEX_SUB:
+    case OP_STORE_SUB:
+    case OP_POW:
+    case OP_SHL:
+    case OP_SHR:
+    case OP_BIT_NOT:
+    case OP_CLOSE_UPVAL:
+    case OP_CLOSURE:
+    case OP_CLOSURE_LONG:
+    case OP_CLASS:
+    case OP_CLASS_LONG:
+    case OP_INHERIT:
+    case OP_METHOD:
+    case OP_METHOD_LONG:
+      emitStep(e, offset, false);
+      break;
+    case OP_THROW:
+      // Not emitted by the compiler yet.
+      break;
+    default:
+      // The interpreter finishes the frame.
+      emitExit(e, offset);
+      break;
+  }
+}
+
+static void emitFunc(FILE* out, ObjFunc* func, int index) {
+  Chunk* chunk = &func->chunk;
+  Emitter e;
+  memset(&e, 0, sizeof(Emitter));
+  e.func = func;
+  e.targets = growBuffer(NULL, sizeof(bool) * (chunk->count + 1));
+  memset(e.targets, 0, sizeof(bool) * (chunk->count + 1));
+  markTargets(&e);
+  for (int offset = 0; offset < chunk->count;) {
+    if (e.targets[offset]) {
+      emit(&e, "at%d:;\n", offset);
+    }
+    emit(&e, "  // %s\n", opNames[chunk->code[offset]]);
+    emitInstruction(&e, offset);
+    offset += instructionLen(chunk, offset);
+  }
+
+  if (func->name == NULL) {
+    fprintf(out, "// <script>\n");
+  }
+  else {
+    fprintf(out, "// %s()\n", func->name->chars);
+  }
+  fprintf(out, "static JitResult func%d(CallFrame* frame) {\n", index);
+  if (e.usesAt) {
+    fprintf(out, "  int at = (int)(frame - vm.frames);\n");
+  }
+  if (e.usesCode) {
+    fprintf(out, "  uint8_t* code = frame->closure->func->chunk.code;\n");
+  }
+  if (e.usesConstants) {
+    fprintf(
+      out,
+      "  Value* constants = frame->closure->func->chunk.constants.values;\n"
+    );
+  }
+  fprintf(out, "  Value* slots = frame->slots;\n");
+  fprintf(out, "  Value* sp = vm.stackTop;\n");
+  fwrite(e.text, 1, e.count, out);
+  fprintf(out, "}\n\n");
+  free(e.text);
+  free(e.targets);
+}
+
+// The script as a string literal, so the program can compile it
+// again.
+static void emitSource(FILE* out, const char* source) {
+  fprintf(out, "static const char source[] =\n  \"");
+  for (const char* c = source; *c != '\0'; c++) {
+    switch (*c) {
+      case '\n':
+        fprintf(out, "\\n\"%s", c[1] == '\0' ? "" : "\n  \"");
+        continue;
+      case '"': fprintf(out, "\\\""); break;
+      case '\\': fprintf(out, "\\\\"); break;
+      // Keeps trigraphs out.
+      case '?': fprintf(out, "\\?"); break;
+      default:
+        if ((unsigned char)*c < ' ' || (unsigned char)*c >= 0x7f) {
+          fprintf(out, "\\%03o", (unsigned char)*c);
+        }
+        else {
+          fputc(*c, out);
+        }
+        break;
+    }
+  }
+  if (source[0] == '\0' || source[strlen(source) - 1] != '\n') {
+    fprintf(out, "\"");
+  }
+  fprintf(out, ";\n\n");
+}
+
+bool emitC(const char* path, FILE* out) {
+  char* source = readFile(path);
+  ObjFunc* script = compile(source);
+  if (script == NULL) {
+    free(source);
+    return false;
+  }
+  FuncList list = {NULL, 0, 0};
+  collectFuncs(&list, script);
+
+  fprintf(
+    out,
+    "// Emitted by `resin --emit-c %s`. Link it with the runtime\n"
+    "// that emitted it:\n"
+    "//   make libresin.a\n"
+    "//   cc -Ofast -Isrc program.c libresin.a -lm\n\n"
+    "#include \"include/aot.h\"\n\n",
+    path
+  );
+  emitSource(out, source);
+  for (int i = 0; i < list.count; i++) {
+    emitFunc(out, list.funcs[i], i);
+  }
+  fprintf(out, "static const AotFunc funcs[] = {\n");
+  for (int i = 0; i < list.count; i++) {
+    fprintf(out, "  {func%d, %d},\n", i, list.funcs[i]->chunk.count);
+  }
+  fprintf(
+    out,
+    "};\n\n"
+    "int main() {\n"
+    "  return aotMain(source, funcs, sizeof(funcs) / sizeof(AotFunc));\n"
+    "}\n"
+  );
+  free(list.funcs);
+  free(source);
+  return true;
+}
+
+int aotMain(const char* source, const AotFunc* funcs, int count) {
+  initVM();
+  ObjFunc* script = compile(source);
+  if (script == NULL) {
+    return 65;
+  }
+  FuncList list = {NULL, 0, 0};
+  collectFuncs(&list, script);
+  bool matches = list.count == count;
+  for (int i = 0; matches && i < count; i++) {
+    matches = list.funcs[i]->chunk.count == funcs[i].codeLength;
+  }
+  if (!matches) {
+    fprintf(stderr, "Program was emitted by a different Resin.\n");
+    free(list.funcs);
+    return 65;
+  }
+  for (int i = 0; i < count; i++) {
+    ObjFunc* func = list.funcs[i];
+    func->native = (void*)funcs[i].native;
+    #ifdef JIT
+    // Keeps the JIT from replacing it.
+    func->calls = JIT_THRESHOLD;
+    #endif
+  }
+  free(list.funcs);
+  InterpretResult result = interpretFunc(script);
+  freeVM();
+  return result == INTERPRET_OK ? 0 : 70;
+}
+
+#else
+
+bool emitC(const char* path, FILE* out) {
+  (void)out;
+  fprintf(stderr, "Cannot emit '%s': built without native code.\n", path);
+  return false;
+}
+
+#endif
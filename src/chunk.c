@@ -11,12 +11,15 @@ void initChunk(Chunk* chunk) {
   chunk->lineCapacity = 0;
   chunk->lines = NULL;
   initValueArray(&chunk->constants);
+  chunk->constIndex = NULL;
+  chunk->constIndexCapacity = 0;
 }
 
 void freeChunk(Chunk* chunk) {
   FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
   FREE_ARRAY(int, chunk->lines, chunk->capacity);
   freeValueArray(&chunk->constants);
+  FREE_ARRAY(int, chunk->constIndex, chunk->constIndexCapacity);
   initChunk(chunk);
   FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
 }
@@ -56,13 +59,122 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line) {
   lineStart->line = line;
 }
 
+// Two constants are the same if their bits are: numbers by bit
+// pattern and objects by pointer, which for interned strings means
+// by contents.
+static bool sameConst(Value a, Value b) {
+  #ifdef NAN_BOXING
+  return a == b;
+  #else
+  if (a.type != b.type) {
+    return false;
+  }
+  if (IS_NUM(a)) {
+    return memcmp(&a.as.number, &b.as.number, sizeof(double)) == 0;
+  }
+  return IS_OBJ(a) ? AS_OBJ(a) == AS_OBJ(b) : valsEqu(a, b);
+  #endif
+}
+
+static uint32_t hashConst(Value value) {
+  uint64_t bits = 0;
+  #ifdef NAN_BOXING
+  bits = value;
+  #else
+  if (IS_NUM(value)) {
+    memcpy(&bits, &value.as.number, sizeof(double));
+  }
+  else if (IS_INT(value)) {
+    bits = (uint64_t)AS_INT(value);
+  }
+  else if (IS_OBJ(value)) {
+    bits = (uint64_t)(uintptr_t)AS_OBJ(value);
+  }
+  #endif
+  bits ^= bits >> 33;
+  bits *= 0xff51afd7ed558ccdULL;
+  bits ^= bits >> 33;
+  return (uint32_t)bits;
+}
+
+// Returns the bucket holding 'value', or the empty one it would go
+// in.
+static int* findConst(
+  int* index,
+  int capacity,
+  Chunk* chunk,
+  Value value
+) {
+  uint32_t bucket = hashConst(value) & (capacity - 1);
+  for (;;) {
+    int* entry = &index[bucket];
+    if (
+      *entry == -1 ||
+      sameConst(chunk->constants.values[*entry], value)
+    ) {
+      return entry;
+    }
+    bucket = (bucket + 1) & (capacity - 1);
+  }
+}
+
+static void growConstIndex(Chunk* chunk) {
+  int capacity = GROW_CAPACITY(chunk->constIndexCapacity);
+  int* index = ALLOCATE(int, capacity);
+  for (int i = 0; i < capacity; i++) {
+    index[i] = -1;
+  }
+  for (int i = 0; i < chunk->constants.count; i++) {
+    *findConst(index, capacity, chunk, chunk->constants.values[i]) = i;
+  }
+  FREE_ARRAY(int, chunk->constIndex, chunk->constIndexCapacity);
+  chunk->constIndex = index;
+  chunk->constIndexCapacity = capacity;
+}
+
+int lookupConst(Chunk* chunk, Value value) {
+  if (chunk->constIndexCapacity == 0) {
+    return -1;
+  }
+  return *findConst(
+    chunk->constIndex, chunk->constIndexCapacity, chunk, value
+  );
+}
+
 int addConst(Chunk* chunk, Value value) {
+  if (chunk->constIndexCapacity > 0) {
+    int* entry = findConst(
+      chunk->constIndex, chunk->constIndexCapacity, chunk, value
+    );
+    if (*entry != -1) {
+      return *entry;
+    }
+  }
   push(value);
   writeValueArray(&chunk->constants, value);
   pop();
+  // Keep the index at most half full.
+  if (chunk->constants.count * 2 > chunk->constIndexCapacity) {
+    growConstIndex(chunk);
+  }
+  else {
+    *findConst(
+      chunk->constIndex, chunk->constIndexCapacity, chunk, value
+    ) = chunk->constants.count - 1;
+  }
   return chunk->constants.count - 1;
 }
 
+void removeLastConst(Chunk* chunk) {
+  Value value = chunk->constants.values[chunk->constants.count - 1];
+  // Nothing was added after it, so nothing probed past its bucket
+  // and emptying that doesn't break any other lookup.
+  *findConst(
+    chunk->constIndex, chunk->constIndexCapacity, chunk, value
+  ) = -1;
+  chunk->constants.count--;
+}
+
 int getLine(Chunk* chunk, int instruction) {
   int start = 0;
   int end = chunk->lineCount - 1;
@@ -6,11 +6,17 @@
 #include "include/scanner.h"
 #include "include/object.h"
 #include "include/memory.h"
+#include "include/vm.h"
+#include "include/optimizer.h"
 #ifdef DEBUG_PRINT_CODE
 #include "include/debug.h"
 #endif
 
 #define MAX_CASES 256
+// A match needs this many literal arms before it is compiled to a
+// switch, and a switch table gets at most this many entries.
+#define SWITCH_MIN_ARMS 3
+#define SWITCH_MAX_SIZE 4096
 
 typedef struct {
   Token current;
@@ -25,6 +31,10 @@ typedef enum {
   PREC_OR, PREC_AND,
   PREC_EQU,
   PREC_COMP,
+  PREC_BIT_OR,
+  PREC_BIT_XOR,
+  PREC_BIT_AND,
+  PREC_SHIFT,
   PREC_TERM,
   PREC_FACTOR,
   PREC_UNARY,
@@ -44,11 +54,16 @@ typedef struct {
 typedef struct {
   Token name;
   int depth;
+  // Captured as an ObjUpval, which has to be closed.
   bool isCaptured;
+  // A function declaration's own name while its body compiles.
+  // The slot only holds the closure once OP_CLOSURE has run, so
+  // that can't copy it.
+  bool isDefining;
 } Local;
 
 typedef struct {
-  uint8_t index;
+  uint16_t index;
   bool isLocal;
 } Upvalue;
 
@@ -63,10 +78,15 @@ typedef struct Compiler {
   struct Compiler* enclosing;
   ObjFunc* func;
   FuncType type;
-  Local locals[UINT8_COUNT];
+  Local* locals;
   int localCount;
+  int localCapacity;
   Upvalue upvals[UINT8_COUNT];
+  Upvalue captures[UINT8_COUNT];
   int scopeDepth;
+  int lastCall;
+  // Where the last constant load began, for folding.
+  int lastConst;
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -78,6 +98,33 @@ Parser parser;
 Compiler* current = NULL;
 ClassCompiler* currentClass = NULL;
 
+// Every name the source assigns to anywhere. A variable whose name
+// isn't here keeps its first value, so closures copy it in.
+typedef struct {
+  Token* names;
+  int count;
+  int capacity;
+} Assigned;
+
+Assigned assigned;
+
+// A name the source declares 'const'. They are all found up front,
+// so code before the declaration can't assign to one either.
+// 'value' is what uses fold to once the declaration is compiled.
+typedef struct {
+  Token name;
+  bool declared;
+  Value value;
+} Constant;
+
+typedef struct {
+  Constant* entries;
+  int count;
+  int capacity;
+} Constants;
+
+Constants consts;
+
 static Chunk* currentChunk() {
   return &current->func->chunk;
 }
@@ -177,17 +224,109 @@ static void emitReturn() {
   emitByte(OP_RETURN);
 }
 
-static uint8_t makeConst(Value value) {
+static int makeConst(Value value) {
   int constant = addConst(currentChunk(), value);
-  if (constant > UINT8_MAX) {
+  if (constant >= UINT24_COUNT) {
     err("Too many constants in one chunk.");
     return 0;
   }
-  return (uint8_t)constant;
+  return constant;
+}
+
+// Emits 'op' with a one-byte operand when it fits, or its _LONG
+// form with a 'width'-byte operand when it doesn't.
+static void emitIndexed(
+  uint8_t op,
+  uint8_t longOp,
+  int width,
+  int operand
+) {
+  if (operand <= UINT8_MAX) {
+    emitBytes(op, (uint8_t)operand);
+    return;
+  }
+  emitByte(longOp);
+  for (int shift = (width - 1) * 8; shift >= 0; shift -= 8) {
+    emitByte((operand >> shift) & 0xff);
+  }
+}
+
+static void emitConstOp(uint8_t op, uint8_t longOp, int constant) {
+  emitIndexed(op, longOp, 3, constant);
 }
 
 static void emitConst(Value value) {
-  emitBytes(OP_CONST, makeConst(value));
+  emitConstOp(OP_CONST, OP_CONST_LONG, makeConst(value));
+}
+
+// Drops everything emitted from 'count' onward.
+static void truncateChunk(int count) {
+  Chunk* chunk = currentChunk();
+  chunk->count = count;
+  while (
+    chunk->lineCount > 0 &&
+    chunk->lines[chunk->lineCount - 1].offset >= count
+  ) {
+    chunk->lineCount--;
+  }
+  if (current->lastConst >= count) {
+    current->lastConst = -1;
+  }
+}
+
+// Emits a load of a value known at compile time.
+static void emitValue(Value value) {
+  current->lastConst = currentChunk()->count;
+  if (IS_NIL(value)) {
+    emitByte(OP_NIL);
+  }
+  else if (IS_BOOL(value)) {
+    emitByte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+  }
+  else if (
+    IS_INT(value) && AS_INT(value) >= INT8_MIN &&
+    AS_INT(value) <= INT8_MAX
+  ) {
+    // Small integers ride in the instruction instead of the pool.
+    emitBytes(OP_SMALLINT, (uint8_t)(int8_t)AS_INT(value));
+  }
+  else {
+    emitConst(value);
+  }
+}
+
+// Gets the value the last instruction emitted loads, if it is a
+// constant load that began at 'start'.
+static bool lastConst(int start, Value* value) {
+  Chunk* chunk = currentChunk();
+  if (
+    start == -1 || current->lastConst != start || start >= chunk->count
+  ) {
+    return false;
+  }
+  uint8_t* code = &chunk->code[start];
+  int length = 1;
+  switch (code[0]) {
+    case OP_NIL: *value = NIL_VAL; break;
+    case OP_TRUE: *value = BOOL_VAL(true); break;
+    case OP_FALSE: *value = BOOL_VAL(false); break;
+    case OP_SMALLINT:
+      *value = INT_VAL((int8_t)code[1]);
+      length = 2;
+      break;
+    case OP_CONST:
+      *value = chunk->constants.values[code[1]];
+      length = 2;
+      break;
+    case OP_CONST_LONG:
+      *value = chunk->constants.values[
+        (code[1] << 16) | (code[2] << 8) | code[3]
+      ];
+      length = 4;
+      break;
+    default: return false;
+  }
+  return start + length == chunk->count;
 }
 
 static void patchJmp(int offset) {
@@ -198,14 +337,33 @@ static void patchJmp(int offset) {
   }
   currentChunk()->code[offset] = (jump >> 8) & 0xff;
   currentChunk()->code[offset + 1] = jump & 0xff;
+  // Code jumps to what comes next, so no load before it can be
+  // folded together with one after it.
+  current->lastConst = -1;
+}
+
+static Local* pushLocal() {
+  if (current->localCapacity < current->localCount + 1) {
+    int oldCapacity = current->localCapacity;
+    current->localCapacity = GROW_CAPACITY(oldCapacity);
+    current->locals = GROW_ARRAY(
+      Local, current->locals,
+      oldCapacity, current->localCapacity
+    );
+  }
+  return &current->locals[current->localCount++];
 }
 
 static void initCompiler(Compiler* compiler, FuncType type) {
   compiler->enclosing = current;
   compiler->func = NULL;
   compiler->type = type;
+  compiler->locals = NULL;
   compiler->localCount = 0;
+  compiler->localCapacity = 0;
   compiler->scopeDepth = 0;
+  compiler->lastCall = -1;
+  compiler->lastConst = -1;
   compiler->func = newFunc();
   current = compiler;
   if (type != TYPE_SCRIPT) {
@@ -214,9 +372,10 @@ static void initCompiler(Compiler* compiler, FuncType type) {
         parser.previous.length
       );
   }
-  Local* local = &current->locals[current->localCount++];
+  Local* local = pushLocal();
   local->depth = 0;
   local->isCaptured = false;
+  local->isDefining = false;
   if (type != TYPE_FUNC) {
     local->name.start = "this";
     local->name.length = 4;
@@ -227,9 +386,106 @@ static void initCompiler(Compiler* compiler, FuncType type) {
   }
 }
 
+// Steps over 'op' at '*at' if it's there.
+static bool matchOp(Chunk* chunk, int* at, OpCode op) {
+  if (*at >= chunk->count || chunk->code[*at] != op) {
+    return false;
+  }
+  (*at)++;
+  return true;
+}
+
+// Steps over 'op' with a one-byte 'operand'.
+static bool matchOperand(Chunk* chunk, int* at, OpCode op, int operand) {
+  if (
+    *at + 1 >= chunk->count ||
+    chunk->code[*at] != op ||
+    chunk->code[*at + 1] != operand
+  ) {
+    return false;
+  }
+  *at += 2;
+  return true;
+}
+
+// Steps over 'op' or its _LONG form, reading its constant.
+static bool matchConstOp(
+  Chunk* chunk,
+  int* at,
+  OpCode op,
+  OpCode longOp,
+  int* constant
+) {
+  uint8_t* code = &chunk->code[*at];
+  if (*at + 1 < chunk->count && code[0] == op) {
+    *constant = code[1];
+    *at += 2;
+    return true;
+  }
+  if (*at + 3 < chunk->count && code[0] == longOp) {
+    *constant = (code[1] << 16) | (code[2] << 8) | code[3];
+    *at += 4;
+    return true;
+  }
+  return false;
+}
+
+// Tags a method whose optimized body is just a getter or setter
+// of one field of 'this'.
+static void findAccessor(ObjFunc* func) {
+  Chunk* chunk = &func->chunk;
+  int at = 0;
+  int field;
+  AccessKind access;
+  if (func->arity == 0) {
+    if (matchOperand(chunk, &at, OP_GET_LOCAL_PROP, 0)) {
+      if (at >= chunk->count) {
+        return;
+      }
+      field = chunk->code[at++];
+    }
+    else if (
+      !matchOperand(chunk, &at, OP_GET_LOCAL, 0) ||
+      !matchConstOp(chunk, &at, OP_GET_PROP, OP_GET_PROP_LONG, &field)
+    ) {
+      return;
+    }
+    if (!matchOp(chunk, &at, OP_RETURN)) {
+      return;
+    }
+    access = ACCESS_GET;
+  }
+  else if (func->arity == 1) {
+    if (
+      !matchOperand(chunk, &at, OP_GET_LOCAL, 0) ||
+      !matchOperand(chunk, &at, OP_GET_LOCAL, 1) ||
+      !matchConstOp(chunk, &at, OP_SET_PROP, OP_SET_PROP_LONG, &field) ||
+      !matchOp(chunk, &at, OP_POP) ||
+      !matchOp(chunk, &at, OP_NIL) ||
+      !matchOp(chunk, &at, OP_RETURN)
+    ) {
+      return;
+    }
+    access = ACCESS_SET;
+  }
+  else {
+    return;
+  }
+  func->access = access;
+  func->field = AS_STR(chunk->constants.values[field]);
+}
+
 static ObjFunc* endCompile() {
   emitReturn();
   ObjFunc* func = current->func;
+  if (!parser.err) {
+    optimizeChunk(currentChunk());
+    func->maxStack = maxStackDepth(currentChunk(), func->arity + 1);
+    initFeedback(func);
+    if (current->type == TYPE_METHOD) {
+      findAccessor(func);
+    }
+  }
   #ifdef DEBUG_PRINT_CODE
   if (!parser.err) {
     disassembleChunk(
@@ -239,6 +495,7 @@ static ObjFunc* endCompile() {
     );
   }
   #endif
+  FREE_ARRAY(Local, current->locals, current->localCapacity);
   current = current->enclosing;
   return func;
 }
@@ -268,10 +525,60 @@ static void expression();
 static ParseRule* getRule(TokenType type);
 static void parsePrecedence(Precedence precedence);
 
+// Works out 'a op b' for two constants, if it's safe to do now.
+// Errors such as division by zero are left for run time to report,
+// and a zero double to work out there with its sign.
+static bool foldBinary(TokenType op, Value a, Value b, Value* result) {
+  if (op == EQU_EQU || op == BANG_EQU) {
+    *result = BOOL_VAL(valsEqu(a, b) == (op == EQU_EQU));
+    return true;
+  }
+  if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+    return false;
+  }
+  ArithOp arith;
+  switch (op) {
+    case GT: *result = BOOL_VAL(valsGt(a, b)); return true;
+    case GT_EQU: *result = BOOL_VAL(valsGtEqu(a, b)); return true;
+    case LT: *result = BOOL_VAL(valsLt(a, b)); return true;
+    case LT_EQU: *result = BOOL_VAL(valsLtEqu(a, b)); return true;
+    case PLUS: arith = ARITH_ADD; break;
+    case DASH: arith = ARITH_SUB; break;
+    case STAR: arith = ARITH_MUL; break;
+    case SLASH: arith = ARITH_DIV; break;
+    case PERCENT: arith = ARITH_MOD; break;
+    case CARET: arith = ARITH_POW; break;
+    case AMP: arith = ARITH_AND; break;
+    case PIPE: arith = ARITH_OR; break;
+    case TILDE: arith = ARITH_XOR; break;
+    case LT_LT: arith = ARITH_SHL; break;
+    case GT_GT: arith = ARITH_SHR; break;
+    default: return false;
+  }
+  if (numArith(arith, a, b, result) != NULL) {
+    return false;
+  }
+  return !IS_NUM(*result) || AS_NUM(*result) != 0;
+}
+
 static void binary(bool canAssign) {
   TokenType opType = parser.previous.type;
   ParseRule* rule = getRule(opType);
+  int leftStart = current->lastConst;
+  int rightStart = currentChunk()->count;
+  Value left;
+  bool leftConst = lastConst(leftStart, &left);
   parsePrecedence((Precedence)(rule->precedence + 1));
+  Value right;
+  Value result;
+  if (
+    leftConst && lastConst(rightStart, &right) &&
+    foldBinary(opType, left, right, &result)
+  ) {
+    truncateChunk(leftStart);
+    emitValue(result);
+    return;
+  }
   switch (opType) {
     case BANG_EQU: emitByte(OP_NOT_EQU); break;
     case EQU_EQU: emitByte(OP_EQU); break;
@@ -285,6 +592,11 @@ static void binary(bool canAssign) {
     case CARET: emitByte(OP_POW); break;
     case PERCENT: emitByte(OP_MOD); break;
     case SLASH: emitByte(OP_DIV); break;
+    case AMP: emitByte(OP_BIT_AND); break;
+    case PIPE: emitByte(OP_BIT_OR); break;
+    case TILDE: emitByte(OP_BIT_XOR); break;
+    case LT_LT: emitByte(OP_SHL); break;
+    case GT_GT: emitByte(OP_SHR); break;
     default: return;
   }
 }
@@ -306,14 +618,15 @@ static uint8_t argList() {
 
 static void call(bool canAssign) {
   uint8_t argCount = argList();
+  current->lastCall = currentChunk()->count;
   emitBytes(OP_CALL, argCount);
 }
 
 static void literal(bool canAssign) {
   switch (parser.previous.type) {
-    case TFALSE: emitByte(OP_FALSE); break;
-    case NIL: emitByte(OP_NIL); break;
-    case TTRUE: emitByte(OP_TRUE); break;
+    case TFALSE: emitValue(BOOL_VAL(false)); break;
+    case NIL: emitValue(NIL_VAL); break;
+    case TTRUE: emitValue(BOOL_VAL(true)); break;
     default: return;
   }
 }
@@ -323,13 +636,23 @@ static void grouping(bool canAssign) {
   consume(RIGHT_PAREN, "Expected ')' after expression.");
 }
 
+// A literal without a point is an integer, unless it is too big
+// for one.
 static void number(bool canAssign) {
-  double value = strtod(parser.previous.start, NULL);
-  emitConst(NUM_VAL(value));
+  double num = strtod(parser.previous.start, NULL);
+  if (
+    memchr(parser.previous.start, '.', parser.previous.length) == NULL &&
+    num <= INT_VAL_MAX
+  ) {
+    emitValue(INT_VAL(strtoll(parser.previous.start, NULL, 10)));
+  }
+  else {
+    emitValue(NUM_VAL(num));
+  }
 }
 
 static void str(bool canAssign) {
-  emitConst(
+  emitValue(
     OBJ_VAL(copyStr(
       parser.previous.start + 1,
       parser.previous.length - 2
@@ -337,26 +660,37 @@ static void str(bool canAssign) {
   );
 }
 
-static uint8_t identConst(Token* name) {
+static int identConst(Token* name) {
   return makeConst(OBJ_VAL(
     copyStr(name->start, name->length)
   ));
 }
 
+// Globals get their slot the first time any code names them, so
+// a function can use one that is only defined later.
+static int globalIndex(Token* name) {
+  int slot = globalSlot(copyStr(name->start, name->length));
+  if (slot >= UINT24_COUNT) {
+    err("Too many global variables.");
+    return 0;
+  }
+  return slot;
+}
+
 static void dot(bool canAssign) {
   consume(IDENT, "Expected a property name after '.'.");
-  uint8_t name = identConst(&parser.previous);
+  int name = identConst(&parser.previous);
   if (canAssign && match(EQU)) {
     expression();
-    emitBytes(OP_SET_PROP, name);
+    emitConstOp(OP_SET_PROP, OP_SET_PROP_LONG, name);
   }
   else if (match(LEFT_PAREN)) {
     uint8_t argCount = argList();
-    emitBytes(OP_INVOKE, name);
+    emitConstOp(OP_INVOKE, OP_INVOKE_LONG, name);
     emitByte(argCount);
   }
   else {
-    emitBytes(OP_GET_PROP, name);
+    emitConstOp(OP_GET_PROP, OP_GET_PROP_LONG, name);
   }
 }
 
@@ -380,59 +714,95 @@ static int resolveLocal(Compiler* compiler, Token* name) {
   return -1;
 }
 
+static bool isAssigned(Token* name) {
+  for (int i = 0; i < assigned.count; i++) {
+    if (identsEqu(name, &assigned.names[i])) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Adds a variable the function captures, 'copied' into its
+// closures or as an ObjUpval. The two are numbered apart.
 static int addUpval(
   Compiler* compiler,
-  uint8_t index,
-  bool isLocal
+  uint16_t index,
+  bool isLocal,
+  bool copied
 ) {
-  int upvalCount = compiler->func->upvalCount;
-  for (int i = 0; i < upvalCount; i++) {
-    Upvalue* upval = &compiler->upvals[i];
+  Upvalue* upvals = copied ? compiler->captures : compiler->upvals;
+  int* count = copied
+    ? &compiler->func->captureCount
+    : &compiler->func->upvalCount;
+  for (int i = 0; i < *count; i++) {
+    Upvalue* upval = &upvals[i];
     if (upval->index == index && upval->isLocal == isLocal) {
       return i;
     }
   }
-  if (upvalCount == UINT8_COUNT) {
+  if (*count == UINT8_COUNT) {
     err("Too many variables in function.");
     return 0;
   }
-  compiler->upvals[upvalCount].isLocal = isLocal;
-  compiler->upvals[upvalCount].index = index;
-  return compiler->func->upvalCount++;
+  upvals[*count].isLocal = isLocal;
+  upvals[*count].index = index;
+  return (*count)++;
 }
 
-static int resolveUpval(Compiler* compiler, Token* name) {
+// Sets 'copied' if the variable is copied into the closure. An
+// enclosing function's capture of it is copied too, since the
+// same holds there.
+static int resolveUpval(Compiler* compiler, Token* name, bool* copied) {
   if (compiler->enclosing == NULL) {
     return -1;
   }
   int local = resolveLocal(compiler->enclosing, name);
   if (local != -1) {
-    compiler->enclosing->locals[local].isCaptured = true;
-    return addUpval(compiler, (uint8_t)local, true);
+    Local* captured = &compiler->enclosing->locals[local];
+    *copied = !captured->isDefining && !isAssigned(name);
+    if (!*copied) {
+      captured->isCaptured = true;
+    }
+    return addUpval(compiler, (uint16_t)local, true, *copied);
   }
-  int upval = resolveUpval(compiler->enclosing, name);
+  int upval = resolveUpval(compiler->enclosing, name, copied);
   if (upval != -1) {
-    return addUpval(compiler, (uint8_t)upval, false);
+    return addUpval(compiler, (uint16_t)upval, false, *copied);
   }
   return -1;
 }
 
 static void addLocal(Token name) {
-  if (current->localCount == UINT8_COUNT) {
+  if (current->localCount == UINT16_COUNT) {
     err("Too many locals in function.");
     return;
   }
-  Local* local = &current->locals[current->localCount++];
+  Local* local = pushLocal();
   local->name = name;
   local->depth = -1;
   local->isCaptured = false;
+  local->isDefining = false;
+}
+
+// The 'const' called 'name', declared yet or not, or NULL.
+static Constant* findConst(Token* name) {
+  for (int i = 0; i < consts.count; i++) {
+    if (identsEqu(name, &consts.entries[i].name)) {
+      return &consts.entries[i];
+    }
+  }
+  return NULL;
 }
 
 static void declareVar() {
+  Token* name = &parser.previous;
   if (current->scopeDepth == 0) {
+    if (findConst(name) != NULL) {
+      err("Already a constant with this name.");
+    }
     return;
   }
-  Token* name = &parser.previous;
   for (int i = current->localCount - 1; i >= 0; i--) {
     Local* local = &current->locals[i];
     if (local->depth != -1 && local->depth < current->scopeDepth) {
@@ -446,27 +816,54 @@ static void declareVar() {
 }
 
 static void namedVar(Token name, bool canAssign) {
-  uint8_t getOp, setOp;
+  uint8_t getOp, setOp, getLongOp, setLongOp;
+  int width;
+  bool copied;
+  Constant* constant;
   int arg = resolveLocal(current, &name);
   if (arg != -1) {
     getOp = OP_GET_LOCAL;
     setOp = OP_SET_LOCAL;
-  }
-  else if ((arg = resolveUpval(current, &name)) != -1) {
-    getOp = OP_GET_UPVAL;
-    setOp = OP_SET_UPVAL;
+    getLongOp = OP_GET_LOCAL_LONG;
+    setLongOp = OP_SET_LOCAL_LONG;
+    width = 2;
+  }
+  else if ((arg = resolveUpval(current, &name, &copied)) != -1) {
+    // Upvalues never need more than a byte. A copied one is never
+    // assigned, so it has no set.
+    getOp = getLongOp = copied ? OP_GET_CAPTURE : OP_GET_UPVAL;
+    setOp = setLongOp = OP_SET_UPVAL;
+    width = 1;
+  }
+  else if ((constant = findConst(&name)) != NULL) {
+    // Constants live in the module, so anything closer shadows
+    // them. Code before the declaration still reads the global.
+    if (canAssign && match(EQU)) {
+      err("Cannot assign to a constant.");
+      expression();
+      return;
+    }
+    if (constant->declared) {
+      emitValue(constant->value);
+      return;
+    }
+    emitIndexed(OP_GET_GLOBAL, OP_GET_GLOBAL_LONG, 3, globalIndex(&name));
+    return;
   }
   else {
-    arg = identConst(&name);
+    arg = globalIndex(&name);
     getOp = OP_GET_GLOBAL;
     setOp = OP_SET_GLOBAL;
+    getLongOp = OP_GET_GLOBAL_LONG;
+    setLongOp = OP_SET_GLOBAL_LONG;
+    width = 3;
   }
   if (canAssign && match(EQU)) {
     expression();
-    emitBytes(setOp, (uint8_t)arg);
+    emitIndexed(setOp, setLongOp, width, arg);
   }
   else {
-    emitBytes(getOp, (uint8_t)arg);
+    emitIndexed(getOp, getLongOp, width, arg);
   }
 }
 
@@ -490,17 +887,17 @@ static void super(bool canAssign) {
   }
   consume(DOT, "Expected '.' after 'super'.");
   consume(IDENT, "Expected superclass method name.");
-  uint8_t name = identConst(&parser.previous);
+  int name = identConst(&parser.previous);
   namedVar(syntheticToken("this"), false);
   if (match(LEFT_PAREN)) {
     uint8_t argCount = argList();
     namedVar(syntheticToken("super"), false);
-    emitBytes(OP_INVOKE_SUPER, name);
+    emitConstOp(OP_INVOKE_SUPER, OP_INVOKE_SUPER_LONG, name);
     emitByte(argCount);
   }
   else {
     namedVar(syntheticToken("super"), false);
-    emitBytes(OP_GET_SUPER, name);
+    emitConstOp(OP_GET_SUPER, OP_GET_SUPER_LONG, name);
   }
 }
 
@@ -514,10 +911,40 @@ static void this(bool canAssign) {
 
 static void unary(bool canAssign) {
   TokenType opType = parser.previous.type;
+  int start = currentChunk()->count;
   parsePrecedence(PREC_UNARY);
+  Value value;
+  if (lastConst(start, &value)) {
+    // Fold '-1' and the like into the constant. A zero double stays
+    // a negation so '-0.0' keeps its sign.
+    if (opType == BANG) {
+      truncateChunk(start);
+      emitValue(BOOL_VAL(
+        IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value))
+      ));
+      return;
+    }
+    if (opType == TILDE && IS_INT(value)) {
+      truncateChunk(start);
+      emitValue(INT_VAL(~AS_INT(value)));
+      return;
+    }
+    if (opType == DASH && IS_INT(value)) {
+      truncateChunk(start);
+      numArith(ARITH_SUB, INT_VAL(0), value, &value);
+      emitValue(value);
+      return;
+    }
+    if (opType == DASH && IS_NUM(value) && AS_NUM(value) != 0) {
+      truncateChunk(start);
+      emitValue(NUM_VAL(-AS_NUM(value)));
+      return;
+    }
+  }
   switch (opType) {
     case BANG: emitByte(OP_NOT); break;
     case DASH: emitByte(OP_NEGATE); break;
+    case TILDE: emitByte(OP_BIT_NOT); break;
     default: return;
   }
 }
@@ -538,23 +965,32 @@ static void or_(bool canAssign) {
   patchJmp(endJmp);
 }
 
+// Long literals are built in batches, so the items on the stack
+// never outgrow what a frame has reserved.
 static void list(bool canAssign) {
   int itemCount = 0;
+  bool built = false;
   if (!check(RIGHT_BRACK)) {
     do {
       if (check(RIGHT_BRACK)) {
         break;
       }
       parsePrecedence(PREC_OR);
-      if (itemCount == UINT8_COUNT) {
-        err("Cannot have more than 256 items in a list.");
-      }
       itemCount++;
+      if (itemCount == UINT8_MAX) {
+        emitBytes(built ? OP_EXTEND_LIST : OP_BUILD_LIST, itemCount);
+        built = true;
+        itemCount = 0;
+      }
     } while (match(COMMA));
   }
   consume(RIGHT_BRACK, "Expected ']' after list.");
-  emitByte(OP_BUILD_LIST);
-  emitByte(itemCount);
+  if (!built) {
+    emitBytes(OP_BUILD_LIST, itemCount);
+  }
+  else if (itemCount > 0) {
+    emitBytes(OP_EXTEND_LIST, itemCount);
+  }
   return;
 }
 
@@ -588,6 +1024,11 @@ ParseRule rules[] = {
   [STAR]          = {NULL,     binary, PREC_FACTOR},
   [CARET]         = {NULL,     binary, PREC_FACTOR},
   [PERCENT]       = {NULL,     binary, PREC_FACTOR},
+  [AMP]           = {NULL,     binary, PREC_BIT_AND},
+  [PIPE]          = {NULL,     binary, PREC_BIT_OR},
+  [TILDE]         = {unary,    binary, PREC_BIT_XOR},
+  [LT_LT]         = {NULL,     binary, PREC_SHIFT},
+  [GT_GT]         = {NULL,     binary, PREC_SHIFT},
   [BANG]          = {unary,    NULL,   PREC_NONE},
   [BANG_EQU]      = {NULL,     binary, PREC_EQU},
   [EQU]           = {NULL,     NULL,   PREC_NONE},
@@ -641,21 +1082,21 @@ static void markInitialized() {
     current->scopeDepth;
 }
 
-static void defVar(uint8_t global) {
+static void defVar(int global) {
   if (current->scopeDepth > 0) {
     markInitialized();
     return;
   }
-  emitBytes(OP_DEF_GLOBAL, global);
+  emitIndexed(OP_DEF_GLOBAL, OP_DEF_GLOBAL_LONG, 3, global);
 }
 
-static uint8_t parseVar(const char* message) {
+static int parseVar(const char* message) {
   consume(IDENT, message);
   declareVar();
   if (current->scopeDepth > 0) {
     return 0;
   }
-  return identConst(&parser.previous);
+  return globalIndex(&parser.previous);
 }
 
 static void func(FuncType type) {
@@ -669,7 +1110,7 @@ static void func(FuncType type) {
       if (current->func->arity > 255) {
         errAtCurrent("Cannot have more than 255 parameters.");
       }
-      uint8_t constant = parseVar("Expected a parameter name.");
+      int constant = parseVar("Expected a parameter name.");
       defVar(constant);
     } while (match(COMMA));
   }
@@ -677,16 +1118,26 @@ static void func(FuncType type) {
   consume(LEFT_BRACE, "Expected a block after function parameters.");
   block();
   ObjFunc* func = endCompile();
-  emitBytes(OP_CLOSURE, makeConst(OBJ_VAL(func)));
+  emitConstOp(OP_CLOSURE, OP_CLOSURE_LONG, makeConst(OBJ_VAL(func)));
   for (int i = 0; i < func->upvalCount; i++) {
     emitByte(compiler.upvals[i].isLocal ? 1 : 0);
-    emitByte(compiler.upvals[i].index);
+    emitByte((compiler.upvals[i].index >> 8) & 0xff);
+    emitByte(compiler.upvals[i].index & 0xff);
+  }
+  for (int i = 0; i < func->captureCount; i++) {
+    emitByte(compiler.captures[i].isLocal ? 1 : 0);
+    emitByte((compiler.captures[i].index >> 8) & 0xff);
+    emitByte(compiler.captures[i].index & 0xff);
   }
 }
 
 static void method() {
   consume(IDENT, "Expected a method name.");
-  uint8_t constant = identConst(&parser.previous);
+  // The selector is given out now, so a class's methods number
+  // together.
+  ObjStr* name = copyStr(parser.previous.start, parser.previous.length);
+  selectorOf(name);
+  int constant = makeConst(OBJ_VAL(name));
   FuncType type = TYPE_METHOD;
   if (
     parser.previous.length == 4 &&
@@ -695,7 +1146,7 @@ static void method() {
     type = TYPE_INITIALIZER;
   }
   func(type);
-  emitBytes(OP_METHOD, constant);
+  emitConstOp(OP_METHOD, OP_METHOD_LONG, constant);
 }
 
 static void expression() {
@@ -707,8 +1158,33 @@ static void expressionStatement() {
   emitByte(OP_POP);
 }
 
+static void constDeclaration() {
+  consume(IDENT, "Expected a constant name.");
+  Token name = parser.previous;
+  Constant* constant = findConst(&name);
+  if (current->type != TYPE_SCRIPT || current->scopeDepth > 0) {
+    err("Constants must be declared at the top level.");
+  }
+  else if (constant->declared) {
+    err("Already a constant with this name.");
+  }
+  consume(EQU, "Expected '=' after constant name.");
+  int start = currentChunk()->count;
+  expression();
+  Value value;
+  if (!lastConst(start, &value)) {
+    err("A constant's value must be known at compile time.");
+  }
+  else {
+    constant->value = value;
+    constant->declared = true;
+  }
+  // It's still a global for code that came before it.
+  emitIndexed(OP_DEF_GLOBAL, OP_DEF_GLOBAL_LONG, 3, globalIndex(&name));
+}
+
 static void varDeclaration() {
-  uint8_t global = parseVar("Expected variable name.");
+  int global = parseVar("Expected variable name.");
   if (match(EQU)) {
     expression();
   }
@@ -721,10 +1197,11 @@ static void varDeclaration() {
 static void classDeclaration() {
   consume(IDENT, "Expected a class name.");
   Token className = parser.previous;
-  uint8_t nameConst = identConst(&parser.previous);
+  int nameConst = identConst(&parser.previous);
   declareVar();
-  emitBytes(OP_CLASS, nameConst);
-  defVar(nameConst);
+  int global = current->scopeDepth > 0 ? 0 : globalIndex(&className);
+  emitConstOp(OP_CLASS, OP_CLASS_LONG, nameConst);
+  defVar(global);
   ClassCompiler classCompiler;
   classCompiler.hasSuperclass = false;
   classCompiler.enclosing = currentClass;
@@ -762,9 +1239,17 @@ static void classDeclaration() {
 }
 
 static void funcDeclaration() {
-  uint8_t global = parseVar("Expected a function name.");
+  int global = parseVar("Expected a function name.");
   markInitialized();
-  func(TYPE_FUNC);
+  if (current->scopeDepth > 0) {
+    int self = current->localCount - 1;
+    current->locals[self].isDefining = true;
+    func(TYPE_FUNC);
+    current->locals[self].isDefining = false;
+  }
+  else {
+    func(TYPE_FUNC);
+  }
   defVar(global);
 }
 
@@ -792,14 +1277,140 @@ static ParseRule* getRule(TokenType type) {
   return &rules[type];
 }
 
+typedef struct {
+  uint8_t slot;
+  uint8_t step;
+  uint8_t limit;
+  uint8_t mode;
+  int line;
+} ForNum;
+
+// Checks whether the OP_CONST or OP_SMALLINT at 'offset' can load
+// through a one-byte constant index, counting in 'added' the small
+// integers that aren't in the pool yet.
+static bool fitsByteConst(int offset, int* added) {
+  Chunk* chunk = currentChunk();
+  if (chunk->code[offset] == OP_CONST) {
+    return true;
+  }
+  int constant = lookupConst(
+    chunk, INT_VAL((int8_t)chunk->code[offset + 1])
+  );
+  if (constant == -1) {
+    constant = chunk->constants.count + (*added)++;
+  }
+  return constant <= UINT8_MAX;
+}
+
+// Returns the constant an OP_CONST or OP_SMALLINT at 'offset'
+// loads, adding the small integer to the pool. Only call it once
+// fitsByteConst() has passed.
+static int literalConst(int offset) {
+  uint8_t* code = currentChunk()->code;
+  if (code[offset] == OP_CONST) {
+    return code[offset + 1];
+  }
+  return makeConst(INT_VAL((int8_t)code[offset + 1]));
+}
+
+// Checks whether a for loop just compiled its condition and
+// increment as 'i < limit' and 'i = i + step', where 'i' is the
+// loop's own variable and 'limit' is a constant or a local.
+static bool matchForNum(
+  int loopVar,
+  int condStart,
+  int condEnd,
+  int incStart,
+  ForNum* forNum
+) {
+  uint8_t* code = currentChunk()->code;
+  int incEnd = currentChunk()->count;
+  if (
+    loopVar == -1 ||
+    condEnd - condStart != 5 ||
+    incEnd - incStart != 8 ||
+    code[condStart] != OP_GET_LOCAL ||
+    code[condStart + 1] != loopVar ||
+    code[incStart] != OP_GET_LOCAL ||
+    code[incStart + 1] != loopVar ||
+    code[incStart + 5] != OP_SET_LOCAL ||
+    code[incStart + 6] != loopVar ||
+    code[incStart + 7] != OP_POP
+  ) {
+    return false;
+  }
+  forNum->mode = 0;
+  if (code[condStart + 2] == OP_GET_LOCAL) {
+    forNum->mode |= FOR_NUM_LIMIT_LOCAL;
+  }
+  else if (
+    code[condStart + 2] != OP_CONST &&
+    code[condStart + 2] != OP_SMALLINT
+  ) {
+    return false;
+  }
+  if (
+    code[incStart + 2] != OP_CONST &&
+    code[incStart + 2] != OP_SMALLINT
+  ) {
+    return false;
+  }
+  switch (code[condStart + 4]) {
+    case OP_LT: forNum->mode |= FOR_NUM_LT; break;
+    case OP_LT_EQU: forNum->mode |= FOR_NUM_LT_EQU; break;
+    case OP_GT: forNum->mode |= FOR_NUM_GT; break;
+    case OP_GT_EQU: forNum->mode |= FOR_NUM_GT_EQU; break;
+    default: return false;
+  }
+  switch (code[incStart + 4]) {
+    case OP_ADD: break;
+    case OP_SUB: forNum->mode |= FOR_NUM_SUB; break;
+    default: return false;
+  }
+  bool limitLocal = forNum->mode & FOR_NUM_LIMIT_LOCAL;
+  int added = 0;
+  if (
+    (!limitLocal && !fitsByteConst(condStart + 2, &added)) ||
+    !fitsByteConst(incStart + 2, &added)
+  ) {
+    return false;
+  }
+  int limit = limitLocal
+    ? code[condStart + 3]
+    : literalConst(condStart + 2);
+  int step = literalConst(incStart + 2);
+  forNum->slot = (uint8_t)loopVar;
+  forNum->limit = (uint8_t)limit;
+  forNum->step = (uint8_t)step;
+  forNum->line = getLine(currentChunk(), incStart);
+  return true;
+}
+
+static void emitForNum(ForNum* forNum, int bodyStart) {
+  Chunk* chunk = currentChunk();
+  writeChunk(chunk, OP_FOR_NUM, forNum->line);
+  writeChunk(chunk, forNum->slot, forNum->line);
+  writeChunk(chunk, forNum->step, forNum->line);
+  writeChunk(chunk, forNum->limit, forNum->line);
+  writeChunk(chunk, forNum->mode, forNum->line);
+  int offset = chunk->count - bodyStart + 2;
+  if (offset > UINT16_MAX) {
+    err("Loop body is too large.");
+  }
+  writeChunk(chunk, (offset >> 8) & 0xff, forNum->line);
+  writeChunk(chunk, offset & 0xff, forNum->line);
+}
+
 static void forStatement() {
   beginScope();
   consume(LEFT_PAREN, "Expected '(' after 'for'.");
+  int loopVar = -1;
   if (match(SEMICOLON)) {
     // Nothing.
   }
   else if (match(LET)) {
     varDeclaration();
+    loopVar = current->localCount - 1;
     consume(
       SEMICOLON,
       "Expected ';' after variable declaration in for loop."
@@ -810,25 +1421,47 @@ static void forStatement() {
   }
   int loopStart = currentChunk()->count;
   int exitJmp = -1;
+  int condEnd = -1;
   if (!match(SEMICOLON)) {
     expression();
     consume(SEMICOLON, "Expected ';' after loop condition.");
+    condEnd = currentChunk()->count;
     exitJmp = emitJmp(OP_JMPF);
     emitByte(OP_POP);
   }
+  ForNum forNum;
+  bool isForNum = false;
   if (!match(RIGHT_PAREN)) {
     int bodyJmp = emitJmp(OP_JMP);
     int incStart = currentChunk()->count;
     expression();
     emitByte(OP_POP);
     consume(RIGHT_PAREN, "Expected ')' after for clause.");
-    emitLoop(loopStart);
-    loopStart = incStart;
-    patchJmp(bodyJmp);
+    isForNum = matchForNum(
+      loopVar, loopStart, condEnd, incStart, &forNum
+    );
+    if (isForNum) {
+      // The body follows the condition directly, and OP_FOR_NUM
+      // does the increment and later checks at its end.
+      truncateChunk(bodyJmp - 1);
+      loopStart = currentChunk()->count;
+    }
+    else {
+      emitLoop(loopStart);
+      loopStart = incStart;
+      patchJmp(bodyJmp);
+    }
   }
   consume(LEFT_BRACE, "Expected a block after for clause.");
+  beginScope();
   block();
-  emitLoop(loopStart);
+  endScope();
+  if (isForNum) {
+    emitForNum(&forNum, loopStart);
+  }
+  else {
+    emitLoop(loopStart);
+  }
   if (exitJmp != -1) {
     patchJmp(exitJmp);
     emitByte(OP_POP);
@@ -876,6 +1509,11 @@ static void returnStatement() {
       err("Cannot return a value from an initializer.");
     }
     expression();
+    // A call that is the last thing the returned expression does
+    // can reuse this function's frame.
+    if (current->lastCall == currentChunk()->count - 2) {
+      currentChunk()->code[current->lastCall] = OP_TAIL_CALL;
+    }
     emitByte(OP_RETURN);
   }
 }
@@ -888,12 +1526,308 @@ static void whileStatement() {
   int exitJmp = emitJmp(OP_JMPF);
   emitByte(OP_POP);
   consume(LEFT_BRACE, "Expected a block after condition.");
+  // The body's locals go at the end of each trip, so the stack is
+  // as deep every time round.
   beginScope();
   block();
+  endScope();
   emitLoop(loopStart);
   patchJmp(exitJmp);
   emitByte(OP_POP);
-  endScope();
+}
+
+typedef struct {
+  Value key;
+  int constant;
+  int body;
+  int line;
+} SwitchArm;
+
+// Reads back the pattern a 'with' arm compiled between 'from' and
+// 'to'. Only a lone number or string literal can be switched on.
+static bool switchKey(int from, int to, SwitchArm* arm) {
+  Chunk* chunk = currentChunk();
+  uint8_t* code = chunk->code;
+  if (to - from == 2 && code[from] == OP_SMALLINT) {
+    arm->key = INT_VAL((int8_t)code[from + 1]);
+    arm->constant = -1;
+    return true;
+  }
+  if (to - from == 2 && code[from] == OP_CONST) {
+    arm->constant = code[from + 1];
+  }
+  else if (to - from == 4 && code[from] == OP_CONST_LONG) {
+    arm->constant =
+      (code[from + 1] << 16) | (code[from + 2] << 8) | code[from + 3];
+  }
+  else {
+    return false;
+  }
+  arm->key = chunk->constants.values[arm->constant];
+  return IS_NUMBER(arm->key) || IS_STR(arm->key);
+}
+
+static void putShort(uint8_t* at, int value) {
+  at[0] = (value >> 8) & 0xff;
+  at[1] = value & 0xff;
+}
+
+// Builds an OP_SWITCH_INT if every key is an integer and they fill
+// at least half of their range. Offsets are relative to 'start',
+// where the switch will go.
+static uint8_t* intSwitch(
+  SwitchArm* arms,
+  int armCount,
+  int start,
+  int miss,
+  int* length
+) {
+  int64_t min = INT32_MAX;
+  int64_t max = INT32_MIN;
+  for (int i = 0; i < armCount; i++) {
+    if (!IS_INT(arms[i].key)) {
+      return NULL;
+    }
+    int64_t key = AS_INT(arms[i].key);
+    if (key < INT32_MIN || key > INT32_MAX) {
+      return NULL;
+    }
+    if (key < min) {
+      min = key;
+    }
+    if (key > max) {
+      max = key;
+    }
+  }
+  int64_t range = max - min + 1;
+  if (range > armCount * 2 || range > SWITCH_MAX_SIZE) {
+    return NULL;
+  }
+  int count = (int)range;
+  *length = 9 + count * 2;
+  uint8_t* bytes = ALLOCATE(uint8_t, *length);
+  uint32_t low = (uint32_t)(int32_t)min;
+  bytes[0] = OP_SWITCH_INT;
+  bytes[1] = (low >> 24) & 0xff;
+  bytes[2] = (low >> 16) & 0xff;
+  bytes[3] = (low >> 8) & 0xff;
+  bytes[4] = low & 0xff;
+  putShort(&bytes[5], count);
+  putShort(&bytes[7], miss - start);
+  for (int i = 0; i < count; i++) {
+    putShort(&bytes[9 + i * 2], miss - start);
+  }
+  // Backwards, so the first of any duplicate arms wins.
+  for (int i = armCount - 1; i >= 0; i--) {
+    int entry = (int)(AS_INT(arms[i].key) - min);
+    putShort(&bytes[9 + entry * 2], arms[i].body - start);
+  }
+  return bytes;
+}
+
+// Fills 'slots' with the arm each entry of a 'size' table holds
+// when strings are placed by (hash >> shift). Fails if two
+// different strings land in the same entry.
+static bool placeStrs(
+  SwitchArm* arms,
+  int armCount,
+  int* slots,
+  int size,
+  int shift
+) {
+  for (int i = 0; i < size; i++) {
+    slots[i] = -1;
+  }
+  for (int i = 0; i < armCount; i++) {
+    ObjStr* key = AS_STR(arms[i].key);
+    int entry = (key->hash >> shift) & (size - 1);
+    if (slots[entry] == -1) {
+      slots[entry] = i;
+    }
+    else if (AS_STR(arms[slots[entry]].key) != key) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Builds an OP_SWITCH_STR if every key is a string and a
+// collision-free table of them can be found.
+static uint8_t* strSwitch(
+  SwitchArm* arms,
+  int armCount,
+  int start,
+  int miss,
+  int* length
+) {
+  for (int i = 0; i < armCount; i++) {
+    if (!IS_STR(arms[i].key)) {
+      return NULL;
+    }
+  }
+  int* slots = ALLOCATE(int, SWITCH_MAX_SIZE);
+  int size = 1;
+  int bits = 0;
+  while (size < armCount) {
+    size *= 2;
+    bits++;
+  }
+  int shift = 0;
+  bool placed = false;
+  while (!placed && size <= SWITCH_MAX_SIZE) {
+    // Try every window of the hash before growing the table.
+    for (shift = 0; !placed && shift <= 32 - bits; shift++) {
+      placed = placeStrs(arms, armCount, slots, size, shift);
+    }
+    if (!placed) {
+      size *= 2;
+      bits++;
+    }
+  }
+  if (!placed) {
+    FREE_ARRAY(int, slots, SWITCH_MAX_SIZE);
+    return NULL;
+  }
+  shift--;
+  *length = 6 + size * 5;
+  uint8_t* bytes = ALLOCATE(uint8_t, *length);
+  bytes[0] = OP_SWITCH_STR;
+  bytes[1] = (uint8_t)shift;
+  putShort(&bytes[2], size);
+  putShort(&bytes[4], miss - start);
+  for (int i = 0; i < size; i++) {
+    uint8_t* entry = &bytes[6 + i * 5];
+    int constant = SWITCH_EMPTY;
+    int offset = miss - start;
+    if (slots[i] != -1) {
+      constant = arms[slots[i]].constant;
+      offset = arms[slots[i]].body - start;
+    }
+    entry[0] = (constant >> 16) & 0xff;
+    entry[1] = (constant >> 8) & 0xff;
+    entry[2] = constant & 0xff;
+    putShort(&entry[3], offset);
+  }
+  FREE_ARRAY(int, slots, SWITCH_MAX_SIZE);
+  return bytes;
+}
+
+// Inserts 'length' bytes at 'offset'. Code after it moves along,
+// so only jumps that stay on one side of 'offset' remain valid.
+static void insertCode(int offset, uint8_t* bytes, int length, int line) {
+  Chunk* chunk = currentChunk();
+  int tailLength = chunk->count - offset;
+  uint8_t* tail = ALLOCATE(uint8_t, tailLength);
+  int* lines = ALLOCATE(int, tailLength);
+  for (int i = 0; i < tailLength; i++) {
+    tail[i] = chunk->code[offset + i];
+    lines[i] = getLine(chunk, offset + i);
+  }
+  truncateChunk(offset);
+  for (int i = 0; i < length; i++) {
+    writeChunk(chunk, bytes[i], line);
+  }
+  for (int i = 0; i < tailLength; i++) {
+    writeChunk(chunk, tail[i], lines[i]);
+  }
+  FREE_ARRAY(int, lines, tailLength);
+  FREE_ARRAY(uint8_t, tail, tailLength);
+}
+
+// Puts a switch ahead of the arms' bodies that jumps straight to the
+// matching one, or to 'miss'. Returns false if none fits them.
+static bool emitSwitch(
+  int start,
+  SwitchArm* arms,
+  int armCount,
+  int miss
+) {
+  if (armCount < SWITCH_MIN_ARMS || miss - start > UINT16_MAX) {
+    return false;
+  }
+  int length = 0;
+  uint8_t* bytes = intSwitch(arms, armCount, start, miss, &length);
+  if (bytes == NULL) {
+    bytes = strSwitch(arms, armCount, start, miss, &length);
+  }
+  if (bytes == NULL) {
+    return false;
+  }
+  insertCode(start, bytes, length, getLine(currentChunk(), start));
+  FREE_ARRAY(uint8_t, bytes, length);
+  return true;
+}
+
+// Writes a load of an arm's key, as its pattern compiled it.
+static void writeKey(Value key, int line) {
+  Chunk* chunk = currentChunk();
+  if (
+    IS_INT(key) && AS_INT(key) >= INT8_MIN && AS_INT(key) <= INT8_MAX
+  ) {
+    writeChunk(chunk, OP_SMALLINT, line);
+    writeChunk(chunk, (uint8_t)(int8_t)AS_INT(key), line);
+    return;
+  }
+  int constant = makeConst(key);
+  if (constant <= UINT8_MAX) {
+    writeChunk(chunk, OP_CONST, line);
+    writeChunk(chunk, (uint8_t)constant, line);
+    return;
+  }
+  writeChunk(chunk, OP_CONST_LONG, line);
+  writeChunk(chunk, (constant >> 16) & 0xff, line);
+  writeChunk(chunk, (constant >> 8) & 0xff, line);
+  writeChunk(chunk, constant & 0xff, line);
+}
+
+// Gives the literal arms, compiled bare in case the match became a
+// switch, their DUP, EQU, JMPF tests back. Each arm's exit jump in
+// 'caseEnds' is re-aimed at the final POP, which ends the chunk.
+static void emitArmTests(
+  int start,
+  SwitchArm* arms,
+  int armCount,
+  int* caseEnds
+) {
+  Chunk* chunk = currentChunk();
+  int length = chunk->count - start;
+  uint8_t* code = ALLOCATE(uint8_t, length);
+  int* lines = ALLOCATE(int, length);
+  for (int i = 0; i < length; i++) {
+    code[i] = chunk->code[start + i];
+    lines[i] = getLine(chunk, start + i);
+  }
+  truncateChunk(start);
+  int exits[MAX_CASES];
+  for (int i = 0; i < armCount; i++) {
+    int line = arms[i].line;
+    writeChunk(chunk, OP_DUP, line);
+    writeKey(arms[i].key, line);
+    writeChunk(chunk, OP_EQU, line);
+    writeChunk(chunk, OP_JMPF, line);
+    writeChunk(chunk, 0xff, line);
+    writeChunk(chunk, 0xff, line);
+    int skip = chunk->count - 2;
+    writeChunk(chunk, OP_POP, line);
+    // The body and the OP_JMP out of the match after it.
+    for (int j = arms[i].body - start; j < caseEnds[i] + 2 - start; j++) {
+      writeChunk(chunk, code[j], lines[j]);
+    }
+    exits[i] = chunk->count - 2;
+    patchJmp(skip);
+    writeChunk(chunk, OP_POP, line);
+  }
+  // The later arms only jump within themselves or to the final POP,
+  // so they move along unchanged.
+  for (int j = caseEnds[armCount - 1] + 2 - start; j < length - 1; j++) {
+    writeChunk(chunk, code[j], lines[j]);
+  }
+  for (int i = 0; i < armCount; i++) {
+    patchJmp(exits[i]);
+  }
+  writeChunk(chunk, code[length - 1], lines[length - 1]);
+  FREE_ARRAY(int, lines, length);
+  FREE_ARRAY(uint8_t, code, length);
 }
 
 static void matchStatement() {
@@ -905,6 +1839,13 @@ static void matchStatement() {
   int caseEnds[MAX_CASES];
   int caseCount = 0;
   int previousCaseSkip = -1;
+  // The leading literal arms, compiled without their tests in case
+  // the whole match can become a switch.
+  SwitchArm arms[MAX_CASES];
+  int armCount = 0;
+  bool switchable = true;
+  int matchStart = currentChunk()->count;
+  int miss = -1;
   while (!match(RIGHT_BRACE) && !check(TEOF)) {
     if (match(WITH) || match(UNDERSCORE)) {
       TokenType caseType = parser.previous.type;
@@ -912,23 +1853,61 @@ static void matchStatement() {
         err("Cannot have another case after the default case.");
       }
       if (state == 1) {
-        caseEnds[caseCount++] = emitJmp(OP_JMP);
-        patchJmp(previousCaseSkip);
-        emitByte(OP_POP);
+        if (caseCount == MAX_CASES - 1) {
+          err("Too many cases in match statement.");
+        }
+        else {
+          caseEnds[caseCount++] = emitJmp(OP_JMP);
+        }
+        if (previousCaseSkip != -1) {
+          patchJmp(previousCaseSkip);
+          emitByte(OP_POP);
+        }
       }
       if (caseType == WITH) {
         state = 1;
+        Chunk* chunk = currentChunk();
+        int armStart = chunk->count;
+        int armLine = parser.previous.line;
+        int poolCount = chunk->constants.count;
         emitByte(OP_DUP);
+        int patternStart = chunk->count;
         expression();
         consume(RARROW, "Expected '->' after each case.");
-        emitByte(OP_EQU);
-        previousCaseSkip = emitJmp(OP_JMPF);
-        emitByte(OP_POP);
+        int patternEnd = chunk->count;
+        SwitchArm* arm = &arms[armCount];
+        if (
+          switchable &&
+          armCount < MAX_CASES &&
+          switchKey(patternStart, patternEnd, arm)
+        ) {
+          // emitArmTests() puts the test back if there's no switch.
+          truncateChunk(armStart);
+          if (
+            !IS_STR(arm->key) &&
+            arm->constant == chunk->constants.count - 1 &&
+            chunk->constants.count > poolCount
+          ) {
+            removeLastConst(chunk);
+            arm->constant = -1;
+          }
+          arm->line = armLine;
+          arm->body = chunk->count;
+          armCount++;
+          previousCaseSkip = -1;
+        }
+        else {
+          switchable = false;
+          emitByte(OP_EQU);
+          previousCaseSkip = emitJmp(OP_JMPF);
+          emitByte(OP_POP);
+        }
       }
       else {
         state = 2;
         consume(RARROW, "Expected '->' after the default case.");
         previousCaseSkip = -1;
+        miss = currentChunk()->count;
       }
     }
     else {
@@ -942,8 +1921,12 @@ static void matchStatement() {
     err("Cannot have an empty match statement.");
   }
   if (state == 1) {
-    patchJmp(previousCaseSkip);
-    emitByte(OP_POP);
+    // The last arm's body jumps past the POP of its failed test too.
+    caseEnds[caseCount++] = emitJmp(OP_JMP);
+    if (previousCaseSkip != -1) {
+      patchJmp(previousCaseSkip);
+      emitByte(OP_POP);
+    }
   }
   if (state == 2 && caseCount == 0) {
     err("Cannot have a default-only match statement.");
@@ -951,7 +1934,15 @@ static void matchStatement() {
   for (int i = 0; i < caseCount; i++) {
     patchJmp(caseEnds[i]);
   }
+  if (miss == -1) {
+    miss = currentChunk()->count;
+  }
   emitByte(OP_POP);
+  if (armCount > 0 && !parser.err) {
+    if (!switchable || !emitSwitch(matchStart, arms, armCount, miss)) {
+      emitArmTests(matchStart, arms, armCount, caseEnds);
+    }
+  }
 }
 
 static void sync() {
@@ -964,6 +1955,7 @@ static void sync() {
       case CLASS:
       case FUNC:
       case LET:
+      case CONST:
       case FOR:
       case IF:
       case WHILE:
@@ -985,6 +1977,9 @@ static void declaration() {
   else if (match(LET)) {
     varDeclaration();
   }
+  else if (match(CONST)) {
+    constDeclaration();
+  }
   else {
     statement();
   }
@@ -1019,7 +2014,62 @@ static void statement() {
   }
 }
 
+// Collects every name that's the target of an assignment, ahead
+// of the compile proper: 'name =', but not 'let name =',
+// 'const name =' or 'object.name ='. Also collects the names
+// declared 'const'.
+static void findAssigned(const char* source) {
+  initScanner(source);
+  assigned.count = 0;
+  consts.count = 0;
+  Token before;
+  Token previous;
+  before.type = ERR;
+  previous.type = ERR;
+  for (;;) {
+    Token token = scanToken();
+    if (
+      token.type == EQU && previous.type == IDENT &&
+      before.type != LET && before.type != CONST && before.type != DOT
+    ) {
+      if (assigned.count == assigned.capacity) {
+        int oldCapacity = assigned.capacity;
+        assigned.capacity = GROW_CAPACITY(oldCapacity);
+        assigned.names = GROW_ARRAY(
+          Token,
+          assigned.names,
+          oldCapacity,
+          assigned.capacity
+        );
+      }
+      assigned.names[assigned.count++] = previous;
+    }
+    if (token.type == IDENT && previous.type == CONST) {
+      if (consts.count == consts.capacity) {
+        int oldCapacity = consts.capacity;
+        consts.capacity = GROW_CAPACITY(oldCapacity);
+        consts.entries = GROW_ARRAY(
+          Constant,
+          consts.entries,
+          oldCapacity,
+          consts.capacity
+        );
+      }
+      Constant* constant = &consts.entries[consts.count++];
+      constant->name = token;
+      constant->declared = false;
+      constant->value = NIL_VAL;
+    }
+    if (token.type == TEOF) {
+      break;
+    }
+    before = previous;
+    previous = token;
+  }
+}
+
 ObjFunc* compile(const char* source) {
+  findAssigned(source);
   initScanner(source);
   Compiler compiler;
   initCompiler(&compiler, TYPE_SCRIPT);
@@ -1030,6 +2080,14 @@ ObjFunc* compile(const char* source) {
     declaration();
   }
   ObjFunc* func = endCompile();
+  FREE_ARRAY(Token, assigned.names, assigned.capacity);
+  assigned.names = NULL;
+  assigned.count = 0;
+  assigned.capacity = 0;
+  FREE_ARRAY(Constant, consts.entries, consts.capacity);
+  consts.entries = NULL;
+  consts.count = 0;
+  consts.capacity = 0;
   return parser.err ? NULL : func;
 }
 
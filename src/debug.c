@@ -1,7 +1,9 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include "include/debug.h"
 #include "include/value.h"
 #include "include/object.h"
+#include "include/vm.h"
 
 static int simpleInstruction(const char* name, int offset) {
   printf("%s\n", name);
@@ -18,6 +20,35 @@ static int byteInstruction(
   return offset + 2;
 }
 
+// Reads a big-endian operand of 'width' bytes.
+static int readOperand(Chunk* chunk, int offset, int width) {
+  int operand = 0;
+  for (int i = 0; i < width; i++) {
+    operand = (operand << 8) | chunk->code[offset + i];
+  }
+  return operand;
+}
+
+static int shortInstruction(
+  const char* name,
+  Chunk* chunk,
+  int offset
+) {
+  int slot = readOperand(chunk, offset + 1, 2);
+  printf("%-16s %4d\n", name, slot);
+  return offset + 3;
+}
+
+static int smallIntInstruction(
+  const char* name,
+  Chunk* chunk,
+  int offset
+) {
+  int8_t value = (int8_t)chunk->code[offset + 1];
+  printf("%-16s %4d\n", name, value);
+  return offset + 2;
+}
+
 static int jmpInstruction(
   const char* name,
   int sign,
@@ -47,6 +78,110 @@ static int constInstruction(
   return offset + 2;
 }
 
+static int constLongInstruction(
+  const char* name,
+  Chunk* chunk,
+  int offset
+) {
+  int constant = readOperand(chunk, offset + 1, 3);
+  printf("%-16s %4d '", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("'\n");
+  return offset + 4;
+}
+
+// A global's operand is its slot, shown with the global's name.
+static int globalInstruction(
+  const char* name,
+  Chunk* chunk,
+  int offset,
+  int width
+) {
+  int slot = readOperand(chunk, offset + 1, width);
+  printf("%-16s %4d '%s'\n", name, slot, vm.globalNames[slot]->chars);
+  return offset + 1 + width;
+}
+
+static int invokeLongInstruction(
+  const char* name,
+  Chunk* chunk,
+  int offset
+) {
+  int constant = readOperand(chunk, offset + 1, 3);
+  uint8_t argCount = chunk->code[offset + 4];
+  printf("%-16s (%d args) %4d '", name, argCount, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("'\n");
+  return offset + 5;
+}
+
+static int closureInstruction(
+  const char* name,
+  int width,
+  Chunk* chunk,
+  int offset
+) {
+  int constant = readOperand(chunk, offset + 1, width);
+  offset += 1 + width;
+  printf("%-16s %4d ", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("\n");
+  ObjFunc* func = AS_FUNC(chunk->constants.values[constant]);
+  for (int j = 0; j < func->upvalCount + func->captureCount; j++) {
+    int isLocal = chunk->code[offset];
+    int index = readOperand(chunk, offset + 1, 2);
+    printf(
+      "%04d\t|\t\t\t%s%s %d\n",
+      offset, j < func->upvalCount ? "" : "copy ",
+      isLocal ? "local" : "upval", index
+    );
+    offset += 3;
+  }
+  return offset;
+}
+
+// Prints the miss offset, then each table entry that jumps
+// somewhere else.
+static int switchIntInstruction(
+  const char* name,
+  Chunk* chunk,
+  int offset
+) {
+  int32_t min = (int32_t)(uint32_t)readOperand(chunk, offset + 1, 4);
+  int count = readOperand(chunk, offset + 5, 2);
+  int miss = readOperand(chunk, offset + 7, 2);
+  int end = offset + 9 + count * 2;
+  printf("%-16s %4d -> %d\n", name, count, end + miss);
+  for (int i = 0; i < count; i++) {
+    int jump = readOperand(chunk, offset + 9 + i * 2, 2);
+    if (jump != miss) {
+      printf("%04d\t|\t\t\t%d -> %d\n", offset, min + i, end + jump);
+    }
+  }
+  return end;
+}
+
+static int switchStrInstruction(
+  const char* name,
+  Chunk* chunk,
+  int offset
+) {
+  int size = readOperand(chunk, offset + 2, 2);
+  int miss = readOperand(chunk, offset + 4, 2);
+  int end = offset + 6 + size * 5;
+  printf("%-16s %4d -> %d\n", name, size, end + miss);
+  for (int i = 0; i < size; i++) {
+    int entry = offset + 6 + i * 5;
+    int constant = readOperand(chunk, entry, 3);
+    if (constant != SWITCH_EMPTY) {
+      printf("%04d\t|\t\t\t'", offset);
+      printValue(chunk->constants.values[constant]);
+      printf("' -> %d\n", end + readOperand(chunk, entry + 3, 2));
+    }
+  }
+  return end;
+}
+
 static int invokeInstruction(
   const char* name,
   Chunk* chunk,
@@ -60,6 +195,91 @@ static int invokeInstruction(
   return offset + 3;
 }
 
+static int jltInstruction(
+  const char* name,
+  Chunk* chunk,
+  int offset
+) {
+  uint8_t slot = chunk->code[offset + 1];
+  uint8_t constant = chunk->code[offset + 2];
+  uint16_t jump = (uint16_t)(chunk->code[offset + 3] << 8);
+  jump |= chunk->code[offset + 4];
+  printf("%-16s %4d '", name, slot);
+  printValue(chunk->constants.values[constant]);
+  printf("' -> %d\n", offset + 5 + jump);
+  return offset + 5;
+}
+
+static int forNumInstruction(
+  const char* name,
+  Chunk* chunk,
+  int offset
+) {
+  uint8_t slot = chunk->code[offset + 1];
+  uint8_t step = chunk->code[offset + 2];
+  uint8_t limit = chunk->code[offset + 3];
+  uint8_t mode = chunk->code[offset + 4];
+  uint16_t jump = (uint16_t)(chunk->code[offset + 5] << 8);
+  jump |= chunk->code[offset + 6];
+  printf("%-16s %4d %c '", name, slot, mode & FOR_NUM_SUB ? '-' : '+');
+  printValue(chunk->constants.values[step]);
+  printf("' ");
+  switch (mode & FOR_NUM_CMP_MASK) {
+    case FOR_NUM_LT: printf("<"); break;
+    case FOR_NUM_LT_EQU: printf("<="); break;
+    case FOR_NUM_GT: printf(">"); break;
+    default: printf(">="); break;
+  }
+  if (mode & FOR_NUM_LIMIT_LOCAL) {
+    printf(" %d", limit);
+  }
+  else {
+    printf(" '");
+    printValue(chunk->constants.values[limit]);
+    printf("'");
+  }
+  printf(" -> %d\n", offset + 7 - jump);
+  return offset + 7;
+}
+
+static int localPropInstruction(
+  const char* name,
+  Chunk* chunk,
+  int offset
+) {
+  uint8_t slot = chunk->code[offset + 1];
+  uint8_t constant = chunk->code[offset + 2];
+  printf("%-16s %4d '", name, slot);
+  printValue(chunk->constants.values[constant]);
+  printf("'\n");
+  return offset + 3;
+}
+
+static int registerInstruction(
+  const char* name,
+  bool store,
+  bool constant,
+  Chunk* chunk,
+  int offset
+) {
+  int operand = offset + 1;
+  printf("%-16s ", name);
+  if (store) {
+    printf("r%d, ", chunk->code[operand++]);
+  }
+  printf("r%d, ", chunk->code[operand++]);
+  uint8_t right = chunk->code[operand++];
+  if (constant) {
+    printf("k%d '", right);
+    printValue(chunk->constants.values[right]);
+    printf("'\n");
+  }
+  else {
+    printf("r%d\n", right);
+  }
+  return operand;
+}
+
 int disassembleInstruction(Chunk* chunk, int offset) {
   printf("%04d ", offset);
   int line = getLine(chunk, offset);
@@ -91,17 +311,15 @@ int disassembleInstruction(Chunk* chunk, int offset) {
     case OP_SET_LOCAL:
       return byteInstruction("OP_SET_LOCAL", chunk, offset);
     case OP_GET_GLOBAL:
-      return constInstruction("OP_GET_GLOBAL", chunk, offset);
+      return globalInstruction("OP_GET_GLOBAL", chunk, offset, 1);
     case OP_DEF_GLOBAL:
-      return constInstruction(
-        "OP_DEF_GLOBAL",
-        chunk,
-        offset
-      );
+      return globalInstruction("OP_DEF_GLOBAL", chunk, offset, 1);
     case OP_SET_GLOBAL:
-      return constInstruction("OP_SET_GLOBAL", chunk, offset);
+      return globalInstruction("OP_SET_GLOBAL", chunk, offset, 1);
     case OP_GET_UPVAL:
       return byteInstruction("OP_GET_UPVAL", chunk, offset);
+    case OP_GET_CAPTURE:
+      return byteInstruction("OP_GET_CAPTURE", chunk, offset);
     case OP_SET_UPVAL:
       return byteInstruction("OP_SET_UPVAL", chunk, offset);
     case OP_GET_PROP:
@@ -110,9 +328,9 @@ int disassembleInstruction(Chunk* chunk, int offset) {
       return constInstruction("OP_SET_PROP", chunk, offset);
     case OP_GET_SUPER:
       return constInstruction("OP_GET_SUPER", chunk, offset);
-    // These will be simple instructions for now.
     case OP_BUILD_LIST:
-      return simpleInstruction("OP_BUILD_LIST", offset);
+      return byteInstruction("OP_BUILD_LIST", chunk, offset);
+    // These will be simple instructions for now.
     case OP_INDEX_SUB:
       return simpleInstruction("OP_INDEX_SUB", offset);
     case OP_STORE_SUB:
@@ -139,6 +357,18 @@ int disassembleInstruction(Chunk* chunk, int offset) {
       return simpleInstruction("OP_DIV", offset);
     case OP_MOD:
       return simpleInstruction("OP_MOD", offset);
+    case OP_BIT_AND:
+      return simpleInstruction("OP_BIT_AND", offset);
+    case OP_BIT_OR:
+      return simpleInstruction("OP_BIT_OR", offset);
+    case OP_BIT_XOR:
+      return simpleInstruction("OP_BIT_XOR", offset);
+    case OP_SHL:
+      return simpleInstruction("OP_SHL", offset);
+    case OP_SHR:
+      return simpleInstruction("OP_SHR", offset);
+    case OP_BIT_NOT:
+      return simpleInstruction("OP_BIT_NOT", offset);
     case OP_NOT:
       return simpleInstruction("OP_NOT", offset);
     case OP_NEGATE:
@@ -155,26 +385,8 @@ int disassembleInstruction(Chunk* chunk, int offset) {
       return invokeInstruction("OP_INVOKE", chunk, offset);
     case OP_INVOKE_SUPER:
       return invokeInstruction("OP_INVOKE_SUPER", chunk, offset);
-    case OP_CLOSURE: {
-      offset++;
-      uint8_t constant = chunk->code[offset++];
-      printf("%-16s %4d ", "OP_CLOSURE", constant);
-      printValue(chunk->constants.values[constant]);
-      printf("\n");
-      ObjFunc* func = AS_FUNC(
-        chunk->constants.values[constant]
-      );
-      for (int j = 0; j < func->upvalCount; j++) {
-        int isLocal = chunk->code[offset++];
-        int index = chunk->code[offset++];
-        printf(
-          "%04d\t|\t\t\t%s %d\n",
-          offset - 2, isLocal ? "local" : "upval",
-          index
-        );
-      }
-      return offset;
-    }
+    case OP_CLOSURE:
+      return closureInstruction("OP_CLOSURE", 1, chunk, offset);
     case OP_CLOSE_UPVAL:
       return simpleInstruction("OP_CLOSE_UPVAL", offset);
     case OP_RETURN:
@@ -185,6 +397,112 @@ int disassembleInstruction(Chunk* chunk, int offset) {
       return simpleInstruction("OP_INHERIT", offset);
     case OP_METHOD:
       return constInstruction("OP_METHOD", chunk, offset);
+    case OP_JMPF_POP:
+      return jmpInstruction("OP_JMPF_POP", 1, chunk, offset);
+    case OP_JLT_LOCAL_CONST:
+      return jltInstruction("OP_JLT_LOCAL_CONST", chunk, offset);
+    case OP_GET_LOCAL_PROP:
+      return localPropInstruction("OP_GET_LOCAL_PROP", chunk, offset);
+    case OP_ADD_RR:
+      return registerInstruction(
+        "OP_ADD_RR", false, false, chunk, offset
+      );
+    case OP_ADD_RK:
+      return registerInstruction(
+        "OP_ADD_RK", false, true, chunk, offset
+      );
+    case OP_ADD_RRR:
+      return registerInstruction(
+        "OP_ADD_RRR", true, false, chunk, offset
+      );
+    case OP_ADD_RRK:
+      return registerInstruction(
+        "OP_ADD_RRK", true, true, chunk, offset
+      );
+    case OP_SUB_RR:
+      return registerInstruction(
+        "OP_SUB_RR", false, false, chunk, offset
+      );
+    case OP_SUB_RK:
+      return registerInstruction(
+        "OP_SUB_RK", false, true, chunk, offset
+      );
+    case OP_SUB_RRR:
+      return registerInstruction(
+        "OP_SUB_RRR", true, false, chunk, offset
+      );
+    case OP_SUB_RRK:
+      return registerInstruction(
+        "OP_SUB_RRK", true, true, chunk, offset
+      );
+    case OP_MUL_RR:
+      return registerInstruction(
+        "OP_MUL_RR", false, false, chunk, offset
+      );
+    case OP_MUL_RK:
+      return registerInstruction(
+        "OP_MUL_RK", false, true, chunk, offset
+      );
+    case OP_MUL_RRR:
+      return registerInstruction(
+        "OP_MUL_RRR", true, false, chunk, offset
+      );
+    case OP_MUL_RRK:
+      return registerInstruction(
+        "OP_MUL_RRK", true, true, chunk, offset
+      );
+    case OP_ADD_NUM:
+      return simpleInstruction("OP_ADD_NUM", offset);
+    case OP_GT_NUM:
+      return simpleInstruction("OP_GT_NUM", offset);
+    case OP_LT_NUM:
+      return simpleInstruction("OP_LT_NUM", offset);
+    case OP_GT_EQU_NUM:
+      return simpleInstruction("OP_GT_EQU_NUM", offset);
+    case OP_LT_EQU_NUM:
+      return simpleInstruction("OP_LT_EQU_NUM", offset);
+    case OP_FOR_NUM:
+      return forNumInstruction("OP_FOR_NUM", chunk, offset);
+    case OP_TAIL_CALL:
+      return byteInstruction("OP_TAIL_CALL", chunk, offset);
+    case OP_CONST_LONG:
+      return constLongInstruction("OP_CONST_LONG", chunk, offset);
+    case OP_GET_LOCAL_LONG:
+      return shortInstruction("OP_GET_LOCAL_LONG", chunk, offset);
+    case OP_SET_LOCAL_LONG:
+      return shortInstruction("OP_SET_LOCAL_LONG", chunk, offset);
+    case OP_GET_GLOBAL_LONG:
+      return globalInstruction("OP_GET_GLOBAL_LONG", chunk, offset, 3);
+    case OP_DEF_GLOBAL_LONG:
+      return globalInstruction("OP_DEF_GLOBAL_LONG", chunk, offset, 3);
+    case OP_SET_GLOBAL_LONG:
+      return globalInstruction("OP_SET_GLOBAL_LONG", chunk, offset, 3);
+    case OP_GET_PROP_LONG:
+      return constLongInstruction("OP_GET_PROP_LONG", chunk, offset);
+    case OP_SET_PROP_LONG:
+      return constLongInstruction("OP_SET_PROP_LONG", chunk, offset);
+    case OP_GET_SUPER_LONG:
+      return constLongInstruction("OP_GET_SUPER_LONG", chunk, offset);
+    case OP_INVOKE_LONG:
+      return invokeLongInstruction("OP_INVOKE_LONG", chunk, offset);
+    case OP_INVOKE_SUPER_LONG:
+      return invokeLongInstruction(
+        "OP_INVOKE_SUPER_LONG", chunk, offset
+      );
+    case OP_CLOSURE_LONG:
+      return closureInstruction("OP_CLOSURE_LONG", 3, chunk, offset);
+    case OP_CLASS_LONG:
+      return constLongInstruction("OP_CLASS_LONG", chunk, offset);
+    case OP_METHOD_LONG:
+      return constLongInstruction("OP_METHOD_LONG", chunk, offset);
+    case OP_EXTEND_LIST:
+      return byteInstruction("OP_EXTEND_LIST", chunk, offset);
+    case OP_SMALLINT:
+      return smallIntInstruction("OP_SMALLINT", chunk, offset);
+    case OP_SWITCH_INT:
+      return switchIntInstruction("OP_SWITCH_INT", chunk, offset);
+    case OP_SWITCH_STR:
+      return switchStrInstruction("OP_SWITCH_STR", chunk, offset);
     default:
       printf("Unknown opcode: %d\n", instruction);
       return offset + 1;
@@ -197,4 +515,175 @@ void disassembleChunk(Chunk* chunk, const char* name) {
   for (int offset = 0; offset < chunk->count;) {
     offset = disassembleInstruction(chunk, offset);
   }
-}
\ No newline at end of file
+}
+
+static const char* seenNames[] = {
+  "num", "int", "bool", "nil", "str", "list", "instance", "other"
+};
+
+static void printSeen(uint8_t seen) {
+  const char* separator = "";
+  for (int i = 0; i < (int)(sizeof(seenNames) / sizeof(char*)); i++) {
+    if (seen & (1 << i)) {
+      printf("%s%s", separator, seenNames[i]);
+      separator = "|";
+    }
+  }
+}
+
+static void printFeedback(int offset, Feedback* feedback) {
+  if (
+    feedback->left == 0 &&
+    feedback->right == 0 &&
+    feedback->target == NULL
+  ) {
+    return;
+  }
+  printf("%04d\t|\t\t\t", offset);
+  if (feedback->left != 0) {
+    printf("seen ");
+    printSeen(feedback->left);
+  }
+  if (feedback->right != 0) {
+    printf(", ");
+    printSeen(feedback->right);
+  }
+  if (feedback->target != NULL) {
+    printf(feedback->left != 0 ? " -> " : "-> ");
+    printValue(OBJ_VAL(feedback->target));
+    if (feedback->polymorphic) {
+      printf(" (polymorphic)");
+    }
+  }
+  printf("\n");
+}
+
+// Disassembles a function with what each instruction has seen so
+// far under it.
+void disassembleFeedback(ObjFunc* func) {
+  Chunk* chunk = &func->chunk;
+  printf("[ %s ]\n", func->name != NULL ? func->name->chars : "<script>");
+  for (int offset = 0; offset < chunk->count;) {
+    int next = disassembleInstruction(chunk, offset);
+    if (
+      func->feedbackAt != NULL &&
+      func->feedbackAt[offset] != NO_FEEDBACK
+    ) {
+      printFeedback(offset, feedbackOf(func, &chunk->code[offset]));
+    }
+    offset = next;
+  }
+}
+
+// Dumps every function still in the heap, oldest first, so the
+// script comes before what it defines.
+void dumpFeedback() {
+  int count = 0;
+  for (Obj* object = vm.objects; object != NULL; object = object->next) {
+    if (object->type == OBJ_FUNC) {
+      count++;
+    }
+  }
+  ObjFunc** funcs = malloc(sizeof(ObjFunc*) * count);
+  int i = count;
+  for (Obj* object = vm.objects; object != NULL; object = object->next) {
+    if (object->type == OBJ_FUNC) {
+      funcs[--i] = (ObjFunc*)object;
+    }
+  }
+  for (i = 0; i < count; i++) {
+    if (i > 0) {
+      printf("\n");
+    }
+    disassembleFeedback(funcs[i]);
+  }
+  free(funcs);
+}
+
+#ifdef DEBUG_PROFILE_OPS
+
+#define PROFILE_TOP 20
+
+typedef struct {
+  int ops[3];
+  uint64_t count;
+} OpSequence;
+
+static const char* opNames[] = {
+  #define OPCODE_NAME(name) #name,
+  OPCODES(OPCODE_NAME)
+  #undef OPCODE_NAME
+};
+
+static uint64_t pairCounts[OP_COUNT][OP_COUNT];
+static uint64_t tripleCounts[OP_COUNT][OP_COUNT][OP_COUNT];
+static int lastOps[2] = {-1, -1};
+
+void profileOp(uint8_t instruction) {
+  if (lastOps[1] != -1) {
+    pairCounts[lastOps[1]][instruction]++;
+    if (lastOps[0] != -1) {
+      tripleCounts[lastOps[0]][lastOps[1]][instruction]++;
+    }
+  }
+  lastOps[0] = lastOps[1];
+  lastOps[1] = instruction;
+}
+
+static int compareSequences(const void* a, const void* b) {
+  uint64_t countA = ((const OpSequence*)a)->count;
+  uint64_t countB = ((const OpSequence*)b)->count;
+  return countA < countB ? 1 : countA > countB ? -1 : 0;
+}
+
+static void printTop(OpSequence* sequences, int count, int length) {
+  qsort(sequences, count, sizeof(OpSequence), compareSequences);
+  for (int i = 0; i < count && i < PROFILE_TOP; i++) {
+    fprintf(stderr, "%12llu ", (unsigned long long)sequences[i].count);
+    for (int j = 0; j < length; j++) {
+      fprintf(stderr, " %s", opNames[sequences[i].ops[j]]);
+    }
+    fprintf(stderr, "\n");
+  }
+}
+
+void printOpProfile() {
+  OpSequence* sequences = malloc(
+    sizeof(OpSequence) * OP_COUNT * OP_COUNT * OP_COUNT
+  );
+  if (sequences == NULL) {
+    return;
+  }
+  int count = 0;
+  for (int a = 0; a < OP_COUNT; a++) {
+    for (int b = 0; b < OP_COUNT; b++) {
+      if (pairCounts[a][b] > 0) {
+        OpSequence* sequence = &sequences[count++];
+        sequence->ops[0] = a;
+        sequence->ops[1] = b;
+        sequence->count = pairCounts[a][b];
+      }
+    }
+  }
+  fprintf(stderr, "== opcode pairs ==\n");
+  printTop(sequences, count, 2);
+  count = 0;
+  for (int a = 0; a < OP_COUNT; a++) {
+    for (int b = 0; b < OP_COUNT; b++) {
+      for (int c = 0; c < OP_COUNT; c++) {
+        if (tripleCounts[a][b][c] > 0) {
+          OpSequence* sequence = &sequences[count++];
+          sequence->ops[0] = a;
+          sequence->ops[1] = b;
+          sequence->ops[2] = c;
+          sequence->count = tripleCounts[a][b][c];
+        }
+      }
+    }
+  }
+  fprintf(stderr, "== opcode triples ==\n");
+  printTop(sequences, count, 3);
+  free(sequences);
+}
+
+#endif
\ No newline at end of file
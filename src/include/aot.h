@@ -0,0 +1,58 @@
+#ifndef resin_aot_h
+#define resin_aot_h
+
+#include <stdio.h>
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+#include "jit.h"
+
+// Writes the script at 'path' to 'out' as a C program, one
+// function per ObjFunc. Returns false if it doesn't compile, or
+// this build has no native code to link it with.
+bool emitC(const char* path, FILE* out);
+
+#ifdef NATIVE_CODE
+
+// One function of a program from `resin --emit-c`, in the order
+// the script's functions are numbered: the script itself, then
+// the functions among its constants, depth first.
+typedef struct {
+  JitFn native;
+  // Its chunk's length, which catches a runtime that compiles
+  // the script differently from the one that emitted it.
+  int codeLength;
+} AotFunc;
+
+// The main() of an emitted program. Compiles 'source' again,
+// gives each of its functions the native code emitted for it and
+// runs it. Returns the exit code.
+int aotMain(const char* source, const AotFunc* funcs, int count);
+
+// The rest is for the emitted code.
+
+// jitStep() with the stack written back and picked up again.
+static inline StepResult aotStep(Value** sp, uint8_t* ins) {
+  vm.stackTop = *sp;
+  StepResult result = jitStep(ins);
+  *sp = vm.stackTop;
+  return result;
+}
+
+// Runs the native code of the frame a call pushed above the one
+// at 'at'.
+static inline bool aotCall(int at) {
+  CallFrame* callee = &vm.frames[at + 1];
+  jitDepth++;
+  JitResult result = ((JitFn)callee->closure->func->native)(callee);
+  jitDepth--;
+  return result == JIT_RETURNED || jitFinish(result);
+}
+
+static inline bool aotFalsey(Value value) {
+  return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+#endif
+
+#endif
@@ -4,41 +4,122 @@
 #include "common.h"
 #include "value.h"
 
+// Every opcode, in encoding order. The enum below and the
+// threaded dispatch table in vm.c are both generated from this
+// list, so they can never fall out of sync. The last group are
+// superinstructions, which the compiler never emits directly;
+// optimizeChunk() fuses them from common sequences.
+//
+// The _RR/_RK/_RRR/_RRK opcodes are register instructions. Their
+// operands name frame slots (R) or constants (K) directly, so
+// OP_ADD_RRK a b k is "slots[a] = slots[b] + constants[k]". The
+// two-operand forms push their result instead of storing it.
+//
+// The _NUM opcodes are quickened forms. run() rewrites a generic
+// instruction into one in place once it sees number operands, and
+// back again if the guard in the quickened handler fails.
+//
+// The _LONG opcodes are wide twins of the indexed instructions,
+// emitted only when an operand doesn't fit in a byte. Constant
+// indexes take 3 bytes and local slots 2, both big-endian.
+//
+// OP_GET_CAPTURE reads a variable a closure copied in when it was
+// made, which the compiler does for variables that are never
+// assigned. OP_CLOSURE lists the function's ObjUpval captures,
+// then its copied ones, each as isLocal(1) index(2).
+//
+// OP_SMALLINT pushes its signed byte operand as an integer, so
+// small integer literals skip the constant pool.
+//
+// The OP_SWITCH opcodes dispatch a match on literal arms in one
+// step, leaving the subject on the stack. Their tables are inline
+// and every offset is 16 bits, forward from the end of the
+// instruction:
+//   OP_SWITCH_INT min(4) count(2) miss(2) offset(2) * count
+//   OP_SWITCH_STR shift(1) size(2) miss(2)
+//                 [constant(3) offset(2)] * size
+// An integer subject n takes offset[n - min]. A string takes the
+// entry at (hash >> shift) & (size - 1) if its constant is the
+// same string. Empty entries hold SWITCH_EMPTY and the miss offset.
+#define OPCODES(OP) \
+  OP(OP_CONST) \
+  OP(OP_NIL) \
+  OP(OP_TRUE) OP(OP_FALSE) \
+  OP(OP_DUP) \
+  OP(OP_POP) \
+  OP(OP_GET_LOCAL) OP(OP_SET_LOCAL) \
+  OP(OP_GET_GLOBAL) OP(OP_DEF_GLOBAL) OP(OP_SET_GLOBAL) \
+  OP(OP_GET_UPVAL) OP(OP_SET_UPVAL) \
+  OP(OP_GET_CAPTURE) \
+  OP(OP_GET_PROP) OP(OP_SET_PROP) \
+  OP(OP_BUILD_LIST) OP(OP_INDEX_SUB) OP(OP_STORE_SUB) \
+  OP(OP_GET_SUPER) \
+  OP(OP_EQU) \
+  OP(OP_GT) OP(OP_LT) \
+  OP(OP_GT_EQU) OP(OP_LT_EQU) \
+  OP(OP_ADD) OP(OP_SUB) \
+  OP(OP_MUL) OP(OP_DIV) OP(OP_MOD) OP(OP_POW) \
+  OP(OP_BIT_AND) OP(OP_BIT_OR) OP(OP_BIT_XOR) \
+  OP(OP_SHL) OP(OP_SHR) OP(OP_BIT_NOT) \
+  OP(OP_NOT) \
+  OP(OP_NOT_EQU) \
+  OP(OP_NEGATE) \
+  OP(OP_THROW) \
+  OP(OP_JMP) \
+  OP(OP_JMPF) \
+  OP(OP_LOOP) \
+  OP(OP_CALL) \
+  OP(OP_INVOKE) \
+  OP(OP_INVOKE_SUPER) \
+  OP(OP_CLOSURE) \
+  OP(OP_CLOSE_UPVAL) \
+  OP(OP_RETURN) \
+  OP(OP_CLASS) \
+  OP(OP_INHERIT) \
+  OP(OP_METHOD) \
+  OP(OP_JMPF_POP) \
+  OP(OP_JLT_LOCAL_CONST) \
+  OP(OP_GET_LOCAL_PROP) \
+  OP(OP_ADD_RR) OP(OP_ADD_RK) OP(OP_ADD_RRR) OP(OP_ADD_RRK) \
+  OP(OP_SUB_RR) OP(OP_SUB_RK) OP(OP_SUB_RRR) OP(OP_SUB_RRK) \
+  OP(OP_MUL_RR) OP(OP_MUL_RK) OP(OP_MUL_RRR) OP(OP_MUL_RRK) \
+  OP(OP_ADD_NUM) \
+  OP(OP_GT_NUM) OP(OP_LT_NUM) \
+  OP(OP_GT_EQU_NUM) OP(OP_LT_EQU_NUM) \
+  OP(OP_FOR_NUM) \
+  OP(OP_TAIL_CALL) \
+  OP(OP_CONST_LONG) \
+  OP(OP_GET_LOCAL_LONG) OP(OP_SET_LOCAL_LONG) \
+  OP(OP_GET_GLOBAL_LONG) OP(OP_DEF_GLOBAL_LONG) \
+  OP(OP_SET_GLOBAL_LONG) \
+  OP(OP_GET_PROP_LONG) OP(OP_SET_PROP_LONG) \
+  OP(OP_GET_SUPER_LONG) \
+  OP(OP_INVOKE_LONG) OP(OP_INVOKE_SUPER_LONG) \
+  OP(OP_CLOSURE_LONG) \
+  OP(OP_CLASS_LONG) OP(OP_METHOD_LONG) \
+  OP(OP_EXTEND_LIST) \
+  OP(OP_SMALLINT) \
+  OP(OP_SWITCH_INT) OP(OP_SWITCH_STR)
+
 typedef enum {
-  OP_CONST,
-  OP_NIL,
-  OP_TRUE, OP_FALSE,
-  OP_DUP,
-  OP_POP,
-  OP_GET_LOCAL, OP_SET_LOCAL,
-  OP_GET_GLOBAL, OP_DEF_GLOBAL, OP_SET_GLOBAL,
-  OP_GET_UPVAL, OP_SET_UPVAL,
-  OP_GET_PROP, OP_SET_PROP,
-  OP_BUILD_LIST, OP_INDEX_SUB, OP_STORE_SUB,
-  OP_GET_SUPER,
-  OP_EQU,
-  OP_GT, OP_LT,
-  OP_GT_EQU, OP_LT_EQU,
-  OP_ADD, OP_SUB,
-  OP_MUL, OP_DIV, OP_MOD, OP_POW,
-  OP_NOT,
-  OP_NOT_EQU,
-  OP_NEGATE,
-  OP_THROW,
-  OP_JMP,
-  OP_JMPF,
-  OP_LOOP,
-  OP_CALL,
-  OP_INVOKE,
-  OP_INVOKE_SUPER,
-  OP_CLOSURE,
-  OP_CLOSE_UPVAL,
-  OP_RETURN,
-  OP_CLASS,
-  OP_INHERIT,
-  OP_METHOD
+  #define OPCODE_ENUM(name) name,
+  OPCODES(OPCODE_ENUM)
+  #undef OPCODE_ENUM
+  OP_COUNT
 } OpCode;
 
+#define SWITCH_EMPTY 0xffffff
+
+// Mode bits for OP_FOR_NUM, which closes a counted for loop:
+// OP_FOR_NUM slot step limit mode offset.
+#define FOR_NUM_SUB         0x01
+#define FOR_NUM_LIMIT_LOCAL 0x02
+#define FOR_NUM_LT          0x00
+#define FOR_NUM_LT_EQU      0x04
+#define FOR_NUM_GT          0x08
+#define FOR_NUM_GT_EQU      0x0c
+#define FOR_NUM_CMP_MASK    0x0c
+
 typedef struct {
   int offset;
   int line;
@@ -52,13 +133,21 @@ typedef struct {
   int lineCapacity;
   LineStart* lines;
   ValueArray constants;
+  // Open-addressed hash of 'constants', so addConst() can hand back
+  // an existing slot. Empty buckets hold -1.
+  int* constIndex;
+  int constIndexCapacity;
 } Chunk;
 
 
 void initChunk(Chunk* chunk);
 void freeChunk(Chunk* chunk);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
+// Returns the index of 'value' in the constant pool, or -1.
+int lookupConst(Chunk* chunk, Value value);
 int addConst(Chunk* chunk, Value value);
+// Takes back the last constant added, while nothing refers to it.
+void removeLastConst(Chunk* chunk);
 int getLine(Chunk* chunk, int instruction);
 
 #endif
\ No newline at end of file
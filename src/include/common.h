@@ -8,11 +8,36 @@
 // Disable NAN_BOXING if it somehow
 // breaks on your machine.
 #define NAN_BOXING
+// Threaded dispatch relies on GCC's labels-as-values. Build
+// with -DNO_THREADED_DISPATCH to get the plain switch loop.
+#if defined(__GNUC__) && !defined(NO_THREADED_DISPATCH)
+#define THREADED_DISPATCH
+#endif
+// Native code, from the JIT or from `resin --emit-c`, runs
+// through the protocol in jit.h. Build with -DNO_JIT to leave out
+// both.
+#ifndef NO_JIT
+#define NATIVE_CODE
+#endif
+// The JIT emits x86-64 code for NaN-boxed values on Linux.
+#if \
+  defined(NATIVE_CODE) && defined(__x86_64__) && \
+  defined(__linux__) && defined(NAN_BOXING)
+#define JIT
+#endif
+// Loop traces are recorded by swapping the threaded loop's
+// dispatch table, so they need both.
+#if defined(JIT) && defined(THREADED_DISPATCH)
+#define TRACE_JIT
+#endif
 // #define DEBUG_PRINT_CODE
 // #define DEBUG_TRACE_EXEC
 // #define DEBUG_STRESS_GC
 // #define DEBUG_LOG_GC
+// #define DEBUG_PROFILE_OPS
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT16_COUNT (UINT16_MAX + 1)
+#define UINT24_COUNT (1 << 24)
 
 #endif
\ No newline at end of file
@@ -2,8 +2,15 @@
 #define resin_debug_h
 
 #include "chunk.h"
+#include "object.h"
 
 void disassembleChunk(Chunk* chunk, const char* name);
 int disassembleInstruction(Chunk* chunk, int offset);
+void disassembleFeedback(ObjFunc* func);
+void dumpFeedback();
+#ifdef DEBUG_PROFILE_OPS
+void profileOp(uint8_t instruction);
+void printOpProfile();
+#endif
 
 #endif
\ No newline at end of file
@@ -0,0 +1,171 @@
+#ifndef resin_jit_h
+#define resin_jit_h
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+#ifdef NATIVE_CODE
+
+// How deep native code may nest on the C stack. Calls past this
+// stay in the interpreter loop.
+#define JIT_DEPTH_MAX 256
+
+// How native code left its frame.
+typedef enum {
+  // It returned and its result is on the stack.
+  JIT_RETURNED,
+  // A runtime error has been reported.
+  JIT_ERROR,
+  // It tail called a closure, which now owns the frame but hasn't
+  // started yet.
+  JIT_TAIL_CALL,
+  // It hit an instruction it has no template for; the
+  // interpreter must finish the frame from its ip.
+  JIT_EXIT
+} JitResult;
+
+// Native code takes its own frame, the top one.
+typedef JitResult (*JitFn)(CallFrame* frame);
+
+// What jitStep() tells native code to do next.
+typedef enum {
+  STEP_ERROR,
+  STEP_NEXT,
+  // The instruction's jump is taken.
+  STEP_JUMP,
+  // As JIT_TAIL_CALL.
+  STEP_TAIL_CALL,
+  // The call pushed a frame with native code, which the caller's
+  // native code runs itself.
+  STEP_CALL
+} StepResult;
+
+// Native frames nested on the C stack.
+extern int jitDepth;
+
+// Slow paths native code calls back into, in vm.c. They work on
+// the top frame and vm.stackTop.
+StepResult jitStep(uint8_t* ins);
+// Finishes a callee whose native code didn't return.
+bool jitFinish(JitResult result);
+int jitSwitch(uint8_t* ins);
+void jitReturn();
+
+#endif
+
+#ifdef JIT
+
+// Calls a function takes before it is compiled to native code.
+#define JIT_THRESHOLD 1000
+
+// Translates a function's bytecode to native code, one template
+// per instruction. Returns false, leaving it to the interpreter,
+// if it can't.
+bool jitCompile(ObjFunc* func);
+void jitFree(ObjFunc* func);
+
+#endif
+
+#ifdef TRACE_JIT
+
+// Trips round a loop before it is recorded. Feedback.loops stops
+// here once it has been, or reads TRACE_COMPILED if that gave a
+// trace.
+#define TRACE_HOT 64
+#define TRACE_COMPILED UINT16_MAX
+// Longest trace, in instructions, and most stack slots it tracks.
+#define TRACE_MAX 512
+#define TRACE_STACK 256
+// Longest method body a trace inlines.
+#define TRACE_INLINE_MAX 32
+// Times a function's loops are recorded again after their slots
+// turn out to hold another kind of number than the trace expects.
+#define TRACE_RETRACES 8
+// What the trace helpers return for "not here": no Value has
+// these bits. An undefined global holds them too.
+#define TRACE_MISSING UNDEFINED_VAL
+
+// What one of the frame's slots held when a loop was recorded.
+typedef enum {
+  SLOT_OTHER,
+  SLOT_NUM,
+  SLOT_INT
+} SlotKind;
+
+// One instruction of a recorded loop, in the order it ran.
+typedef struct {
+  uint8_t* ip;
+  // Part of an inlined method's body.
+  bool inlined;
+  // Its operands were all numbers when it was recorded, and bit i
+  // of 'ints' is set if its i-th was an integer.
+  bool numeric;
+  uint8_t ints;
+  // For OP_INVOKE, the method whose body follows.
+  ObjClosure* method;
+} TraceStep;
+
+// A loop compiled from one recorded trip round it. The code runs
+// the loop until a guard fails, then writes the stack back and
+// leaves the frame at the instruction that failed.
+typedef struct Trace {
+  uint8_t* header;
+  // Stack depth at the header, and the most the trace uses, both
+  // from the frame's slots.
+  int depth;
+  int maxDepth;
+  void* native;
+  size_t nativeSize;
+  // Inlined methods, which the trace's guards compare against.
+  ObjClosure** methods;
+  int methodCount;
+  struct Trace* next;
+  // The kind of number each carried slot must hold on entry, and
+  // SLOT_OTHER for the slots the trace doesn't carry.
+  SlotKind kinds[];
+} Trace;
+
+typedef void (*TraceFn)(CallFrame* frame);
+
+// Compiles a loop recorded in 'func' from its header. 'slotKinds'
+// says what each of the frame's 'depth' slots held then.
+// Returns NULL if the trace holds something it can't compile.
+Trace* traceCompile(
+  ObjFunc* func,
+  uint8_t* header,
+  int depth,
+  SlotKind* slotKinds,
+  TraceStep* steps,
+  int count
+);
+void traceFree(Trace* trace);
+// Copies a method's body into 'steps' for a trace to inline, if
+// it's short and straight enough. Returns how many steps that
+// took, or -1.
+int traceInline(ObjFunc* func, TraceStep* steps, int room);
+void traceMarkRecording();
+
+// Slow paths traces call, in vm.c. Each fails, without side
+// effects, by returning TRACE_MISSING, NULL or false, leaving the
+// interpreter to redo the instruction.
+Value traceGetField(Value receiver, ObjStr* name, InlineCache* cache);
+bool traceSetField(
+  Value receiver,
+  ObjStr* name,
+  Value value,
+  InlineCache* cache
+);
+ObjClosure* traceMethod(
+  Value receiver,
+  ObjStr* name,
+  InlineCache* cache
+);
+Value traceIndex(Value list, Value index);
+bool traceStore(Value list, Value index, Value item);
+// Pushes the frame of an inlined method a trace left from.
+void traceEnter(ObjClosure* closure, uint8_t* ip, int base);
+
+#endif
+
+#endif
@@ -46,14 +46,124 @@ struct Obj {
   struct Obj* next;
 };
 
+// Kinds of value a feedback entry has seen, as bits.
+typedef enum {
+  SEEN_NUM = 1 << 0,
+  SEEN_INT = 1 << 1,
+  SEEN_BOOL = 1 << 2,
+  SEEN_NIL = 1 << 3,
+  SEEN_STR = 1 << 4,
+  SEEN_LIST = 1 << 5,
+  SEEN_INSTANCE = 1 << 6,
+  SEEN_OTHER = 1 << 7
+} SeenKind;
+
+// What an instruction has seen at run time, for later tiers to
+// specialize on. 'left' and 'right' are operand kinds; 'target' is
+// the first receiver class or callee, and 'polymorphic' is set once
+// a different one turns up. 'target' doesn't keep its object alive:
+// the GC clears it once nothing else does. 'loops' counts a
+// backward jump's trips, for the tracing JIT.
+typedef struct {
+  uint8_t left;
+  uint8_t right;
+  bool polymorphic;
+  uint16_t loops;
+  // Index of the property site's inline cache, or NO_CACHE.
+  uint16_t cache;
+  Obj* target;
+} Feedback;
+
+#define NO_CACHE UINT16_MAX
+// Marks code with no feedback entry of its own.
+#define NO_FEEDBACK UINT16_MAX
+// Receivers an inline cache learns before it stops adding more.
+#define CACHE_WAYS 4
+
+// One receiver an inline cache has resolved. A field is keyed by
+// shape alone and found at 'slot'; a store that adds the field
+// also moves the instance to shape 'next'. A method is keyed by
+// shape and class, and has 'slot' -1.
+typedef struct {
+  struct Shape* shape;
+  struct ObjClass* class;
+  int slot;
+  struct Shape* next;
+  struct ObjClosure* method;
+} CacheEntry;
+
+// The cache of a property or method instruction. Method entries go
+// stale when any class's methods change, so the whole cache is
+// dropped once 'epoch' falls behind vm.cacheEpoch.
+typedef struct {
+  int count;
+  uint32_t epoch;
+  CacheEntry entries[CACHE_WAYS];
+} InlineCache;
+
+// What a method does if its whole body is 'return this.field' or
+// 'this.field = param'.
+typedef enum {
+  ACCESS_NONE,
+  ACCESS_GET,
+  ACCESS_SET
+} AccessKind;
+
 typedef struct {
   Obj obj;
   int arity;
   int upvalCount;
+  // Variables its closures copy in rather than capture.
+  int captureCount;
+  // Most values its frame holds at once, locals and temporaries
+  // alike, so call() can reserve stack for them.
+  int maxStack;
+  // Lets OP_INVOKE read or write 'field' without a frame.
+  AccessKind access;
+  ObjStr* field;
   Chunk chunk;
   ObjStr* name;
+  // One entry per instruction that records feedback, found through
+  // 'feedbackAt', which holds an index for each byte of code or
+  // NO_FEEDBACK. Both are NULL until it is compiled.
+  Feedback* feedback;
+  uint16_t* feedbackAt;
+  int feedbackCount;
+  InlineCache* caches;
+  int cacheCount;
+  // The closure every OP_CLOSURE shares when it captures nothing.
+  struct ObjClosure* closure;
+  #ifdef JIT
+  // Calls so far, up to JIT_THRESHOLD.
+  int calls;
+  #endif
+  #ifdef NATIVE_CODE
+  // Its native code, if any. 'nativeSize' is zero for code that
+  // isn't the JIT's to free.
+  void* native;
+  size_t nativeSize;
+  #endif
+  #ifdef TRACE_JIT
+  // Compiled traces of its hot loops, and how many times they have
+  // been recorded again for other kinds of number.
+  struct Trace* traces;
+  int retraces;
+  #endif
 } ObjFunc;
 
+// The feedback entry of the instruction at 'ins', which must be
+// one that records some.
+static inline Feedback* feedbackOf(ObjFunc* func, uint8_t* ins) {
+  return &func->feedback[func->feedbackAt[ins - func->chunk.code]];
+}
+
+// The inline cache of the instruction at 'ins', or NULL if its
+// function ran out of them.
+static inline InlineCache* siteCache(ObjFunc* func, uint8_t* ins) {
+  uint16_t cache = feedbackOf(func, ins)->cache;
+  return cache == NO_CACHE ? NULL : &func->caches[cache];
+}
+
 typedef Value (*NativeFn)(int argCount, Value* args);
 
 typedef struct {
@@ -66,6 +176,8 @@ struct ObjStr {
   int length;
   char* chars;
   uint32_t hash;
+  // Its index in method tables, or -1 if it isn't a method name.
+  int selector;
 };
 
 typedef struct ObjUpval {
@@ -75,25 +187,80 @@ typedef struct ObjUpval {
   struct ObjUpval* next;
 } ObjUpval;
 
-typedef struct {
+// A closure and its captures are one allocation: 'captures'
+// points just past the last of 'upvals'.
+typedef struct ObjClosure {
   Obj obj;
   ObjFunc* func;
-  ObjUpval** upvals;
   int upvalCount;
+  int captureCount;
+  Value* captures;
+  ObjUpval* upvals[];
 } ObjClosure;
 
-typedef struct {
+#define CLOSURE_SIZE(upvalCount, captureCount) \
+  (sizeof(ObjClosure) + sizeof(ObjUpval*) * (upvalCount) + \
+    sizeof(Value) * (captureCount))
+
+// Methods are indexed by their name's selector, less
+// 'firstSelector', and missing ones are nil. Selectors are handed
+// out in declaration order, so the table mostly spans just the few
+// a class's methods use. When it would be mostly holes, the methods
+// move to an open-addressed map instead: 'selectors' holds the key
+// in each slot, or -1, and 'methodCount' is the map's capacity.
+typedef struct ObjClass {
   Obj obj;
   ObjStr* name;
-  Table methods;
+  Value* methods;
+  // NULL while the methods are kept as a table.
+  int* selectors;
+  int firstSelector;
+  int methodCount;
+  // Methods it has, however they're kept.
+  int liveCount;
+  // Its 'init' method, or NULL.
+  struct ObjClosure* init;
+  // Most fields an instance has had, to size new ones by.
+  int fieldCount;
 } ObjClass;
 
+// Instances past this many fields keep them in a table instead.
+#define SHAPE_MAX_FIELDS 32
+// Slots an instance of a new class holds inline before they move
+// to the heap. Later instances get as many as the class has needed.
+#define INSTANCE_SLOTS 4
+
+// The layout shared by instances whose fields were added in the
+// same order: 'names' gives each slot's field. Each shape adds one
+// field to its parent, so they form a tree rooted at vm.rootShape
+// that lives as long as the VM.
+typedef struct Shape {
+  struct Shape* parent;
+  ObjStr* name;
+  int count;
+  ObjStr** names;
+  // Shapes that add one more field to this one.
+  struct Shape* children;
+  struct Shape* sibling;
+} Shape;
+
+// Field values live in 'slots', laid out by 'shape'. Slots start
+// out inline and move to the heap if they outgrow it. An instance
+// with a NULL shape is in dictionary mode and uses 'fields'.
 typedef struct {
   Obj obj;
   ObjClass* class;
+  Shape* shape;
+  Value* slots;
+  int slotCapacity;
+  int inlineCapacity;
   Table fields;
+  Value inlineSlots[];
 } ObjInstance;
 
+#define INSTANCE_SIZE(inlineCapacity) \
+  (sizeof(ObjInstance) + sizeof(Value) * (inlineCapacity))
+
 typedef struct {
   Obj obj;
   Value receiver;
@@ -112,9 +279,24 @@ ObjBoundMethod* newBoundMethod(
   ObjClosure* method
 );
 ObjClass* newClass(ObjStr* name);
+int selectorOf(ObjStr* name);
+bool classGet(ObjClass* class, ObjStr* name, Value* method);
+void classSet(ObjClass* class, ObjStr* name, Value method);
+void classInherit(ObjClass* subclass, ObjClass* superclass);
 ObjClosure* newClosure(ObjFunc* func);
 ObjFunc* newFunc();
+void initFeedback(ObjFunc* func);
 ObjInstance* newInstance(ObjClass* class);
+bool instanceGet(
+  ObjInstance* instance,
+  ObjStr* name,
+  Value* value
+);
+void instanceSet(ObjInstance* instance, ObjStr* name, Value value);
+Shape* newShape(Shape* parent, ObjStr* name);
+int shapeSlot(Shape* shape, ObjStr* name);
+void markShape(Shape* shape);
+void freeShape(Shape* shape);
 ObjNative* newNative(NativeFn func);
 ObjList* newList();
 
@@ -122,7 +304,7 @@ void appendToList(ObjList* list, Value value);
 void storeToList(ObjList* list, int index, Value value);
 Value indexFromList(ObjList* list, int index);
 void deleteFromList(ObjList* list, int index);
-bool isValidListIndex(ObjList* list, int index);
+bool isValidListIndex(ObjList* list, int64_t index);
 
 ObjStr* takeStr(char* chars, int length);
 ObjStr* copyStr(const char* chars, int length);
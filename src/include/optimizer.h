@@ -0,0 +1,10 @@
+#ifndef resin_optimizer_h
+#define resin_optimizer_h
+
+#include "chunk.h"
+
+void optimizeChunk(Chunk* chunk);
+int instructionLen(Chunk* chunk, int offset);
+int maxStackDepth(Chunk* chunk, int depth);
+
+#endif
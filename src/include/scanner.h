@@ -19,10 +19,12 @@ typedef enum {
   EQU,
   GT, LT,
   UNDERSCORE,
+  AMP, PIPE, TILDE,
   // Two char
   BANG_EQU,
   EQU_EQU,
   GT_EQU, LT_EQU,
+  LT_LT, GT_GT,
   RARROW,
   // Literals
   IDENT,
@@ -43,6 +45,7 @@ typedef enum {
   RETURN,
   THIS,
   LET,
+  CONST,
   THROW,
   // Other
   ERR, TEOF
@@ -1,7 +1,9 @@
 #ifndef resin_util_h
 #define resin_util_h
 
+#include "common.h"
+
 char* readFile(const char* path);
-void runFile(const char* path);
+void runFile(const char* path, bool feedback);
 
 #endif
\ No newline at end of file
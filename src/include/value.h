@@ -16,16 +16,23 @@ typedef struct ObjStr ObjStr;
 #define TAG_FALSE 2
 #define TAG_TRUE  3
 
+// Integers keep 48 bits, two's complement, under QNAN with bit 48
+// set: nothing else has those top sixteen bits.
+#define INT_TAG   ((uint64_t)0x7ffd000000000000)
+#define INT_MASK  ((uint64_t)0x0000ffffffffffff)
+
 typedef uint64_t Value;
 
 #define IS_BOOL(value)    (((value) | 1) == TRUE_VAL)
 #define IS_NIL(value)     ((value) == NIL_VAL)
 #define IS_NUM(value)     (((value) & QNAN) != QNAN)
+#define IS_INT(value)     (((value) >> 48) == (INT_TAG >> 48))
 #define IS_OBJ(value) \
   (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
 
 #define AS_BOOL(value)    ((value) == TRUE_VAL)
 #define AS_NUM(value)     valToNum(value)
+#define AS_INT(value)     ((int64_t)((value) << 16) >> 16)
 #define AS_OBJ(value) \
   ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
 
@@ -34,8 +41,13 @@ typedef uint64_t Value;
 #define TRUE_VAL          ((Value)(uint64_t)(QNAN | TAG_TRUE))
 #define NIL_VAL           ((Value)(uint64_t)(QNAN | TAG_NIL))
 #define NUM_VAL(num)      numToVal(num)
+#define INT_VAL(i) \
+  ((Value)(INT_TAG | ((uint64_t)(int64_t)(i) & INT_MASK)))
 #define OBJ_VAL(obj) \
   (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
+// What an undefined global's slot holds. It is never a real value.
+#define UNDEFINED_VAL     ((Value)QNAN)
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
 
 static inline double valToNum(Value value) {
   double num;
@@ -55,6 +67,7 @@ typedef enum {
   VAL_BOOL,
   VAL_NIL,
   VAL_NUM,
+  VAL_INT,
   VAL_OBJ
 } ValueType;
 
@@ -63,6 +76,7 @@ typedef struct {
   union {
     bool boolean;
     double number;
+    int64_t integer;
     Obj* obj;
   } as;
 } Value;
@@ -70,19 +84,82 @@ typedef struct {
 #define IS_BOOL(value)  ((value).type == VAL_BOOL)
 #define IS_NIL(value)   ((value).type == VAL_NIL)
 #define IS_NUM(value)   ((value).type == VAL_NUM)
+#define IS_INT(value)   ((value).type == VAL_INT)
 #define IS_OBJ(value)   ((value).type == VAL_OBJ)
 
 #define AS_OBJ(value)   ((value).as.obj)
 #define AS_BOOL(value)  ((value).as.boolean)
 #define AS_NUM(value)   ((value).as.number)
+#define AS_INT(value)   ((value).as.integer)
 
 #define BOOL_VAL(value) ((Value){VAL_BOOL, {.boolean = value}})
 #define NIL_VAL         ((Value){VAL_NIL, {.number = 0}})
 #define NUM_VAL(value)  ((Value){VAL_NUM, {.number = value}})
+#define INT_VAL(value)  ((Value){VAL_INT, {.integer = value}})
 #define OBJ_VAL(object) ((Value){VAL_OBJ, {.obj = (Obj*)object}})
+// A nil only globals ever hold, for ones not defined yet.
+#define UNDEFINED_VAL   ((Value){VAL_NIL, {.number = 1}})
+#define IS_UNDEFINED(value) \
+  (IS_NIL(value) && (value).as.number == 1)
 
 #endif
 
+// Integers run from INT_VAL_MIN to INT_VAL_MAX in either build.
+// Arithmetic that leaves that range gives a double instead.
+#define INT_VAL_MIN (-((int64_t)1 << 47))
+#define INT_VAL_MAX (((int64_t)1 << 47) - 1)
+#define FITS_INT(i) ((i) >= INT_VAL_MIN && (i) <= INT_VAL_MAX)
+
+// A number of either kind.
+#define IS_NUMBER(value)  (IS_NUM(value) || IS_INT(value))
+#define AS_NUMBER(value) \
+  (IS_INT(value) ? (double)AS_INT(value) : AS_NUM(value))
+
+// The arithmetic numArith() does.
+typedef enum {
+  ARITH_ADD,
+  ARITH_SUB,
+  ARITH_MUL,
+  ARITH_DIV,
+  ARITH_MOD,
+  ARITH_POW,
+  ARITH_AND,
+  ARITH_OR,
+  ARITH_XOR,
+  ARITH_SHL,
+  ARITH_SHR
+} ArithOp;
+
+// 'a op b' for two integers and + - or *, when the result is an
+// integer too. Otherwise it's left to numArith() to give a double.
+static inline bool intArith(ArithOp op, Value a, Value b, Value* result) {
+  int64_t x = AS_INT(a);
+  int64_t y = AS_INT(b);
+  int64_t num;
+  if (op == ARITH_ADD) {
+    num = x + y;
+  }
+  else if (op == ARITH_SUB) {
+    num = x - y;
+  }
+  else {
+    // Exact whenever it's in range.
+    double product = (double)x * (double)y;
+    if (product < INT_VAL_MIN || product > INT_VAL_MAX) {
+      return false;
+    }
+    num = x * y;
+  }
+  if (!FITS_INT(num)) {
+    return false;
+  }
+  *result = INT_VAL(num);
+  return true;
+}
+
+// Longest text formatNum() writes, with its terminator.
+#define NUM_CHARS_MAX 32
+
 typedef struct {
   int capacity;
   int count;
@@ -99,5 +176,7 @@ void initValueArray(ValueArray* array);
 void writeValueArray(ValueArray* array, Value value);
 void freeValueArray(ValueArray* array);
 void printValue(Value value);
+int formatNum(Value value, char* out);
+const char* numArith(ArithOp op, Value a, Value b, Value* result);
 
 #endif
\ No newline at end of file
@@ -5,8 +5,17 @@
 #include "object.h"
 #include "table.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// Both stacks start small and grow on demand; FRAMES_MAX only
+// bounds runaway recursion.
+#define FRAMES_INIT 64
+#define FRAMES_MAX (1 << 16)
+#define STACK_INIT (FRAMES_INIT * UINT8_COUNT)
+// Values the VM's helpers push past the top of a frame to keep
+// them from the collector, such as the operands registerArith()
+// hands to concat() and the string that makes.
+#define STACK_SLACK 4
+// Frames shown at each end of a runtime error's stack trace.
+#define TRACE_EDGE 16
 
 typedef struct {
   ObjClosure* closure;
@@ -15,13 +24,29 @@ typedef struct {
 } CallFrame;
 
 typedef struct {
-  CallFrame frames[FRAMES_MAX];
+  CallFrame* frames;
   int frameCount;
-  Value stack[STACK_MAX];
+  int frameCapacity;
+  Value* stack;
   Value* stackTop;
-  Table globals;
+  int stackCapacity;
+  // Global variables, at the indices the compiler gave their
+  // names. One that isn't defined yet holds UNDEFINED_VAL.
+  Value* globals;
+  ObjStr** globalNames;
+  int globalCount;
+  int globalCapacity;
+  // Each global's name, mapped to its index.
+  Table globalSlots;
   Table strings;
   ObjStr* initString;
+  // Selectors handed out to method names so far.
+  int selectorCount;
+  // The shape of an instance with no fields yet.
+  Shape* rootShape;
+  // Bumped whenever a class's methods change, to drop stale
+  // method entries from inline caches.
+  uint32_t cacheEpoch;
   ObjUpval* openUpvals;
   size_t allocatedBytes;
   size_t nextGC;
@@ -41,7 +66,12 @@ extern VM vm;
 
 void initVM();
 void freeVM();
+// The index of the global called 'name', given out the first
+// time it is asked for.
+int globalSlot(ObjStr* name);
 InterpretResult interpret(const char* source);
+// Runs a script that has already been compiled.
+InterpretResult interpretFunc(ObjFunc* func);
 // good old push 'n pop
 void push(Value value);
 Value pop();
@@ -0,0 +1,2869 @@
+// For MAP_ANONYMOUS under -std=c17.
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include "include/jit.h"
+
+#ifdef JIT
+
+#include <stddef.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "include/chunk.h"
+#include "include/optimizer.h"
+#include "include/vm.h"
+
+// Registers, by their x86-64 encoding.
+enum {
+  RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+  R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+// Native code keeps the interpreter's state in callee-saved
+// registers, so it lives through calls into C. The stack pointer
+// is written back to vm.stackTop around every such call.
+#define REG_SP    R12
+#define REG_SLOTS R13
+#define REG_FRAME R14
+#define REG_QNAN  R15
+#define REG_VM    RBP
+// The frame's byte offset in vm.frames, which may move.
+#define REG_FRAME_AT RBX
+
+// Condition codes.
+#define CC_JMP -1
+#define CC_O   0x0
+#define CC_B   0x2
+#define CC_AE  0x3
+#define CC_E   0x4
+#define CC_NE  0x5
+#define CC_BE  0x6
+#define CC_A   0x7
+#define CC_P   0xa
+#define CC_NP  0xb
+#define CC_L   0xc
+#define CC_GE  0xd
+#define CC_LE  0xe
+#define CC_G   0xf
+
+// Patch targets that aren't bytecode offsets.
+#define TARGET_ERROR    -1
+#define TARGET_TAIL     -2
+#define TARGET_EPILOGUE -3
+
+typedef struct {
+  int at;
+  int target;
+} Patch;
+
+typedef struct {
+  int lea;
+  int offset;
+} SwitchTable;
+
+typedef struct {
+  uint8_t* code;
+  int count;
+  int capacity;
+  bool failed;
+  ObjFunc* func;
+  // Bytecode offset -> native offset, -1 inside instructions.
+  int* nativeAt;
+  Patch* patches;
+  int patchCount;
+  int patchCapacity;
+  SwitchTable* tables;
+  int tableCount;
+  int tableCapacity;
+} Asm;
+
+// Grows one of the Asm arrays with realloc, since native code
+// isn't part of the GC heap.
+#define GROW_LIST(as, type, list, count, capacity) \
+  do { \
+    if ((as)->count + 1 > (as)->capacity) { \
+      int grown = (as)->capacity < 8 ? 8 : (as)->capacity * 2; \
+      type* items = realloc((as)->list, sizeof(type) * grown); \
+      if (items == NULL) { \
+        (as)->failed = true; \
+        (as)->count = 0; \
+      } \
+      else { \
+        (as)->list = items; \
+        (as)->capacity = grown; \
+      } \
+    } \
+  } while (false)
+
+static void emitByte(Asm* as, uint8_t byte) {
+  GROW_LIST(as, uint8_t, code, count, capacity);
+  if (!as->failed) {
+    as->code[as->count++] = byte;
+  }
+}
+
+static void emitInt32(Asm* as, int32_t value) {
+  uint32_t bits = (uint32_t)value;
+  for (int i = 0; i < 4; i++) {
+    emitByte(as, (bits >> (i * 8)) & 0xff);
+  }
+}
+
+static void emitInt64(Asm* as, uint64_t value) {
+  for (int i = 0; i < 8; i++) {
+    emitByte(as, (value >> (i * 8)) & 0xff);
+  }
+}
+
+static void writeInt32(Asm* as, int at, int32_t value) {
+  if (!as->failed) {
+    memcpy(&as->code[at], &value, sizeof(int32_t));
+  }
+}
+
+// A 64-bit REX prefix for 'reg' in ModRM.reg and 'rm' in ModRM.rm.
+static void emitRex(Asm* as, int reg, int rm) {
+  emitByte(as, 0x48 | ((reg >> 3) << 2) | (rm >> 3));
+}
+
+// op reg, [base + disp]
+static void emitMem(Asm* as, uint8_t op, int reg, int base, int disp) {
+  emitRex(as, reg, base);
+  emitByte(as, op);
+  emitByte(as, 0x80 | ((reg & 7) << 3) | (base & 7));
+  if ((base & 7) == RSP) {
+    emitByte(as, 0x24);
+  }
+  emitInt32(as, disp);
+}
+
+// op rm, reg
+static void emitReg(Asm* as, uint8_t op, int reg, int rm) {
+  emitRex(as, reg, rm);
+  emitByte(as, op);
+  emitByte(as, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+static void emitLoad(Asm* as, int reg, int base, int disp) {
+  emitMem(as, 0x8b, reg, base, disp);
+}
+
+static void emitStore(Asm* as, int base, int disp, int reg) {
+  emitMem(as, 0x89, reg, base, disp);
+}
+
+static void emitMovImm(Asm* as, int reg, uint64_t imm) {
+  emitByte(as, 0x48 | (reg >> 3));
+  emitByte(as, 0xb8 + (reg & 7));
+  emitInt64(as, imm);
+}
+
+static void emitAddImm(Asm* as, int reg, int imm) {
+  emitRex(as, 0, reg);
+  emitByte(as, 0x81);
+  emitByte(as, 0xc0 | (reg & 7));
+  emitInt32(as, imm);
+}
+
+// mov eax, imm
+static void emitResult(Asm* as, int result) {
+  emitByte(as, 0xb8);
+  emitInt32(as, result);
+}
+
+// cmp eax, imm
+static void emitCmpResult(Asm* as, int result) {
+  emitByte(as, 0x83);
+  emitByte(as, 0xf8);
+  emitByte(as, (uint8_t)result);
+}
+
+// Emits a jump with a blank rel32 and returns where that is.
+static int emitJump(Asm* as, int cc) {
+  if (cc == CC_JMP) {
+    emitByte(as, 0xe9);
+  }
+  else {
+    emitByte(as, 0x0f);
+    emitByte(as, 0x80 + cc);
+  }
+  emitInt32(as, 0);
+  return as->count - 4;
+}
+
+static void patchHere(Asm* as, int at) {
+  writeInt32(as, at, as->count - (at + 4));
+}
+
+static void addPatch(Asm* as, int at, int target) {
+  GROW_LIST(as, Patch, patches, patchCount, patchCapacity);
+  if (!as->failed) {
+    as->patches[as->patchCount].at = at;
+    as->patches[as->patchCount++].target = target;
+  }
+}
+
+static void emitJumpTo(Asm* as, int cc, int target) {
+  addPatch(as, emitJump(as, cc), target);
+}
+
+static void emitCall(Asm* as, void* fn) {
+  emitMovImm(as, RAX, (uint64_t)(uintptr_t)fn);
+  emitByte(as, 0xff);
+  emitByte(as, 0xd0);
+}
+
+// movq xmm, reg
+static void emitToXmm(Asm* as, int xmm, int reg) {
+  emitByte(as, 0x66);
+  emitRex(as, xmm, reg);
+  emitByte(as, 0x0f);
+  emitByte(as, 0x6e);
+  emitByte(as, 0xc0 | ((xmm & 7) << 3) | (reg & 7));
+}
+
+// movq reg, xmm
+static void emitFromXmm(Asm* as, int reg, int xmm) {
+  emitByte(as, 0x66);
+  emitRex(as, xmm, reg);
+  emitByte(as, 0x0f);
+  emitByte(as, 0x7e);
+  emitByte(as, 0xc0 | ((xmm & 7) << 3) | (reg & 7));
+}
+
+// An SSE2 scalar double op between xmm registers. 'prefix' is
+// 0xf2 for arithmetic and movsd, and 0x66 for ucomisd.
+static void emitSse(Asm* as, uint8_t prefix, uint8_t op, int dst, int src) {
+  emitByte(as, prefix);
+  if (dst >= 8 || src >= 8) {
+    emitByte(as, 0x40 | ((dst >> 3) << 2) | (src >> 3));
+  }
+  emitByte(as, 0x0f);
+  emitByte(as, op);
+  emitByte(as, 0xc0 | ((dst & 7) << 3) | (src & 7));
+}
+
+#ifdef TRACE_JIT
+// movsd between 'xmm' and [base + disp]: SSE_LOAD or SSE_STORE.
+static void emitSseMem(Asm* as, uint8_t op, int xmm, int base, int disp) {
+  emitByte(as, 0xf2);
+  if (xmm >= 8 || base >= 8) {
+    emitByte(as, 0x40 | ((xmm >> 3) << 2) | (base >> 3));
+  }
+  emitByte(as, 0x0f);
+  emitByte(as, op);
+  emitByte(as, 0x80 | ((xmm & 7) << 3) | (base & 7));
+  if ((base & 7) == RSP) {
+    emitByte(as, 0x24);
+  }
+  emitInt32(as, disp);
+}
+#endif
+
+#define SSE_LOAD 0x10
+#define SSE_STORE 0x11
+#define SSE_ADD 0x58
+#define SSE_MUL 0x59
+#define SSE_SUB 0x5c
+#define SSE_DIV 0x5e
+#define SSE_UCOMI 0x2e
+
+// setcc on a byte register: al, cl or dl.
+static void emitSetcc(Asm* as, int cc, int reg) {
+  emitByte(as, 0x0f);
+  emitByte(as, 0x90 + cc);
+  emitByte(as, 0xc0 | reg);
+}
+
+// Widens al into a bool Value in rax.
+static void emitBoolFromAl(Asm* as) {
+  emitByte(as, 0x0f);
+  emitByte(as, 0xb6);
+  emitByte(as, 0xc0);
+  emitMovImm(as, RCX, FALSE_VAL);
+  emitReg(as, 0x01, RCX, RAX);
+}
+
+static void emitLoadTop(Asm* as, int reg, int depth) {
+  emitLoad(as, reg, REG_SP, -8 * (depth + 1));
+}
+
+static void emitStoreTop(Asm* as, int depth, int reg) {
+  emitStore(as, REG_SP, -8 * (depth + 1), reg);
+}
+
+static void emitPush(Asm* as, int reg) {
+  emitStore(as, REG_SP, 0, reg);
+  emitAddImm(as, REG_SP, 8);
+}
+
+static void emitDrop(Asm* as, int count) {
+  emitAddImm(as, REG_SP, -8 * count);
+}
+
+static void emitLoadSlot(Asm* as, int reg, int slot) {
+  emitLoad(as, reg, REG_SLOTS, 8 * slot);
+}
+
+static void emitStoreSlot(Asm* as, int slot, int reg) {
+  emitStore(as, REG_SLOTS, 8 * slot, reg);
+}
+
+// Jumps to the returned patch unless 'reg' holds a number.
+// Clobbers rcx.
+static int emitGuardNum(Asm* as, int reg) {
+  emitReg(as, 0x89, reg, RCX);
+  emitReg(as, 0x21, REG_QNAN, RCX);
+  emitReg(as, 0x39, REG_QNAN, RCX);
+  return emitJump(as, CC_E);
+}
+
+// cmp reg32, imm32, for the first eight registers.
+static void emitCmp32(Asm* as, int reg, int32_t imm) {
+  emitByte(as, 0x81);
+  emitByte(as, 0xf8 | (reg & 7));
+  emitInt32(as, imm);
+}
+
+#define SHIFT_ROR 1
+#define SHIFT_SHL 4
+#define SHIFT_SHR 5
+#define SHIFT_SAR 7
+
+// A shift or rotate of 'reg' by a constant 'count'.
+static void emitShift(Asm* as, int kind, int reg, int count) {
+  emitRex(as, 0, reg);
+  emitByte(as, 0xc1);
+  emitByte(as, 0xc0 | (kind << 3) | (reg & 7));
+  emitByte(as, count);
+}
+
+// Sets ZF if 'reg' holds an integer. Clobbers rcx.
+static void emitTestInt(Asm* as, int reg) {
+  emitReg(as, 0x89, reg, RCX);
+  emitShift(as, SHIFT_SHR, RCX, 48);
+  emitCmp32(as, RCX, INT_TAG >> 48);
+}
+
+// Jumps to the returned patch unless 'reg' holds an integer.
+// Clobbers rcx.
+static int emitGuardInt(Asm* as, int reg) {
+  emitTestInt(as, reg);
+  return emitJump(as, CC_NE);
+}
+
+// cvtsi2sd xmm, reg
+static void emitIntToXmm(Asm* as, int xmm, int reg) {
+  emitByte(as, 0xf2);
+  emitRex(as, xmm, reg);
+  emitByte(as, 0x0f);
+  emitByte(as, 0x2a);
+  emitByte(as, 0xc0 | ((xmm & 7) << 3) | (reg & 7));
+}
+
+// Loads the number in 'reg' into 'xmm' as a double, converting
+// an integer. Jumps to the returned patch if it isn't a number.
+// Clobbers rcx.
+static int emitNumToXmm(Asm* as, int xmm, int reg) {
+  emitTestInt(as, reg);
+  int notInt = emitJump(as, CC_NE);
+  emitReg(as, 0x89, reg, RCX);
+  emitShift(as, SHIFT_SHL, RCX, 16);
+  emitShift(as, SHIFT_SAR, RCX, 16);
+  emitIntToXmm(as, xmm, RCX);
+  int done = emitJump(as, CC_JMP);
+  patchHere(as, notInt);
+  int notNum = emitGuardNum(as, reg);
+  emitToXmm(as, xmm, reg);
+  patchHere(as, done);
+  return notNum;
+}
+
+// Boxes the integer that integer arithmetic leaves in the top 48
+// bits of 'reg'.
+static void emitBoxInt(Asm* as, int reg) {
+  // or reg, INT_TAG >> 48
+  emitRex(as, 0, reg);
+  emitByte(as, 0x81);
+  emitByte(as, 0xc8 | (reg & 7));
+  emitInt32(as, INT_TAG >> 48);
+  emitShift(as, SHIFT_ROR, reg, 16);
+}
+
+// a op b on the integers in rax and rdx, for the double op
+// SSE_ADD, SSE_SUB or SSE_MUL, leaving the result in rax. It works
+// in the top 48 bits, so the overflow flag catches any result out
+// of range, which jumps to the returned patch. Clobbers rdx.
+static int emitIntArith(Asm* as, uint8_t op) {
+  emitShift(as, SHIFT_SHL, RAX, 16);
+  if (op == SSE_MUL) {
+    emitShift(as, SHIFT_SHL, RDX, 16);
+    emitShift(as, SHIFT_SAR, RDX, 16);
+    // imul rax, rdx
+    emitByte(as, 0x48);
+    emitByte(as, 0x0f);
+    emitByte(as, 0xaf);
+    emitByte(as, 0xc2);
+  }
+  else {
+    emitShift(as, SHIFT_SHL, RDX, 16);
+    emitReg(as, op == SSE_ADD ? 0x01 : 0x29, RDX, RAX);
+  }
+  int overflow = emitJump(as, CC_O);
+  emitBoxInt(as, RAX);
+  return overflow;
+}
+
+// Compares the integers in rax and rdx, for a signed jcc or setcc.
+static void emitCmpInts(Asm* as) {
+  emitShift(as, SHIFT_SHL, RAX, 16);
+  emitShift(as, SHIFT_SHL, RDX, 16);
+  emitReg(as, 0x39, RDX, RAX);
+}
+
+// Jumps to 'target' if rax is falsey. Clobbers rcx.
+static void emitJumpIfFalsey(Asm* as, int target) {
+  emitMovImm(as, RCX, FALSE_VAL);
+  emitReg(as, 0x39, RCX, RAX);
+  emitJumpTo(as, CC_E, target);
+  emitMovImm(as, RCX, NIL_VAL);
+  emitReg(as, 0x39, RCX, RAX);
+  emitJumpTo(as, CC_E, target);
+}
+
+// Picks up the stack, frame and slots again after a call, which
+// may have moved any of them.
+static void emitReload(Asm* as) {
+  emitLoad(as, REG_SP, REG_VM, offsetof(VM, stackTop));
+  emitLoad(as, REG_FRAME, REG_VM, offsetof(VM, frames));
+  emitReg(as, 0x01, REG_FRAME_AT, REG_FRAME);
+  emitLoad(as, REG_SLOTS, REG_FRAME, offsetof(CallFrame, slots));
+}
+
+// Calls fn(ins) with the stack written back. Only calls can grow
+// the stack or the frames, so anything else just reloads the
+// stack pointer.
+static void emitCallVM(Asm* as, void* fn, uint8_t* ins, bool isCall) {
+  emitStore(as, REG_VM, offsetof(VM, stackTop), REG_SP);
+  emitMovImm(as, RDI, (uint64_t)(uintptr_t)ins);
+  emitCall(as, fn);
+  if (isCall) {
+    emitReload(as);
+  }
+  else {
+    emitLoad(as, REG_SP, REG_VM, offsetof(VM, stackTop));
+  }
+}
+
+// Runs the instruction through jitStep(), leaving its StepResult
+// in eax. Errors leave the function.
+static void emitStep(Asm* as, uint8_t* ins, bool isCall) {
+  emitCallVM(as, (void*)jitStep, ins, isCall);
+  // test eax, eax
+  emitByte(as, 0x85);
+  emitByte(as, 0xc0);
+  emitJumpTo(as, CC_E, TARGET_ERROR);
+}
+
+// inc/dec dword [jitDepth]
+static void emitDepth(Asm* as, int delta) {
+  emitMovImm(as, RCX, (uint64_t)(uintptr_t)&jitDepth);
+  emitByte(as, 0xff);
+  emitByte(as, delta > 0 ? 0x01 : 0x09);
+}
+
+// Runs a call through jitStep(). A callee with native code is
+// called straight from here, keeping the C stack to one frame per
+// call.
+static void emitCallStep(Asm* as, uint8_t* ins) {
+  emitStep(as, ins, true);
+  if (ins[0] == OP_TAIL_CALL) {
+    emitCmpResult(as, STEP_TAIL_CALL);
+    emitJumpTo(as, CC_E, TARGET_TAIL);
+  }
+  emitCmpResult(as, STEP_CALL);
+  int done = emitJump(as, CC_NE);
+  // The callee's frame follows this one.
+  emitLoad(
+    as, RAX, REG_FRAME,
+    sizeof(CallFrame) + offsetof(CallFrame, closure)
+  );
+  emitLoad(as, RAX, RAX, offsetof(ObjClosure, func));
+  emitLoad(as, RAX, RAX, offsetof(ObjFunc, native));
+  emitMem(as, 0x8d, RDI, REG_FRAME, sizeof(CallFrame));
+  emitDepth(as, 1);
+  // call rax
+  emitByte(as, 0xff);
+  emitByte(as, 0xd0);
+  emitDepth(as, -1);
+  emitCmpResult(as, JIT_RETURNED);
+  int returned = emitJump(as, CC_E);
+  // mov edi, eax
+  emitByte(as, 0x89);
+  emitByte(as, 0xc7);
+  emitCall(as, (void*)jitFinish);
+  // test eax, eax
+  emitByte(as, 0x85);
+  emitByte(as, 0xc0);
+  emitJumpTo(as, CC_E, TARGET_ERROR);
+  patchHere(as, returned);
+  emitReload(as);
+  patchHere(as, done);
+}
+
+// Returns the top value. Closing upvalues is left to jitReturn(),
+// when any are open in this frame.
+static void emitReturn(Asm* as) {
+  emitLoadTop(as, RDX, 0);
+  emitLoad(as, RAX, REG_VM, offsetof(VM, openUpvals));
+  // test rax, rax
+  emitReg(as, 0x85, RAX, RAX);
+  int noUpvals = emitJump(as, CC_E);
+  emitLoad(as, RAX, RAX, offsetof(ObjUpval, location));
+  emitReg(as, 0x39, REG_SLOTS, RAX);
+  int below = emitJump(as, CC_B);
+  emitStore(as, REG_VM, offsetof(VM, stackTop), REG_SP);
+  emitCall(as, (void*)jitReturn);
+  int done = emitJump(as, CC_JMP);
+  patchHere(as, noUpvals);
+  patchHere(as, below);
+  emitStore(as, REG_SLOTS, 0, RDX);
+  // lea rax, [r13 + 8]
+  emitMem(as, 0x8d, RAX, REG_SLOTS, 8);
+  emitStore(as, REG_VM, offsetof(VM, stackTop), RAX);
+  // dec dword [rbp + frameCount]
+  emitByte(as, 0xff);
+  emitByte(as, 0x8d);
+  emitInt32(as, offsetof(VM, frameCount));
+  patchHere(as, done);
+  emitResult(as, JIT_RETURNED);
+  emitJumpTo(as, CC_JMP, TARGET_EPILOGUE);
+}
+
+static int readShort(uint8_t* at) {
+  return (at[0] << 8) | at[1];
+}
+
+// Stores the result in rax of a register form: pushed, or stored
+// to 'dest' if it isn't -1.
+static void emitResultTo(Asm* as, int dest) {
+  if (dest == -1) {
+    emitPush(as, RAX);
+  }
+  else {
+    emitStoreSlot(as, dest, RAX);
+  }
+}
+
+// a op b on the numbers in rax and rdx. Two integers stay integers
+// unless DIV, or a result out of range, sends them on as doubles;
+// anything else falls to the slow path, as does a zero divisor,
+// which it reports. The result goes as emitResultTo() puts it, or
+// over 'a' on the stack if 'dest' is -2.
+static void emitArithRegs(Asm* as, uint8_t* ins, uint8_t op, int dest) {
+  int intDone = -1;
+  int overflow = -1;
+  if (op != SSE_DIV) {
+    int notIntA = emitGuardInt(as, RAX);
+    int notIntB = emitGuardInt(as, RDX);
+    overflow = emitIntArith(as, op);
+    if (dest == -2) {
+      emitStoreTop(as, 1, RAX);
+      emitDrop(as, 1);
+    }
+    else {
+      emitResultTo(as, dest);
+    }
+    intDone = emitJump(as, CC_JMP);
+    patchHere(as, notIntA);
+    patchHere(as, notIntB);
+  }
+  int notNumA = emitNumToXmm(as, 0, RAX);
+  int notNumB = emitNumToXmm(as, 1, RDX);
+  int zero = -1;
+  if (op == SSE_DIV) {
+    // shl rcx, 1 drops the sign, leaving zero only for +-0.
+    emitFromXmm(as, RCX, 1);
+    emitByte(as, 0x48);
+    emitByte(as, 0xd1);
+    emitByte(as, 0xe1);
+    zero = emitJump(as, CC_E);
+  }
+  emitSse(as, 0xf2, op, 0, 1);
+  emitFromXmm(as, RAX, 0);
+  if (dest == -2) {
+    emitStoreTop(as, 1, RAX);
+    emitDrop(as, 1);
+  }
+  else {
+    emitResultTo(as, dest);
+  }
+  int done = emitJump(as, CC_JMP);
+  patchHere(as, notNumA);
+  patchHere(as, notNumB);
+  if (zero != -1) {
+    patchHere(as, zero);
+  }
+  if (overflow != -1) {
+    patchHere(as, overflow);
+  }
+  emitStep(as, ins, false);
+  patchHere(as, done);
+  if (intDone != -1) {
+    patchHere(as, intDone);
+  }
+}
+
+// a op b on the top two values.
+static void emitArith(Asm* as, uint8_t* ins, uint8_t op) {
+  emitLoadTop(as, RAX, 1);
+  emitLoadTop(as, RDX, 0);
+  emitArithRegs(as, ins, op, -2);
+}
+
+// and, or or xor of the top two values, if both are integers. The
+// tags of two integers and or or to the tag, but xor clears it.
+static void emitBitwise(Asm* as, uint8_t* ins, uint8_t op) {
+  emitLoadTop(as, RAX, 1);
+  emitLoadTop(as, RDX, 0);
+  int notIntA = emitGuardInt(as, RAX);
+  int notIntB = emitGuardInt(as, RDX);
+  emitReg(as, op, RDX, RAX);
+  if (op == 0x31) {
+    emitMovImm(as, RCX, INT_TAG);
+    emitReg(as, 0x09, RCX, RAX);
+  }
+  emitStoreTop(as, 1, RAX);
+  emitDrop(as, 1);
+  int done = emitJump(as, CC_JMP);
+  patchHere(as, notIntA);
+  patchHere(as, notIntB);
+  emitStep(as, ins, false);
+  patchHere(as, done);
+}
+
+// a % b on the top two values, if both are integers and b isn't
+// zero. idiv leaves C's remainder, as the interpreter gives.
+static void emitMod(Asm* as, uint8_t* ins) {
+  emitLoadTop(as, RAX, 1);
+  emitLoadTop(as, RDX, 0);
+  int notIntA = emitGuardInt(as, RAX);
+  int notIntB = emitGuardInt(as, RDX);
+  emitReg(as, 0x89, RDX, RCX);
+  emitShift(as, SHIFT_SHL, RCX, 16);
+  emitShift(as, SHIFT_SAR, RCX, 16);
+  emitReg(as, 0x85, RCX, RCX);
+  int zero = emitJump(as, CC_E);
+  emitShift(as, SHIFT_SHL, RAX, 16);
+  emitShift(as, SHIFT_SAR, RAX, 16);
+  // cqo; idiv rcx
+  emitByte(as, 0x48);
+  emitByte(as, 0x99);
+  emitByte(as, 0x48);
+  emitByte(as, 0xf7);
+  emitByte(as, 0xf9);
+  emitReg(as, 0x89, RDX, RAX);
+  emitShift(as, SHIFT_SHL, RAX, 16);
+  emitBoxInt(as, RAX);
+  emitStoreTop(as, 1, RAX);
+  emitDrop(as, 1);
+  int done = emitJump(as, CC_JMP);
+  patchHere(as, notIntA);
+  patchHere(as, notIntB);
+  patchHere(as, zero);
+  emitStep(as, ins, false);
+  patchHere(as, done);
+}
+
+// Compares the top two values. Integers compare as integers, other
+// numbers as doubles and anything else by its bits, as valsLt()
+// and friends do.
+static void emitCompare(Asm* as, OpCode op) {
+  emitLoadTop(as, RAX, 1);
+  emitLoadTop(as, RDX, 0);
+  int intCc;
+  int numCc;
+  int bitsCc;
+  switch (op) {
+    case OP_LT:
+      intCc = CC_L;
+      numCc = CC_A;
+      bitsCc = CC_B;
+      break;
+    case OP_LT_EQU:
+      intCc = CC_LE;
+      numCc = CC_AE;
+      bitsCc = CC_BE;
+      break;
+    case OP_GT:
+      intCc = CC_G;
+      numCc = CC_A;
+      bitsCc = CC_A;
+      break;
+    default:
+      intCc = CC_GE;
+      numCc = CC_AE;
+      bitsCc = CC_AE;
+      break;
+  }
+  int notIntA = emitGuardInt(as, RAX);
+  int notIntB = emitGuardInt(as, RDX);
+  emitCmpInts(as);
+  emitSetcc(as, intCc, RAX);
+  int intDone = emitJump(as, CC_JMP);
+  patchHere(as, notIntA);
+  patchHere(as, notIntB);
+  int notNumA = emitNumToXmm(as, 0, RAX);
+  int notNumB = emitNumToXmm(as, 1, RDX);
+  if (op == OP_LT || op == OP_LT_EQU) {
+    emitSse(as, 0x66, SSE_UCOMI, 1, 0);
+  }
+  else {
+    emitSse(as, 0x66, SSE_UCOMI, 0, 1);
+  }
+  emitSetcc(as, numCc, RAX);
+  int done = emitJump(as, CC_JMP);
+  patchHere(as, notNumA);
+  patchHere(as, notNumB);
+  emitReg(as, 0x39, RDX, RAX);
+  emitSetcc(as, bitsCc, RAX);
+  patchHere(as, done);
+  patchHere(as, intDone);
+  emitBoolFromAl(as);
+  emitStoreTop(as, 1, RAX);
+  emitDrop(as, 1);
+}
+
+// Doubles are equal as doubles, so NaN never is; everything else,
+// integers too, by its bits. Compares rax with rdx, leaving a bool in rax.
+static void emitEqualsRegs(Asm* as, bool negate) {
+  int notNumA = emitGuardNum(as, RAX);
+  int notNumB = emitGuardNum(as, RDX);
+  emitToXmm(as, 0, RAX);
+  emitToXmm(as, 1, RDX);
+  emitSse(as, 0x66, SSE_UCOMI, 0, 1);
+  emitSetcc(as, negate ? CC_NE : CC_E, RAX);
+  emitSetcc(as, negate ? CC_P : CC_NP, RCX);
+  // or al, cl / and al, cl
+  emitByte(as, negate ? 0x08 : 0x20);
+  emitByte(as, 0xc8);
+  int done = emitJump(as, CC_JMP);
+  patchHere(as, notNumA);
+  patchHere(as, notNumB);
+  emitReg(as, 0x39, RDX, RAX);
+  emitSetcc(as, negate ? CC_NE : CC_E, RAX);
+  patchHere(as, done);
+  emitBoolFromAl(as);
+}
+
+static void emitEquals(Asm* as, bool negate) {
+  emitLoadTop(as, RAX, 1);
+  emitLoadTop(as, RDX, 0);
+  emitEqualsRegs(as, negate);
+  emitStoreTop(as, 1, RAX);
+  emitDrop(as, 1);
+}
+
+static void emitForNum(Asm* as, uint8_t* ins, int offset) {
+  Value* constants = as->func->chunk.constants.values;
+  int slot = ins[1];
+  Value step = constants[ins[2]];
+  int limit = ins[3];
+  uint8_t mode = ins[4];
+  int target = offset + 7 - readShort(&ins[5]);
+  bool limitLocal = mode & FOR_NUM_LIMIT_LOCAL;
+  // An integer loop counts in integers, with an integer limit; any
+  // other kinds are left to the slow path.
+  bool isInt = IS_INT(step) && (limitLocal || IS_INT(constants[limit]));
+  if (
+    !isInt &&
+    (!IS_NUM(step) || (!limitLocal && !IS_NUM(constants[limit])))
+  ) {
+    emitStep(as, ins, false);
+    emitCmpResult(as, STEP_JUMP);
+    emitJumpTo(as, CC_E, target);
+    return;
+  }
+  emitLoadSlot(as, RAX, slot);
+  int notNumCounter = isInt ?
+    emitGuardInt(as, RAX) : emitGuardNum(as, RAX);
+  int notNumLimit = -1;
+  if (limitLocal) {
+    emitLoadSlot(as, RDX, limit);
+    notNumLimit = isInt ? emitGuardInt(as, RDX) : emitGuardNum(as, RDX);
+  }
+  uint8_t op = mode & FOR_NUM_SUB ? SSE_SUB : SSE_ADD;
+  int overflow = -1;
+  if (isInt) {
+    emitMovImm(as, RDX, step);
+    overflow = emitIntArith(as, op);
+  }
+  else {
+    emitToXmm(as, 0, RAX);
+    emitMovImm(as, RCX, step);
+    emitToXmm(as, 1, RCX);
+    emitSse(as, 0xf2, op, 0, 1);
+    emitFromXmm(as, RAX, 0);
+  }
+  emitStoreSlot(as, slot, RAX);
+  // The limit may be the counter itself, so it's read after the
+  // store, as the interpreter does.
+  if (limitLocal) {
+    emitLoadSlot(as, RDX, limit);
+  }
+  else {
+    emitMovImm(as, RDX, constants[limit]);
+  }
+  if (isInt) {
+    // By FOR_NUM_CMP_MASK's values, shifted down.
+    static const int intCcs[] = {CC_L, CC_LE, CC_G, CC_GE};
+    emitCmpInts(as);
+    emitJumpTo(as, intCcs[(mode & FOR_NUM_CMP_MASK) >> 2], target);
+  }
+  else {
+    emitToXmm(as, 1, RDX);
+    switch (mode & FOR_NUM_CMP_MASK) {
+      case FOR_NUM_LT:
+        emitSse(as, 0x66, SSE_UCOMI, 1, 0);
+        emitJumpTo(as, CC_A, target);
+        break;
+      case FOR_NUM_LT_EQU:
+        emitSse(as, 0x66, SSE_UCOMI, 1, 0);
+        emitJumpTo(as, CC_AE, target);
+        break;
+      case FOR_NUM_GT:
+        emitSse(as, 0x66, SSE_UCOMI, 0, 1);
+        emitJumpTo(as, CC_A, target);
+        break;
+      default:
+        emitSse(as, 0x66, SSE_UCOMI, 0, 1);
+        emitJumpTo(as, CC_AE, target);
+        break;
+    }
+  }
+  emitMovImm(as, RAX, FALSE_VAL);
+  emitPush(as, RAX);
+  int done = emitJump(as, CC_JMP);
+  patchHere(as, notNumCounter);
+  if (notNumLimit != -1) {
+    patchHere(as, notNumLimit);
+  }
+  if (overflow != -1) {
+    patchHere(as, overflow);
+  }
+  emitStep(as, ins, false);
+  emitCmpResult(as, STEP_JUMP);
+  emitJumpTo(as, CC_E, target);
+  patchHere(as, done);
+}
+
+static void emitJumpLessLocalConst(Asm* as, uint8_t* ins, int offset) {
+  int target = offset + 5 + readShort(&ins[3]);
+  Value limit = as->func->chunk.constants.values[ins[2]];
+  emitLoadSlot(as, RAX, ins[1]);
+  emitMovImm(as, RDX, limit);
+  int notNumA;
+  int notNumB = -1;
+  int less;
+  if (IS_INT(limit)) {
+    notNumA = emitGuardInt(as, RAX);
+    emitCmpInts(as);
+    less = emitJump(as, CC_L);
+  }
+  else {
+    notNumA = emitGuardNum(as, RAX);
+    notNumB = emitGuardNum(as, RDX);
+    emitToXmm(as, 0, RAX);
+    emitToXmm(as, 1, RDX);
+    emitSse(as, 0x66, SSE_UCOMI, 1, 0);
+    less = emitJump(as, CC_A);
+  }
+  emitMovImm(as, RAX, FALSE_VAL);
+  emitPush(as, RAX);
+  emitJumpTo(as, CC_JMP, target);
+  patchHere(as, notNumA);
+  if (notNumB != -1) {
+    patchHere(as, notNumB);
+  }
+  emitStep(as, ins, false);
+  emitCmpResult(as, STEP_JUMP);
+  emitJumpTo(as, CC_E, target);
+  patchHere(as, less);
+}
+
+// jitSwitch() picks the entry; a table of rel32s from its own
+// start, filled in at the end, turns that into an address.
+static void emitSwitch(Asm* as, uint8_t* ins, int offset) {
+  emitCallVM(as, (void*)jitSwitch, ins, false);
+  // lea rcx, [rip + table]
+  emitByte(as, 0x48);
+  emitByte(as, 0x8d);
+  emitByte(as, 0x0d);
+  emitInt32(as, 0);
+  GROW_LIST(as, SwitchTable, tables, tableCount, tableCapacity);
+  if (!as->failed) {
+    as->tables[as->tableCount].lea = as->count - 4;
+    as->tables[as->tableCount++].offset = offset;
+  }
+  // movsxd rax, [rcx + rax * 4]; add rax, rcx; jmp rax
+  static const uint8_t dispatch[] = {
+    0x48, 0x63, 0x04, 0x81, 0x48, 0x01, 0xc8, 0xff, 0xe0
+  };
+  for (int i = 0; i < (int)sizeof(dispatch); i++) {
+    emitByte(as, dispatch[i]);
+  }
+}
+
+static void emitSwitchTable(Asm* as, SwitchTable* table) {
+  uint8_t* ins = &as->func->chunk.code[table->offset];
+  int end = table->offset + instructionLen(&as->func->chunk, table->offset);
+  int count;
+  int first;
+  int stride;
+  if (ins[0] == OP_SWITCH_INT) {
+    count = readShort(&ins[5]);
+    first = 7;
+    stride = 2;
+  }
+  else {
+    count = readShort(&ins[2]);
+    first = 4;
+    stride = 5;
+  }
+  int start = as->count;
+  writeInt32(as, table->lea, start - (table->lea + 4));
+  for (int i = 0; i <= count; i++) {
+    int at = end + readShort(&ins[first + i * stride]);
+    int target = as->nativeAt[at];
+    if (target == -1) {
+      as->failed = true;
+    }
+    emitInt32(as, target - start);
+  }
+}
+
+static void emitUpval(Asm* as, int index) {
+  emitLoad(as, RAX, REG_FRAME, offsetof(CallFrame, closure));
+  emitLoad(as, RAX, RAX, offsetof(ObjClosure, upvals) + 8 * index);
+  emitLoad(as, RAX, RAX, offsetof(ObjUpval, location));
+}
+
+static void emitPrologue(Asm* as) {
+  static const uint8_t saves[] = {
+    0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57,
+    // sub rsp, 8 keeps calls 16-byte aligned.
+    0x48, 0x83, 0xec, 0x08
+  };
+  for (int i = 0; i < (int)sizeof(saves); i++) {
+    emitByte(as, saves[i]);
+  }
+  emitMovImm(as, REG_VM, (uint64_t)(uintptr_t)&vm);
+  emitMovImm(as, REG_QNAN, QNAN);
+  // The frame comes in rdi.
+  emitReg(as, 0x89, RDI, REG_FRAME);
+  emitReg(as, 0x89, RDI, REG_FRAME_AT);
+  emitMem(as, 0x2b, REG_FRAME_AT, REG_VM, offsetof(VM, frames));
+  emitLoad(as, REG_SP, REG_VM, offsetof(VM, stackTop));
+  emitLoad(as, REG_SLOTS, REG_FRAME, offsetof(CallFrame, slots));
+}
+
+static void emitEpilogue(Asm* as) {
+  static const uint8_t restores[] = {
+    0x48, 0x83, 0xc4, 0x08,
+    0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5d, 0x5b,
+    0xc3
+  };
+  for (int i = 0; i < (int)sizeof(restores); i++) {
+    emitByte(as, restores[i]);
+  }
+}
+
+// Loads global 'slot' into rax, and the globals array into rdx,
+// then jumps to the returned patch if it isn't defined. The array
+// moves as globals are added, so its address is read each time.
+// An undefined slot holds QNAN, which REG_QNAN has already.
+static int emitLoadGlobal(Asm* as, int slot) {
+  emitLoad(as, RDX, REG_VM, offsetof(VM, globals));
+  emitLoad(as, RAX, RDX, 8 * slot);
+  emitReg(as, 0x39, REG_QNAN, RAX);
+  return emitJump(as, CC_E);
+}
+
+// The first operand of an indexed instruction, short or _LONG.
+static int indexOperand(uint8_t* ins) {
+  switch (ins[0]) {
+    case OP_GET_LOCAL_LONG:
+    case OP_SET_LOCAL_LONG:
+      return readShort(&ins[1]);
+    case OP_CONST_LONG:
+    case OP_GET_GLOBAL_LONG:
+    case OP_DEF_GLOBAL_LONG:
+    case OP_SET_GLOBAL_LONG:
+    case OP_GET_PROP_LONG:
+    case OP_SET_PROP_LONG:
+    case OP_INVOKE_LONG:
+      return (ins[1] << 16) | (ins[2] << 8) | ins[3];
+    default:
+      return ins[1];
+  }
+}
+
+// Emits the template for the instruction at 'offset'. Returns
+// false for an opcode it doesn't know.
+static bool emitInstruction(Asm* as, int offset) {
+  uint8_t* ins = &as->func->chunk.code[offset];
+  Value* constants = as->func->chunk.constants.values;
+  switch (ins[0]) {
+    case OP_CONST:
+    case OP_CONST_LONG:
+      emitMovImm(as, RAX, constants[indexOperand(ins)]);
+      emitPush(as, RAX);
+      return true;
+    case OP_SMALLINT:
+      emitMovImm(as, RAX, INT_VAL((int8_t)ins[1]));
+      emitPush(as, RAX);
+      return true;
+    case OP_NIL:
+      emitMovImm(as, RAX, NIL_VAL);
+      emitPush(as, RAX);
+      return true;
+    case OP_TRUE:
+      emitMovImm(as, RAX, TRUE_VAL);
+      emitPush(as, RAX);
+      return true;
+    case OP_FALSE:
+      emitMovImm(as, RAX, FALSE_VAL);
+      emitPush(as, RAX);
+      return true;
+    case OP_DUP:
+      emitLoadTop(as, RAX, 0);
+      emitPush(as, RAX);
+      return true;
+    case OP_POP:
+      emitDrop(as, 1);
+      return true;
+    case OP_GET_LOCAL:
+    case OP_GET_LOCAL_LONG:
+      emitLoadSlot(as, RAX, indexOperand(ins));
+      emitPush(as, RAX);
+      return true;
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_LONG:
+      emitLoadTop(as, RAX, 0);
+      emitStoreSlot(as, indexOperand(ins), RAX);
+      return true;
+    case OP_GET_UPVAL:
+      emitUpval(as, ins[1]);
+      emitLoad(as, RAX, RAX, 0);
+      emitPush(as, RAX);
+      return true;
+    case OP_SET_UPVAL:
+      emitUpval(as, ins[1]);
+      emitLoadTop(as, RDX, 0);
+      emitStore(as, RAX, 0, RDX);
+      return true;
+    case OP_GET_GLOBAL:
+    case OP_GET_GLOBAL_LONG: {
+      int undefined = emitLoadGlobal(as, indexOperand(ins));
+      emitPush(as, RAX);
+      int done = emitJump(as, CC_JMP);
+      patchHere(as, undefined);
+      emitStep(as, ins, false);
+      patchHere(as, done);
+      return true;
+    }
+    case OP_DEF_GLOBAL:
+    case OP_DEF_GLOBAL_LONG:
+      emitLoad(as, RDX, REG_VM, offsetof(VM, globals));
+      emitLoadTop(as, RAX, 0);
+      emitStore(as, RDX, 8 * indexOperand(ins), RAX);
+      emitDrop(as, 1);
+      return true;
+    case OP_SET_GLOBAL:
+    case OP_SET_GLOBAL_LONG: {
+      int undefined = emitLoadGlobal(as, indexOperand(ins));
+      emitLoadTop(as, RAX, 0);
+      emitStore(as, RDX, 8 * indexOperand(ins), RAX);
+      int done = emitJump(as, CC_JMP);
+      patchHere(as, undefined);
+      emitStep(as, ins, false);
+      patchHere(as, done);
+      return true;
+    }
+    case OP_GET_CAPTURE:
+      emitLoad(as, RAX, REG_FRAME, offsetof(CallFrame, closure));
+      emitLoad(as, RAX, RAX, offsetof(ObjClosure, captures));
+      emitLoad(as, RAX, RAX, 8 * ins[1]);
+      emitPush(as, RAX);
+      return true;
+    case OP_ADD:
+    case OP_ADD_NUM:
+      emitArith(as, ins, SSE_ADD);
+      return true;
+    case OP_SUB: emitArith(as, ins, SSE_SUB); return true;
+    case OP_MUL: emitArith(as, ins, SSE_MUL); return true;
+    case OP_DIV: emitArith(as, ins, SSE_DIV); return true;
+    case OP_MOD: emitMod(as, ins); return true;
+    // and, or and xor rax, rdx
+    case OP_BIT_AND: emitBitwise(as, ins, 0x21); return true;
+    case OP_BIT_OR: emitBitwise(as, ins, 0x09); return true;
+    case OP_BIT_XOR: emitBitwise(as, ins, 0x31); return true;
+    case OP_BIT_NOT: {
+      emitLoadTop(as, RAX, 0);
+      int notInt = emitGuardInt(as, RAX);
+      // Flipping the payload leaves the tag alone.
+      emitMovImm(as, RCX, INT_MASK);
+      emitReg(as, 0x31, RCX, RAX);
+      emitStoreTop(as, 0, RAX);
+      int done = emitJump(as, CC_JMP);
+      patchHere(as, notInt);
+      emitStep(as, ins, false);
+      patchHere(as, done);
+      return true;
+    }
+    case OP_LT:
+    case OP_LT_NUM:
+      emitCompare(as, OP_LT);
+      return true;
+    case OP_LT_EQU:
+    case OP_LT_EQU_NUM:
+      emitCompare(as, OP_LT_EQU);
+      return true;
+    case OP_GT:
+    case OP_GT_NUM:
+      emitCompare(as, OP_GT);
+      return true;
+    case OP_GT_EQU:
+    case OP_GT_EQU_NUM:
+      emitCompare(as, OP_GT_EQU);
+      return true;
+    case OP_EQU: emitEquals(as, false); return true;
+    case OP_NOT_EQU: emitEquals(as, true); return true;
+    case OP_NOT: {
+      emitLoadTop(as, RAX, 0);
+      emitMovImm(as, RCX, NIL_VAL);
+      emitReg(as, 0x39, RCX, RAX);
+      emitSetcc(as, CC_E, RDX);
+      emitMovImm(as, RCX, FALSE_VAL);
+      emitReg(as, 0x39, RCX, RAX);
+      emitSetcc(as, CC_E, RAX);
+      // or al, dl
+      emitByte(as, 0x08);
+      emitByte(as, 0xd0);
+      emitBoolFromAl(as);
+      emitStoreTop(as, 0, RAX);
+      return true;
+    }
+    case OP_NEGATE: {
+      emitLoadTop(as, RAX, 0);
+      int notNum = emitGuardNum(as, RAX);
+      emitMovImm(as, RCX, SIGN_BIT);
+      emitReg(as, 0x31, RCX, RAX);
+      emitStoreTop(as, 0, RAX);
+      int done = emitJump(as, CC_JMP);
+      patchHere(as, notNum);
+      int notInt = emitGuardInt(as, RAX);
+      emitShift(as, SHIFT_SHL, RAX, 16);
+      // neg rax
+      emitByte(as, 0x48);
+      emitByte(as, 0xf7);
+      emitByte(as, 0xd8);
+      int overflow = emitJump(as, CC_O);
+      emitBoxInt(as, RAX);
+      emitStoreTop(as, 0, RAX);
+      int intDone = emitJump(as, CC_JMP);
+      patchHere(as, notInt);
+      patchHere(as, overflow);
+      emitStep(as, ins, false);
+      patchHere(as, done);
+      patchHere(as, intDone);
+      return true;
+    }
+    case OP_JMP:
+      emitJumpTo(as, CC_JMP, offset + 3 + readShort(&ins[1]));
+      return true;
+    case OP_LOOP:
+      emitJumpTo(as, CC_JMP, offset + 3 - readShort(&ins[1]));
+      return true;
+    case OP_JMPF:
+      emitLoadTop(as, RAX, 0);
+      emitJumpIfFalsey(as, offset + 3 + readShort(&ins[1]));
+      return true;
+    case OP_JMPF_POP:
+      emitLoadTop(as, RAX, 0);
+      emitJumpIfFalsey(as, offset + 3 + readShort(&ins[1]));
+      emitDrop(as, 1);
+      return true;
+    case OP_JLT_LOCAL_CONST:
+      emitJumpLessLocalConst(as, ins, offset);
+      return true;
+    case OP_FOR_NUM:
+      emitForNum(as, ins, offset);
+      return true;
+    case OP_ADD_RR:
+    case OP_SUB_RR:
+    case OP_MUL_RR:
+    case OP_ADD_RK:
+    case OP_SUB_RK:
+    case OP_MUL_RK:
+    case OP_ADD_RRR:
+    case OP_SUB_RRR:
+    case OP_MUL_RRR:
+    case OP_ADD_RRK:
+    case OP_SUB_RRK:
+    case OP_MUL_RRK: {
+      OpCode op = ins[0];
+      bool store =
+        op == OP_ADD_RRR || op == OP_SUB_RRR || op == OP_MUL_RRR ||
+        op == OP_ADD_RRK || op == OP_SUB_RRK || op == OP_MUL_RRK;
+      bool isConst =
+        op == OP_ADD_RK || op == OP_SUB_RK || op == OP_MUL_RK ||
+        op == OP_ADD_RRK || op == OP_SUB_RRK || op == OP_MUL_RRK;
+      uint8_t sse = SSE_ADD;
+      if (op == OP_SUB_RR || op == OP_SUB_RK || op == OP_SUB_RRR || op == OP_SUB_RRK) {
+        sse = SSE_SUB;
+      }
+      else if (op == OP_MUL_RR || op == OP_MUL_RK || op == OP_MUL_RRR || op == OP_MUL_RRK) {
+        sse = SSE_MUL;
+      }
+      uint8_t* operands = store ? &ins[2] : &ins[1];
+      emitLoadSlot(as, RAX, operands[0]);
+      if (isConst) {
+        emitMovImm(as, RDX, constants[operands[1]]);
+      }
+      else {
+        emitLoadSlot(as, RDX, operands[1]);
+      }
+      emitArithRegs(as, ins, sse, store ? ins[1] : -1);
+      return true;
+    }
+    case OP_SWITCH_INT:
+    case OP_SWITCH_STR:
+      emitSwitch(as, ins, offset);
+      return true;
+    case OP_RETURN:
+      emitReturn(as);
+      return true;
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    case OP_INVOKE:
+    case OP_INVOKE_LONG:
+    case OP_INVOKE_SUPER:
+    case OP_INVOKE_SUPER_LONG:
+      emitCallStep(as, ins);
+      return true;
+    case OP_GET_PROP:
+    case OP_GET_PROP_LONG:
+    case OP_SET_PROP:
+    case OP_SET_PROP_LONG:
+    case OP_GET_LOCAL_PROP:
+    case OP_GET_SUPER:
+    case OP_GET_SUPER_LONG:
+    case OP_BUILD_LIST:
+    case OP_EXTEND_LIST:
+    case OP_INDEX_SUB:
+    case OP_STORE_SUB:
+    case OP_POW:
+    case OP_SHL:
+    case OP_SHR:
+    case OP_CLOSE_UPVAL:
+    case OP_CLOSURE:
+    case OP_CLOSURE_LONG:
+    case OP_CLASS:
+    case OP_CLASS_LONG:
+    case OP_INHERIT:
+    case OP_METHOD:
+    case OP_METHOD_LONG:
+      emitStep(as, ins, false);
+      return true;
+    case OP_THROW:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static void freeAsm(Asm* as) {
+  free(as->code);
+  free(as->nativeAt);
+  free(as->patches);
+  free(as->tables);
+}
+
+// Copies finished code to pages of its own and makes them
+// executable. Returns NULL if it can't.
+static void* mapCode(Asm* as, size_t* size) {
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  *size = ((size_t)as->count + page - 1) / page * page;
+  void* native = mmap(
+    NULL, *size,
+    PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS,
+    -1, 0
+  );
+  if (native == MAP_FAILED) {
+    return NULL;
+  }
+  memcpy(native, as->code, as->count);
+  if (mprotect(native, *size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(native, *size);
+    return NULL;
+  }
+  return native;
+}
+
+bool jitCompile(ObjFunc* func) {
+  Chunk* chunk = &func->chunk;
+  Asm as;
+  memset(&as, 0, sizeof(Asm));
+  as.func = func;
+  as.nativeAt = malloc(sizeof(int) * (chunk->count + 1));
+  if (as.nativeAt == NULL) {
+    return false;
+  }
+  for (int i = 0; i <= chunk->count; i++) {
+    as.nativeAt[i] = -1;
+  }
+
+  emitPrologue(&as);
+  for (int offset = 0; offset < chunk->count;) {
+    as.nativeAt[offset] = as.count;
+    if (!emitInstruction(&as, offset)) {
+      as.failed = true;
+      break;
+    }
+    offset += instructionLen(chunk, offset);
+  }
+  int tail = as.count;
+  emitResult(&as, JIT_TAIL_CALL);
+  int tailDone = emitJump(&as, CC_JMP);
+  int error = as.count;
+  emitResult(&as, JIT_ERROR);
+  int epilogue = as.count;
+  patchHere(&as, tailDone);
+  emitEpilogue(&as);
+  // Tables are read as int32s.
+  while (as.count % 4 != 0) {
+    emitByte(&as, 0xcc);
+  }
+  for (int i = 0; i < as.tableCount; i++) {
+    emitSwitchTable(&as, &as.tables[i]);
+  }
+  for (int i = 0; !as.failed && i < as.patchCount; i++) {
+    Patch* patch = &as.patches[i];
+    int target;
+    switch (patch->target) {
+      case TARGET_ERROR: target = error; break;
+      case TARGET_TAIL: target = tail; break;
+      case TARGET_EPILOGUE: target = epilogue; break;
+      default: target = as.nativeAt[patch->target]; break;
+    }
+    if (target == -1) {
+      as.failed = true;
+      break;
+    }
+    writeInt32(&as, patch->at, target - (patch->at + 4));
+  }
+  if (as.failed) {
+    freeAsm(&as);
+    return false;
+  }
+  size_t size;
+  void* native = mapCode(&as, &size);
+  freeAsm(&as);
+  if (native == NULL) {
+    return false;
+  }
+  func->native = native;
+  func->nativeSize = size;
+  return true;
+}
+
+void jitFree(ObjFunc* func) {
+  if (func->nativeSize != 0) {
+    munmap(func->native, func->nativeSize);
+    func->native = NULL;
+  }
+}
+
+#ifdef TRACE_JIT
+
+// Traces keep numbers unboxed in xmm registers: xmm0 and xmm1 are
+// scratch, temporaries get xmm2-7 and loop-carried locals xmm8-15.
+// Integers are kept as doubles too, which hold them exactly; what
+// makes one checks it is still in range, and it is boxed again as
+// an integer.
+#define XMM_TEMP 2
+#define XMM_CARRIED 8
+#define XMM_COUNT 16
+
+// Where a trace has a stack slot's value while it compiles.
+typedef enum {
+  // Boxed in the slot, of no known type.
+  VAL_SLOT,
+  // A number, boxed in the slot.
+  VAL_SLOT_NUM,
+  // A number, unboxed in an xmm register.
+  VAL_XMM,
+  // A constant.
+  VAL_CONST,
+  // A bool still in the flags of the compare that made it. Only
+  // ever the top value.
+  VAL_FLAGS
+} ValKind;
+
+typedef struct {
+  ValKind kind;
+  // The slot itself is behind.
+  bool dirty;
+  // A number that is an integer, for VAL_SLOT_NUM and VAL_XMM.
+  bool isInt;
+  // The xmm register, or the condition code for VAL_FLAGS.
+  int reg;
+  Value value;
+} TraceVal;
+
+// The method whose inlined body is being compiled, if any.
+typedef struct {
+  ObjClosure* method;
+  // Where the OP_INVOKE returns to, and the callee's first slot.
+  uint8_t* returnIp;
+  int base;
+} Inline;
+
+// Where a failed guard goes: the stack as it stood at the guard,
+// to write back before the interpreter takes over at 'ip'.
+typedef struct {
+  int at;
+  uint8_t* ip;
+  TraceVal* vals;
+  int top;
+  Inline inlined;
+} SideExit;
+
+typedef struct {
+  Asm as;
+  bool failed;
+  ObjFunc* func;
+  uint8_t* header;
+  int depth;
+  // Slots are counted from the frame's, so an inlined method's
+  // sit above its caller's.
+  TraceVal vals[TRACE_STACK];
+  int top;
+  int maxTop;
+  // The register each slot is carried round the loop in, or -1,
+  // and whether it holds an integer there.
+  int carried[TRACE_STACK];
+  bool carriedInt[TRACE_STACK];
+  Inline inlined;
+  // The function the current instruction is from.
+  ObjFunc* code;
+  bool closed;
+  SideExit* exits;
+  int exitCount;
+  int exitCapacity;
+} TraceAsm;
+
+static int traceSlot(TraceAsm* t, int slot) {
+  slot += t->inlined.base;
+  if (slot >= TRACE_STACK) {
+    t->failed = true;
+    return 0;
+  }
+  return slot;
+}
+
+// Boxes the number in 'xmm' into 'reg'.
+static void emitBoxXmm(Asm* as, int reg, int xmm, bool isInt) {
+  if (!isInt) {
+    emitFromXmm(as, reg, xmm);
+    return;
+  }
+  // cvttsd2si reg, xmm
+  emitByte(as, 0xf2);
+  emitRex(as, reg, xmm);
+  emitByte(as, 0x0f);
+  emitByte(as, 0x2c);
+  emitByte(as, 0xc0 | ((reg & 7) << 3) | (xmm & 7));
+  emitShift(as, SHIFT_SHL, reg, 16);
+  emitBoxInt(as, reg);
+}
+
+// Stores the number in 'xmm' to a slot, boxed. Clobbers rax.
+static void storeXmm(Asm* as, int slot, int xmm, bool isInt) {
+  if (isInt) {
+    emitBoxXmm(as, RAX, xmm, true);
+    emitStoreSlot(as, slot, RAX);
+  }
+  else {
+    emitSseMem(as, SSE_STORE, xmm, REG_SLOTS, 8 * slot);
+  }
+}
+
+// Loads the integer boxed in 'reg' into 'xmm'.
+static void emitUnboxInt(Asm* as, int xmm, int reg) {
+  emitShift(as, SHIFT_SHL, reg, 16);
+  emitShift(as, SHIFT_SAR, reg, 16);
+  emitIntToXmm(as, xmm, reg);
+}
+
+// Writes a value back to its slot, boxed.
+static void writeBack(Asm* as, TraceVal* val, int slot) {
+  if (!val->dirty) {
+    return;
+  }
+  switch (val->kind) {
+    case VAL_XMM:
+      storeXmm(as, slot, val->reg, val->isInt);
+      break;
+    case VAL_CONST:
+      emitMovImm(as, RAX, val->value);
+      emitStoreSlot(as, slot, RAX);
+      break;
+    case VAL_FLAGS:
+      emitSetcc(as, val->reg, RAX);
+      emitBoolFromAl(as);
+      emitStoreSlot(as, slot, RAX);
+      val->kind = VAL_SLOT;
+      break;
+    default:
+      break;
+  }
+  val->dirty = false;
+}
+
+static void addExit(TraceAsm* t, int at, uint8_t* ip) {
+  GROW_LIST(t, SideExit, exits, exitCount, exitCapacity);
+  if (t->failed) {
+    return;
+  }
+  SideExit* exit = &t->exits[t->exitCount];
+  exit->vals = malloc(sizeof(TraceVal) * (t->top + 1));
+  if (exit->vals == NULL) {
+    t->failed = true;
+    return;
+  }
+  memcpy(exit->vals, t->vals, sizeof(TraceVal) * t->top);
+  exit->at = at;
+  exit->ip = ip;
+  exit->top = t->top;
+  exit->inlined = t->inlined;
+  t->exitCount++;
+}
+
+static void emitStackTop(Asm* as, int top) {
+  emitMem(as, 0x8d, RAX, REG_SLOTS, 8 * top);
+  emitStore(as, REG_VM, offsetof(VM, stackTop), RAX);
+}
+
+static void emitSideExit(TraceAsm* t, SideExit* exit, int epilogue) {
+  Asm* as = &t->as;
+  patchHere(as, exit->at);
+  for (int i = 0; i < exit->top; i++) {
+    writeBack(as, &exit->vals[i], i);
+  }
+  emitStackTop(as, exit->top);
+  if (exit->inlined.method != NULL) {
+    emitMovImm(as, RAX, (uint64_t)(uintptr_t)exit->inlined.returnIp);
+    emitStore(as, REG_FRAME, offsetof(CallFrame, ip), RAX);
+    emitMovImm(as, RDI, (uint64_t)(uintptr_t)exit->inlined.method);
+    emitMovImm(as, RSI, (uint64_t)(uintptr_t)exit->ip);
+    emitMovImm(as, RDX, exit->inlined.base);
+    emitCall(as, (void*)traceEnter);
+  }
+  else {
+    emitMovImm(as, RAX, (uint64_t)(uintptr_t)exit->ip);
+    emitStore(as, REG_FRAME, offsetof(CallFrame, ip), RAX);
+  }
+  int at = emitJump(as, CC_JMP);
+  writeInt32(as, at, epilogue - (at + 4));
+}
+
+static bool regInUse(TraceAsm* t, int reg) {
+  for (int i = 0; i < t->top; i++) {
+    if (t->vals[i].kind == VAL_XMM && t->vals[i].reg == reg) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static int allocTemp(TraceAsm* t) {
+  for (int reg = XMM_TEMP; reg < XMM_CARRIED; reg++) {
+    if (!regInUse(t, reg)) {
+      return reg;
+    }
+  }
+  return -1;
+}
+
+static void pushVal(TraceAsm* t, ValKind kind, int reg, Value value) {
+  if (t->top == TRACE_STACK) {
+    t->failed = true;
+    return;
+  }
+  TraceVal* val = &t->vals[t->top++];
+  val->kind = kind;
+  val->dirty = kind != VAL_SLOT && kind != VAL_SLOT_NUM;
+  val->isInt = false;
+  val->reg = reg;
+  val->value = value;
+  if (t->top > t->maxTop) {
+    t->maxTop = t->top;
+  }
+}
+
+// Pushes the boxed value in rax.
+static void pushRax(TraceAsm* t) {
+  pushVal(t, VAL_SLOT, 0, 0);
+  emitStoreSlot(&t->as, t->top - 1, RAX);
+}
+
+// Copies one slot's value to another that isn't carried.
+static void copyVal(TraceAsm* t, int dst, int src) {
+  TraceVal val = t->vals[src];
+  if (val.kind == VAL_SLOT || val.kind == VAL_SLOT_NUM) {
+    emitLoadSlot(&t->as, RAX, src);
+    emitStoreSlot(&t->as, dst, RAX);
+  }
+  else {
+    val.dirty = true;
+  }
+  t->vals[dst] = val;
+}
+
+static void pushCopy(TraceAsm* t, int src) {
+  pushVal(t, VAL_SLOT, 0, 0);
+  if (!t->failed) {
+    copyVal(t, t->top - 1, src);
+  }
+}
+
+// Turns a bool left in the flags into a real one, before anything
+// can clobber them.
+static void settle(TraceAsm* t) {
+  if (t->top > 0 && t->vals[t->top - 1].kind == VAL_FLAGS) {
+    writeBack(&t->as, &t->vals[t->top - 1], t->top - 1);
+  }
+}
+
+static int constIn(TraceAsm* t, Value value, int scratch) {
+  if (IS_INT(value)) {
+    value = NUM_VAL((double)AS_INT(value));
+  }
+  else if (!IS_NUM(value)) {
+    t->failed = true;
+  }
+  emitMovImm(&t->as, RAX, value);
+  emitToXmm(&t->as, scratch, RAX);
+  return scratch;
+}
+
+// Gets a slot's number into an xmm register, which is returned:
+// its own, or 'scratch'. A slot of no known type is expected to
+// hold an integer if 'isInt' is set, or else a double; anything
+// else leaves the trace at 'ip'.
+static int numIn(
+  TraceAsm* t,
+  int slot,
+  int scratch,
+  uint8_t* ip,
+  bool isInt
+) {
+  Asm* as = &t->as;
+  TraceVal* val = &t->vals[slot];
+  switch (val->kind) {
+    case VAL_XMM:
+      return val->reg;
+    case VAL_SLOT_NUM:
+      if (val->isInt) {
+        emitLoadSlot(as, RAX, slot);
+        emitUnboxInt(as, scratch, RAX);
+      }
+      else {
+        emitSseMem(as, SSE_LOAD, scratch, REG_SLOTS, 8 * slot);
+      }
+      return scratch;
+    case VAL_SLOT:
+      emitLoadSlot(as, RAX, slot);
+      if (isInt) {
+        addExit(t, emitGuardInt(as, RAX), ip);
+        emitUnboxInt(as, scratch, RAX);
+      }
+      else {
+        addExit(t, emitGuardNum(as, RAX), ip);
+        emitToXmm(as, scratch, RAX);
+      }
+      val->kind = VAL_SLOT_NUM;
+      val->isInt = isInt;
+      return scratch;
+    case VAL_CONST:
+      return constIn(t, val->value, scratch);
+    default:
+      t->failed = true;
+      return scratch;
+  }
+}
+
+// Whether a slot numIn() has been through holds an integer.
+static bool valIsInt(TraceAsm* t, int slot) {
+  TraceVal* val = &t->vals[slot];
+  return val->kind == VAL_CONST ? IS_INT(val->value) : val->isInt;
+}
+
+// Leaves the trace at 'ip' if the integer an instruction has just
+// made in 'xmm' is out of range, for the interpreter to make it a
+// double instead.
+static void guardIntRange(TraceAsm* t, int xmm, uint8_t* ip) {
+  Asm* as = &t->as;
+  // cvttsd2si rax, xmm
+  emitByte(as, 0xf2);
+  emitRex(as, RAX, xmm);
+  emitByte(as, 0x0f);
+  emitByte(as, 0x2c);
+  emitByte(as, 0xc0 | (xmm & 7));
+  emitReg(as, 0x89, RAX, RCX);
+  emitShift(as, SHIFT_SHL, RCX, 16);
+  emitShift(as, SHIFT_SAR, RCX, 16);
+  emitReg(as, 0x39, RAX, RCX);
+  addExit(t, emitJump(as, CC_NE), ip);
+}
+
+// Pushes the number in 'xmm', keeping it in a register if one's
+// free.
+static void pushNum(TraceAsm* t, int xmm, bool isInt) {
+  int reg = allocTemp(t);
+  if (reg == -1) {
+    pushVal(t, VAL_SLOT_NUM, 0, 0);
+    storeXmm(&t->as, t->top - 1, xmm, isInt);
+  }
+  else {
+    if (reg != xmm) {
+      emitSse(&t->as, 0xf2, SSE_LOAD, reg, xmm);
+    }
+    pushVal(t, VAL_XMM, reg, 0);
+  }
+  if (!t->failed) {
+    t->vals[t->top - 1].isInt = isInt;
+  }
+}
+
+// Stores the number in 'xmm' to a slot. A carried slot's register
+// is about to change, so anything else still reading its old
+// value gets a copy first.
+static void storeNum(TraceAsm* t, int dst, int xmm, bool isInt) {
+  Asm* as = &t->as;
+  int reg = t->carried[dst];
+  t->vals[dst].isInt = isInt;
+  if (reg == -1) {
+    t->vals[dst].kind = VAL_SLOT;
+    reg = allocTemp(t);
+    if (reg == -1) {
+      storeXmm(as, dst, xmm, isInt);
+      t->vals[dst].kind = VAL_SLOT_NUM;
+      t->vals[dst].dirty = false;
+      return;
+    }
+  }
+  else {
+    for (int i = 0; i < t->top; i++) {
+      TraceVal* val = &t->vals[i];
+      if (i == dst || val->kind != VAL_XMM || val->reg != reg) {
+        continue;
+      }
+      int copy = allocTemp(t);
+      if (copy == -1) {
+        storeXmm(as, i, reg, val->isInt);
+        val->kind = VAL_SLOT_NUM;
+        val->dirty = false;
+      }
+      else {
+        emitSse(as, 0xf2, SSE_LOAD, copy, reg);
+        val->reg = copy;
+      }
+    }
+  }
+  if (reg != xmm) {
+    emitSse(as, 0xf2, SSE_LOAD, reg, xmm);
+  }
+  t->vals[dst].kind = VAL_XMM;
+  t->vals[dst].reg = reg;
+  t->vals[dst].dirty = true;
+}
+
+static void assign(
+  TraceAsm* t,
+  int dst,
+  int src,
+  uint8_t* ip,
+  bool isInt
+) {
+  if (dst == src) {
+    return;
+  }
+  if (t->carried[dst] != -1) {
+    int xmm = numIn(t, src, 0, ip, isInt);
+    storeNum(t, dst, xmm, valIsInt(t, src));
+  }
+  else {
+    copyVal(t, dst, src);
+  }
+}
+
+// Gets a slot's value into 'reg', boxed.
+static void boxIn(TraceAsm* t, int slot, int reg) {
+  TraceVal* val = &t->vals[slot];
+  switch (val->kind) {
+    case VAL_XMM:
+      emitBoxXmm(&t->as, reg, val->reg, val->isInt);
+      break;
+    case VAL_CONST: emitMovImm(&t->as, reg, val->value); break;
+    case VAL_FLAGS: t->failed = true; break;
+    default: emitLoadSlot(&t->as, reg, slot); break;
+  }
+}
+
+// Gets ready to call into C, which clobbers every xmm register:
+// numbers go back to their slots, and vm.stackTop covers them.
+static void spill(TraceAsm* t) {
+  for (int i = 0; i < t->top; i++) {
+    TraceVal* val = &t->vals[i];
+    if (val->kind == VAL_XMM) {
+      writeBack(&t->as, val, i);
+      val->kind = VAL_SLOT_NUM;
+    }
+  }
+  emitStackTop(&t->as, t->top);
+}
+
+// Leaves the trace at 'ip' if a helper's rax is TRACE_MISSING.
+static void guardMissing(TraceAsm* t, uint8_t* ip) {
+  emitMovImm(&t->as, RCX, TRACE_MISSING);
+  emitReg(&t->as, 0x39, RCX, RAX);
+  addExit(t, emitJump(&t->as, CC_E), ip);
+}
+
+// Leaves the trace at 'ip' if a helper returned false.
+static void guardTrue(TraceAsm* t, uint8_t* ip) {
+  // test al, al
+  emitByte(&t->as, 0x84);
+  emitByte(&t->as, 0xc0);
+  addExit(t, emitJump(&t->as, CC_E), ip);
+}
+
+// Sets the flags by a slot's truthiness and returns the condition
+// code that holds when it's truthy, or -1 with 'truthy' set if
+// that's known already.
+static int truthCc(TraceAsm* t, int slot, bool* truthy) {
+  TraceVal* val = &t->vals[slot];
+  switch (val->kind) {
+    case VAL_FLAGS:
+      return val->reg;
+    case VAL_CONST:
+      *truthy = !IS_NIL(val->value) &&
+        !(IS_BOOL(val->value) && !AS_BOOL(val->value));
+      return -1;
+    case VAL_XMM:
+    case VAL_SLOT_NUM:
+      *truthy = true;
+      return -1;
+    default:
+      // nil and false are next to each other, so one unsigned
+      // compare finds both.
+      emitLoadSlot(&t->as, RAX, slot);
+      emitMovImm(&t->as, RCX, NIL_VAL);
+      emitReg(&t->as, 0x29, RCX, RAX);
+      // cmp rax, 1
+      emitByte(&t->as, 0x48);
+      emitByte(&t->as, 0x83);
+      emitByte(&t->as, 0xf8);
+      emitByte(&t->as, 0x01);
+      return CC_A;
+  }
+}
+
+// Follows a branch the way it went when recorded, leaving the
+// trace if it goes the other way. 'pop' is for OP_JMPF_POP, which
+// drops the value when it doesn't jump.
+static void traceBranch(
+  TraceAsm* t,
+  bool jumped,
+  bool pop,
+  uint8_t* target,
+  uint8_t* fall
+) {
+  bool truthy = false;
+  int cc = truthCc(t, t->top - 1, &truthy);
+  if (cc == -1) {
+    // Known when compiling: it can only go the recorded way.
+    if (truthy == jumped) {
+      t->failed = true;
+    }
+  }
+  else if (jumped) {
+    int at = emitJump(&t->as, cc);
+    if (pop) {
+      t->top--;
+      addExit(t, at, fall);
+      t->top++;
+    }
+    else {
+      addExit(t, at, fall);
+    }
+  }
+  else {
+    addExit(t, emitJump(&t->as, cc ^ 1), target);
+  }
+  if (pop && !jumped) {
+    t->top--;
+  }
+}
+
+// Whether a slot holds an integer that can be had boxed, without
+// going through an xmm register. A slot of no known type is
+// expected to if 'isInt' is set.
+static bool boxedInt(TraceAsm* t, int slot, bool isInt) {
+  TraceVal* val = &t->vals[slot];
+  switch (val->kind) {
+    case VAL_SLOT: return isInt;
+    case VAL_SLOT_NUM: return val->isInt;
+    case VAL_CONST: return IS_INT(val->value);
+    default: return false;
+  }
+}
+
+// Gets a slot boxedInt() allows into 'reg', leaving the trace at
+// 'ip' if it doesn't hold an integer after all. Clobbers rcx.
+static void intIn(TraceAsm* t, int slot, int reg, uint8_t* ip) {
+  TraceVal* val = &t->vals[slot];
+  if (val->kind == VAL_CONST) {
+    emitMovImm(&t->as, reg, val->value);
+    return;
+  }
+  emitLoadSlot(&t->as, reg, slot);
+  if (val->kind == VAL_SLOT) {
+    addExit(t, emitGuardInt(&t->as, reg), ip);
+    val->kind = VAL_SLOT_NUM;
+    val->isInt = true;
+  }
+}
+
+// Integers still boxed in their slots are added, subtracted or
+// multiplied as the baseline JIT does, which saves converting them
+// to doubles and back.
+static void traceArith(TraceAsm* t, TraceStep* step, uint8_t op) {
+  uint8_t* ins = step->ip;
+  if (
+    op != SSE_DIV &&
+    boxedInt(t, t->top - 2, step->ints & 1) &&
+    boxedInt(t, t->top - 1, step->ints & 2)
+  ) {
+    intIn(t, t->top - 2, RAX, ins);
+    intIn(t, t->top - 1, RDX, ins);
+    addExit(t, emitIntArith(&t->as, op), ins);
+    t->top -= 2;
+    pushVal(t, VAL_SLOT_NUM, 0, 0);
+    emitStoreSlot(&t->as, t->top - 1, RAX);
+    if (!t->failed) {
+      t->vals[t->top - 1].isInt = true;
+    }
+    return;
+  }
+  int a = numIn(t, t->top - 2, 0, ins, step->ints & 1);
+  int b = numIn(t, t->top - 1, 1, ins, step->ints & 2);
+  bool isInt =
+    op != SSE_DIV && valIsInt(t, t->top - 2) && valIsInt(t, t->top - 1);
+  if (op == SSE_DIV) {
+    // shl rax, 1 drops the sign, leaving zero only for +-0.
+    emitFromXmm(&t->as, RAX, b);
+    emitByte(&t->as, 0x48);
+    emitByte(&t->as, 0xd1);
+    emitByte(&t->as, 0xe0);
+    addExit(t, emitJump(&t->as, CC_E), ins);
+  }
+  if (a != 0) {
+    emitSse(&t->as, 0xf2, SSE_LOAD, 0, a);
+  }
+  emitSse(&t->as, 0xf2, op, 0, b);
+  if (isInt) {
+    guardIntRange(t, 0, ins);
+  }
+  t->top -= 2;
+  pushNum(t, 0, isInt);
+}
+
+// Integers compare exactly as doubles, so every number does.
+static void traceCompare(TraceAsm* t, TraceStep* step, OpCode op) {
+  uint8_t* ins = step->ip;
+  int a = numIn(t, t->top - 2, 0, ins, step->ints & 1);
+  int b = numIn(t, t->top - 1, 1, ins, step->ints & 2);
+  int cc;
+  switch (op) {
+    case OP_LT: emitSse(&t->as, 0x66, SSE_UCOMI, b, a); cc = CC_A; break;
+    case OP_LT_EQU: emitSse(&t->as, 0x66, SSE_UCOMI, b, a); cc = CC_AE; break;
+    case OP_GT: emitSse(&t->as, 0x66, SSE_UCOMI, a, b); cc = CC_A; break;
+    default: emitSse(&t->as, 0x66, SSE_UCOMI, a, b); cc = CC_AE; break;
+  }
+  t->top -= 2;
+  pushVal(t, VAL_FLAGS, cc, 0);
+}
+
+// The back-edge: gets every slot to where the loop's top expects
+// it, then jumps there.
+static void traceBackEdge(TraceAsm* t, int loopTop) {
+  Asm* as = &t->as;
+  if (t->top != t->depth || t->inlined.method != NULL) {
+    t->failed = true;
+    return;
+  }
+  // Numbers in the wrong register go to their slots first, so no
+  // carried register is overwritten while still needed.
+  for (int i = 0; i < t->depth; i++) {
+    TraceVal* val = &t->vals[i];
+    if (val->kind == VAL_XMM && val->reg != t->carried[i]) {
+      writeBack(as, val, i);
+      val->kind = VAL_SLOT_NUM;
+    }
+  }
+  for (int i = 0; i < t->depth; i++) {
+    int reg = t->carried[i];
+    if (reg == -1) {
+      writeBack(as, &t->vals[i], i);
+      continue;
+    }
+    if (t->vals[i].kind != VAL_XMM) {
+      numIn(t, i, reg, t->header, t->carriedInt[i]);
+    }
+    // The loop's top takes it to be the kind it came in as.
+    if (valIsInt(t, i) != t->carriedInt[i]) {
+      t->failed = true;
+    }
+  }
+  int at = emitJump(as, CC_JMP);
+  writeInt32(as, at, loopTop - (at + 4));
+  t->closed = true;
+}
+
+static void traceForNum(
+  TraceAsm* t,
+  TraceStep* step,
+  bool taken,
+  int loopTop
+) {
+  uint8_t* ins = step->ip;
+  Value* constants = t->code->chunk.constants.values;
+  int slot = traceSlot(t, ins[1]);
+  Value increment = constants[ins[2]];
+  int limit = ins[3];
+  uint8_t mode = ins[4];
+  uint8_t* fall = ins + 7;
+  uint8_t* target = fall - readShort(&ins[5]);
+  bool limitLocal = mode & FOR_NUM_LIMIT_LOCAL;
+  if (limitLocal) {
+    limit = traceSlot(t, limit);
+  }
+  int counter = numIn(t, slot, 0, ins, step->ints & 1);
+  bool isInt = valIsInt(t, slot) && IS_INT(increment);
+  // Only checked here; it's read after the store, as the
+  // interpreter does, since it may be the counter itself.
+  if (limitLocal) {
+    numIn(t, limit, 1, ins, step->ints & 2);
+  }
+  if (counter != 0) {
+    emitSse(&t->as, 0xf2, SSE_LOAD, 0, counter);
+  }
+  constIn(t, increment, 1);
+  emitSse(
+    &t->as, 0xf2, mode & FOR_NUM_SUB ? SSE_SUB : SSE_ADD, 0, 1
+  );
+  if (isInt) {
+    guardIntRange(t, 0, ins);
+  }
+  storeNum(t, slot, 0, isInt);
+  counter = numIn(t, slot, 0, ins, isInt);
+  int bound = limitLocal
+    ? numIn(t, limit, 1, ins, step->ints & 2)
+    : constIn(t, constants[limit], 1);
+  int cc;
+  switch (mode & FOR_NUM_CMP_MASK) {
+    case FOR_NUM_LT:
+      emitSse(&t->as, 0x66, SSE_UCOMI, bound, counter);
+      cc = CC_A;
+      break;
+    case FOR_NUM_LT_EQU:
+      emitSse(&t->as, 0x66, SSE_UCOMI, bound, counter);
+      cc = CC_AE;
+      break;
+    case FOR_NUM_GT:
+      emitSse(&t->as, 0x66, SSE_UCOMI, counter, bound);
+      cc = CC_A;
+      break;
+    default:
+      emitSse(&t->as, 0x66, SSE_UCOMI, counter, bound);
+      cc = CC_AE;
+      break;
+  }
+  if (taken) {
+    int at = emitJump(&t->as, cc ^ 1);
+    pushVal(t, VAL_CONST, 0, FALSE_VAL);
+    addExit(t, at, fall);
+    t->top--;
+    traceBackEdge(t, loopTop);
+  }
+  else {
+    addExit(t, emitJump(&t->as, cc), target);
+    pushVal(t, VAL_CONST, 0, FALSE_VAL);
+  }
+}
+
+static void traceJumpLess(TraceAsm* t, TraceStep* step, bool less) {
+  uint8_t* ins = step->ip;
+  uint8_t* fall = ins + 5;
+  uint8_t* target = fall + readShort(&ins[3]);
+  int a = numIn(t, traceSlot(t, ins[1]), 0, ins, step->ints & 1);
+  constIn(t, t->code->chunk.constants.values[ins[2]], 1);
+  emitSse(&t->as, 0x66, SSE_UCOMI, 1, a);
+  if (less) {
+    int at = emitJump(&t->as, CC_BE);
+    pushVal(t, VAL_CONST, 0, FALSE_VAL);
+    addExit(t, at, target);
+    t->top--;
+  }
+  else {
+    addExit(t, emitJump(&t->as, CC_A), fall);
+    pushVal(t, VAL_CONST, 0, FALSE_VAL);
+  }
+}
+
+static void traceRegisterArith(TraceAsm* t, TraceStep* step) {
+  uint8_t* ins = step->ip;
+  OpCode op = ins[0];
+  bool store =
+    op == OP_ADD_RRR || op == OP_SUB_RRR || op == OP_MUL_RRR ||
+    op == OP_ADD_RRK || op == OP_SUB_RRK || op == OP_MUL_RRK;
+  bool isConst =
+    op == OP_ADD_RK || op == OP_SUB_RK || op == OP_MUL_RK ||
+    op == OP_ADD_RRK || op == OP_SUB_RRK || op == OP_MUL_RRK;
+  uint8_t sse = SSE_ADD;
+  if (op == OP_SUB_RR || op == OP_SUB_RK || op == OP_SUB_RRR || op == OP_SUB_RRK) {
+    sse = SSE_SUB;
+  }
+  else if (op == OP_MUL_RR || op == OP_MUL_RK || op == OP_MUL_RRR || op == OP_MUL_RRK) {
+    sse = SSE_MUL;
+  }
+  uint8_t* operands = store ? &ins[2] : &ins[1];
+  Value constant = isConst
+    ? t->code->chunk.constants.values[operands[1]]
+    : NIL_VAL;
+  int slotA = traceSlot(t, operands[0]);
+  int slotB = isConst ? -1 : traceSlot(t, operands[1]);
+  int a = numIn(t, slotA, 0, ins, step->ints & 1);
+  int b = isConst
+    ? constIn(t, constant, 1)
+    : numIn(t, slotB, 1, ins, step->ints & 2);
+  bool isInt = valIsInt(t, slotA) &&
+    (isConst ? IS_INT(constant) : valIsInt(t, slotB));
+  if (a != 0) {
+    emitSse(&t->as, 0xf2, SSE_LOAD, 0, a);
+  }
+  emitSse(&t->as, 0xf2, sse, 0, b);
+  if (isInt) {
+    guardIntRange(t, 0, ins);
+  }
+  if (store) {
+    storeNum(t, traceSlot(t, ins[1]), 0, isInt);
+  }
+  else {
+    pushNum(t, 0, isInt);
+  }
+}
+
+// Calls a helper with 'count' slots from 'first' as arguments,
+// boxed. A 'name' goes second, or first if there are no slots, and
+// a 'cache' goes last.
+static void traceCall(
+  TraceAsm* t,
+  void* fn,
+  int first,
+  int count,
+  ObjStr* name,
+  InlineCache* cache
+) {
+  static const int args[] = {RDI, RSI, RDX, RCX};
+  spill(t);
+  int arg = 0;
+  for (int i = 0; i < count; i++) {
+    if (name != NULL && arg == 1) {
+      emitMovImm(&t->as, RSI, (uint64_t)(uintptr_t)name);
+      arg++;
+    }
+    boxIn(t, first + i, args[arg++]);
+  }
+  if (name != NULL && arg <= 1) {
+    emitMovImm(&t->as, args[arg++], (uint64_t)(uintptr_t)name);
+  }
+  if (cache != NULL) {
+    emitMovImm(&t->as, args[arg], (uint64_t)(uintptr_t)cache);
+  }
+  emitCall(&t->as, fn);
+}
+
+// The only entry of a site's inline cache, if it has just the one
+// and it's still good, so a trace can guard on it inline.
+static CacheEntry* monoEntry(ObjFunc* func, uint8_t* ins) {
+  InlineCache* cache = siteCache(func, ins);
+  if (
+    cache == NULL || cache->count != 1 ||
+    cache->epoch != vm.cacheEpoch
+  ) {
+    return NULL;
+  }
+  return &cache->entries[0];
+}
+
+// Leaves the trace at 'ip' unless a slot holds an instance with
+// the entry's shape, and its class too for a method. Leaves the
+// instance's address in rax.
+static void guardEntry(
+  TraceAsm* t,
+  int slot,
+  CacheEntry* entry,
+  uint8_t* ip
+) {
+  Asm* as = &t->as;
+  boxIn(t, slot, RAX);
+  emitMovImm(as, RCX, SIGN_BIT | QNAN);
+  emitReg(as, 0x89, RAX, RDX);
+  emitReg(as, 0x21, RCX, RDX);
+  emitReg(as, 0x39, RCX, RDX);
+  addExit(t, emitJump(as, CC_NE), ip);
+  emitReg(as, 0x31, RCX, RAX);
+  emitLoad(as, RDX, RAX, offsetof(Obj, type));
+  emitCmp32(as, RDX, OBJ_INSTANCE);
+  addExit(t, emitJump(as, CC_NE), ip);
+  emitMovImm(as, RCX, (uint64_t)(uintptr_t)entry->shape);
+  emitMem(as, 0x3b, RCX, RAX, offsetof(ObjInstance, shape));
+  addExit(t, emitJump(as, CC_NE), ip);
+  if (entry->method != NULL) {
+    emitMovImm(as, RCX, (uint64_t)(uintptr_t)entry->class);
+    emitMem(as, 0x3b, RCX, RAX, offsetof(ObjInstance, class));
+    addExit(t, emitJump(as, CC_NE), ip);
+    // A changed method table would make the entry stale.
+    emitLoad(as, RDX, REG_VM, offsetof(VM, cacheEpoch));
+    emitCmp32(as, RDX, vm.cacheEpoch);
+    addExit(t, emitJump(as, CC_NE), ip);
+  }
+}
+
+// Pushes a field of the instance in 'slot', inline if the site's
+// cache has settled on one shape.
+static void traceGetProp(
+  TraceAsm* t,
+  int slot,
+  ObjStr* name,
+  uint8_t* ins
+) {
+  CacheEntry* entry = monoEntry(t->code, ins);
+  if (entry != NULL && entry->method == NULL) {
+    guardEntry(t, slot, entry, ins);
+    emitLoad(&t->as, RAX, RAX, offsetof(ObjInstance, slots));
+    emitLoad(&t->as, RAX, RAX, 8 * entry->slot);
+    return;
+  }
+  traceCall(
+    t, (void*)traceGetField, slot, 1, name,
+    siteCache(t->code, ins)
+  );
+  guardMissing(t, ins);
+}
+
+static void traceInvoke(TraceAsm* t, TraceStep* step) {
+  uint8_t* ins = step->ip;
+  int argCount = ins[0] == OP_INVOKE ? ins[2] : ins[4];
+  int receiver = t->top - argCount - 1;
+  if (t->inlined.method != NULL || step->method == NULL) {
+    t->failed = true;
+    return;
+  }
+  ObjStr* name = AS_STR(t->code->chunk.constants.values[indexOperand(ins)]);
+  CacheEntry* entry = monoEntry(t->code, ins);
+  if (entry != NULL && entry->method == step->method) {
+    guardEntry(t, receiver, entry, ins);
+  }
+  else {
+    traceCall(
+      t, (void*)traceMethod, receiver, 1, name,
+      siteCache(t->code, ins)
+    );
+    emitMovImm(&t->as, RCX, (uint64_t)(uintptr_t)step->method);
+    emitReg(&t->as, 0x39, RCX, RAX);
+    addExit(t, emitJump(&t->as, CC_NE), ins);
+  }
+  t->inlined.method = step->method;
+  t->inlined.returnIp = ins + (ins[0] == OP_INVOKE ? 3 : 5);
+  t->inlined.base = receiver;
+  t->code = step->method->func;
+}
+
+// Compiles one recorded instruction; 'next' is the one that ran
+// after it.
+static void traceInstruction(
+  TraceAsm* t,
+  TraceStep* step,
+  uint8_t* next,
+  int loopTop
+) {
+  Asm* as = &t->as;
+  uint8_t* ins = step->ip;
+  Value* constants = t->code->chunk.constants.values;
+  OpCode op = ins[0];
+  if (op != OP_POP && op != OP_NOT && op != OP_JMPF && op != OP_JMPF_POP) {
+    settle(t);
+  }
+  switch (op) {
+    case OP_CONST:
+    case OP_CONST_LONG:
+      pushVal(t, VAL_CONST, 0, constants[indexOperand(ins)]);
+      break;
+    case OP_SMALLINT:
+      pushVal(t, VAL_CONST, 0, INT_VAL((int8_t)ins[1]));
+      break;
+    case OP_NIL: pushVal(t, VAL_CONST, 0, NIL_VAL); break;
+    case OP_TRUE: pushVal(t, VAL_CONST, 0, TRUE_VAL); break;
+    case OP_FALSE: pushVal(t, VAL_CONST, 0, FALSE_VAL); break;
+    case OP_DUP: pushCopy(t, t->top - 1); break;
+    case OP_POP: t->top--; break;
+    case OP_GET_LOCAL:
+    case OP_GET_LOCAL_LONG:
+      pushCopy(t, traceSlot(t, indexOperand(ins)));
+      break;
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_LONG:
+      assign(
+        t, traceSlot(t, indexOperand(ins)), t->top - 1, ins,
+        step->ints & 1
+      );
+      break;
+    // An undefined global leaves the trace for the interpreter to
+    // report.
+    case OP_GET_GLOBAL:
+    case OP_GET_GLOBAL_LONG:
+      emitLoad(as, RDX, REG_VM, offsetof(VM, globals));
+      emitLoad(as, RAX, RDX, 8 * indexOperand(ins));
+      guardMissing(t, ins);
+      pushRax(t);
+      break;
+    case OP_SET_GLOBAL:
+    case OP_SET_GLOBAL_LONG:
+      emitLoad(as, RDX, REG_VM, offsetof(VM, globals));
+      emitLoad(as, RAX, RDX, 8 * indexOperand(ins));
+      guardMissing(t, ins);
+      boxIn(t, t->top - 1, RAX);
+      emitStore(as, RDX, 8 * indexOperand(ins), RAX);
+      break;
+    case OP_GET_PROP:
+    case OP_GET_PROP_LONG:
+      traceGetProp(
+        t, t->top - 1, AS_STR(constants[indexOperand(ins)]), ins
+      );
+      t->top--;
+      pushRax(t);
+      break;
+    case OP_GET_LOCAL_PROP:
+      traceGetProp(
+        t, traceSlot(t, ins[1]), AS_STR(constants[ins[2]]), ins
+      );
+      pushRax(t);
+      break;
+    case OP_SET_PROP:
+    case OP_SET_PROP_LONG: {
+      // Only a store to a field the instance has goes inline.
+      CacheEntry* entry = monoEntry(t->code, ins);
+      if (entry != NULL && entry->next == NULL) {
+        guardEntry(t, t->top - 2, entry, ins);
+        emitLoad(as, RAX, RAX, offsetof(ObjInstance, slots));
+        boxIn(t, t->top - 1, RDX);
+        emitStore(as, RAX, 8 * entry->slot, RDX);
+      }
+      else {
+        traceCall(
+          t, (void*)traceSetField, t->top - 2, 2,
+          AS_STR(constants[indexOperand(ins)]),
+          siteCache(t->code, ins)
+        );
+        guardTrue(t, ins);
+      }
+      copyVal(t, t->top - 2, t->top - 1);
+      t->top--;
+      break;
+    }
+    case OP_INDEX_SUB:
+      traceCall(t, (void*)traceIndex, t->top - 2, 2, NULL, NULL);
+      guardMissing(t, ins);
+      t->top -= 2;
+      pushRax(t);
+      break;
+    case OP_STORE_SUB:
+      traceCall(t, (void*)traceStore, t->top - 3, 3, NULL, NULL);
+      guardTrue(t, ins);
+      copyVal(t, t->top - 3, t->top - 1);
+      t->top -= 2;
+      break;
+    case OP_ADD:
+    case OP_ADD_NUM:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+      if (!step->numeric) {
+        t->failed = true;
+        break;
+      }
+      traceArith(
+        t, step,
+        op == OP_SUB ? SSE_SUB :
+        op == OP_MUL ? SSE_MUL :
+        op == OP_DIV ? SSE_DIV : SSE_ADD
+      );
+      break;
+    case OP_LT:
+    case OP_LT_NUM:
+    case OP_LT_EQU:
+    case OP_LT_EQU_NUM:
+    case OP_GT:
+    case OP_GT_NUM:
+    case OP_GT_EQU:
+    case OP_GT_EQU_NUM:
+      if (!step->numeric) {
+        t->failed = true;
+        break;
+      }
+      traceCompare(
+        t, step,
+        op == OP_LT || op == OP_LT_NUM ? OP_LT :
+        op == OP_LT_EQU || op == OP_LT_EQU_NUM ? OP_LT_EQU :
+        op == OP_GT || op == OP_GT_NUM ? OP_GT : OP_GT_EQU
+      );
+      break;
+    case OP_EQU:
+    case OP_NOT_EQU:
+      boxIn(t, t->top - 2, RAX);
+      boxIn(t, t->top - 1, RDX);
+      emitEqualsRegs(as, op == OP_NOT_EQU);
+      t->top -= 2;
+      pushRax(t);
+      break;
+    case OP_NOT: {
+      TraceVal* val = &t->vals[t->top - 1];
+      bool truthy = false;
+      if (val->kind == VAL_FLAGS) {
+        val->reg ^= 1;
+        break;
+      }
+      int cc = truthCc(t, t->top - 1, &truthy);
+      t->top--;
+      if (cc == -1) {
+        pushVal(t, VAL_CONST, 0, BOOL_VAL(!truthy));
+      }
+      else {
+        pushVal(t, VAL_FLAGS, cc ^ 1, 0);
+      }
+      break;
+    }
+    case OP_NEGATE: {
+      if (!step->numeric) {
+        t->failed = true;
+        break;
+      }
+      int a = numIn(t, t->top - 1, 0, ins, step->ints & 1);
+      bool isInt = valIsInt(t, t->top - 1);
+      emitFromXmm(as, RAX, a);
+      emitMovImm(as, RCX, SIGN_BIT);
+      emitReg(as, 0x31, RCX, RAX);
+      emitToXmm(as, 0, RAX);
+      if (isInt) {
+        guardIntRange(t, 0, ins);
+      }
+      t->top--;
+      pushNum(t, 0, isInt);
+      break;
+    }
+    case OP_JMP:
+      break;
+    case OP_LOOP:
+      if (next != t->header) {
+        t->failed = true;
+        break;
+      }
+      traceBackEdge(t, loopTop);
+      break;
+    case OP_JMPF:
+    case OP_JMPF_POP: {
+      uint8_t* fall = ins + 3;
+      uint8_t* target = fall + readShort(&ins[1]);
+      traceBranch(t, next == target, op == OP_JMPF_POP, target, fall);
+      break;
+    }
+    case OP_JLT_LOCAL_CONST:
+      traceJumpLess(t, step, next == ins + 5);
+      break;
+    case OP_FOR_NUM: {
+      bool taken = next != ins + 7;
+      if (taken && next != t->header) {
+        t->failed = true;
+        break;
+      }
+      traceForNum(t, step, taken, loopTop);
+      break;
+    }
+    case OP_ADD_RR:
+    case OP_SUB_RR:
+    case OP_MUL_RR:
+    case OP_ADD_RK:
+    case OP_SUB_RK:
+    case OP_MUL_RK:
+    case OP_ADD_RRR:
+    case OP_SUB_RRR:
+    case OP_MUL_RRR:
+    case OP_ADD_RRK:
+    case OP_SUB_RRK:
+    case OP_MUL_RRK:
+      if (!step->numeric) {
+        t->failed = true;
+        break;
+      }
+      traceRegisterArith(t, step);
+      break;
+    case OP_INVOKE:
+    case OP_INVOKE_LONG:
+      traceInvoke(t, step);
+      break;
+    case OP_RETURN: {
+      if (t->inlined.method == NULL) {
+        t->failed = true;
+        break;
+      }
+      int base = t->inlined.base;
+      copyVal(t, base, t->top - 1);
+      t->top = base + 1;
+      t->inlined.method = NULL;
+      t->inlined.base = 0;
+      t->code = t->func;
+      break;
+    }
+    default:
+      t->failed = true;
+      break;
+  }
+}
+
+// Picks the numbers to carry round the loop in registers: slots
+// below the header's depth that held numbers there, are read on
+// the way round, and only ever have numbers of the same kind
+// stored to them.
+static void chooseCarried(
+  TraceAsm* t,
+  SlotKind* slotKinds,
+  TraceStep* steps,
+  int count
+) {
+  Value* constants = t->func->chunk.constants.values;
+  bool read[TRACE_STACK] = {false};
+  bool mixed[TRACE_STACK] = {false};
+  for (int i = 0; i < count; i++) {
+    uint8_t* ins = steps[i].ip;
+    bool numeric = steps[i].numeric;
+    uint8_t ints = steps[i].ints;
+    if (steps[i].inlined) {
+      continue;
+    }
+    int slot = -1;
+    int other = -1;
+    int written = -1;
+    // Whether what's written is an integer.
+    bool isInt = false;
+    switch (ins[0]) {
+      case OP_GET_LOCAL:
+      case OP_GET_LOCAL_LONG:
+        slot = indexOperand(ins);
+        break;
+      case OP_SET_LOCAL:
+      case OP_SET_LOCAL_LONG:
+        written = indexOperand(ins);
+        isInt = ints & 1;
+        break;
+      case OP_ADD_RR:
+      case OP_SUB_RR:
+      case OP_MUL_RR:
+        slot = ins[1];
+        other = ins[2];
+        break;
+      case OP_ADD_RRR:
+      case OP_SUB_RRR:
+      case OP_MUL_RRR:
+        written = ins[1];
+        slot = ins[2];
+        other = ins[3];
+        isInt = ints == 3;
+        break;
+      case OP_ADD_RRK:
+      case OP_SUB_RRK:
+      case OP_MUL_RRK:
+        written = ins[1];
+        slot = ins[2];
+        isInt = (ints & 1) && IS_INT(constants[ins[3]]);
+        break;
+      case OP_ADD_RK:
+      case OP_SUB_RK:
+      case OP_MUL_RK:
+      case OP_JLT_LOCAL_CONST:
+        slot = ins[1];
+        break;
+      case OP_FOR_NUM:
+        slot = written = ins[1];
+        if (ins[4] & FOR_NUM_LIMIT_LOCAL) {
+          other = ins[3];
+        }
+        isInt = (ints & 1) && IS_INT(constants[ins[2]]);
+        break;
+      default:
+        break;
+    }
+    if (slot != -1 && slot < TRACE_STACK) {
+      read[slot] = true;
+    }
+    if (other != -1 && other < TRACE_STACK) {
+      read[other] = true;
+    }
+    if (
+      written != -1 && written < TRACE_STACK &&
+      (!numeric || isInt != (slotKinds[written] == SLOT_INT))
+    ) {
+      mixed[written] = true;
+    }
+  }
+  int reg = XMM_CARRIED;
+  for (int i = 0; i < t->depth && reg < XMM_COUNT; i++) {
+    if (slotKinds[i] != SLOT_OTHER && read[i] && !mixed[i]) {
+      t->carriedInt[i] = slotKinds[i] == SLOT_INT;
+      t->carried[i] = reg++;
+    }
+  }
+}
+
+static void freeTraceAsm(TraceAsm* t) {
+  for (int i = 0; i < t->exitCount; i++) {
+    free(t->exits[i].vals);
+  }
+  free(t->exits);
+  freeAsm(&t->as);
+  free(t);
+}
+
+Trace* traceCompile(
+  ObjFunc* func,
+  uint8_t* header,
+  int depth,
+  SlotKind* slotKinds,
+  TraceStep* steps,
+  int count
+) {
+  TraceAsm* t = malloc(sizeof(TraceAsm));
+  if (t == NULL) {
+    return NULL;
+  }
+  memset(t, 0, sizeof(TraceAsm));
+  t->func = func;
+  t->code = func;
+  t->header = header;
+  t->depth = depth;
+  t->top = depth;
+  t->maxTop = depth;
+  for (int i = 0; i < TRACE_STACK; i++) {
+    t->carried[i] = -1;
+  }
+  for (int i = 0; i < depth; i++) {
+    t->vals[i].kind = VAL_SLOT;
+  }
+  chooseCarried(t, slotKinds, steps, count);
+
+  Asm* as = &t->as;
+  emitPrologue(as);
+  for (int i = 0; i < depth; i++) {
+    if (t->carried[i] == -1) {
+      continue;
+    }
+    emitLoadSlot(as, RAX, i);
+    if (t->carriedInt[i]) {
+      addExit(t, emitGuardInt(as, RAX), header);
+      emitUnboxInt(as, t->carried[i], RAX);
+    }
+    else {
+      addExit(t, emitGuardNum(as, RAX), header);
+      emitToXmm(as, t->carried[i], RAX);
+    }
+  }
+  for (int i = 0; i < depth; i++) {
+    if (t->carried[i] != -1) {
+      t->vals[i].kind = VAL_XMM;
+      t->vals[i].reg = t->carried[i];
+      t->vals[i].dirty = true;
+      t->vals[i].isInt = t->carriedInt[i];
+    }
+  }
+  int loopTop = as->count;
+  for (int i = 0; i < count && !t->failed && !t->closed; i++) {
+    uint8_t* next = i + 1 < count ? steps[i + 1].ip : header;
+    traceInstruction(t, &steps[i], next, loopTop);
+  }
+  int epilogue = as->count;
+  emitEpilogue(as);
+  for (int i = 0; i < t->exitCount; i++) {
+    emitSideExit(t, &t->exits[i], epilogue);
+  }
+
+  Trace* trace = NULL;
+  size_t size;
+  void* native = NULL;
+  if (
+    t->closed && !t->failed && !as->failed &&
+    (native = mapCode(as, &size)) != NULL
+  ) {
+    trace = malloc(sizeof(Trace) + sizeof(SlotKind) * depth);
+  }
+  if (trace == NULL) {
+    if (native != NULL) {
+      munmap(native, size);
+    }
+    freeTraceAsm(t);
+    return NULL;
+  }
+  trace->header = header;
+  trace->depth = depth;
+  trace->maxDepth = t->maxTop;
+  trace->native = native;
+  trace->nativeSize = size;
+  trace->methods = NULL;
+  trace->methodCount = 0;
+  trace->next = NULL;
+  for (int i = 0; i < depth; i++) {
+    trace->kinds[i] = t->carried[i] == -1 ? SLOT_OTHER :
+      t->carriedInt[i] ? SLOT_INT : SLOT_NUM;
+  }
+  for (int i = 0; i < count; i++) {
+    if (steps[i].method != NULL) {
+      ObjClosure** methods = realloc(
+        trace->methods,
+        sizeof(ObjClosure*) * (trace->methodCount + 1)
+      );
+      if (methods == NULL) {
+        traceFree(trace);
+        freeTraceAsm(t);
+        return NULL;
+      }
+      trace->methods = methods;
+      trace->methods[trace->methodCount++] = steps[i].method;
+    }
+  }
+  freeTraceAsm(t);
+  return trace;
+}
+
+void traceFree(Trace* trace) {
+  munmap(trace->native, trace->nativeSize);
+  free(trace->methods);
+  free(trace);
+}
+
+// Whether a trace can inline an instruction: nothing that jumps,
+// calls or touches upvalues.
+static bool inlinable(OpCode op) {
+  switch (op) {
+    case OP_CONST:
+    case OP_CONST_LONG:
+    case OP_SMALLINT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_DUP:
+    case OP_POP:
+    case OP_GET_LOCAL:
+    case OP_GET_LOCAL_LONG:
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_LONG:
+    case OP_GET_GLOBAL:
+    case OP_GET_GLOBAL_LONG:
+    case OP_SET_GLOBAL:
+    case OP_SET_GLOBAL_LONG:
+    case OP_GET_PROP:
+    case OP_GET_PROP_LONG:
+    case OP_SET_PROP:
+    case OP_SET_PROP_LONG:
+    case OP_GET_LOCAL_PROP:
+    case OP_INDEX_SUB:
+    case OP_STORE_SUB:
+    case OP_ADD:
+    case OP_ADD_NUM:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_LT:
+    case OP_LT_NUM:
+    case OP_LT_EQU:
+    case OP_LT_EQU_NUM:
+    case OP_GT:
+    case OP_GT_NUM:
+    case OP_GT_EQU:
+    case OP_GT_EQU_NUM:
+    case OP_EQU:
+    case OP_NOT_EQU:
+    case OP_NOT:
+    case OP_NEGATE:
+    case OP_ADD_RR:
+    case OP_SUB_RR:
+    case OP_MUL_RR:
+    case OP_ADD_RK:
+    case OP_SUB_RK:
+    case OP_MUL_RK:
+    case OP_ADD_RRR:
+    case OP_SUB_RRR:
+    case OP_MUL_RRR:
+    case OP_ADD_RRK:
+    case OP_SUB_RRK:
+    case OP_MUL_RRK:
+    case OP_RETURN:
+      return true;
+    default:
+      return false;
+  }
+}
+
+int traceInline(ObjFunc* func, TraceStep* steps, int room) {
+  Chunk* chunk = &func->chunk;
+  int count = 0;
+  for (
+    int offset = 0;
+    offset < chunk->count;
+    offset += instructionLen(chunk, offset)
+  ) {
+    OpCode op = chunk->code[offset];
+    if (count == room || count == TRACE_INLINE_MAX || !inlinable(op)) {
+      return -1;
+    }
+    steps[count].ip = &chunk->code[offset];
+    steps[count].inlined = true;
+    // Unknown until it runs, so left to the guards.
+    steps[count].numeric = true;
+    steps[count].ints = 0;
+    steps[count].method = NULL;
+    count++;
+    if (op == OP_RETURN) {
+      return count;
+    }
+  }
+  return -1;
+}
+
+#endif
+
+#endif
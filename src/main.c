@@ -6,6 +6,7 @@
 #include "include/util.h"
 #include "include/vm.h"
 #include "include/debug.h"
+#include "include/aot.h"
 
 #define RESIN_VERSION "11-07-2022"
 
@@ -32,10 +33,20 @@ int main(int argc, const char* argv[]) {
     exit(0);
   }
   else if (argc == 2) {
-    runFile(argv[1]);
+    runFile(argv[1], false);
+  }
+  else if (argc == 3 && strcmp(argv[1], "feedback") == 0) {
+    // Runs the file, then dumps each function's type feedback.
+    runFile(argv[2], true);
+  }
+  else if (argc == 3 && strcmp(argv[1], "--emit-c") == 0) {
+    // Writes the file out as a C program instead of running it.
+    if (!emitC(argv[2], stdout)) {
+      exit(65);
+    }
   }
   else {
-    fprintf(stderr, "Usage: resin <path>\n");
+    fprintf(stderr, "Usage: resin [feedback | --emit-c] <path>\n");
     exit(64);
   }
   freeVM();
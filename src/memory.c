@@ -3,6 +3,7 @@
 #include "include/memory.h"
 #include "include/vm.h"
 #include "include/compiler.h"
+#include "include/jit.h"
 
 #ifdef DEBUG_LOG_GC
 #include "include/debug.h"
@@ -102,7 +103,9 @@ static void blackenObj(Obj* object) {
     case OBJ_CLASS: {
       ObjClass* class = (ObjClass*)object;
       markObj((Obj*)class->name);
-      markTable(&class->methods);
+      for (int i = 0; i < class->methodCount; i++) {
+        markVal(class->methods[i]);
+      }
       break;
     }
     case OBJ_CLOSURE: {
@@ -111,18 +114,47 @@ static void blackenObj(Obj* object) {
       for (int i = 0; i < closure->upvalCount; i++) {
         markObj((Obj*)closure->upvals[i]);
       }
+      for (int i = 0; i < closure->captureCount; i++) {
+        markVal(closure->captures[i]);
+      }
       break;
     }
     case OBJ_FUNC: {
       ObjFunc* func = (ObjFunc*)object;
       markObj((Obj*)func->name);
       markArray(&func->chunk.constants);
+      markObj((Obj*)func->closure);
+      for (int i = 0; i < func->cacheCount; i++) {
+        InlineCache* cache = &func->caches[i];
+        for (int j = 0; j < cache->count; j++) {
+          markObj((Obj*)cache->entries[j].class);
+          markObj((Obj*)cache->entries[j].method);
+        }
+      }
+      #ifdef TRACE_JIT
+      for (
+        Trace* trace = func->traces;
+        trace != NULL;
+        trace = trace->next
+      ) {
+        for (int i = 0; i < trace->methodCount; i++) {
+          markObj((Obj*)trace->methods[i]);
+        }
+      }
+      #endif
       break;
     }
     case OBJ_INSTANCE: {
       ObjInstance* instance = (ObjInstance*)object;
       markObj((Obj*)instance->class);
-      markTable(&instance->fields);
+      if (instance->shape == NULL) {
+        markTable(&instance->fields);
+      }
+      else {
+        for (int i = 0; i < instance->shape->count; i++) {
+          markVal(instance->slots[i]);
+        }
+      }
       break;
     }
     case OBJ_UPVAL:
@@ -150,30 +182,50 @@ static void freeObj(Obj* object) {
       break;
     case OBJ_CLASS: {
       ObjClass* class = (ObjClass*)object;
-      freeTable(&class->methods);
+      FREE_ARRAY(Value, class->methods, class->methodCount);
+      if (class->selectors != NULL) {
+        FREE_ARRAY(int, class->selectors, class->methodCount);
+      }
       FREE(ObjClass, object);
       break;
     }
     case OBJ_CLOSURE: {
       ObjClosure* closure = (ObjClosure*)object;
-      FREE_ARRAY(
-        ObjUpval*,
-        closure->upvals,
-        closure->upvalCount
+      reallocate(
+        object,
+        CLOSURE_SIZE(closure->upvalCount, closure->captureCount),
+        0
       );
-      FREE(ObjClosure, object);
       break;
     }
     case OBJ_FUNC: {
       ObjFunc* func = (ObjFunc*)object;
+      FREE_ARRAY(Feedback, func->feedback, func->feedbackCount);
+      if (func->feedbackAt != NULL) {
+        FREE_ARRAY(uint16_t, func->feedbackAt, func->chunk.count);
+      }
+      FREE_ARRAY(InlineCache, func->caches, func->cacheCount);
+      #ifdef JIT
+      jitFree(func);
+      #endif
+      #ifdef TRACE_JIT
+      while (func->traces != NULL) {
+        Trace* next = func->traces->next;
+        traceFree(func->traces);
+        func->traces = next;
+      }
+      #endif
       freeChunk(&func->chunk);
       FREE(ObjFunc, object);
       break;
     }
     case OBJ_INSTANCE: {
       ObjInstance* instance = (ObjInstance*)object;
+      if (instance->slots != instance->inlineSlots) {
+        FREE_ARRAY(Value, instance->slots, instance->slotCapacity);
+      }
       freeTable(&instance->fields);
-      FREE(ObjInstance, object);
+      reallocate(object, INSTANCE_SIZE(instance->inlineCapacity), 0);
       break;
     }
     case OBJ_NATIVE:
@@ -205,9 +257,16 @@ static void markRoots() {
   ) {
     markObj((Obj*)upval);
   }
-  markTable(&vm.globals);
+  for (int i = 0; i < vm.globalCount; i++) {
+    markVal(vm.globals[i]);
+  }
+  markTable(&vm.globalSlots);
   markCompilerRoots();
+  #ifdef TRACE_JIT
+  traceMarkRecording();
+  #endif
   markObj((Obj*)vm.initString);
+  markShape(vm.rootShape);
 }
 
 static void traceRefs() {
@@ -218,6 +277,23 @@ static void traceRefs() {
 }
 
 // Sweep 'em away!
+// Feedback targets are weak, so ones nothing else reached are
+// forgotten before they're freed.
+static void clearDeadTargets() {
+  for (Obj* object = vm.objects; object != NULL; object = object->next) {
+    if (!object->isMarked || object->type != OBJ_FUNC) {
+      continue;
+    }
+    ObjFunc* func = (ObjFunc*)object;
+    for (int i = 0; i < func->feedbackCount; i++) {
+      Obj* target = func->feedback[i].target;
+      if (target != NULL && !target->isMarked) {
+        func->feedback[i].target = NULL;
+      }
+    }
+  }
+}
+
 static void sweep() {
   Obj* previous = NULL;
   Obj* object = vm.objects;
@@ -249,6 +325,7 @@ void garbageCollect() {
   markRoots();
   traceRefs();
   tableRemoveWhite(&vm.strings);
+  clearDeadTargets();
   sweep();
   vm.nextGC = vm.allocatedBytes * GC_HEAP_GROW_FACTOR;
   #ifdef DEBUG_LOG_GC
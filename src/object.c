@@ -1,3 +1,4 @@
+#include <limits.h>
 #include <stdio.h>
 #include <string.h>
 #include "include/memory.h"
@@ -5,6 +6,7 @@
 #include "include/object.h"
 #include "include/vm.h"
 #include "include/table.h"
+#include "include/optimizer.h"
 
 #define ALLOCATE_OBJ(type, objType) \
   (type*)allocObj(sizeof(type), objType)
@@ -37,22 +39,231 @@ ObjBoundMethod* newBoundMethod(
 ObjClass* newClass(ObjStr* name) {
   ObjClass* class = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
   class->name = name;
-  initTable(&class->methods);
+  class->methods = NULL;
+  class->selectors = NULL;
+  class->firstSelector = 0;
+  class->methodCount = 0;
+  class->liveCount = 0;
+  class->init = NULL;
+  class->fieldCount = 0;
   return class;
 }
 
+// Numbers a name the first time it's used for a method.
+int selectorOf(ObjStr* name) {
+  if (name->selector == -1) {
+    name->selector = vm.selectorCount++;
+  }
+  return name->selector;
+}
+
+// A table may span this many selectors per method, plus
+// SPAN_SLACK, before its methods move to a map.
+#define SPAN_PER_METHOD 4
+#define SPAN_SLACK 16
+
+// The slot 'selector' has in a class's map, or the empty one it
+// would go in. Selectors count up from 0, so they index the map
+// well enough as they are.
+static int mapSlot(ObjClass* class, int selector) {
+  unsigned mask = (unsigned)class->methodCount - 1;
+  unsigned index = (unsigned)selector & mask;
+  while (
+    class->selectors[index] != selector &&
+    class->selectors[index] != -1
+  ) {
+    index = (index + 1) & mask;
+  }
+  return (int)index;
+}
+
+// The selector of the method in slot 'index'.
+static inline int selectorAt(ObjClass* class, int index) {
+  return class->selectors != NULL
+    ? class->selectors[index] : class->firstSelector + index;
+}
+
+bool classGet(ObjClass* class, ObjStr* name, Value* method) {
+  // A name with no selector wraps around past the end, and finds an
+  // empty slot in a map.
+  unsigned index = (unsigned)(name->selector - class->firstSelector);
+  if (class->selectors != NULL) {
+    index = (unsigned)mapSlot(class, name->selector);
+  }
+  if (
+    index >= (unsigned)class->methodCount ||
+    IS_NIL(class->methods[index])
+  ) {
+    return false;
+  }
+  *method = class->methods[index];
+  return true;
+}
+
+// Moves a class's methods to a map with room for 'capacity'.
+static void toMap(ObjClass* class, int capacity) {
+  Value* methods = ALLOCATE(Value, capacity);
+  int* selectors = ALLOCATE(int, capacity);
+  for (int i = 0; i < capacity; i++) {
+    methods[i] = NIL_VAL;
+    selectors[i] = -1;
+  }
+  Value* oldMethods = class->methods;
+  int* oldSelectors = class->selectors;
+  int oldCount = class->methodCount;
+  int oldFirst = class->firstSelector;
+  class->methods = methods;
+  class->selectors = selectors;
+  class->firstSelector = 0;
+  class->methodCount = capacity;
+  for (int i = 0; i < oldCount; i++) {
+    if (!IS_NIL(oldMethods[i])) {
+      int selector = oldSelectors != NULL
+        ? oldSelectors[i] : oldFirst + i;
+      int slot = mapSlot(class, selector);
+      selectors[slot] = selector;
+      methods[slot] = oldMethods[i];
+    }
+  }
+  FREE_ARRAY(Value, oldMethods, oldCount);
+  if (oldSelectors != NULL) {
+    FREE_ARRAY(int, oldSelectors, oldCount);
+  }
+}
+
+// Makes room for 'adding' more methods with selectors from 'low' to
+// 'high'. A table widens to take them in, unless it would then be
+// mostly holes, in which case it becomes a map.
+static void reserveMethods(
+  ObjClass* class,
+  int low,
+  int high,
+  int adding
+) {
+  int live = class->liveCount + adding;
+  if (class->selectors != NULL) {
+    int capacity = class->methodCount;
+    while (live * 2 > capacity) {
+      capacity *= 2;
+    }
+    if (capacity != class->methodCount) {
+      toMap(class, capacity);
+    }
+    return;
+  }
+  int first = class->firstSelector;
+  int end = first + class->methodCount;
+  if (class->methodCount == 0) {
+    first = low;
+    end = high + 1;
+  }
+  if (low < first) {
+    first = low;
+  }
+  if (high >= end) {
+    end = high + 1;
+  }
+  if (end - first == class->methodCount) {
+    return;
+  }
+  if (end - first > live * SPAN_PER_METHOD + SPAN_SLACK) {
+    int capacity = 8;
+    while (live * 2 > capacity) {
+      capacity *= 2;
+    }
+    toMap(class, capacity);
+    return;
+  }
+  Value* methods = ALLOCATE(Value, end - first);
+  for (int i = 0; i < end - first; i++) {
+    methods[i] = NIL_VAL;
+  }
+  int offset = class->firstSelector - first;
+  for (int i = 0; i < class->methodCount; i++) {
+    methods[offset + i] = class->methods[i];
+  }
+  FREE_ARRAY(Value, class->methods, class->methodCount);
+  class->methods = methods;
+  class->firstSelector = first;
+  class->methodCount = end - first;
+}
+
+// Puts 'method' under 'selector', which there must be room for.
+static void putMethod(ObjClass* class, int selector, Value method) {
+  int index = selector - class->firstSelector;
+  if (class->selectors != NULL) {
+    index = mapSlot(class, selector);
+    class->selectors[index] = selector;
+  }
+  if (IS_NIL(class->methods[index])) {
+    class->liveCount++;
+  }
+  class->methods[index] = method;
+}
+
+static void cacheInit(ObjClass* class) {
+  Value init;
+  class->init = classGet(class, vm.initString, &init) && IS_CLOSURE(init)
+    ? AS_CLOSURE(init) : NULL;
+}
+
+void classSet(ObjClass* class, ObjStr* name, Value method) {
+  int selector = selectorOf(name);
+  reserveMethods(class, selector, selector, 1);
+  putMethod(class, selector, method);
+  cacheInit(class);
+}
+
+// Copies every method of 'superclass' into 'subclass'.
+void classInherit(ObjClass* subclass, ObjClass* superclass) {
+  if (superclass->liveCount == 0) {
+    return;
+  }
+  int low = INT_MAX;
+  int high = -1;
+  for (int i = 0; i < superclass->methodCount; i++) {
+    if (!IS_NIL(superclass->methods[i])) {
+      int selector = selectorAt(superclass, i);
+      low = selector < low ? selector : low;
+      high = selector > high ? selector : high;
+    }
+  }
+  reserveMethods(subclass, low, high, superclass->liveCount);
+  for (int i = 0; i < superclass->methodCount; i++) {
+    if (!IS_NIL(superclass->methods[i])) {
+      putMethod(
+        subclass,
+        selectorAt(superclass, i),
+        superclass->methods[i]
+      );
+    }
+  }
+  cacheInit(subclass);
+}
+
+// A function that captures nothing gets the same closure every
+// time, so only its first OP_CLOSURE allocates.
 ObjClosure* newClosure(ObjFunc* func) {
-  ObjUpval** upvals = ALLOCATE(
-    ObjUpval*,
-    func->upvalCount
-  );
-  for (int i = 0; i < func->upvalCount; i++) {
-    upvals[i] = NULL;
+  if (func->closure != NULL) {
+    return func->closure;
   }
-  ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+  ObjClosure* closure = (ObjClosure*)allocObj(
+    CLOSURE_SIZE(func->upvalCount, func->captureCount),
+    OBJ_CLOSURE
+  );
   closure->func = func;
-  closure->upvals = upvals;
   closure->upvalCount = func->upvalCount;
+  closure->captureCount = func->captureCount;
+  for (int i = 0; i < func->upvalCount; i++) {
+    closure->upvals[i] = NULL;
+  }
+  closure->captures = (Value*)&closure->upvals[func->upvalCount];
+  for (int i = 0; i < func->captureCount; i++) {
+    closure->captures[i] = NIL_VAL;
+  }
+  if (func->upvalCount == 0 && func->captureCount == 0) {
+    func->closure = closure;
+  }
   return closure;
 }
 
@@ -60,18 +271,299 @@ ObjFunc* newFunc() {
   ObjFunc* func = ALLOCATE_OBJ(ObjFunc, OBJ_FUNC);
   func->arity = 0;
   func->upvalCount = 0;
+  func->captureCount = 0;
+  func->maxStack = 0;
+  func->access = ACCESS_NONE;
+  func->field = NULL;
   func->name = NULL;
+  func->feedback = NULL;
+  func->feedbackAt = NULL;
+  func->feedbackCount = 0;
+  func->caches = NULL;
+  func->cacheCount = 0;
+  func->closure = NULL;
+  #ifdef JIT
+  func->calls = 0;
+  #endif
+  #ifdef NATIVE_CODE
+  func->native = NULL;
+  func->nativeSize = 0;
+  #endif
+  #ifdef TRACE_JIT
+  func->traces = NULL;
+  func->retraces = 0;
+  #endif
   initChunk(&func->chunk);
   return func;
 }
 
+static bool isCacheSite(OpCode op) {
+  switch (op) {
+    case OP_GET_PROP:
+    case OP_GET_PROP_LONG:
+    case OP_SET_PROP:
+    case OP_SET_PROP_LONG:
+    case OP_GET_LOCAL_PROP:
+    case OP_INVOKE:
+    case OP_INVOKE_LONG:
+    case OP_INVOKE_SUPER:
+    case OP_INVOKE_SUPER_LONG:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Whether an instruction records feedback. Quickened forms share
+// the entry of the generic instruction they replace.
+static bool isFeedbackSite(OpCode op) {
+  if (isCacheSite(op)) {
+    return true;
+  }
+  switch (op) {
+    case OP_EQU:
+    case OP_NOT_EQU:
+    case OP_GT:
+    case OP_LT:
+    case OP_GT_EQU:
+    case OP_LT_EQU:
+    case OP_GT_NUM:
+    case OP_LT_NUM:
+    case OP_GT_EQU_NUM:
+    case OP_LT_EQU_NUM:
+    case OP_ADD:
+    case OP_ADD_NUM:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_MOD:
+    case OP_POW:
+    case OP_BIT_AND:
+    case OP_BIT_OR:
+    case OP_BIT_XOR:
+    case OP_SHL:
+    case OP_SHR:
+    case OP_BIT_NOT:
+    case OP_NEGATE:
+    case OP_ADD_RR:
+    case OP_ADD_RK:
+    case OP_ADD_RRR:
+    case OP_ADD_RRK:
+    case OP_SUB_RR:
+    case OP_SUB_RK:
+    case OP_SUB_RRR:
+    case OP_SUB_RRK:
+    case OP_MUL_RR:
+    case OP_MUL_RK:
+    case OP_MUL_RRR:
+    case OP_MUL_RRK:
+    case OP_JLT_LOCAL_CONST:
+    case OP_FOR_NUM:
+    case OP_LOOP:
+    case OP_CALL:
+    case OP_TAIL_CALL:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Gives a finished function an empty feedback entry for each
+// instruction that records any, and an empty inline cache for each
+// property site. Past NO_FEEDBACK - 1 sites, the rest share the
+// last entry, without a cache.
+void initFeedback(ObjFunc* func) {
+  Chunk* chunk = &func->chunk;
+  func->feedbackAt = ALLOCATE(uint16_t, chunk->count);
+  int sites = 0;
+  for (int i = 0; i < chunk->count; i++) {
+    func->feedbackAt[i] = NO_FEEDBACK;
+  }
+  for (int i = 0; i < chunk->count; i += instructionLen(chunk, i)) {
+    if (isFeedbackSite(chunk->code[i])) {
+      func->feedbackAt[i] = sites < NO_FEEDBACK - 1
+        ? sites : NO_FEEDBACK - 1;
+      sites++;
+    }
+  }
+  int count = sites < NO_FEEDBACK ? sites : NO_FEEDBACK;
+  func->feedback = ALLOCATE(Feedback, count);
+  func->feedbackCount = count;
+  for (int i = 0; i < count; i++) {
+    func->feedback[i].left = 0;
+    func->feedback[i].right = 0;
+    func->feedback[i].polymorphic = false;
+    func->feedback[i].loops = 0;
+    func->feedback[i].cache = NO_CACHE;
+    func->feedback[i].target = NULL;
+  }
+  int caches = 0;
+  for (int i = 0; i < chunk->count; i += instructionLen(chunk, i)) {
+    uint16_t at = func->feedbackAt[i];
+    if (
+      isCacheSite(chunk->code[i]) && at < NO_FEEDBACK - 1 &&
+      caches < NO_CACHE
+    ) {
+      func->feedback[at].cache = caches++;
+    }
+  }
+  func->caches = ALLOCATE(InlineCache, caches);
+  func->cacheCount = caches;
+  for (int i = 0; i < caches; i++) {
+    func->caches[i].count = 0;
+    func->caches[i].epoch = 0;
+  }
+}
+
 ObjInstance* newInstance(ObjClass* class) {
-  ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+  int capacity = class->fieldCount == 0
+    ? INSTANCE_SLOTS : class->fieldCount;
+  ObjInstance* instance = (ObjInstance*)allocObj(
+    INSTANCE_SIZE(capacity),
+    OBJ_INSTANCE
+  );
   instance->class = class;
+  instance->shape = vm.rootShape;
+  instance->slots = instance->inlineSlots;
+  instance->slotCapacity = capacity;
+  instance->inlineCapacity = capacity;
   initTable(&instance->fields);
   return instance;
 }
 
+bool instanceGet(
+  ObjInstance* instance,
+  ObjStr* name,
+  Value* value
+) {
+  if (instance->shape == NULL) {
+    return tableGet(&instance->fields, name, value);
+  }
+  int slot = shapeSlot(instance->shape, name);
+  if (slot == -1) {
+    return false;
+  }
+  *value = instance->slots[slot];
+  return true;
+}
+
+// Moves an instance's fields into its table for good.
+static void toDictionary(ObjInstance* instance) {
+  Shape* shape = instance->shape;
+  for (int i = 0; i < shape->count; i++) {
+    tableSet(&instance->fields, shape->names[i], instance->slots[i]);
+  }
+  instance->shape = NULL;
+  if (instance->slots != instance->inlineSlots) {
+    FREE_ARRAY(Value, instance->slots, instance->slotCapacity);
+  }
+  instance->slots = instance->inlineSlots;
+  instance->slotCapacity = instance->inlineCapacity;
+}
+
+static Shape* addField(Shape* shape, ObjStr* name) {
+  for (
+    Shape* child = shape->children;
+    child != NULL;
+    child = child->sibling
+  ) {
+    if (child->name == name) {
+      return child;
+    }
+  }
+  return newShape(shape, name);
+}
+
+void instanceSet(ObjInstance* instance, ObjStr* name, Value value) {
+  if (instance->shape != NULL) {
+    int slot = shapeSlot(instance->shape, name);
+    if (slot != -1) {
+      instance->slots[slot] = value;
+      return;
+    }
+    if (instance->shape->count == SHAPE_MAX_FIELDS) {
+      toDictionary(instance);
+    }
+  }
+  if (instance->shape == NULL) {
+    tableSet(&instance->fields, name, value);
+    return;
+  }
+  int count = instance->shape->count;
+  if (count == instance->slotCapacity) {
+    int capacity = GROW_CAPACITY(instance->slotCapacity);
+    Value* slots = ALLOCATE(Value, capacity);
+    memcpy(slots, instance->slots, sizeof(Value) * count);
+    if (instance->slots != instance->inlineSlots) {
+      FREE_ARRAY(Value, instance->slots, instance->slotCapacity);
+    }
+    instance->slots = slots;
+    instance->slotCapacity = capacity;
+  }
+  Shape* shape = addField(instance->shape, name);
+  instance->slots[count] = value;
+  instance->shape = shape;
+  if (shape->count > instance->class->fieldCount) {
+    instance->class->fieldCount = shape->count;
+  }
+}
+
+// 'parent' is NULL for the empty root shape.
+Shape* newShape(Shape* parent, ObjStr* name) {
+  Shape* shape = ALLOCATE(Shape, 1);
+  shape->parent = parent;
+  shape->name = name;
+  shape->count = parent == NULL ? 0 : parent->count + 1;
+  shape->names = ALLOCATE(ObjStr*, shape->count);
+  if (parent != NULL) {
+    for (int i = 0; i < parent->count; i++) {
+      shape->names[i] = parent->names[i];
+    }
+    shape->names[parent->count] = name;
+  }
+  shape->children = NULL;
+  shape->sibling = NULL;
+  if (parent != NULL) {
+    shape->sibling = parent->children;
+    parent->children = shape;
+  }
+  return shape;
+}
+
+int shapeSlot(Shape* shape, ObjStr* name) {
+  for (int i = 0; i < shape->count; i++) {
+    if (shape->names[i] == name) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void markShape(Shape* shape) {
+  if (shape == NULL) {
+    return;
+  }
+  markObj((Obj*)shape->name);
+  for (
+    Shape* child = shape->children;
+    child != NULL;
+    child = child->sibling
+  ) {
+    markShape(child);
+  }
+}
+
+void freeShape(Shape* shape) {
+  Shape* child = shape->children;
+  while (child != NULL) {
+    Shape* sibling = child->sibling;
+    freeShape(child);
+    child = sibling;
+  }
+  FREE_ARRAY(ObjStr*, shape->names, shape->count);
+  FREE(Shape, shape);
+}
+
 ObjNative* newNative(NativeFn func) {
   ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
   native->func = func;
@@ -83,6 +575,7 @@ static ObjStr* allocStr(char* chars, int length, uint32_t hash) {
   string->length = length;
   string->chars = chars;
   string->hash = hash;
+  string->selector = -1;
   push(OBJ_VAL(string));
   tableSet(&vm.strings, string, NIL_VAL);
   pop();
@@ -172,7 +665,7 @@ void deleteFromList(ObjList* list, int index) {
   list->count--;
 }
 
-bool isValidListIndex(ObjList* list, int index) {
+bool isValidListIndex(ObjList* list, int64_t index) {
   if (index < 0 || index > list->count - 1) {
     return false;
   }
@@ -0,0 +1,537 @@
+#include <stdlib.h>
+#include "include/optimizer.h"
+#include "include/memory.h"
+#include "include/object.h"
+
+// A 16-bit jump operand 'operand' bytes into the instruction at
+// 'offset'.
+typedef struct {
+  int offset;
+  int operand;
+  int target;
+} Jump;
+
+// Register forms of a stack arithmetic opcode, indexed by
+// whether the right operand is a constant and whether the
+// result is stored back into a slot.
+typedef struct {
+  OpCode op;
+  OpCode forms[2][2];
+} RegisterOp;
+
+static RegisterOp registerOps[] = {
+  {OP_ADD, {{OP_ADD_RR, OP_ADD_RRR}, {OP_ADD_RK, OP_ADD_RRK}}},
+  {OP_SUB, {{OP_SUB_RR, OP_SUB_RRR}, {OP_SUB_RK, OP_SUB_RRK}}},
+  {OP_MUL, {{OP_MUL_RR, OP_MUL_RRR}, {OP_MUL_RK, OP_MUL_RRK}}}
+};
+
+#define REGISTER_OP_COUNT \
+  ((int)(sizeof(registerOps) / sizeof(RegisterOp)))
+
+static int readShort(Chunk* chunk, int offset) {
+  return (chunk->code[offset] << 8) | chunk->code[offset + 1];
+}
+
+int instructionLen(Chunk* chunk, int offset) {
+  switch (chunk->code[offset]) {
+    case OP_CONST:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_DEF_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_UPVAL:
+    case OP_SET_UPVAL:
+    case OP_GET_CAPTURE:
+    case OP_GET_PROP:
+    case OP_SET_PROP:
+    case OP_GET_SUPER:
+    case OP_BUILD_LIST:
+    case OP_EXTEND_LIST:
+    case OP_SMALLINT:
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    case OP_CLASS:
+    case OP_METHOD:
+      return 2;
+    case OP_JMP:
+    case OP_JMPF:
+    case OP_LOOP:
+    case OP_INVOKE:
+    case OP_INVOKE_SUPER:
+    case OP_JMPF_POP:
+    case OP_GET_LOCAL_PROP:
+    case OP_ADD_RR:
+    case OP_ADD_RK:
+    case OP_SUB_RR:
+    case OP_SUB_RK:
+    case OP_MUL_RR:
+    case OP_MUL_RK:
+    case OP_GET_LOCAL_LONG:
+    case OP_SET_LOCAL_LONG:
+      return 3;
+    case OP_ADD_RRR:
+    case OP_ADD_RRK:
+    case OP_SUB_RRR:
+    case OP_SUB_RRK:
+    case OP_MUL_RRR:
+    case OP_MUL_RRK:
+    case OP_CONST_LONG:
+    case OP_GET_GLOBAL_LONG:
+    case OP_DEF_GLOBAL_LONG:
+    case OP_SET_GLOBAL_LONG:
+    case OP_GET_PROP_LONG:
+    case OP_SET_PROP_LONG:
+    case OP_GET_SUPER_LONG:
+    case OP_CLASS_LONG:
+    case OP_METHOD_LONG:
+      return 4;
+    case OP_JLT_LOCAL_CONST:
+    case OP_INVOKE_LONG:
+    case OP_INVOKE_SUPER_LONG:
+      return 5;
+    case OP_FOR_NUM:
+      return 7;
+    case OP_CLOSURE: {
+      ObjFunc* func = AS_FUNC(
+        chunk->constants.values[chunk->code[offset + 1]]
+      );
+      return 2 + (func->upvalCount + func->captureCount) * 3;
+    }
+    case OP_CLOSURE_LONG: {
+      int constant =
+        (chunk->code[offset + 1] << 16) |
+        (chunk->code[offset + 2] << 8) |
+        chunk->code[offset + 3];
+      ObjFunc* func = AS_FUNC(chunk->constants.values[constant]);
+      return 4 + (func->upvalCount + func->captureCount) * 3;
+    }
+    case OP_SWITCH_INT:
+      return 9 + readShort(chunk, offset + 5) * 2;
+    case OP_SWITCH_STR:
+      return 6 + readShort(chunk, offset + 2) * 5;
+    default:
+      return 1;
+  }
+}
+
+// Returns how many jump operands an instruction has. Switches
+// have one per table entry plus the miss offset.
+static int jumpCount(Chunk* chunk, int offset) {
+  switch (chunk->code[offset]) {
+    case OP_JMP:
+    case OP_JMPF:
+    case OP_JMPF_POP:
+    case OP_JLT_LOCAL_CONST:
+    case OP_LOOP:
+    case OP_FOR_NUM:
+      return 1;
+    case OP_SWITCH_INT:
+      return 1 + readShort(chunk, offset + 5);
+    case OP_SWITCH_STR:
+      return 1 + readShort(chunk, offset + 2);
+    default:
+      return 0;
+  }
+}
+
+// Returns where the n-th jump operand sits in the instruction.
+// Outside the switches it is always the last operand; in them the
+// miss offset comes first, directly ahead of the table.
+static int jumpOperand(Chunk* chunk, int offset, int n) {
+  switch (chunk->code[offset]) {
+    case OP_SWITCH_INT:
+      return 7 + n * 2;
+    case OP_SWITCH_STR:
+      return 4 + n * 5;
+    default:
+      return instructionLen(chunk, offset) - 2;
+  }
+}
+
+static bool isBackward(OpCode op) {
+  return op == OP_LOOP || op == OP_FOR_NUM;
+}
+
+// Returns the offset the n-th jump operand of an instruction
+// jumps to.
+static int jumpTarget(Chunk* chunk, int offset, int n) {
+  int end = offset + instructionLen(chunk, offset);
+  int jump = readShort(chunk, offset + jumpOperand(chunk, offset, n));
+  return isBackward(chunk->code[offset]) ? end - jump : end + jump;
+}
+
+// A fused sequence is only safe if nothing jumps into the
+// middle of it.
+static bool anyTarget(bool* targets, int from, int to) {
+  for (int i = from; i < to; i++) {
+    if (targets[i]) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool isOp(Chunk* chunk, int offset, OpCode op) {
+  return offset < chunk->count && chunk->code[offset] == op;
+}
+
+// Returns the constant an OP_CONST or OP_SMALLINT at 'offset'
+// loads, adding the small integer to the pool if it isn't there.
+// Returns -1 if there is none or its index doesn't fit in a byte,
+// in which case the pool is left alone.
+static int constOperand(Chunk* chunk, int offset) {
+  if (isOp(chunk, offset, OP_CONST)) {
+    return chunk->code[offset + 1];
+  }
+  if (!isOp(chunk, offset, OP_SMALLINT)) {
+    return -1;
+  }
+  Value value = INT_VAL((int8_t)chunk->code[offset + 1]);
+  int constant = lookupConst(chunk, value);
+  if (constant == -1 && chunk->constants.count <= UINT8_MAX) {
+    return addConst(chunk, value);
+  }
+  return constant <= UINT8_MAX ? constant : -1;
+}
+
+static bool isConstOp(Chunk* chunk, int offset) {
+  return
+    isOp(chunk, offset, OP_CONST) ||
+    isOp(chunk, offset, OP_SMALLINT);
+}
+
+static RegisterOp* registerOp(Chunk* chunk, int offset) {
+  if (offset >= chunk->count) {
+    return NULL;
+  }
+  for (int i = 0; i < REGISTER_OP_COUNT; i++) {
+    if (chunk->code[offset] == registerOps[i].op) {
+      return &registerOps[i];
+    }
+  }
+  return NULL;
+}
+
+static void emit(Chunk* out, Chunk* chunk, int from, int length) {
+  int line = getLine(chunk, from);
+  for (int i = 0; i < length; i++) {
+    writeChunk(out, chunk->code[from + i], line);
+  }
+}
+
+void optimizeChunk(Chunk* chunk) {
+  bool* targets = ALLOCATE(bool, chunk->count + 1);
+  for (int i = 0; i <= chunk->count; i++) {
+    targets[i] = false;
+  }
+  int jumpCapacity = 0;
+  for (int i = 0; i < chunk->count; i += instructionLen(chunk, i)) {
+    int count = jumpCount(chunk, i);
+    for (int n = 0; n < count; n++) {
+      targets[jumpTarget(chunk, i, n)] = true;
+    }
+    jumpCapacity += count;
+  }
+
+  // Old offset -> new offset, so jumps can be re-aimed once the
+  // code has shrunk.
+  int* newOffsets = ALLOCATE(int, chunk->count + 1);
+  Jump* jumps = ALLOCATE(Jump, jumpCapacity);
+  int jumpsCount = 0;
+  Chunk out;
+  initChunk(&out);
+
+  int i = 0;
+  while (i < chunk->count) {
+    newOffsets[i] = out.count;
+    int line = getLine(chunk, i);
+    // GET_LOCAL, CONST, LT, JMPF, POP -> JLT_LOCAL_CONST
+    int constant = -1;
+    if (
+      isOp(chunk, i, OP_GET_LOCAL) &&
+      isConstOp(chunk, i + 2) &&
+      isOp(chunk, i + 4, OP_LT) &&
+      isOp(chunk, i + 5, OP_JMPF) &&
+      isOp(chunk, i + 8, OP_POP) &&
+      !anyTarget(targets, i + 1, i + 9) &&
+      (constant = constOperand(chunk, i + 2)) != -1
+    ) {
+      jumps[jumpsCount++] = (Jump){
+        out.count, 3, jumpTarget(chunk, i + 5, 0)
+      };
+      writeChunk(&out, OP_JLT_LOCAL_CONST, line);
+      writeChunk(&out, chunk->code[i + 1], line);
+      writeChunk(&out, constant, line);
+      writeChunk(&out, 0xff, line);
+      writeChunk(&out, 0xff, line);
+      i += 9;
+      continue;
+    }
+    // JMPF, POP -> JMPF_POP
+    if (
+      isOp(chunk, i, OP_JMPF) &&
+      isOp(chunk, i + 3, OP_POP) &&
+      !anyTarget(targets, i + 1, i + 4)
+    ) {
+      jumps[jumpsCount++] = (Jump){out.count, 1, jumpTarget(chunk, i, 0)};
+      writeChunk(&out, OP_JMPF_POP, line);
+      writeChunk(&out, 0xff, line);
+      writeChunk(&out, 0xff, line);
+      i += 4;
+      continue;
+    }
+    // GET_LOCAL, GET_LOCAL/CONST, ADD/SUB/MUL -> register form,
+    // with a trailing SET_LOCAL, POP folded into the destination.
+    if (
+      isOp(chunk, i, OP_GET_LOCAL) &&
+      (
+        isOp(chunk, i + 2, OP_GET_LOCAL) ||
+        isConstOp(chunk, i + 2)
+      ) &&
+      registerOp(chunk, i + 4) != NULL &&
+      !anyTarget(targets, i + 1, i + 5) &&
+      (
+        isOp(chunk, i + 2, OP_GET_LOCAL) ||
+        (constant = constOperand(chunk, i + 2)) != -1
+      )
+    ) {
+      RegisterOp* op = registerOp(chunk, i + 4);
+      bool isConst = isConstOp(chunk, i + 2);
+      bool store =
+        isOp(chunk, i + 5, OP_SET_LOCAL) &&
+        isOp(chunk, i + 7, OP_POP) &&
+        !anyTarget(targets, i + 5, i + 8);
+      writeChunk(&out, op->forms[isConst][store], line);
+      if (store) {
+        writeChunk(&out, chunk->code[i + 6], line);
+      }
+      writeChunk(&out, chunk->code[i + 1], line);
+      writeChunk(&out, isConst ? constant : chunk->code[i + 3], line);
+      i += store ? 8 : 5;
+      continue;
+    }
+    // GET_LOCAL, GET_PROP -> GET_LOCAL_PROP
+    if (
+      isOp(chunk, i, OP_GET_LOCAL) &&
+      isOp(chunk, i + 2, OP_GET_PROP) &&
+      !anyTarget(targets, i + 1, i + 4)
+    ) {
+      writeChunk(&out, OP_GET_LOCAL_PROP, line);
+      writeChunk(&out, chunk->code[i + 1], line);
+      writeChunk(&out, chunk->code[i + 3], line);
+      i += 4;
+      continue;
+    }
+    int length = instructionLen(chunk, i);
+    int count = jumpCount(chunk, i);
+    for (int n = 0; n < count; n++) {
+      jumps[jumpsCount++] = (Jump){
+        out.count, jumpOperand(chunk, i, n), jumpTarget(chunk, i, n)
+      };
+    }
+    emit(&out, chunk, i, length);
+    i += length;
+  }
+  newOffsets[chunk->count] = out.count;
+
+  for (int j = 0; j < jumpsCount; j++) {
+    int offset = jumps[j].offset;
+    int end = offset + instructionLen(&out, offset);
+    int target = newOffsets[jumps[j].target];
+    int jump = isBackward(out.code[offset])
+      ? end - target
+      : target - end;
+    out.code[offset + jumps[j].operand] = (jump >> 8) & 0xff;
+    out.code[offset + jumps[j].operand + 1] = jump & 0xff;
+  }
+
+  FREE_ARRAY(Jump, jumps, jumpCapacity);
+  FREE_ARRAY(int, newOffsets, chunk->count + 1);
+  FREE_ARRAY(bool, targets, chunk->count + 1);
+  FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+  FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
+  chunk->code = out.code;
+  chunk->count = out.count;
+  chunk->capacity = out.capacity;
+  chunk->lines = out.lines;
+  chunk->lineCount = out.lineCount;
+  chunk->lineCapacity = out.lineCapacity;
+}
+
+// How far an instruction moves the stack top when it falls through
+// to the next one.
+static int stackEffect(Chunk* chunk, int offset) {
+  uint8_t* code = &chunk->code[offset];
+  switch (code[0]) {
+    case OP_CONST:
+    case OP_CONST_LONG:
+    case OP_SMALLINT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_DUP:
+    case OP_GET_LOCAL:
+    case OP_GET_LOCAL_LONG:
+    case OP_GET_GLOBAL:
+    case OP_GET_GLOBAL_LONG:
+    case OP_GET_UPVAL:
+    case OP_GET_CAPTURE:
+    case OP_GET_LOCAL_PROP:
+    case OP_CLOSURE:
+    case OP_CLOSURE_LONG:
+    case OP_CLASS:
+    case OP_CLASS_LONG:
+    case OP_ADD_RR:
+    case OP_ADD_RK:
+    case OP_SUB_RR:
+    case OP_SUB_RK:
+    case OP_MUL_RR:
+    case OP_MUL_RK:
+    // Falls out of the loop with 'false' for the exit's OP_POP.
+    case OP_FOR_NUM:
+      return 1;
+    case OP_POP:
+    case OP_DEF_GLOBAL:
+    case OP_DEF_GLOBAL_LONG:
+    case OP_SET_PROP:
+    case OP_SET_PROP_LONG:
+    case OP_GET_SUPER:
+    case OP_GET_SUPER_LONG:
+    case OP_INDEX_SUB:
+    case OP_EQU:
+    case OP_NOT_EQU:
+    case OP_GT:
+    case OP_LT:
+    case OP_GT_EQU:
+    case OP_LT_EQU:
+    case OP_GT_NUM:
+    case OP_LT_NUM:
+    case OP_GT_EQU_NUM:
+    case OP_LT_EQU_NUM:
+    case OP_ADD:
+    case OP_ADD_NUM:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_MOD:
+    case OP_POW:
+    case OP_BIT_AND:
+    case OP_BIT_OR:
+    case OP_BIT_XOR:
+    case OP_SHL:
+    case OP_SHR:
+    case OP_CLOSE_UPVAL:
+    case OP_INHERIT:
+    case OP_METHOD:
+    case OP_METHOD_LONG:
+    case OP_JMPF_POP:
+      return -1;
+    case OP_STORE_SUB:
+      return -2;
+    case OP_BUILD_LIST:
+      return 1 - code[1];
+    case OP_EXTEND_LIST:
+    case OP_CALL:
+      return -code[1];
+    case OP_INVOKE:
+      return -code[2];
+    case OP_INVOKE_LONG:
+      return -code[4];
+    // The superclass goes too.
+    case OP_INVOKE_SUPER:
+      return -code[2] - 1;
+    case OP_INVOKE_SUPER_LONG:
+      return -code[4] - 1;
+    default:
+      return 0;
+  }
+}
+
+// How far an instruction moves the stack top when it jumps, where
+// that differs from falling through.
+static int jumpEffect(Chunk* chunk, int offset) {
+  switch (chunk->code[offset]) {
+    // Jumps with 'false' pushed, as OP_JMPF would have left it.
+    case OP_JLT_LOCAL_CONST: return 1;
+    // Keeps the value it tested.
+    case OP_JMPF_POP: return 0;
+    case OP_FOR_NUM: return 0;
+    default: return stackEffect(chunk, offset);
+  }
+}
+
+static bool fallsThrough(OpCode op) {
+  switch (op) {
+    case OP_JMP:
+    case OP_LOOP:
+    case OP_RETURN:
+    case OP_TAIL_CALL:
+    case OP_SWITCH_INT:
+    case OP_SWITCH_STR:
+      return false;
+    default:
+      return true;
+  }
+}
+
+// Where maxStackDepth() has got to: the depth each instruction is
+// reached at, or -1, and those still to walk from.
+typedef struct {
+  int* depths;
+  int* pending;
+  int count;
+  int max;
+} DepthWalk;
+
+// Notes that 'offset' is reached at 'depth', and queues it up the
+// first time.
+static void reach(DepthWalk* walk, int offset, int depth) {
+  if (depth > walk->max) {
+    walk->max = depth;
+  }
+  if (walk->depths[offset] == -1) {
+    walk->depths[offset] = depth;
+    walk->pending[walk->count++] = offset;
+  }
+}
+
+// Returns the most values a frame running 'chunk' ever holds,
+// locals included, if it starts with 'depth' of them. Every path to
+// an instruction reaches it at the same depth, so each one is
+// walked once.
+int maxStackDepth(Chunk* chunk, int depth) {
+  DepthWalk walk;
+  walk.depths = ALLOCATE(int, chunk->count + 1);
+  walk.pending = ALLOCATE(int, chunk->count + 1);
+  walk.count = 0;
+  walk.max = 0;
+  for (int i = 0; i <= chunk->count; i++) {
+    walk.depths[i] = -1;
+  }
+  reach(&walk, 0, depth);
+  while (walk.count > 0) {
+    int offset = walk.pending[--walk.count];
+    if (offset == chunk->count) {
+      continue;
+    }
+    int before = walk.depths[offset];
+    OpCode op = chunk->code[offset];
+    if (fallsThrough(op)) {
+      reach(
+        &walk, offset + instructionLen(chunk, offset),
+        before + stackEffect(chunk, offset)
+      );
+    }
+    int count = jumpCount(chunk, offset);
+    for (int n = 0; n < count; n++) {
+      reach(
+        &walk, jumpTarget(chunk, offset, n),
+        before + jumpEffect(chunk, offset)
+      );
+    }
+  }
+  FREE_ARRAY(int, walk.pending, chunk->count + 1);
+  FREE_ARRAY(int, walk.depths, chunk->count + 1);
+  return walk.max;
+}
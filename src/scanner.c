@@ -122,7 +122,14 @@ static TokenType checkKeyword(
 
 static TokenType identifierType() {
   switch (scanner.start[0]) {
-    case 'c': return checkKeyword(1, 4, "lass", CLASS);
+    case 'c':
+      if (scanner.current - scanner.start > 1) {
+        switch (scanner.start[1]) {
+          case 'l': return checkKeyword(2, 3, "ass", CLASS);
+          case 'o': return checkKeyword(2, 3, "nst", CONST);
+        }
+      }
+      break;
     case 'e':
       if (scanner.current - scanner.start > 1) {
         switch (scanner.start[1]) {
@@ -237,13 +244,14 @@ Token scanToken() {
     case '^': return makeToken(CARET);
     case '/': return makeToken(SLASH);
     case '%': return makeToken(PERCENT);
+    case '~': return makeToken(TILDE);
     case '|':
       return makeToken(
-        match('|') ? OR : ERR
+        match('|') ? OR : PIPE
       );
     case '&':
       return makeToken(
-        match('&') ? AND : ERR
+        match('&') ? AND : AMP
       );
     case '!':
       return makeToken(
@@ -255,11 +263,11 @@ Token scanToken() {
       );
     case '<':
       return makeToken(
-        match('=') ? LT_EQU : LT
+        match('=') ? LT_EQU : match('<') ? LT_LT : LT
       );
     case '>':
       return makeToken(
-        match('=') ? GT_EQU : GT
+        match('=') ? GT_EQU : match('>') ? GT_GT : GT
       );
     case '"': return string();
     case '_': return makeToken(UNDERSCORE);
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include "include/util.h"
 #include "include/vm.h"
+#include "include/debug.h"
 
 char* readFile(const char* path) {
   FILE* file = fopen(path, "rb");
@@ -30,10 +31,13 @@ char* readFile(const char* path) {
   return buffer;
 }
 
-void runFile(const char* path) {
+void runFile(const char* path, bool feedback) {
   char* source = readFile(path);
   InterpretResult result = interpret(source);
   free(source);
+  if (feedback && result != INTERPRET_COMPILE_ERROR) {
+    dumpFeedback();
+  }
   if (result == INTERPRET_COMPILE_ERROR) {
     exit(65);
   }
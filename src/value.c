@@ -1,3 +1,4 @@
+#include <math.h>
 #include <stdio.h>
 #include <string.h>
 #include "include/memory.h"
@@ -36,8 +37,10 @@ void printValue(Value value) {
   else if (IS_NIL(value)) {
     printf("nil");
   }
-  else if (IS_NUM(value)) {
-    printf("%.16g", AS_NUM(value));
+  else if (IS_NUMBER(value)) {
+    char num[NUM_CHARS_MAX];
+    formatNum(value, num);
+    printf("%s", num);
   }
   else if (IS_OBJ(value)) {
     printObj(value);
@@ -48,12 +51,120 @@ void printValue(Value value) {
       printf(AS_BOOL(value) ? "true" : "false");
       break;
     case VAL_NIL: printf("nil"); break;
-    case VAL_NUM: printf("%.16g", AS_NUM(value)); break;
+    case VAL_NUM:
+    case VAL_INT: {
+      char num[NUM_CHARS_MAX];
+      formatNum(value, num);
+      printf("%s", num);
+      break;
+    }
     case VAL_OBJ: printObj(value); break;
   }
   #endif
 }
 
+// Writes a number out as it prints, returning its length. A double
+// with nothing after the point still gets one, so it can't be
+// mistaken for an integer.
+int formatNum(Value value, char* out) {
+  if (IS_INT(value)) {
+    return snprintf(out, NUM_CHARS_MAX, "%lld", (long long)AS_INT(value));
+  }
+  int length = snprintf(out, NUM_CHARS_MAX, "%.16g", AS_NUM(value));
+  if (strspn(out, "-0123456789") == (size_t)length) {
+    memcpy(&out[length], ".0", 3);
+    length += 2;
+  }
+  return length;
+}
+
+// Shift counts run from 0 to 47, an integer's width less its sign.
+#define SHIFT_MAX 47
+
+// 'x' shifted left or right by 'n' bits into 'result'. A count out
+// of range is an error, as is a left shift that leaves the integer
+// range. Right shifts bring the sign in.
+static const char* shiftInt(
+  int64_t x,
+  int64_t n,
+  bool left,
+  int64_t* result
+) {
+  if (n < 0 || n > SHIFT_MAX) {
+    return "Shift count must be between 0 and 47.";
+  }
+  if (!left) {
+    *result = x >> n;
+    return NULL;
+  }
+  if (x > (INT_VAL_MAX >> n) || x < (INT_VAL_MIN >> n)) {
+    return "Shift result is out of integer range.";
+  }
+  *result = (int64_t)((uint64_t)x << n);
+  return NULL;
+}
+
+// Works out 'a op b' for two numbers. Integers give an integer for
+// all but '/' and '^', or a double if it leaves their range; the
+// bitwise operators take integers alone. Returns the error to
+// report, or NULL.
+const char* numArith(ArithOp op, Value a, Value b, Value* result) {
+  if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+    return "Operands must be numbers.";
+  }
+  bool ints = IS_INT(a) && IS_INT(b);
+  if (op >= ARITH_AND && !ints) {
+    return "Operands must be integers.";
+  }
+  if (ints && op <= ARITH_MUL) {
+    if (intArith(op, a, b, result)) {
+      return NULL;
+    }
+  }
+  else if (ints && op != ARITH_DIV && op != ARITH_POW) {
+    int64_t x = AS_INT(a);
+    int64_t y = AS_INT(b);
+    int64_t num;
+    switch (op) {
+      case ARITH_MOD:
+        if (y == 0) {
+          return "Division by zero.";
+        }
+        num = x % y;
+        break;
+      case ARITH_AND: num = x & y; break;
+      case ARITH_OR: num = x | y; break;
+      case ARITH_XOR: num = x ^ y; break;
+      default: {
+        const char* error = shiftInt(x, y, op == ARITH_SHL, &num);
+        if (error != NULL) {
+          return error;
+        }
+        break;
+      }
+    }
+    *result = INT_VAL(num);
+    return NULL;
+  }
+  double x = AS_NUMBER(a);
+  double y = AS_NUMBER(b);
+  switch (op) {
+    case ARITH_ADD: *result = NUM_VAL(x + y); break;
+    case ARITH_SUB: *result = NUM_VAL(x - y); break;
+    case ARITH_MUL: *result = NUM_VAL(x * y); break;
+    case ARITH_POW: *result = NUM_VAL(pow(x, y)); break;
+    default:
+      if (y == 0) {
+        return "Division by zero.";
+      }
+      *result = NUM_VAL(op == ARITH_DIV ? x / y : fmod(x, y));
+      break;
+  }
+  return NULL;
+}
+
+// A number only equals one of its own kind, so 1 == 1.0 is false.
+// Ordering compares numbers of either kind by value.
 bool valsEqu(Value a, Value b) {
   #ifdef NAN_BOXING
   if (IS_NUM(a) && IS_NUM(b)) {
@@ -68,6 +179,7 @@ bool valsEqu(Value a, Value b) {
     case VAL_BOOL: return AS_BOOL(a) == AS_BOOL(b);
     case VAL_NIL: return true;
     case VAL_NUM: return AS_NUM(a) == AS_NUM(b);
+    case VAL_INT: return AS_INT(a) == AS_INT(b);
     case VAL_OBJ: return AS_OBJ(a) == AS_OBJ(b);
     default: return false;
   }
@@ -88,6 +200,7 @@ bool valsNotEqu(Value a, Value b) {
     case VAL_BOOL: return AS_BOOL(a) != AS_BOOL(b);
     case VAL_NIL: return true;
     case VAL_NUM: return AS_NUM(a) != AS_NUM(b);
+    case VAL_INT: return AS_INT(a) != AS_INT(b);
     case VAL_OBJ: return AS_OBJ(a) != AS_OBJ(b);
     default: return true;
   }
@@ -95,10 +208,10 @@ bool valsNotEqu(Value a, Value b) {
 }
 
 bool valsGtEqu(Value a, Value b) {
-  #ifdef NAN_BOXING
-  if (IS_NUM(a) && IS_NUM(b)) {
-    return AS_NUM(a) >= AS_NUM(b);
+  if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    return AS_NUMBER(a) >= AS_NUMBER(b);
   }
+  #ifdef NAN_BOXING
   return a >= b;
   #else
   // If the types are not the same,
@@ -119,10 +232,10 @@ bool valsGtEqu(Value a, Value b) {
 }
 
 bool valsLtEqu(Value a, Value b) {
-  #ifdef NAN_BOXING
-  if (IS_NUM(a) && IS_NUM(b)) {
-    return AS_NUM(a) <= AS_NUM(b);
+  if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    return AS_NUMBER(a) <= AS_NUMBER(b);
   }
+  #ifdef NAN_BOXING
   return a <= b;
   #else
   // If the types are not the same,
@@ -141,10 +254,10 @@ bool valsLtEqu(Value a, Value b) {
 }
 
 bool valsGt(Value a, Value b) {
-  #ifdef NAN_BOXING
-  if (IS_NUM(a) && IS_NUM(b)) {
-    return AS_NUM(a) > AS_NUM(b);
+  if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    return AS_NUMBER(a) > AS_NUMBER(b);
   }
+  #ifdef NAN_BOXING
   return a > b;
   #else
   if (a.type != b.type) {
@@ -161,10 +274,10 @@ bool valsGt(Value a, Value b) {
 }
 
 bool valsLt(Value a, Value b) {
-  #ifdef NAN_BOXING
-  if (IS_NUM(a) && IS_NUM(b)) {
-    return AS_NUM(a) < AS_NUM(b);
+  if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    return AS_NUMBER(a) < AS_NUMBER(b);
   }
+  #ifdef NAN_BOXING
   return a < b;
   #else
   if (a.type != b.type) {
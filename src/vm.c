@@ -1,11 +1,19 @@
+// For MAP_ANONYMOUS under -std=c17.
+#define _DEFAULT_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
 #include <math.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 #include "include/common.h"
 #include "include/vm.h"
 #include "include/compiler.h"
 #include "include/debug.h"
+#include "include/jit.h"
 #include "include/memory.h"
 #include "include/object.h"
 #include "include/memory.h"
@@ -61,8 +69,8 @@ static Value printNative(int argCount, Value* args) {
   if (IS_BOOL(args[0])) {
     printf("%s", AS_BOOL(args[0]) ? "true" : "false");
   }
-  else if (IS_NUM(args[0])) {
-    printf("%.16g", AS_NUM(args[0]));
+  else if (IS_NUMBER(args[0])) {
+    printValue(args[0]);
   }
   else if (IS_NIL(args[0])) {
     printf("nil");
@@ -88,8 +96,9 @@ static Value printlnNative(int argCount, Value* args) {
   if (IS_BOOL(args[0])) {
     printf("%s\n", AS_BOOL(args[0]) ? "true" : "false");
   }
-  else if (IS_NUM(args[0])) {
-    printf("%.16g\n", AS_NUM(args[0]));
+  else if (IS_NUMBER(args[0])) {
+    printValue(args[0]);
+    printf("\n");
   }
   else if (IS_NIL(args[0])) {
     printf("nil\n");
@@ -123,6 +132,12 @@ static Value readNumNative(int argCount, Value* args) {
   }
   double input;
   scanf("%lf", &input);
+  if (
+    input >= INT_VAL_MIN && input <= INT_VAL_MAX &&
+    input == (int64_t)input
+  ) {
+    return INT_VAL((int64_t)input);
+  }
   return NUM_VAL(input);
 }
 
@@ -141,7 +156,7 @@ static Value delNative(int argCount, Value* args) {
     // Add later.
   }
   ObjList* list = AS_LIST(args[0]);
-  int index = AS_NUM(args[1]);
+  int index = IS_INT(args[1]) ? (int)AS_INT(args[1]) : -1;
   if (!isValidListIndex(list, index)) {
     // Add later.
   }
@@ -151,6 +166,108 @@ static Value delNative(int argCount, Value* args) {
 
 // End natives
 
+static void stackAllocFail() {
+  fprintf(stderr, "Failure to allocate or grow the VM stack.\n");
+  exit(1);
+}
+
+// The value stack gets its own mapping with an inaccessible page
+// right after it, so a push past the end faults on the spot
+// instead of scribbling over the heap. That keeps bounds checks
+// out of push; call() makes sure each new frame has room instead.
+// One spare slot sits below the bottom, because run() reloads its
+// cached top value from sp[-1] even when the stack empties.
+#ifdef _WIN32
+static Value* mapStack(int capacity) {
+  Value* stack = (Value*)malloc(sizeof(Value) * (capacity + 1));
+  if (stack == NULL) {
+    stackAllocFail();
+  }
+  return stack + 1;
+}
+
+static void unmapStack(Value* stack, int capacity) {
+  free(stack - 1);
+}
+#else
+static size_t stackBytes(int capacity) {
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t bytes = sizeof(Value) * (capacity + 1);
+  return (bytes + page - 1) / page * page;
+}
+
+static Value* mapStack(int capacity) {
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t bytes = stackBytes(capacity);
+  char* region = mmap(
+    NULL, bytes + page,
+    PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS,
+    -1, 0
+  );
+  if (region == MAP_FAILED) {
+    stackAllocFail();
+  }
+  if (mprotect(region + bytes, page, PROT_NONE) != 0) {
+    stackAllocFail();
+  }
+  // Line the end of the stack up with the guard page.
+  return (Value*)(region + bytes) - capacity;
+}
+
+static void unmapStack(Value* stack, int capacity) {
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  char* region = (char*)(stack + capacity) - stackBytes(capacity);
+  munmap(region, stackBytes(capacity) + page);
+}
+#endif
+
+// Moves the value stack to a mapping with room for 'slots' more
+// values, rebasing everything that points into it: frame slots,
+// open upvalues and the top.
+static void growStack(int slots) {
+  int needed = (int)(vm.stackTop - vm.stack) + slots;
+  int capacity = vm.stackCapacity;
+  while (capacity < needed) {
+    capacity *= 2;
+  }
+  Value* stack = mapStack(capacity);
+  memcpy(stack, vm.stack, sizeof(Value) * (vm.stackTop - vm.stack));
+  for (int i = 0; i < vm.frameCount; i++) {
+    vm.frames[i].slots = stack + (vm.frames[i].slots - vm.stack);
+  }
+  for (
+    ObjUpval* upval = vm.openUpvals;
+    upval != NULL;
+    upval = upval->next
+  ) {
+    upval->location = stack + (upval->location - vm.stack);
+  }
+  vm.stackTop = stack + (vm.stackTop - vm.stack);
+  unmapStack(vm.stack, vm.stackCapacity);
+  vm.stack = stack;
+  vm.stackCapacity = capacity;
+}
+
+// Each frame gets room for the most values the compiler found it
+// can hold, plus STACK_SLACK; pushes within that never check bounds.
+static void reserveStack(int slots) {
+  if (vm.stackTop + slots > vm.stack + vm.stackCapacity) {
+    growStack(slots);
+  }
+}
+
+static void growFrames() {
+  vm.frameCapacity *= 2;
+  vm.frames = (CallFrame*)realloc(
+    vm.frames,
+    sizeof(CallFrame) * vm.frameCapacity
+  );
+  if (vm.frames == NULL) {
+    stackAllocFail();
+  }
+}
+
 static void resetStack() {
   vm.stackTop = vm.stack;
   vm.frameCount = 0;
@@ -164,6 +281,12 @@ static void runtimeErr(const char* format, ...) {
   va_end(args);
   fputs("\n", stderr);
   for (int i = vm.frameCount - 1; i >= 0; i--) {
+    // Deep recursion would bury the error, so only the innermost
+    // and outermost frames are shown.
+    if (i == vm.frameCount - TRACE_EDGE - 1 && i >= TRACE_EDGE) {
+      fprintf(stderr, "\n[...] %d more frames\n", i - TRACE_EDGE + 1);
+      i = TRACE_EDGE - 1;
+    }
     CallFrame* frame = &vm.frames[i];
     ObjFunc* func = frame->closure->func;
     size_t instruction = frame->ip - func->chunk.code - 1;
@@ -181,15 +304,54 @@ static void runtimeErr(const char* format, ...) {
   resetStack();
 }
 
+int globalSlot(ObjStr* name) {
+  Value index;
+  if (tableGet(&vm.globalSlots, name, &index)) {
+    return (int)AS_NUM(index);
+  }
+  // Growing the arrays can collect, and nothing else holds 'name'.
+  push(OBJ_VAL(name));
+  if (vm.globalCount == vm.globalCapacity) {
+    int oldCapacity = vm.globalCapacity;
+    vm.globalCapacity = GROW_CAPACITY(oldCapacity);
+    vm.globals = GROW_ARRAY(
+      Value,
+      vm.globals,
+      oldCapacity,
+      vm.globalCapacity
+    );
+    vm.globalNames = GROW_ARRAY(
+      ObjStr*,
+      vm.globalNames,
+      oldCapacity,
+      vm.globalCapacity
+    );
+  }
+  int slot = vm.globalCount++;
+  vm.globals[slot] = UNDEFINED_VAL;
+  vm.globalNames[slot] = name;
+  tableSet(&vm.globalSlots, name, NUM_VAL(slot));
+  pop();
+  return slot;
+}
+
 static void defNative(const char* name, NativeFn func) {
   push(OBJ_VAL(copyStr(name, (int)strlen(name))));
   push(OBJ_VAL(newNative(func)));
-  tableSet(&vm.globals, AS_STR(vm.stack[0]), vm.stack[1]);
+  int slot = globalSlot(AS_STR(vm.stack[0]));
+  vm.globals[slot] = vm.stack[1];
   pop();
   pop();
 }
 
 void initVM() {
+  vm.frameCapacity = FRAMES_INIT;
+  vm.frames = (CallFrame*)malloc(sizeof(CallFrame) * vm.frameCapacity);
+  if (vm.frames == NULL) {
+    stackAllocFail();
+  }
+  vm.stackCapacity = STACK_INIT;
+  vm.stack = mapStack(vm.stackCapacity);
   resetStack();
   vm.objects = NULL;
   vm.allocatedBytes = 0;
@@ -197,10 +359,18 @@ void initVM() {
   vm.grayCount = 0;
   vm.grayCapacity = 0;
   vm.grayStack = NULL;
-  initTable(&vm.globals);
+  vm.globals = NULL;
+  vm.globalNames = NULL;
+  vm.globalCount = 0;
+  vm.globalCapacity = 0;
+  initTable(&vm.globalSlots);
   initTable(&vm.strings);
   vm.initString = NULL;
+  vm.rootShape = NULL;
+  vm.selectorCount = 0;
   vm.initString = copyStr("init", 4);
+  vm.cacheEpoch = 0;
+  vm.rootShape = newShape(NULL, NULL);
   // defNative("type", typeNative);
   defNative("append", appendNative);
   defNative("del", delNative);
@@ -211,10 +381,23 @@ void initVM() {
 }
 
 void freeVM() {
-  freeTable(&vm.globals);
+  #ifdef DEBUG_PROFILE_OPS
+  printOpProfile();
+  #endif
+  FREE_ARRAY(Value, vm.globals, vm.globalCapacity);
+  FREE_ARRAY(ObjStr*, vm.globalNames, vm.globalCapacity);
+  vm.globals = NULL;
+  vm.globalNames = NULL;
+  vm.globalCount = 0;
+  vm.globalCapacity = 0;
+  freeTable(&vm.globalSlots);
   freeTable(&vm.strings);
   vm.initString = NULL;
+  freeShape(vm.rootShape);
+  vm.rootShape = NULL;
   freeObjs();
+  free(vm.frames);
+  unmapStack(vm.stack, vm.stackCapacity);
 }
 
 void push(Value value) {
@@ -231,7 +414,7 @@ static Value peek(int distance) {
   return vm.stackTop[-1 - distance];
 }
 
-static bool call(ObjClosure* closure, int argCount) {
+static bool checkArity(ObjClosure* closure, int argCount) {
   if (
     argCount != closure->func->arity &&
     closure->func->arity == 1
@@ -249,14 +432,38 @@ static bool call(ObjClosure* closure, int argCount) {
     );
     return false;
   }
+  return true;
+}
+
+#ifdef JIT
+// Compiles a function to native code once it has been called
+// often enough.
+static inline void countCall(ObjFunc* func) {
+  if (func->calls < JIT_THRESHOLD && ++func->calls == JIT_THRESHOLD) {
+    jitCompile(func);
+  }
+}
+#endif
+
+static bool call(ObjClosure* closure, int argCount) {
+  if (!checkArity(closure, argCount)) {
+    return false;
+  }
   if (vm.frameCount == FRAMES_MAX) {
     runtimeErr("Stack overflow.");
     return false;
   }
+  if (vm.frameCount == vm.frameCapacity) {
+    growFrames();
+  }
+  reserveStack(closure->func->maxStack + STACK_SLACK);
   CallFrame* frame = &vm.frames[vm.frameCount++];
   frame->closure = closure;
   frame->ip = closure->func->chunk.code;
   frame->slots = vm.stackTop - argCount - 1;
+  #ifdef JIT
+  countCall(closure->func);
+  #endif
   return true;
 }
 
@@ -271,13 +478,8 @@ static bool callVal(Value callee, int argCount) {
       case OBJ_CLASS: {
         ObjClass* class = AS_CLASS(callee);
         vm.stackTop[-argCount - 1] = OBJ_VAL(newInstance(class));
-        Value initializer;
-        if (tableGet(
-          &class->methods,
-          vm.initString,
-          &initializer
-        )) {
-          return call(AS_CLOSURE(initializer), argCount);
+        if (class->init != NULL) {
+          return call(class->init, argCount);
         }
         else if (argCount != 0) {
           runtimeErr(
@@ -305,37 +507,151 @@ static bool callVal(Value callee, int argCount) {
   return false;
 }
 
+static CacheEntry* cacheFind(
+  InlineCache* cache,
+  Shape* shape,
+  ObjClass* class
+) {
+  if (cache == NULL) {
+    return NULL;
+  }
+  if (cache->epoch != vm.cacheEpoch) {
+    cache->count = 0;
+    cache->epoch = vm.cacheEpoch;
+    return NULL;
+  }
+  for (int i = 0; i < cache->count; i++) {
+    CacheEntry* entry = &cache->entries[i];
+    if (
+      entry->shape == shape &&
+      (entry->method == NULL || entry->class == class)
+    ) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+// Only call after a cacheFind() miss, which brings the epoch up
+// to date.
+static void cacheAdd(InlineCache* cache, CacheEntry entry) {
+  if (cache != NULL && cache->count < CACHE_WAYS) {
+    cache->entries[cache->count++] = entry;
+  }
+}
+
+// Looks 'name' up on an instance, fields before methods. Sets
+// '*method' for a method, or else '*field'. Dictionary-mode
+// instances aren't cached.
+static bool lookupProp(
+  InlineCache* cache,
+  ObjInstance* instance,
+  ObjStr* name,
+  Value* field,
+  ObjClosure** method
+) {
+  Shape* shape = instance->shape;
+  CacheEntry* entry = shape == NULL
+    ? NULL : cacheFind(cache, shape, instance->class);
+  if (entry != NULL) {
+    *method = entry->method;
+    if (entry->method == NULL) {
+      *field = instance->slots[entry->slot];
+    }
+    return true;
+  }
+  *method = NULL;
+  if (instanceGet(instance, name, field)) {
+    if (shape != NULL) {
+      CacheEntry miss = {shape, NULL, shapeSlot(shape, name), NULL, NULL};
+      cacheAdd(cache, miss);
+    }
+    return true;
+  }
+  Value value;
+  if (!classGet(instance->class, name, &value)) {
+    return false;
+  }
+  *method = AS_CLOSURE(value);
+  if (shape != NULL) {
+    CacheEntry miss = {shape, instance->class, -1, NULL, *method};
+    cacheAdd(cache, miss);
+  }
+  return true;
+}
+
 static bool invokeFromClass(
+  InlineCache* cache,
   ObjClass* class,
   ObjStr* name,
   int argCount
 ) {
+  CacheEntry* entry = cacheFind(cache, NULL, class);
+  if (entry != NULL) {
+    return call(entry->method, argCount);
+  }
   Value method;
-  if (!tableGet(&class->methods, name, &method)) {
+  if (!classGet(class, name, &method)) {
     runtimeErr("Property '%s' is undefined.", name->chars);
     return false;
   }
+  CacheEntry miss = {NULL, class, -1, NULL, AS_CLOSURE(method)};
+  cacheAdd(cache, miss);
   return call(AS_CLOSURE(method), argCount);
 }
 
-static bool invoke(ObjStr* name, int argCount) {
+// Does what a getter or setter would, without its frame. Returns
+// false to leave anything that could go wrong to call() instead.
+static bool runAccessor(
+  ObjFunc* func,
+  ObjInstance* instance,
+  int argCount
+) {
+  Value result = NIL_VAL;
+  if (func->access == ACCESS_GET) {
+    if (argCount != 0 || !instanceGet(instance, func->field, &result)) {
+      return false;
+    }
+  }
+  else if (argCount == 1) {
+    instanceSet(instance, func->field, peek(0));
+  }
+  else {
+    return false;
+  }
+  vm.stackTop -= argCount + 1;
+  push(result);
+  return true;
+}
+
+static bool invoke(InlineCache* cache, ObjStr* name, int argCount) {
   Value receiver = peek(argCount);
   if (!IS_INSTANCE(receiver)) {
     runtimeErr("Only instances can have methods.");
     return false;
   }
-  ObjInstance* instance = AS_INSTANCE(receiver);
-  Value value;
-  if (tableGet(&instance->fields, name, &value)) {
-    vm.stackTop[-argCount - 1] = value;
-    return callVal(value, argCount);
+  Value field;
+  ObjClosure* method;
+  if (!lookupProp(cache, AS_INSTANCE(receiver), name, &field, &method)) {
+    runtimeErr("Property '%s' is undefined.", name->chars);
+    return false;
+  }
+  if (method != NULL) {
+    if (
+      method->func->access != ACCESS_NONE &&
+      runAccessor(method->func, AS_INSTANCE(receiver), argCount)
+    ) {
+      return true;
+    }
+    return call(method, argCount);
   }
-  return invokeFromClass(instance->class, name, argCount);
+  vm.stackTop[-argCount - 1] = field;
+  return callVal(field, argCount);
 }
 
 static bool bindMethod(ObjClass* class, ObjStr* name) {
   Value method;
-  if (!tableGet(&class->methods, name, &method)) {
+  if (!classGet(class, name, &method)) {
     runtimeErr("Property '%s' is undefined.", name->chars);
     return false;
   }
@@ -383,25 +699,122 @@ static void closeUpvals(Value* last) {
 static void defMethod(ObjStr* name) {
   Value method = peek(0);
   ObjClass* class = AS_CLASS(peek(1));
-  tableSet(&class->methods, name, method);
+  classSet(class, name, method);
+  vm.cacheEpoch++;
+  pop();
+}
+
+static bool getProp(InlineCache* cache, ObjStr* name) {
+  if (!IS_INSTANCE(peek(0))) {
+    runtimeErr("Only instances can have properties.");
+    return false;
+  }
+  Value field;
+  ObjClosure* method;
+  if (!lookupProp(cache, AS_INSTANCE(peek(0)), name, &field, &method)) {
+    runtimeErr("Property '%s' is undefined.", name->chars);
+    return false;
+  }
+  if (method != NULL) {
+    field = OBJ_VAL(newBoundMethod(peek(0), method));
+  }
+  pop();
+  push(field);
+  return true;
+}
+
+// Stores to a field the instance already has, or adds it along a
+// shape transition the site has seen before.
+static void setField(
+  InlineCache* cache,
+  ObjInstance* instance,
+  ObjStr* name,
+  Value value
+) {
+  Shape* shape = instance->shape;
+  if (shape == NULL) {
+    instanceSet(instance, name, value);
+    return;
+  }
+  CacheEntry* entry = cacheFind(cache, shape, instance->class);
+  if (entry != NULL && entry->next == NULL) {
+    instance->slots[entry->slot] = value;
+    return;
+  }
+  if (entry != NULL && entry->slot < instance->slotCapacity) {
+    instance->slots[entry->slot] = value;
+    instance->shape = entry->next;
+    if (entry->slot >= instance->class->fieldCount) {
+      instance->class->fieldCount = entry->slot + 1;
+    }
+    return;
+  }
+  int slot = shapeSlot(shape, name);
+  instanceSet(instance, name, value);
+  if (entry != NULL) {
+    return;
+  }
+  if (slot != -1) {
+    CacheEntry miss = {shape, NULL, slot, NULL, NULL};
+    cacheAdd(cache, miss);
+  }
+  else if (instance->shape != NULL) {
+    CacheEntry miss = {shape, NULL, shape->count, instance->shape, NULL};
+    cacheAdd(cache, miss);
+  }
+}
+
+// Setting a field on a class stores it with the class's methods.
+static bool setProp(InlineCache* cache, ObjStr* name) {
+  if (IS_CLASS(peek(1))) {
+    classSet(AS_CLASS(peek(1)), name, peek(0));
+    vm.cacheEpoch++;
+  }
+  else if (IS_INSTANCE(peek(1))) {
+    setField(cache, AS_INSTANCE(peek(1)), name, peek(0));
+  }
+  else {
+    runtimeErr("Only instances and classes can have fields.");
+    return false;
+  }
+  Value value = pop();
   pop();
+  push(value);
+  return true;
 }
 
 static bool falsey(Value value) {
   return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
+// Reads a list index: an integer, or a double that holds a whole
+// number, such as 'n / 2' gives.
+static inline bool toIndex(Value value, int64_t* index) {
+  if (IS_INT(value)) {
+    *index = AS_INT(value);
+    return true;
+  }
+  if (!IS_NUM(value)) {
+    return false;
+  }
+  double number = AS_NUM(value);
+  if (number < INT_VAL_MIN || number > INT_VAL_MAX) {
+    return false;
+  }
+  *index = (int64_t)number;
+  return *index == number;
+}
+
 static ObjStr* toStr(Value value) {
   ObjStr* str;
   if (IS_STR(value)) {
     str = AS_STR(value);
   }
-  else if (IS_NUM(value)) {
-    char nstr[24];
-    double num = AS_NUM(value);
-    sprintf(nstr, "%.16g", num);
+  else if (IS_NUMBER(value)) {
+    char nstr[NUM_CHARS_MAX];
+    int length = formatNum(value, nstr);
     str =
-      copyStr(nstr, strlen(nstr));
+      copyStr(nstr, length);
   }
   else if (IS_BOOL(value)) {
     str =
@@ -431,420 +844,1944 @@ static void concat() {
   push(OBJ_VAL(result));
 }
 
-static InterpretResult run() {
-  CallFrame* frame = &vm.frames[vm.frameCount - 1];
-  register uint8_t* ip = frame->ip;
-  #define READ_BYTE() (*ip++)
-  #define READ_CONST() \
-    (frame->closure->func->chunk.constants.values[READ_BYTE()])
-  #define READ_SHORT() \
-    (ip += 2, \
-    (uint16_t)((ip[-2] << 8) | ip[-1]))
-  #define READ_STR() AS_STR(READ_CONST())
-  #define BINARY_OP(valType, op) \
-    do { \
-      if (!IS_NUM(peek(0)) || !IS_NUM(peek(1))) { \
-        frame->ip = ip; \
-        runtimeErr("Operands must be numbers."); \
-        return INTERPRET_RUNTIME_ERROR; \
-      } \
-      double b = AS_NUM(pop()); \
-      double a = AS_NUM(pop()); \
-      push(valType(a op b)); \
-    } while (false)
-  
-  for (;;) {
-    #ifdef DEBUG_TRACE_EXEC
-    printf("\t\t");
-    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
-      printf("[ ");
-      printValue(*slot);
-      printf(" ]");
+// Whether two values are numbers of the same kind, which the
+// quickened opcodes handle inline.
+static inline bool sameKindNums(Value a, Value b) {
+  return (IS_INT(a) && IS_INT(b)) || (IS_NUM(a) && IS_NUM(b));
+}
+
+// The numArith() operation an arithmetic opcode does.
+static inline ArithOp arithOf(OpCode op) {
+  switch (op) {
+    case OP_SUB: return ARITH_SUB;
+    case OP_MUL: return ARITH_MUL;
+    case OP_DIV: return ARITH_DIV;
+    case OP_MOD: return ARITH_MOD;
+    case OP_POW: return ARITH_POW;
+    case OP_BIT_AND: return ARITH_AND;
+    case OP_BIT_OR: return ARITH_OR;
+    case OP_BIT_XOR: return ARITH_XOR;
+    case OP_SHL: return ARITH_SHL;
+    case OP_SHR: return ARITH_SHR;
+    default: return ARITH_ADD;
+  }
+}
+
+// -value for a number of either kind. The most negative integer's
+// negation is one past the largest, so it becomes a double.
+static inline Value negate(Value value) {
+  if (IS_INT(value) && AS_INT(value) != INT_VAL_MIN) {
+    return INT_VAL(-AS_INT(value));
+  }
+  return NUM_VAL(-AS_NUMBER(value));
+}
+
+// Replaces the top two values on the stack with the result of a
+// binary arithmetic or bitwise opcode, for whatever kinds of value
+// they are. Adding a string to anything concatenates.
+static bool binaryArith(OpCode op) {
+  Value b = peek(0);
+  Value a = peek(1);
+  bool isAdd = op == OP_ADD || op == OP_ADD_NUM;
+  if (isAdd && (IS_STR(a) || IS_STR(b))) {
+    concat();
+    return true;
+  }
+  if (isAdd && (!IS_NUMBER(a) || !IS_NUMBER(b))) {
+    runtimeErr("Invalid types for operator.");
+    return false;
+  }
+  Value result;
+  const char* error = numArith(arithOf(op), a, b, &result);
+  if (error != NULL) {
+    runtimeErr("%s", error);
+    return false;
+  }
+  vm.stackTop -= 2;
+  push(result);
+  return true;
+}
+
+// Slow path for the register instructions, which only handle
+// numbers of one kind inline, and integers only while they stay
+// in range. Leaves the result on the stack.
+static bool registerArith(OpCode op, Value a, Value b) {
+  push(a);
+  push(b);
+  return binaryArith(op);
+}
+
+// Loop test for OP_FOR_NUM, with the comparison taken from its
+// mode operand.
+static bool forNumCompare(uint8_t mode, Value a, Value b) {
+  if (IS_INT(a) && IS_INT(b)) {
+    switch (mode & FOR_NUM_CMP_MASK) {
+      case FOR_NUM_LT: return AS_INT(a) < AS_INT(b);
+      case FOR_NUM_LT_EQU: return AS_INT(a) <= AS_INT(b);
+      case FOR_NUM_GT: return AS_INT(a) > AS_INT(b);
+      default: return AS_INT(a) >= AS_INT(b);
     }
-    printf("\n");
-    disassembleInstruction(
-      &frame->closure->func->chunk,
-      (int)(frame->ip - frame->closure->func->chunk.code)
+  }
+  if (IS_NUM(a) && IS_NUM(b)) {
+    switch (mode & FOR_NUM_CMP_MASK) {
+      case FOR_NUM_LT: return AS_NUM(a) < AS_NUM(b);
+      case FOR_NUM_LT_EQU: return AS_NUM(a) <= AS_NUM(b);
+      case FOR_NUM_GT: return AS_NUM(a) > AS_NUM(b);
+      default: return AS_NUM(a) >= AS_NUM(b);
+    }
+  }
+  switch (mode & FOR_NUM_CMP_MASK) {
+    case FOR_NUM_LT: return valsLt(a, b);
+    case FOR_NUM_LT_EQU: return valsLtEqu(a, b);
+    case FOR_NUM_GT: return valsGt(a, b);
+    default: return valsGtEqu(a, b);
+  }
+}
+
+static inline uint8_t seenKind(Value value) {
+  if (IS_NUM(value)) {
+    return SEEN_NUM;
+  }
+  if (IS_INT(value)) {
+    return SEEN_INT;
+  }
+  if (IS_BOOL(value)) {
+    return SEEN_BOOL;
+  }
+  if (IS_NIL(value)) {
+    return SEEN_NIL;
+  }
+  switch (OBJ_TYPE(value)) {
+    case OBJ_STR: return SEEN_STR;
+    case OBJ_LIST: return SEEN_LIST;
+    case OBJ_INSTANCE: return SEEN_INSTANCE;
+    default: return SEEN_OTHER;
+  }
+}
+
+static inline void recordTarget(Feedback* feedback, Obj* target) {
+  if (feedback->target == NULL) {
+    feedback->target = target;
+  }
+  else if (feedback->target != target) {
+    feedback->polymorphic = true;
+  }
+}
+
+// Records a receiver's kind, and its class if it is an instance.
+static inline void recordReceiver(Feedback* feedback, Value receiver) {
+  feedback->left |= seenKind(receiver);
+  if (IS_INSTANCE(receiver)) {
+    recordTarget(feedback, (Obj*)AS_INSTANCE(receiver)->class);
+  }
+}
+
+// Records a callee by the code it runs, so a closure made afresh
+// each time still looks like the same callee.
+static inline void recordCallee(Feedback* feedback, Value callee) {
+  if (!IS_OBJ(callee)) {
+    return;
+  }
+  switch (OBJ_TYPE(callee)) {
+    case OBJ_CLOSURE:
+      recordTarget(feedback, (Obj*)AS_CLOSURE(callee)->func);
+      break;
+    case OBJ_BOUND_METHOD:
+      recordTarget(
+        feedback, (Obj*)AS_BOUND_METHOD(callee)->method->func
       );
-    #endif
-    uint8_t instruction;
-    switch (instruction = READ_BYTE()) {
-      case OP_CONST: {
-        Value constant = READ_CONST();
-        push(constant);
-        break;
-      }
-      case OP_NIL: push(NIL_VAL); break;
-      case OP_TRUE: push(BOOL_VAL(true)); break;
-      case OP_FALSE: push(BOOL_VAL(false)); break;
-      case OP_DUP: push(peek(0)); break;
-      case OP_POP: pop(); break;
-      case OP_GET_LOCAL: {
-        uint8_t slot = READ_BYTE();
-        push(frame->slots[slot]);
-        break;
-      }
-      case OP_SET_LOCAL: {
-        uint8_t slot = READ_BYTE();
-        frame->slots[slot] = peek(0);
-        break;
-      }
-      case OP_GET_GLOBAL: {
-        ObjStr* name = READ_STR();
-        Value value;
-        if (!tableGet(&vm.globals, name, &value)) {
-          frame->ip = ip;
-          runtimeErr("Variable '%s' is undefined.", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        push(value);
-        break;
-      }
-      case OP_DEF_GLOBAL: {
-        ObjStr* name = READ_STR();
-        tableSet(&vm.globals, name, peek(0));
-        pop();
-        break;
-      }
-      case OP_SET_GLOBAL: {
-        ObjStr* name = READ_STR();
-        if (tableSet(&vm.globals, name, peek(0))) {
-          tableDel(&vm.globals, name);
-          frame->ip = ip;
-          runtimeErr("'%s' is undefined.", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        break;
-      }
-      case OP_GET_UPVAL: {
-        uint8_t slot = READ_BYTE();
-        push(*frame->closure->upvals[slot]->location);
-        break;
-      }
-      case OP_SET_UPVAL: {
-        uint8_t slot = READ_BYTE();
-        *frame->closure->upvals[slot]->location = peek(0);
-        break;
-      }
-      case OP_GET_PROP: {
-        if (!IS_INSTANCE(peek(0))) {
-          runtimeErr("Only instances can have properties.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        ObjInstance* instance = AS_INSTANCE(peek(0));
-        ObjStr* name = READ_STR();
-        Value value;
-        if (tableGet(&instance->fields, name, &value)) {
-          pop();
-          push(value);
-          break;
-        }
-        if (!bindMethod(instance->class, name)) {
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        break;
-      }
-      case OP_SET_PROP: {
-        if (!IS_INSTANCE(peek(1)) && !IS_CLASS(peek(1))) {
-          runtimeErr("Only instances and classes can have fields.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        ObjInstance* instance = AS_INSTANCE(peek(1));
-        tableSet(&instance->fields, READ_STR(), peek(0));
-        Value value = pop();
-        pop();
-        push(value);
-        break;
-      }
-      case OP_GET_SUPER: {
-        ObjStr* name = READ_STR();
-        ObjClass* superclass = AS_CLASS(pop());
-        if (!bindMethod(superclass, name)) {
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        break;
-      }
-      case OP_BUILD_LIST: {
-        ObjList* list = newList();
-        uint8_t itemCount = READ_BYTE();
-        push(OBJ_VAL(list));
-        for (int i = itemCount; i > 0; i--) {
-          appendToList(list, peek(i));
-        }
-        pop();
-        while (itemCount-- > 0) {
-          pop();
-        }
-        push(OBJ_VAL(list));
-        break;
-      }
-      case OP_INDEX_SUB: {
-        Value index = pop();
-        Value list = pop();
-        Value result;
+      break;
+    default:
+      recordTarget(feedback, AS_OBJ(callee));
+      break;
+  }
+}
 
-        if (!IS_LIST(list)) {
-          runtimeErr("Invalid type to index.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        ObjList* olist = AS_LIST(list);
-        if (!IS_NUM(index)) {
-          runtimeErr("List index must be a number.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        int oindex = AS_NUM(index);
-        if (!isValidListIndex(olist, oindex)) {
-          runtimeErr("List index is out of range.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        result = indexFromList(olist, AS_NUM(index));
-        push(result);
-        break;
-      }
-      case OP_STORE_SUB: {
-        Value item = pop();
-        Value index = pop();
-        Value list = pop();
+// The entry an OP_SWITCH_INT picks for 'value': 0 for its miss
+// offset or k for its k-th case. 'table' follows the opcode.
+static inline int switchIntEntry(uint8_t* table, Value value) {
+  if (!IS_INT(value)) {
+    return 0;
+  }
+  int32_t min = (int32_t)(
+    ((uint32_t)table[0] << 24) |
+    (table[1] << 16) | (table[2] << 8) | table[3]
+  );
+  int count = (table[4] << 8) | table[5];
+  int64_t index = AS_INT(value) - min;
+  if (index >= 0 && index < count) {
+    return (int)index + 1;
+  }
+  return 0;
+}
 
-        if (!IS_LIST(list)) {
-          runtimeErr(
-            "Cannot store value in something other than a list."
-          );
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        ObjList* olist = AS_LIST(list);
-        if (!IS_NUM(index)) {
-          runtimeErr("List index must be a number.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        int oindex = AS_NUM(index);
-        if (!isValidListIndex(olist, oindex)) {
-          runtimeErr("Invalid list index.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        storeToList(olist, oindex, item);
-        push(item);
-        break;
-      }
-      case OP_EQU: {
-        Value b = pop();
-        Value a = pop();
-        push(BOOL_VAL(valsEqu(a, b)));
-        break;
-      }
-      case OP_GT: {
-        Value b = pop();
-        Value a = pop();
-        push(BOOL_VAL(valsGt(a, b)));
-        break;
-      }
-      case OP_LT: {
-        Value b = pop();
-        Value a = pop();
-        push(BOOL_VAL(valsLt(a, b)));
-        break;
-      }
-      case OP_GT_EQU: {
-        Value b = pop();
-        Value a = pop();
-        push(BOOL_VAL(valsGtEqu(a, b)));
-        break;
+// As switchIntEntry(), for OP_SWITCH_STR.
+static inline int switchStrEntry(
+  Value* constants,
+  uint8_t* table,
+  Value value
+) {
+  if (!IS_STR(value)) {
+    return 0;
+  }
+  int shift = table[0];
+  int size = (table[1] << 8) | table[2];
+  int index = (AS_STR(value)->hash >> shift) & (size - 1);
+  uint8_t* entry = &table[5 + index * 5];
+  uint32_t constant = (entry[0] << 16) | (entry[1] << 8) | entry[2];
+  // Strings are interned, so equal strings are the same object.
+  if (
+    constant != SWITCH_EMPTY &&
+    AS_OBJ(constants[constant]) == AS_OBJ(value)
+  ) {
+    return index + 1;
+  }
+  return 0;
+}
+
+// The handlers below are shared by run() and jitStep(). Those that
+// work on the stack use the VM's own, so run() stores its cached top
+// first. The ones its hot paths call return their error, as
+// numArith() does, so run() only has to note where it is when one
+// fails; the rest report their own.
+
+// Reports global 'index' being read, or assigned to, before its
+// definition has run.
+static void undefinedErr(uint32_t index, bool assigning) {
+  const char* name = vm.globalNames[index]->chars;
+  if (assigning) {
+    runtimeErr("'%s' is undefined.", name);
+  }
+  else {
+    runtimeErr("Variable '%s' is undefined.", name);
+  }
+}
+
+// Replaces the top 'count' values on the stack with a list of them.
+static void buildList(int count) {
+  ObjList* list = newList();
+  push(OBJ_VAL(list));
+  for (int i = count; i > 0; i--) {
+    appendToList(list, peek(i));
+  }
+  vm.stackTop -= count + 1;
+  push(OBJ_VAL(list));
+}
+
+// Appends the next batch of a long list literal, the top 'count'
+// values on the stack, to the list below it.
+static void extendList(int count) {
+  ObjList* list = AS_LIST(peek(count));
+  for (int i = count; i > 0; i--) {
+    appendToList(list, peek(i - 1));
+  }
+  vm.stackTop -= count;
+}
+
+static inline const char* indexSub(
+  Value list,
+  Value index,
+  Value* item
+) {
+  if (!IS_LIST(list)) {
+    return "Invalid type to index.";
+  }
+  int64_t at;
+  if (!toIndex(index, &at)) {
+    return "List index must be an integer.";
+  }
+  if (!isValidListIndex(AS_LIST(list), at)) {
+    return "List index is out of range.";
+  }
+  *item = indexFromList(AS_LIST(list), (int)at);
+  return NULL;
+}
+
+static inline const char* storeSub(Value list, Value index, Value item) {
+  if (!IS_LIST(list)) {
+    return "Cannot store value in something other than a list.";
+  }
+  int64_t at;
+  if (!toIndex(index, &at)) {
+    return "List index must be an integer.";
+  }
+  if (!isValidListIndex(AS_LIST(list), at)) {
+    return "Invalid list index.";
+  }
+  storeToList(AS_LIST(list), (int)at, item);
+  return NULL;
+}
+
+static inline const char* negateOp(Value value, Value* result) {
+  if (!IS_NUMBER(value)) {
+    return "Operand must be a number.";
+  }
+  *result = negate(value);
+  return NULL;
+}
+
+static inline const char* bitNotOp(Value value, Value* result) {
+  if (!IS_INT(value)) {
+    return "Operand must be an integer.";
+  }
+  *result = INT_VAL(~AS_INT(value));
+  return NULL;
+}
+
+// Pushes a closure over 'func' for the frame on top, capturing what
+// the OP_CLOSURE operands at 'operands' say. Returns their end.
+static uint8_t* makeClosure(ObjFunc* func, uint8_t* operands) {
+  CallFrame* frame = &vm.frames[vm.frameCount - 1];
+  ObjClosure* closure = newClosure(func);
+  push(OBJ_VAL(closure));
+  for (int i = 0; i < closure->upvalCount; i++) {
+    uint16_t index = (operands[1] << 8) | operands[2];
+    if (operands[0]) {
+      closure->upvals[i] = captureUpval(frame->slots + index);
+    }
+    else {
+      closure->upvals[i] = frame->closure->upvals[index];
+    }
+    operands += 3;
+  }
+  for (int i = 0; i < closure->captureCount; i++) {
+    uint16_t index = (operands[1] << 8) | operands[2];
+    closure->captures[i] = operands[0]
+      ? frame->slots[index]
+      : frame->closure->captures[index];
+    operands += 3;
+  }
+  return operands;
+}
+
+// Copies the methods of 'superclass' into the class on top of the
+// stack, and pops that class.
+static bool inherit(Value superclass) {
+  if (!IS_CLASS(superclass)) {
+    runtimeErr("Superclass must be a class.");
+    return false;
+  }
+  classInherit(AS_CLASS(peek(0)), AS_CLASS(superclass));
+  vm.cacheEpoch++;
+  pop();
+  return true;
+}
+
+// Slides a tail call to 'closure', with its arguments on top of the
+// stack, down over the top frame and starts it there.
+static bool reuseFrame(ObjClosure* closure, int argCount) {
+  if (!checkArity(closure, argCount)) {
+    return false;
+  }
+  reserveStack(closure->func->maxStack + STACK_SLACK);
+  CallFrame* frame = &vm.frames[vm.frameCount - 1];
+  closeUpvals(frame->slots);
+  memmove(
+    frame->slots,
+    vm.stackTop - argCount - 1,
+    sizeof(Value) * (argCount + 1)
+  );
+  vm.stackTop = frame->slots + argCount + 1;
+  frame->closure = closure;
+  frame->ip = closure->func->chunk.code;
+  #ifdef JIT
+  countCall(closure->func);
+  #endif
+  return true;
+}
+
+#ifdef NATIVE_CODE
+int jitDepth = 0;
+
+static InterpretResult run(int baseFrame);
+
+static inline bool canEnterNative() {
+  return
+    vm.frames[vm.frameCount - 1].closure->func->native != NULL &&
+    jitDepth < JIT_DEPTH_MAX;
+}
+
+// Runs the top frame's native code, and the closures it tail
+// calls for as long as they have native code too.
+static JitResult enterNative() {
+  JitResult result;
+  jitDepth++;
+  do {
+    CallFrame* frame = &vm.frames[vm.frameCount - 1];
+    result = ((JitFn)frame->closure->func->native)(frame);
+  } while (result == JIT_TAIL_CALL && canEnterNative());
+  jitDepth--;
+  return result;
+}
+
+// Runs a frame that a call from native code pushed until it
+// returns. 'base' is the frame count before the call.
+static bool finishCall(int base) {
+  if (canEnterNative()) {
+    switch (enterNative()) {
+      case JIT_ERROR: return false;
+      case JIT_RETURNED: return true;
+      default: break;
+    }
+  }
+  return run(base) == INTERPRET_OK;
+}
+
+static StepResult stepCall(int frameCount, bool called) {
+  if (!called) {
+    return STEP_ERROR;
+  }
+  if (vm.frameCount > frameCount) {
+    if (canEnterNative()) {
+      return STEP_CALL;
+    }
+    if (run(frameCount) != INTERPRET_OK) {
+      return STEP_ERROR;
+    }
+  }
+  return STEP_NEXT;
+}
+
+// Slow path for the register instructions. 'hasDest' is for the
+// forms that store their result to a slot.
+static StepResult stepRegister(
+  uint8_t* ins,
+  OpCode op,
+  bool hasDest,
+  bool isConst
+) {
+  CallFrame* frame = &vm.frames[vm.frameCount - 1];
+  ObjFunc* func = frame->closure->func;
+  uint8_t* operands = hasDest ? &ins[2] : &ins[1];
+  Value a = frame->slots[operands[0]];
+  Value b = isConst
+    ? func->chunk.constants.values[operands[1]]
+    : frame->slots[operands[1]];
+  Feedback* feedback = feedbackOf(func, ins);
+  feedback->left |= seenKind(a);
+  feedback->right |= seenKind(b);
+  if (!registerArith(op, a, b)) {
+    return STEP_ERROR;
+  }
+  if (hasDest) {
+    frame->slots[ins[1]] = pop();
+  }
+  return STEP_NEXT;
+}
+
+StepResult jitStep(uint8_t* ins) {
+  CallFrame* frame = &vm.frames[vm.frameCount - 1];
+  ObjFunc* func = frame->closure->func;
+  Value* constants = func->chunk.constants.values;
+  // NULL for instructions that record no feedback.
+  Feedback* feedback = func->feedbackAt[ins - func->chunk.code] ==
+    NO_FEEDBACK ? NULL : feedbackOf(func, ins);
+  // For runtimeErr()'s line, and the GC's view of the frame.
+  frame->ip = ins + 1;
+  // The _LONG forms share their short form's case, with a wider
+  // constant operand.
+  OpCode op = ins[0];
+  uint32_t operand = ins[1];
+  uint8_t* rest = &ins[2];
+  #define WIDEN(name) \
+    case name##_LONG: \
+      op = name; \
+      operand = (ins[1] << 16) | (ins[2] << 8) | ins[3]; \
+      rest = &ins[4]; \
+      break
+  switch (op) {
+    WIDEN(OP_GET_GLOBAL);
+    WIDEN(OP_DEF_GLOBAL);
+    WIDEN(OP_SET_GLOBAL);
+    WIDEN(OP_GET_PROP);
+    WIDEN(OP_SET_PROP);
+    WIDEN(OP_GET_SUPER);
+    WIDEN(OP_INVOKE);
+    WIDEN(OP_INVOKE_SUPER);
+    WIDEN(OP_CLOSURE);
+    WIDEN(OP_CLASS);
+    WIDEN(OP_METHOD);
+    default: break;
+  }
+  #undef WIDEN
+  switch (op) {
+    case OP_GET_GLOBAL:
+      if (IS_UNDEFINED(vm.globals[operand])) {
+        undefinedErr(operand, false);
+        return STEP_ERROR;
       }
-      case OP_LT_EQU: {
-        Value b = pop();
-        Value a = pop();
-        push(BOOL_VAL(valsLtEqu(a, b)));
-        break;
+      push(vm.globals[operand]);
+      return STEP_NEXT;
+    case OP_DEF_GLOBAL:
+      vm.globals[operand] = pop();
+      return STEP_NEXT;
+    case OP_SET_GLOBAL:
+      if (IS_UNDEFINED(vm.globals[operand])) {
+        undefinedErr(operand, true);
+        return STEP_ERROR;
       }
-      case OP_NOT_EQU: {
-        Value b = pop();
-        Value a = pop();
-        push(BOOL_VAL(valsNotEqu(a, b)));
-        break;
+      vm.globals[operand] = peek(0);
+      return STEP_NEXT;
+    case OP_GET_PROP:
+      recordReceiver(feedback, peek(0));
+      return getProp(siteCache(func, ins), AS_STR(constants[operand]))
+        ? STEP_NEXT : STEP_ERROR;
+    case OP_SET_PROP:
+      return setProp(siteCache(func, ins), AS_STR(constants[operand]))
+        ? STEP_NEXT : STEP_ERROR;
+    case OP_GET_LOCAL_PROP:
+      push(frame->slots[ins[1]]);
+      recordReceiver(feedback, peek(0));
+      return getProp(siteCache(func, ins), AS_STR(constants[ins[2]]))
+        ? STEP_NEXT : STEP_ERROR;
+    case OP_GET_SUPER: {
+      ObjClass* superclass = AS_CLASS(pop());
+      if (!bindMethod(superclass, AS_STR(constants[operand]))) {
+        return STEP_ERROR;
       }
-      case OP_ADD: {
-        if (IS_STR(peek(0)) || IS_STR(peek(1))) {
-          concat();
-        }
-        else if (IS_NUM(peek(0)) && IS_NUM(peek(1))) {
-          double b = AS_NUM(pop());
-          double a = AS_NUM(pop());
-          push(NUM_VAL(a + b));
-        }
-        else {
-          frame->ip = ip;
-          runtimeErr(
-            "Invalid types for operator."
-          );
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        break;
+      return STEP_NEXT;
+    }
+    case OP_BUILD_LIST:
+      buildList(ins[1]);
+      return STEP_NEXT;
+    case OP_EXTEND_LIST:
+      extendList(ins[1]);
+      return STEP_NEXT;
+    case OP_INDEX_SUB: {
+      Value item;
+      const char* error = indexSub(peek(1), peek(0), &item);
+      if (error != NULL) {
+        runtimeErr("%s", error);
+        return STEP_ERROR;
       }
-      case OP_SUB: BINARY_OP(NUM_VAL, -); break;
-      case OP_MUL: BINARY_OP(NUM_VAL, *); break;
-      case OP_POW: {
-        if (IS_NUM(peek(0)) && IS_NUM(peek(1))) {
-          double b = AS_NUM(pop());
-          double a = AS_NUM(pop());
-          push(NUM_VAL(pow(a, b)));
-        }
-        else {
-          runtimeErr("Operands must be numbers.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        break;
+      vm.stackTop -= 2;
+      push(item);
+      return STEP_NEXT;
+    }
+    case OP_STORE_SUB: {
+      Value item = peek(0);
+      const char* error = storeSub(peek(2), peek(1), item);
+      if (error != NULL) {
+        runtimeErr("%s", error);
+        return STEP_ERROR;
       }
-      case OP_DIV: {
-        if (IS_NUM(peek(0)) && IS_NUM(peek(1))) {
-          double b = AS_NUM(pop());
-          double a = AS_NUM(pop());
-          if (b == 0) {
-            runtimeErr("Division by zero.");
-            return INTERPRET_RUNTIME_ERROR;
-          }
-          push(NUM_VAL(a / b));
-        }
-        else {
-          runtimeErr("Operands must be numbers.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        break;
+      vm.stackTop -= 3;
+      push(item);
+      return STEP_NEXT;
+    }
+    case OP_ADD:
+    case OP_ADD_NUM:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_MOD:
+    case OP_POW:
+    case OP_BIT_AND:
+    case OP_BIT_OR:
+    case OP_BIT_XOR:
+    case OP_SHL:
+    case OP_SHR:
+      feedback->left |= seenKind(peek(1));
+      feedback->right |= seenKind(peek(0));
+      return binaryArith(op) ? STEP_NEXT : STEP_ERROR;
+    case OP_NEGATE:
+    case OP_BIT_NOT: {
+      feedback->left |= seenKind(peek(0));
+      Value result;
+      const char* error = op == OP_NEGATE
+        ? negateOp(peek(0), &result)
+        : bitNotOp(peek(0), &result);
+      if (error != NULL) {
+        runtimeErr("%s", error);
+        return STEP_ERROR;
       }
-      case OP_MOD: {
-        if (IS_NUM(peek(0)) && IS_NUM(peek(1))) {
-          double b = AS_NUM(pop());
-          double a = AS_NUM(pop());
-          push(NUM_VAL((int)a % (int)b));
-        }
-        else {
-          runtimeErr("Operands must be numbers.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        break;
+      vm.stackTop[-1] = result;
+      return STEP_NEXT;
+    }
+    case OP_ADD_RR: return stepRegister(ins, OP_ADD, false, false);
+    case OP_ADD_RK: return stepRegister(ins, OP_ADD, false, true);
+    case OP_ADD_RRR: return stepRegister(ins, OP_ADD, true, false);
+    case OP_ADD_RRK: return stepRegister(ins, OP_ADD, true, true);
+    case OP_SUB_RR: return stepRegister(ins, OP_SUB, false, false);
+    case OP_SUB_RK: return stepRegister(ins, OP_SUB, false, true);
+    case OP_SUB_RRR: return stepRegister(ins, OP_SUB, true, false);
+    case OP_SUB_RRK: return stepRegister(ins, OP_SUB, true, true);
+    case OP_MUL_RR: return stepRegister(ins, OP_MUL, false, false);
+    case OP_MUL_RK: return stepRegister(ins, OP_MUL, false, true);
+    case OP_MUL_RRR: return stepRegister(ins, OP_MUL, true, false);
+    case OP_MUL_RRK: return stepRegister(ins, OP_MUL, true, true);
+    case OP_JLT_LOCAL_CONST: {
+      Value a = frame->slots[ins[1]];
+      Value b = constants[ins[2]];
+      feedback->left |= seenKind(a);
+      feedback->right |= seenKind(b);
+      if (valsLt(a, b)) {
+        return STEP_NEXT;
       }
-      case OP_NOT:
-        push(BOOL_VAL(falsey(pop())));
-        break;
-      case OP_NEGATE:
-        if (!IS_NUM(peek(0))) {
-          frame->ip = ip;
-          runtimeErr("Operand must be a number.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        push(NUM_VAL(-AS_NUM(pop())));
-        break;
-      case OP_JMP: {
-        uint16_t offset = READ_SHORT();
-        ip += offset;
-        break;
+      push(BOOL_VAL(false));
+      return STEP_JUMP;
+    }
+    case OP_FOR_NUM: {
+      Value* counter = &frame->slots[ins[1]];
+      Value step = constants[ins[2]];
+      uint8_t limit = ins[3];
+      uint8_t mode = ins[4];
+      OpCode arith = mode & FOR_NUM_SUB ? OP_SUB : OP_ADD;
+      if (IS_NUM(*counter) && IS_NUM(step)) {
+        double delta = arith == OP_SUB ? -AS_NUM(step) : AS_NUM(step);
+        *counter = NUM_VAL(AS_NUM(*counter) + delta);
       }
-      case OP_JMPF: {
-        uint16_t offset = READ_SHORT();
-        if (falsey(peek(0))) {
-          ip += offset;
+      else if (
+        !IS_INT(*counter) || !IS_INT(step) ||
+        !intArith(arithOf(arith), *counter, step, counter)
+      ) {
+        feedback->left |= seenKind(*counter);
+        feedback->right |= seenKind(step);
+        if (!registerArith(arith, *counter, step)) {
+          return STEP_ERROR;
         }
-        break;
+        *counter = pop();
       }
-      case OP_LOOP: {
-        uint16_t offset = READ_SHORT();
-        ip -= offset;
-        break;
+      Value limitVal = mode & FOR_NUM_LIMIT_LOCAL
+        ? frame->slots[limit]
+        : constants[limit];
+      if (forNumCompare(mode, *counter, limitVal)) {
+        return STEP_JUMP;
       }
-      case OP_CALL: {
-        int argCount = READ_BYTE();
+      push(BOOL_VAL(false));
+      return STEP_NEXT;
+    }
+    case OP_CALL: {
+      int argCount = ins[1];
+      int frameCount = vm.frameCount;
+      recordCallee(feedback, peek(argCount));
+      return stepCall(frameCount, callVal(peek(argCount), argCount));
+    }
+    case OP_TAIL_CALL: {
+      int argCount = ins[1];
+      int frameCount = vm.frameCount;
+      Value callee = peek(argCount);
+      recordCallee(feedback, callee);
+      if (!IS_CLOSURE(callee)) {
+        return stepCall(frameCount, callVal(callee, argCount));
+      }
+      if (!reuseFrame(AS_CLOSURE(callee), argCount)) {
+        return STEP_ERROR;
+      }
+      return STEP_TAIL_CALL;
+    }
+    case OP_INVOKE: {
+      int argCount = rest[0];
+      int frameCount = vm.frameCount;
+      recordReceiver(feedback, peek(argCount));
+      return stepCall(
+        frameCount,
+        invoke(siteCache(func, ins), AS_STR(constants[operand]), argCount)
+      );
+    }
+    case OP_INVOKE_SUPER: {
+      int argCount = rest[0];
+      int frameCount = vm.frameCount;
+      ObjClass* superclass = AS_CLASS(pop());
+      return stepCall(
+        frameCount,
+        invokeFromClass(
+          siteCache(func, ins), superclass,
+          AS_STR(constants[operand]), argCount
+        )
+      );
+    }
+    case OP_CLOSE_UPVAL:
+      closeUpvals(vm.stackTop - 1);
+      pop();
+      return STEP_NEXT;
+    case OP_CLOSURE:
+      makeClosure(AS_FUNC(constants[operand]), rest);
+      return STEP_NEXT;
+    case OP_CLASS:
+      push(OBJ_VAL(newClass(AS_STR(constants[operand]))));
+      return STEP_NEXT;
+    case OP_INHERIT:
+      return inherit(peek(1)) ? STEP_NEXT : STEP_ERROR;
+    case OP_METHOD:
+      defMethod(AS_STR(constants[operand]));
+      return STEP_NEXT;
+    default:
+      runtimeErr("Unexpected instruction in native code.");
+      return STEP_ERROR;
+  }
+}
+
+bool jitFinish(JitResult result) {
+  switch (result) {
+    case JIT_RETURNED: return true;
+    case JIT_ERROR: return false;
+    case JIT_TAIL_CALL: return finishCall(vm.frameCount - 1);
+    default: return run(vm.frameCount - 1) == INTERPRET_OK;
+  }
+}
+
+int jitSwitch(uint8_t* ins) {
+  if (ins[0] == OP_SWITCH_INT) {
+    return switchIntEntry(&ins[1], peek(0));
+  }
+  Value* constants =
+    vm.frames[vm.frameCount - 1].closure->func->chunk.constants.values;
+  return switchStrEntry(constants, &ins[1], peek(0));
+}
+
+void jitReturn() {
+  CallFrame* frame = &vm.frames[vm.frameCount - 1];
+  Value result = pop();
+  closeUpvals(frame->slots);
+  vm.frameCount--;
+  vm.stackTop = frame->slots;
+  push(result);
+}
+#endif
+
+#ifdef TRACE_JIT
+// The loop being recorded, if any. While one is, run()'s dispatch
+// table sends each instruction through recordStep() first.
+static struct {
+  bool active;
+  // The loop's frame, by count, and its first and last
+  // instructions.
+  int frameCount;
+  uint8_t* header;
+  uint8_t* backEdge;
+  int depth;
+  SlotKind slotKinds[TRACE_STACK];
+  TraceStep steps[TRACE_MAX];
+  int count;
+  // In a call whose body has already been recorded inline, and the
+  // step of that body it runs next.
+  bool inlined;
+  int nextInlined;
+} recorder;
+
+void traceMarkRecording() {
+  if (recorder.active) {
+    for (int i = 0; i < recorder.count; i++) {
+      markObj((Obj*)recorder.steps[i].method);
+    }
+  }
+}
+
+// Starts recording the top frame's loop, whose backward jump is
+// at 'backEdge' and whose header the frame has just jumped to.
+static bool startTrace(uint8_t* backEdge, uint8_t* header, Value* sp) {
+  CallFrame* frame = &vm.frames[vm.frameCount - 1];
+  int depth = (int)(sp - frame->slots);
+  if (depth > TRACE_STACK / 2) {
+    return false;
+  }
+  recorder.active = true;
+  recorder.frameCount = vm.frameCount;
+  recorder.header = header;
+  recorder.backEdge = backEdge;
+  recorder.depth = depth;
+  for (int i = 0; i < depth; i++) {
+    Value value = frame->slots[i];
+    recorder.slotKinds[i] =
+      IS_INT(value) ? SLOT_INT : IS_NUM(value) ? SLOT_NUM : SLOT_OTHER;
+  }
+  recorder.count = 0;
+  recorder.inlined = false;
+  return true;
+}
+
+// Records the method an OP_INVOKE is about to call, and its body
+// after it.
+static bool recordInvoke(TraceStep* step, Value* sp) {
+  CallFrame* frame = &vm.frames[vm.frameCount - 1];
+  uint8_t* ip = step->ip;
+  uint32_t name = ip[1];
+  int argCount = ip[2];
+  if (ip[0] == OP_INVOKE_LONG) {
+    name = (ip[1] << 16) | (ip[2] << 8) | ip[3];
+    argCount = ip[4];
+  }
+  ObjFunc* func = frame->closure->func;
+  ObjClosure* method = traceMethod(
+    sp[-1 - argCount],
+    AS_STR(func->chunk.constants.values[name]),
+    siteCache(func, ip)
+  );
+  if (method == NULL || method->func->arity != argCount) {
+    return false;
+  }
+  int count = traceInline(
+    method->func,
+    &recorder.steps[recorder.count],
+    TRACE_MAX - recorder.count
+  );
+  if (count == -1) {
+    return false;
+  }
+  step->method = method;
+  recorder.nextInlined = recorder.count;
+  recorder.count += count;
+  recorder.inlined = true;
+  return true;
+}
+
+static void finishTrace() {
+  recorder.active = false;
+  ObjFunc* func = vm.frames[vm.frameCount - 1].closure->func;
+  Trace* trace = traceCompile(
+    func, recorder.header, recorder.depth, recorder.slotKinds,
+    recorder.steps, recorder.count
+  );
+  if (trace != NULL) {
+    trace->next = func->traces;
+    func->traces = trace;
+    feedbackOf(func, recorder.backEdge)->loops = TRACE_COMPILED;
+  }
+}
+
+// Notes down one of a step's operands: whether it is a number, and
+// if so which kind.
+static void recordOperand(TraceStep* step, int operand, Value value) {
+  if (IS_INT(value)) {
+    step->ints |= 1 << operand;
+  }
+  else if (!IS_NUM(value)) {
+    step->numeric = false;
+  }
+}
+
+// Records the operands of the instruction at 'ip', which is about to
+// run with stack top 'sp' in a frame at 'slots'.
+static void recordOperands(TraceStep* step, Value* sp, Value* slots) {
+  uint8_t* ip = step->ip;
+  step->numeric = true;
+  step->ints = 0;
+  switch (ip[0]) {
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_ADD_NUM:
+    case OP_GT:
+    case OP_LT:
+    case OP_GT_EQU:
+    case OP_LT_EQU:
+    case OP_GT_NUM:
+    case OP_LT_NUM:
+    case OP_GT_EQU_NUM:
+    case OP_LT_EQU_NUM:
+      recordOperand(step, 0, sp[-2]);
+      recordOperand(step, 1, sp[-1]);
+      break;
+    case OP_NEGATE:
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_LONG:
+      recordOperand(step, 0, sp[-1]);
+      break;
+    case OP_ADD_RR:
+    case OP_SUB_RR:
+    case OP_MUL_RR:
+      recordOperand(step, 0, slots[ip[1]]);
+      recordOperand(step, 1, slots[ip[2]]);
+      break;
+    case OP_ADD_RRR:
+    case OP_SUB_RRR:
+    case OP_MUL_RRR:
+      recordOperand(step, 0, slots[ip[2]]);
+      recordOperand(step, 1, slots[ip[3]]);
+      break;
+    case OP_ADD_RK:
+    case OP_SUB_RK:
+    case OP_MUL_RK:
+    case OP_JLT_LOCAL_CONST:
+      recordOperand(step, 0, slots[ip[1]]);
+      break;
+    case OP_FOR_NUM:
+      recordOperand(step, 0, slots[ip[1]]);
+      if (ip[4] & FOR_NUM_LIMIT_LOCAL) {
+        recordOperand(step, 1, slots[ip[3]]);
+      }
+      break;
+    case OP_ADD_RRK:
+    case OP_SUB_RRK:
+    case OP_MUL_RRK:
+      recordOperand(step, 0, slots[ip[2]]);
+      break;
+    default:
+      break;
+  }
+}
+
+// Records the instruction at 'ip', before it runs. Returns false
+// once recording is over: the loop came back round to its header,
+// or left in a way a trace can't follow.
+static bool recordStep(uint8_t* ip, Value* sp) {
+  if (!recorder.active) {
+    return false;
+  }
+  Value* slots = vm.frames[vm.frameCount - 1].slots;
+  if (recorder.inlined && vm.frameCount > recorder.frameCount) {
+    // The inlined body's steps are in already; what runs in its
+    // frame fills in their operands.
+    TraceStep* next = &recorder.steps[recorder.nextInlined];
+    if (
+      vm.frameCount == recorder.frameCount + 1 &&
+      recorder.nextInlined < recorder.count && next->ip == ip
+    ) {
+      recordOperands(next, sp, slots);
+      recorder.nextInlined++;
+    }
+    return true;
+  }
+  recorder.inlined = false;
+  if (
+    vm.frameCount != recorder.frameCount ||
+    ip < recorder.header || ip > recorder.backEdge ||
+    recorder.count == TRACE_MAX
+  ) {
+    recorder.active = false;
+    return false;
+  }
+  if (ip == recorder.header && recorder.count > 0) {
+    finishTrace();
+    return false;
+  }
+  TraceStep* step = &recorder.steps[recorder.count++];
+  step->ip = ip;
+  step->inlined = false;
+  step->method = NULL;
+  recordOperands(step, sp, slots);
+  if (
+    (ip[0] == OP_INVOKE || ip[0] == OP_INVOKE_LONG) &&
+    !recordInvoke(step, sp)
+  ) {
+    recorder.active = false;
+    return false;
+  }
+  return true;
+}
+
+// Whether 'trace' can start from the frame at 'slots': each slot it
+// carries must hold the kind of number it was compiled for.
+static bool traceFits(Trace* trace, Value* slots) {
+  for (int i = 0; i < trace->depth; i++) {
+    if (
+      trace->kinds[i] != SLOT_OTHER &&
+      trace->kinds[i] != (IS_INT(slots[i]) ? SLOT_INT : SLOT_NUM)
+    ) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Runs the trace compiled for the loop the top frame has just
+// jumped back to, if there's one for this stack depth and the
+// numbers its slots hold.
+static bool runTrace() {
+  CallFrame* frame = &vm.frames[vm.frameCount - 1];
+  int depth = (int)(vm.stackTop - frame->slots);
+  // A loop inside the one being recorded would run without it.
+  recorder.active = false;
+  if (vm.frameCount == FRAMES_MAX) {
+    return false;
+  }
+  for (
+    Trace* trace = frame->closure->func->traces;
+    trace != NULL;
+    trace = trace->next
+  ) {
+    if (
+      trace->header == frame->ip && trace->depth == depth &&
+      traceFits(trace, frame->slots)
+    ) {
+      reserveStack(trace->maxDepth - depth);
+      ((TraceFn)trace->native)(frame);
+      return true;
+    }
+  }
+  return false;
+}
+
+// Only fields: methods would need binding.
+Value traceGetField(Value receiver, ObjStr* name, InlineCache* cache) {
+  Value value;
+  ObjClosure* method;
+  if (
+    !IS_INSTANCE(receiver) ||
+    !lookupProp(cache, AS_INSTANCE(receiver), name, &value, &method) ||
+    method != NULL
+  ) {
+    return TRACE_MISSING;
+  }
+  return value;
+}
+
+bool traceSetField(
+  Value receiver,
+  ObjStr* name,
+  Value value,
+  InlineCache* cache
+) {
+  if (!IS_INSTANCE(receiver)) {
+    return false;
+  }
+  setField(cache, AS_INSTANCE(receiver), name, value);
+  return true;
+}
+
+// The closure invoke() would call for 'name' on 'receiver', if
+// it's a method rather than a field.
+ObjClosure* traceMethod(
+  Value receiver,
+  ObjStr* name,
+  InlineCache* cache
+) {
+  Value field;
+  ObjClosure* method;
+  if (
+    !IS_INSTANCE(receiver) ||
+    !lookupProp(cache, AS_INSTANCE(receiver), name, &field, &method)
+  ) {
+    return NULL;
+  }
+  return method;
+}
+
+Value traceIndex(Value list, Value index) {
+  int64_t at;
+  if (
+    !IS_LIST(list) || !toIndex(index, &at) ||
+    !isValidListIndex(AS_LIST(list), at)
+  ) {
+    return TRACE_MISSING;
+  }
+  return indexFromList(AS_LIST(list), (int)at);
+}
+
+bool traceStore(Value list, Value index, Value item) {
+  int64_t at;
+  if (
+    !IS_LIST(list) || !toIndex(index, &at) ||
+    !isValidListIndex(AS_LIST(list), at)
+  ) {
+    return false;
+  }
+  storeToList(AS_LIST(list), (int)at, item);
+  return true;
+}
+
+void traceEnter(ObjClosure* closure, uint8_t* ip, int base) {
+  if (vm.frameCount == vm.frameCapacity) {
+    growFrames();
+  }
+  CallFrame* frame = &vm.frames[vm.frameCount++];
+  frame->closure = closure;
+  frame->ip = ip;
+  frame->slots = vm.frames[vm.frameCount - 2].slots + base;
+}
+#endif
+
+static InterpretResult run(int baseFrame) {
+  CallFrame* frame = &vm.frames[vm.frameCount - 1];
+  register uint8_t* ip = frame->ip;
+  // The stack pointer lives in a local, and the top value is
+  // mirrored in 'tos' so handlers don't reload it. Stack memory
+  // stays valid, so locals and upvalues can still alias it, but
+  // vm.stackTop is stale inside this loop: STORE_STACK() must come
+  // before anything that uses the VM stack or may collect, and
+  // LOAD_STACK() after anything that moved it.
+  register Value* sp = vm.stackTop;
+  Value tos = sp[-1];
+  Value popped;
+  #define PUSH(value) (tos = (value), *sp++ = tos)
+  #define POP() (popped = tos, sp--, tos = sp[-1], popped)
+  #define DROP() (sp--, tos = sp[-1])
+  #define PEEK(distance) \
+    ((distance) == 0 ? tos : sp[-1 - (distance)])
+  #define STORE_STACK() (vm.stackTop = sp)
+  #define LOAD_STACK() (sp = vm.stackTop, tos = sp[-1])
+  #define READ_BYTE() (*ip++)
+  #define READ_CONST() \
+    (frame->closure->func->chunk.constants.values[READ_BYTE()])
+  #define READ_SHORT() \
+    (ip += 2, \
+    (uint16_t)((ip[-2] << 8) | ip[-1]))
+  #define READ_STR() AS_STR(READ_CONST())
+  #define READ_LONG() \
+    (ip += 3, \
+    (uint32_t)((ip[-3] << 16) | (ip[-2] << 8) | ip[-1]))
+  // Indexed handlers take their operand from 'operand', so a _LONG
+  // form can decode its wider one and share the short handler's
+  // body.
+  // 'start' is where the instruction began, for its feedback.
+  uint32_t operand;
+  uint8_t* start;
+  #define LONG_CASE(name, read) \
+    CASE(name##_LONG): start = ip - 1; operand = (read); \
+      goto long_##name; \
+    CASE(name): start = ip - 1; operand = READ_BYTE(); long_##name
+  #define OPERAND_CONST() \
+    (frame->closure->func->chunk.constants.values[operand])
+  #define OPERAND_STR() AS_STR(OPERAND_CONST())
+  // Type feedback for the instruction starting at 'at'. Only
+  // generic handlers and slow paths record operand kinds: the
+  // fast paths of quickened and register forms run on numbers
+  // alone, which their opcode already says.
+  #define FEEDBACK(at) feedbackOf(frame->closure->func, at)
+  // The inline cache of the property site starting at 'at'.
+  #define CACHE(at) siteCache(frame->closure->func, at)
+  #define RECORD_OPERANDS(at, a, b) \
+    do { \
+      Feedback* feedback = FEEDBACK(at); \
+      feedback->left |= seenKind(a); \
+      feedback->right |= seenKind(b); \
+    } while (false)
+  // Mixed kinds, strings, integer overflow and errors all go
+  // through binaryArith(), which the fast paths below fall back on.
+  #define SLOW_ARITH(genericOp) \
+    do { \
+      frame->ip = ip; \
+      STORE_STACK(); \
+      if (!binaryArith(genericOp)) { \
+        return INTERPRET_RUNTIME_ERROR; \
+      } \
+      LOAD_STACK(); \
+    } while (false)
+  #define BINARY_OP(genericOp, op) \
+    do { \
+      RECORD_OPERANDS(ip - 1, PEEK(1), PEEK(0)); \
+      Value result; \
+      if ( \
+        IS_INT(PEEK(0)) && IS_INT(PEEK(1)) && \
+        intArith(arithOf(genericOp), PEEK(1), PEEK(0), &result) \
+      ) { \
+        DROP(); \
+        DROP(); \
+        PUSH(result); \
+      } \
+      else if (IS_NUM(PEEK(0)) && IS_NUM(PEEK(1))) { \
+        double b = AS_NUM(POP()); \
+        double a = AS_NUM(POP()); \
+        PUSH(NUM_VAL(a op b)); \
+      } \
+      else { \
+        SLOW_ARITH(genericOp); \
+      } \
+    } while (false)
+  // '%' and the bitwise operators, which integers do inline.
+  #define INT_OP(genericOp, op) \
+    do { \
+      RECORD_OPERANDS(ip - 1, PEEK(1), PEEK(0)); \
+      if ( \
+        IS_INT(PEEK(0)) && IS_INT(PEEK(1)) && \
+        (genericOp != OP_MOD || AS_INT(PEEK(0)) != 0) \
+      ) { \
+        int64_t b = AS_INT(POP()); \
+        int64_t a = AS_INT(POP()); \
+        PUSH(INT_VAL(a op b)); \
+      } \
+      else { \
+        SLOW_ARITH(genericOp); \
+      } \
+    } while (false)
+  // 'length' is the instruction's, so the slow path can find its
+  // feedback.
+  #define REGISTER_OP(genericOp, op, length, a, b, result) \
+    do { \
+      if ( \
+        IS_INT(a) && IS_INT(b) && \
+        intArith(arithOf(genericOp), a, b, &result) \
+      ) { \
+      } \
+      else if (IS_NUM(a) && IS_NUM(b)) { \
+        result = NUM_VAL(AS_NUM(a) op AS_NUM(b)); \
+      } \
+      else { \
+        RECORD_OPERANDS(ip - (length), a, b); \
+        frame->ip = ip; \
+        STORE_STACK(); \
+        if (!registerArith(genericOp, a, b)) { \
+          return INTERPRET_RUNTIME_ERROR; \
+        } \
+        result = pop(); \
+      } \
+    } while (false)
+  // Quickening rewrites the opcode just read. The quickened
+  // handlers guard on their operand types and, on failure, put
+  // the generic opcode back and run it instead.
+  #define QUICKEN(op) (ip[-1] = (op))
+  #define UNQUICKEN(op) \
+    do { \
+      QUICKEN(op); \
+      ip--; \
+      DISPATCH(); \
+    } while (false)
+  #define COMPARE_OP(numOp, compare) \
+    do { \
+      RECORD_OPERANDS(ip - 1, PEEK(1), PEEK(0)); \
+      if (sameKindNums(PEEK(1), PEEK(0))) { \
+        QUICKEN(numOp); \
+      } \
+      Value b = POP(); \
+      Value a = POP(); \
+      PUSH(BOOL_VAL(compare(a, b))); \
+    } while (false)
+  #define NUM_COMPARE_OP(genericOp, op) \
+    do { \
+      if (IS_INT(PEEK(0)) && IS_INT(PEEK(1))) { \
+        int64_t b = AS_INT(POP()); \
+        int64_t a = AS_INT(POP()); \
+        PUSH(BOOL_VAL(a op b)); \
+        DISPATCH(); \
+      } \
+      if (!IS_NUM(PEEK(0)) || !IS_NUM(PEEK(1))) { \
+        UNQUICKEN(genericOp); \
+      } \
+      double b = AS_NUM(POP()); \
+      double a = AS_NUM(POP()); \
+      PUSH(BOOL_VAL(a op b)); \
+    } while (false)
+
+  #ifdef NATIVE_CODE
+  // Once a call has pushed or replaced a frame, runs it natively
+  // if it has been compiled. Leaves 'frame' and the stack to be
+  // reloaded.
+  #define ENTER_NATIVE(pushed) \
+    do { \
+      if ((pushed) && canEnterNative()) { \
+        if (enterNative() == JIT_ERROR) { \
+          return INTERPRET_RUNTIME_ERROR; \
+        } \
+        if (vm.frameCount == baseFrame) { \
+          return INTERPRET_OK; \
+        } \
+      } \
+    } while (false)
+  #else
+  #define ENTER_NATIVE(pushed) do { (void)(pushed); } while (false)
+  #endif
+
+  #ifdef TRACE_JIT
+  // Counts trips round the loop whose backward jump is at 'at',
+  // now that 'ip' is back at its header. A hot loop is recorded
+  // for one trip, and once that's compiled its trace runs instead.
+  // If none of its traces fit the loop's slots any more, say once a
+  // sum has outgrown integers, the next trip is recorded too, and
+  // the header finishes that recording rather than running a trace.
+  #define TRACE_LOOP(at) \
+    do { \
+      Feedback* loop = FEEDBACK(at); \
+      bool record = false; \
+      if (loop->loops < TRACE_HOT) { \
+        record = ++loop->loops == TRACE_HOT; \
+      } \
+      else if ( \
+        loop->loops == TRACE_COMPILED && \
+        !(recorder.active && recorder.backEdge == (at)) \
+      ) { \
+        frame->ip = ip; \
+        STORE_STACK(); \
+        if (runTrace()) { \
+          frame = &vm.frames[vm.frameCount - 1]; \
+          ip = frame->ip; \
+          LOAD_STACK(); \
+        } \
+        else if (frame->closure->func->retraces < TRACE_RETRACES) { \
+          frame->closure->func->retraces++; \
+          record = true; \
+        } \
+      } \
+      if (record && startTrace((at), ip, sp)) { \
+        for (int i = 0; i < OP_COUNT; i++) { \
+          dispatchTable[i] = &&do_record; \
+        } \
+      } \
+    } while (false)
+  #else
+  #define TRACE_LOOP(at) do {} while (false)
+  #endif
+
+  #ifdef DEBUG_TRACE_EXEC
+  #define TRACE_EXEC() \
+    do { \
+      printf("\t\t"); \
+      for (Value* slot = vm.stack; slot < sp; slot++) { \
+        printf("[ "); \
+        printValue(*slot); \
+        printf(" ]"); \
+      } \
+      printf("\n"); \
+      disassembleInstruction( \
+        &frame->closure->func->chunk, \
+        (int)(ip - frame->closure->func->chunk.code) \
+      ); \
+    } while (false)
+  #else
+  #define TRACE_EXEC() do {} while (false)
+  #endif
+
+  #ifdef DEBUG_PROFILE_OPS
+  #define PROFILE_OP() profileOp(*ip)
+  #else
+  #define PROFILE_OP() do {} while (false)
+  #endif
+
+  #ifdef THREADED_DISPATCH
+  // Each handler jumps straight to the next one, which gives
+  // the branch predictor one indirect jump per opcode instead
+  // of a single shared one at the top of a switch.
+  static void* dispatchTable[OP_COUNT] = {
+    #define OPCODE_LABEL(name) &&do_##name,
+    OPCODES(OPCODE_LABEL)
+    #undef OPCODE_LABEL
+  };
+  #ifdef TRACE_JIT
+  // The same again, to put back when dispatchTable has been
+  // pointed at do_record for a recording.
+  static void* handlers[OP_COUNT] = {
+    #define OPCODE_LABEL(name) &&do_##name,
+    OPCODES(OPCODE_LABEL)
+    #undef OPCODE_LABEL
+  };
+  #endif
+  #define CASE(name) do_##name
+  #define DISPATCH() \
+    do { \
+      TRACE_EXEC(); \
+      PROFILE_OP(); \
+      goto *dispatchTable[READ_BYTE()]; \
+    } while (false)
+  #define INTERPRET_LOOP DISPATCH();
+  #else
+  #define CASE(name) case name
+  #define DISPATCH() goto loop
+  #define INTERPRET_LOOP \
+    loop: \
+    TRACE_EXEC(); \
+    PROFILE_OP(); \
+    switch (READ_BYTE())
+  #endif
+
+  INTERPRET_LOOP
+  {
+    LONG_CASE(OP_CONST, READ_LONG()): {
+      Value constant = OPERAND_CONST();
+      PUSH(constant);
+      DISPATCH();
+    }
+    CASE(OP_SMALLINT): PUSH(INT_VAL((int8_t)READ_BYTE())); DISPATCH();
+    CASE(OP_NIL): PUSH(NIL_VAL); DISPATCH();
+    CASE(OP_TRUE): PUSH(BOOL_VAL(true)); DISPATCH();
+    CASE(OP_FALSE): PUSH(BOOL_VAL(false)); DISPATCH();
+    CASE(OP_DUP): PUSH(PEEK(0)); DISPATCH();
+    CASE(OP_POP): DROP(); DISPATCH();
+    LONG_CASE(OP_GET_LOCAL, READ_SHORT()): {
+      PUSH(frame->slots[operand]);
+      DISPATCH();
+    }
+    LONG_CASE(OP_SET_LOCAL, READ_SHORT()): {
+      frame->slots[operand] = PEEK(0);
+      DISPATCH();
+    }
+    LONG_CASE(OP_GET_GLOBAL, READ_LONG()): {
+      Value value = vm.globals[operand];
+      if (IS_UNDEFINED(value)) {
         frame->ip = ip;
-        if (!callVal(peek(argCount), argCount)) {
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        frame = &vm.frames[vm.frameCount - 1];
-        ip = frame->ip;
-        break;
+        undefinedErr(operand, false);
+        return INTERPRET_RUNTIME_ERROR;
       }
-      case OP_INVOKE: {
-        ObjStr* method = READ_STR();
-        int argCount = READ_BYTE();
+      PUSH(value);
+      DISPATCH();
+    }
+    LONG_CASE(OP_DEF_GLOBAL, READ_LONG()): {
+      vm.globals[operand] = PEEK(0);
+      DROP();
+      DISPATCH();
+    }
+    LONG_CASE(OP_SET_GLOBAL, READ_LONG()): {
+      if (IS_UNDEFINED(vm.globals[operand])) {
         frame->ip = ip;
-        if (!invoke(method, argCount)) {
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        frame = &vm.frames[vm.frameCount - 1];
-        ip = frame->ip;
-        break;
+        undefinedErr(operand, true);
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      vm.globals[operand] = PEEK(0);
+      DISPATCH();
+    }
+    CASE(OP_GET_UPVAL): {
+      uint8_t slot = READ_BYTE();
+      PUSH(*frame->closure->upvals[slot]->location);
+      DISPATCH();
+    }
+    CASE(OP_SET_UPVAL): {
+      uint8_t slot = READ_BYTE();
+      *frame->closure->upvals[slot]->location = PEEK(0);
+      DISPATCH();
+    }
+    CASE(OP_GET_CAPTURE):
+      PUSH(frame->closure->captures[READ_BYTE()]);
+      DISPATCH();
+    LONG_CASE(OP_GET_PROP, READ_LONG()): {
+      recordReceiver(FEEDBACK(start), PEEK(0));
+      frame->ip = ip;
+      STORE_STACK();
+      if (!getProp(CACHE(start), OPERAND_STR())) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      LOAD_STACK();
+      DISPATCH();
+    }
+    LONG_CASE(OP_SET_PROP, READ_LONG()): {
+      frame->ip = ip;
+      STORE_STACK();
+      if (!setProp(CACHE(start), OPERAND_STR())) {
+        return INTERPRET_RUNTIME_ERROR;
       }
-      case OP_INVOKE_SUPER: {
-        ObjStr* method = READ_STR();
-        int argCount = READ_BYTE();
+      LOAD_STACK();
+      DISPATCH();
+    }
+    LONG_CASE(OP_GET_SUPER, READ_LONG()): {
+      ObjStr* name = OPERAND_STR();
+      ObjClass* superclass = AS_CLASS(POP());
+      frame->ip = ip;
+      STORE_STACK();
+      if (!bindMethod(superclass, name)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      LOAD_STACK();
+      DISPATCH();
+    }
+    CASE(OP_BUILD_LIST):
+      STORE_STACK();
+      buildList(READ_BYTE());
+      LOAD_STACK();
+      DISPATCH();
+    CASE(OP_EXTEND_LIST):
+      STORE_STACK();
+      extendList(READ_BYTE());
+      LOAD_STACK();
+      DISPATCH();
+    CASE(OP_INDEX_SUB): {
+      Value item;
+      const char* error = indexSub(PEEK(1), PEEK(0), &item);
+      if (error != NULL) {
+        frame->ip = ip;
+        runtimeErr("%s", error);
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      DROP();
+      DROP();
+      PUSH(item);
+      DISPATCH();
+    }
+    CASE(OP_STORE_SUB): {
+      Value item = PEEK(0);
+      const char* error = storeSub(PEEK(2), PEEK(1), item);
+      if (error != NULL) {
+        frame->ip = ip;
+        runtimeErr("%s", error);
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      DROP();
+      DROP();
+      DROP();
+      PUSH(item);
+      DISPATCH();
+    }
+    CASE(OP_EQU): {
+      RECORD_OPERANDS(ip - 1, PEEK(1), PEEK(0));
+      Value b = POP();
+      Value a = POP();
+      PUSH(BOOL_VAL(valsEqu(a, b)));
+      DISPATCH();
+    }
+    CASE(OP_GT): COMPARE_OP(OP_GT_NUM, valsGt); DISPATCH();
+    CASE(OP_LT): COMPARE_OP(OP_LT_NUM, valsLt); DISPATCH();
+    CASE(OP_GT_EQU): COMPARE_OP(OP_GT_EQU_NUM, valsGtEqu); DISPATCH();
+    CASE(OP_LT_EQU): COMPARE_OP(OP_LT_EQU_NUM, valsLtEqu); DISPATCH();
+    CASE(OP_NOT_EQU): {
+      RECORD_OPERANDS(ip - 1, PEEK(1), PEEK(0));
+      Value b = POP();
+      Value a = POP();
+      PUSH(BOOL_VAL(valsNotEqu(a, b)));
+      DISPATCH();
+    }
+    CASE(OP_ADD): {
+      RECORD_OPERANDS(ip - 1, PEEK(1), PEEK(0));
+      if (sameKindNums(PEEK(1), PEEK(0))) {
+        QUICKEN(OP_ADD_NUM);
+      }
+      SLOW_ARITH(OP_ADD);
+      DISPATCH();
+    }
+    CASE(OP_SUB): BINARY_OP(OP_SUB, -); DISPATCH();
+    CASE(OP_MUL): BINARY_OP(OP_MUL, *); DISPATCH();
+    CASE(OP_POW):
+      RECORD_OPERANDS(ip - 1, PEEK(1), PEEK(0));
+      SLOW_ARITH(OP_POW);
+      DISPATCH();
+    CASE(OP_DIV): {
+      RECORD_OPERANDS(ip - 1, PEEK(1), PEEK(0));
+      if (IS_NUM(PEEK(0)) && IS_NUM(PEEK(1)) && AS_NUM(PEEK(0)) != 0) {
+        double b = AS_NUM(POP());
+        double a = AS_NUM(POP());
+        PUSH(NUM_VAL(a / b));
+      }
+      else {
+        SLOW_ARITH(OP_DIV);
+      }
+      DISPATCH();
+    }
+    CASE(OP_MOD): INT_OP(OP_MOD, %); DISPATCH();
+    CASE(OP_BIT_AND): INT_OP(OP_BIT_AND, &); DISPATCH();
+    CASE(OP_BIT_OR): INT_OP(OP_BIT_OR, |); DISPATCH();
+    CASE(OP_BIT_XOR): INT_OP(OP_BIT_XOR, ^); DISPATCH();
+    CASE(OP_SHL):
+      RECORD_OPERANDS(ip - 1, PEEK(1), PEEK(0));
+      SLOW_ARITH(OP_SHL);
+      DISPATCH();
+    CASE(OP_SHR):
+      RECORD_OPERANDS(ip - 1, PEEK(1), PEEK(0));
+      SLOW_ARITH(OP_SHR);
+      DISPATCH();
+    CASE(OP_NOT):
+      PUSH(BOOL_VAL(falsey(POP())));
+      DISPATCH();
+    CASE(OP_NEGATE): {
+      FEEDBACK(ip - 1)->left |= seenKind(PEEK(0));
+      Value result;
+      const char* error = negateOp(PEEK(0), &result);
+      if (error != NULL) {
         frame->ip = ip;
-        ObjClass* superclass = AS_CLASS(pop());
-        if (!invokeFromClass(superclass, method, argCount)) {
+        runtimeErr("%s", error);
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      DROP();
+      PUSH(result);
+      DISPATCH();
+    }
+    CASE(OP_BIT_NOT): {
+      FEEDBACK(ip - 1)->left |= seenKind(PEEK(0));
+      Value result;
+      const char* error = bitNotOp(PEEK(0), &result);
+      if (error != NULL) {
+        frame->ip = ip;
+        runtimeErr("%s", error);
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      DROP();
+      PUSH(result);
+      DISPATCH();
+    }
+    CASE(OP_JMP): {
+      uint16_t offset = READ_SHORT();
+      ip += offset;
+      DISPATCH();
+    }
+    CASE(OP_JMPF): {
+      uint16_t offset = READ_SHORT();
+      if (falsey(PEEK(0))) {
+        ip += offset;
+      }
+      DISPATCH();
+    }
+    CASE(OP_SWITCH_INT): {
+      // Entry k's offset sits 2 * k bytes on from the miss offset.
+      uint8_t* table = ip;
+      int count = (table[4] << 8) | table[5];
+      uint8_t* entry = &table[6 + switchIntEntry(table, tos) * 2];
+      ip += 8 + count * 2;
+      ip += (uint16_t)((entry[0] << 8) | entry[1]);
+      DISPATCH();
+    }
+    CASE(OP_SWITCH_STR): {
+      // And here 5 * k bytes, past each entry's constant.
+      uint8_t* table = ip;
+      int size = (table[1] << 8) | table[2];
+      uint8_t* entry = &table[3 + switchStrEntry(
+        frame->closure->func->chunk.constants.values, table, tos
+      ) * 5];
+      ip += 5 + size * 5;
+      ip += (uint16_t)((entry[0] << 8) | entry[1]);
+      DISPATCH();
+    }
+    CASE(OP_LOOP): {
+      uint16_t offset = READ_SHORT();
+      ip -= offset;
+      TRACE_LOOP(ip + offset - 3);
+      DISPATCH();
+    }
+    CASE(OP_CALL): {
+      int argCount = READ_BYTE();
+      int frameCount = vm.frameCount;
+      recordCallee(FEEDBACK(ip - 2), PEEK(argCount));
+      frame->ip = ip;
+      STORE_STACK();
+      if (!callVal(PEEK(argCount), argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      ENTER_NATIVE(vm.frameCount > frameCount);
+      frame = &vm.frames[vm.frameCount - 1];
+      ip = frame->ip;
+      LOAD_STACK();
+      DISPATCH();
+    }
+    CASE(OP_TAIL_CALL): {
+      int argCount = READ_BYTE();
+      Value callee = PEEK(argCount);
+      recordCallee(FEEDBACK(ip - 2), callee);
+      frame->ip = ip;
+      STORE_STACK();
+      if (!IS_CLOSURE(callee)) {
+        // Natives and classes don't push a frame to reuse; the
+        // OP_RETURN that follows finishes the job.
+        int frameCount = vm.frameCount;
+        if (!callVal(callee, argCount)) {
           return INTERPRET_RUNTIME_ERROR;
         }
+        ENTER_NATIVE(vm.frameCount > frameCount);
         frame = &vm.frames[vm.frameCount - 1];
         ip = frame->ip;
-        break;
+        LOAD_STACK();
+        DISPATCH();
       }
-      case OP_CLOSURE: {
-        ObjFunc* func = AS_FUNC(READ_CONST());
-        ObjClosure* closure = newClosure(func);
-        push(OBJ_VAL(closure));
-        for (int i = 0; i < closure->upvalCount; i++) {
-          uint8_t isLocal = READ_BYTE();
-          uint8_t index = READ_BYTE();
-          if (isLocal) {
-            closure->upvals[i] =
-              captureUpval(frame->slots + index);
-          }
-          else {
-            closure->upvals[i] = frame->closure->upvals[index];
-          }
-        }
-        break;
+      if (!reuseFrame(AS_CLOSURE(callee), argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
       }
-      case OP_CLOSE_UPVAL:
-        closeUpvals(vm.stackTop - 1);
-        pop();
-        break;
-      case OP_RETURN: {
-        Value result = pop();
-        closeUpvals(frame->slots);
-        vm.frameCount--;
-        if (vm.frameCount == 0) {
-          pop();
-          return INTERPRET_OK;
-        }
-        vm.stackTop = frame->slots;
-        push(result);
-        frame = &vm.frames[vm.frameCount - 1];
-        ip = frame->ip;
-        break;
+      ENTER_NATIVE(true);
+      frame = &vm.frames[vm.frameCount - 1];
+      ip = frame->ip;
+      LOAD_STACK();
+      DISPATCH();
+    }
+    LONG_CASE(OP_INVOKE, READ_LONG()): {
+      ObjStr* method = OPERAND_STR();
+      int argCount = READ_BYTE();
+      int frameCount = vm.frameCount;
+      recordReceiver(FEEDBACK(start), PEEK(argCount));
+      frame->ip = ip;
+      STORE_STACK();
+      if (!invoke(CACHE(start), method, argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
       }
-      case OP_CLASS:
-        push(OBJ_VAL(newClass(READ_STR())));
-        break;
-      case OP_INHERIT: {
-        Value superclass = peek(1);
-        if (!IS_CLASS(superclass)) {
-          runtimeErr("Superclass must be a class.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        ObjClass* subclass = AS_CLASS(peek(0));
-        tableAddAll(
-          &AS_CLASS(superclass)->methods,
-          &subclass->methods
-        );
-        pop();
-        break;
+      ENTER_NATIVE(vm.frameCount > frameCount);
+      frame = &vm.frames[vm.frameCount - 1];
+      ip = frame->ip;
+      LOAD_STACK();
+      DISPATCH();
+    }
+    LONG_CASE(OP_INVOKE_SUPER, READ_LONG()): {
+      ObjStr* method = OPERAND_STR();
+      int argCount = READ_BYTE();
+      int frameCount = vm.frameCount;
+      frame->ip = ip;
+      ObjClass* superclass = AS_CLASS(POP());
+      STORE_STACK();
+      if (
+        !invokeFromClass(CACHE(start), superclass, method, argCount)
+      ) {
+        return INTERPRET_RUNTIME_ERROR;
       }
-      case OP_METHOD:
-        defMethod(READ_STR());
-        break;
+      ENTER_NATIVE(vm.frameCount > frameCount);
+      frame = &vm.frames[vm.frameCount - 1];
+      ip = frame->ip;
+      LOAD_STACK();
+      DISPATCH();
+    }
+    LONG_CASE(OP_CLOSURE, READ_LONG()):
+      STORE_STACK();
+      ip = makeClosure(AS_FUNC(OPERAND_CONST()), ip);
+      LOAD_STACK();
+      DISPATCH();
+    CASE(OP_CLOSE_UPVAL):
+      closeUpvals(sp - 1);
+      DROP();
+      DISPATCH();
+    CASE(OP_RETURN): {
+      Value result = POP();
+      closeUpvals(frame->slots);
+      vm.frameCount--;
+      if (vm.frameCount == 0) {
+        vm.stackTop = sp - 1;
+        return INTERPRET_OK;
+      }
+      sp = frame->slots;
+      PUSH(result);
+      // A nested run() for native code ends with its first frame.
+      if (vm.frameCount == baseFrame) {
+        STORE_STACK();
+        return INTERPRET_OK;
+      }
+      frame = &vm.frames[vm.frameCount - 1];
+      ip = frame->ip;
+      DISPATCH();
+    }
+    LONG_CASE(OP_CLASS, READ_LONG()): {
+      STORE_STACK();
+      ObjClass* class = newClass(OPERAND_STR());
+      PUSH(OBJ_VAL(class));
+      DISPATCH();
+    }
+    CASE(OP_INHERIT):
+      frame->ip = ip;
+      STORE_STACK();
+      if (!inherit(PEEK(1))) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      LOAD_STACK();
+      DISPATCH();
+    LONG_CASE(OP_METHOD, READ_LONG()):
+      STORE_STACK();
+      defMethod(OPERAND_STR());
+      LOAD_STACK();
+      DISPATCH();
+    CASE(OP_JMPF_POP): {
+      uint16_t offset = READ_SHORT();
+      if (falsey(PEEK(0))) {
+        ip += offset;
+      }
+      else {
+        DROP();
+      }
+      DISPATCH();
+    }
+    CASE(OP_JLT_LOCAL_CONST): {
+      // Jumps with 'false' on the stack, like OP_JMPF, so the
+      // exit path's OP_POP still lines up.
+      Value a = frame->slots[READ_BYTE()];
+      Value b = READ_CONST();
+      uint16_t offset = READ_SHORT();
+      bool less;
+      if (IS_INT(a) && IS_INT(b)) {
+        less = AS_INT(a) < AS_INT(b);
+      }
+      else if (IS_NUM(a) && IS_NUM(b)) {
+        less = AS_NUM(a) < AS_NUM(b);
+      }
+      else {
+        RECORD_OPERANDS(ip - 5, a, b);
+        less = valsLt(a, b);
+      }
+      if (!less) {
+        PUSH(BOOL_VAL(false));
+        ip += offset;
+      }
+      DISPATCH();
+    }
+    CASE(OP_GET_LOCAL_PROP): {
+      PUSH(frame->slots[READ_BYTE()]);
+      recordReceiver(FEEDBACK(ip - 2), tos);
+      InlineCache* cache = CACHE(ip - 2);
+      ObjStr* name = READ_STR();
+      frame->ip = ip;
+      STORE_STACK();
+      if (!getProp(cache, name)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      LOAD_STACK();
+      DISPATCH();
+    }
+    CASE(OP_ADD_RR): {
+      Value a = frame->slots[READ_BYTE()];
+      Value b = frame->slots[READ_BYTE()];
+      Value result;
+      REGISTER_OP(OP_ADD, +, 3, a, b, result);
+      PUSH(result);
+      DISPATCH();
+    }
+    CASE(OP_ADD_RK): {
+      Value a = frame->slots[READ_BYTE()];
+      Value b = READ_CONST();
+      Value result;
+      REGISTER_OP(OP_ADD, +, 3, a, b, result);
+      PUSH(result);
+      DISPATCH();
+    }
+    CASE(OP_ADD_RRR): {
+      uint8_t dest = READ_BYTE();
+      Value a = frame->slots[READ_BYTE()];
+      Value b = frame->slots[READ_BYTE()];
+      REGISTER_OP(OP_ADD, +, 4, a, b, frame->slots[dest]);
+      // The destination may be the top slot.
+      tos = sp[-1];
+      DISPATCH();
     }
+    CASE(OP_ADD_RRK): {
+      uint8_t dest = READ_BYTE();
+      Value a = frame->slots[READ_BYTE()];
+      Value b = READ_CONST();
+      REGISTER_OP(OP_ADD, +, 4, a, b, frame->slots[dest]);
+      // The destination may be the top slot.
+      tos = sp[-1];
+      DISPATCH();
+    }
+    CASE(OP_SUB_RR): {
+      Value a = frame->slots[READ_BYTE()];
+      Value b = frame->slots[READ_BYTE()];
+      Value result;
+      REGISTER_OP(OP_SUB, -, 3, a, b, result);
+      PUSH(result);
+      DISPATCH();
+    }
+    CASE(OP_SUB_RK): {
+      Value a = frame->slots[READ_BYTE()];
+      Value b = READ_CONST();
+      Value result;
+      REGISTER_OP(OP_SUB, -, 3, a, b, result);
+      PUSH(result);
+      DISPATCH();
+    }
+    CASE(OP_SUB_RRR): {
+      uint8_t dest = READ_BYTE();
+      Value a = frame->slots[READ_BYTE()];
+      Value b = frame->slots[READ_BYTE()];
+      REGISTER_OP(OP_SUB, -, 4, a, b, frame->slots[dest]);
+      // The destination may be the top slot.
+      tos = sp[-1];
+      DISPATCH();
+    }
+    CASE(OP_SUB_RRK): {
+      uint8_t dest = READ_BYTE();
+      Value a = frame->slots[READ_BYTE()];
+      Value b = READ_CONST();
+      REGISTER_OP(OP_SUB, -, 4, a, b, frame->slots[dest]);
+      // The destination may be the top slot.
+      tos = sp[-1];
+      DISPATCH();
+    }
+    CASE(OP_MUL_RR): {
+      Value a = frame->slots[READ_BYTE()];
+      Value b = frame->slots[READ_BYTE()];
+      Value result;
+      REGISTER_OP(OP_MUL, *, 3, a, b, result);
+      PUSH(result);
+      DISPATCH();
+    }
+    CASE(OP_MUL_RK): {
+      Value a = frame->slots[READ_BYTE()];
+      Value b = READ_CONST();
+      Value result;
+      REGISTER_OP(OP_MUL, *, 3, a, b, result);
+      PUSH(result);
+      DISPATCH();
+    }
+    CASE(OP_MUL_RRR): {
+      uint8_t dest = READ_BYTE();
+      Value a = frame->slots[READ_BYTE()];
+      Value b = frame->slots[READ_BYTE()];
+      REGISTER_OP(OP_MUL, *, 4, a, b, frame->slots[dest]);
+      // The destination may be the top slot.
+      tos = sp[-1];
+      DISPATCH();
+    }
+    CASE(OP_MUL_RRK): {
+      uint8_t dest = READ_BYTE();
+      Value a = frame->slots[READ_BYTE()];
+      Value b = READ_CONST();
+      REGISTER_OP(OP_MUL, *, 4, a, b, frame->slots[dest]);
+      // The destination may be the top slot.
+      tos = sp[-1];
+      DISPATCH();
+    }
+    CASE(OP_ADD_NUM): {
+      Value result;
+      if (
+        IS_INT(PEEK(0)) && IS_INT(PEEK(1)) &&
+        intArith(ARITH_ADD, PEEK(1), PEEK(0), &result)
+      ) {
+        DROP();
+        DROP();
+        PUSH(result);
+        DISPATCH();
+      }
+      if (!IS_NUM(PEEK(0)) || !IS_NUM(PEEK(1))) {
+        UNQUICKEN(OP_ADD);
+      }
+      double b = AS_NUM(POP());
+      double a = AS_NUM(POP());
+      PUSH(NUM_VAL(a + b));
+      DISPATCH();
+    }
+    CASE(OP_GT_NUM): NUM_COMPARE_OP(OP_GT, >); DISPATCH();
+    CASE(OP_LT_NUM): NUM_COMPARE_OP(OP_LT, <); DISPATCH();
+    CASE(OP_GT_EQU_NUM): NUM_COMPARE_OP(OP_GT_EQU, >=); DISPATCH();
+    CASE(OP_LT_EQU_NUM): NUM_COMPARE_OP(OP_LT_EQU, <=); DISPATCH();
+    CASE(OP_FOR_NUM): {
+      // Increments the loop variable in its slot, tests it against
+      // the limit and jumps back to the body, or falls out of the
+      // loop with 'false' on the stack for the exit path's OP_POP.
+      Value* counter = &frame->slots[READ_BYTE()];
+      Value step = READ_CONST();
+      uint8_t limit = READ_BYTE();
+      uint8_t mode = READ_BYTE();
+      uint16_t offset = READ_SHORT();
+      if (mode & FOR_NUM_SUB) {
+        REGISTER_OP(OP_SUB, -, 7, *counter, step, *counter);
+      }
+      else {
+        REGISTER_OP(OP_ADD, +, 7, *counter, step, *counter);
+      }
+      tos = sp[-1];
+      Value limitVal = mode & FOR_NUM_LIMIT_LOCAL
+        ? frame->slots[limit]
+        : frame->closure->func->chunk.constants.values[limit];
+      if (forNumCompare(mode, *counter, limitVal)) {
+        ip -= offset;
+        TRACE_LOOP(ip + offset - 7);
+      }
+      else {
+        PUSH(BOOL_VAL(false));
+      }
+      DISPATCH();
+    }
+    CASE(OP_THROW):
+      // Not emitted by the compiler yet.
+      DISPATCH();
+    #ifdef TRACE_JIT
+    do_record:
+      // Every instruction passes through here while a loop is
+      // being recorded.
+      if (!recordStep(ip - 1, sp)) {
+        memcpy(dispatchTable, handlers, sizeof(handlers));
+      }
+      goto *handlers[ip[-1]];
+    #endif
   }
+  // Only the switch loop can get here, on an unknown opcode.
+  return INTERPRET_RUNTIME_ERROR;
   #undef READ_BYTE
   #undef READ_SHORT
   #undef READ_CONST
   #undef READ_STR
+  #undef READ_LONG
+  #undef LONG_CASE
+  #undef OPERAND_CONST
+  #undef OPERAND_STR
+  #undef FEEDBACK
+  #undef CACHE
+  #undef RECORD_OPERANDS
+  #undef SLOW_ARITH
   #undef BINARY_OP
+  #undef INT_OP
+  #undef REGISTER_OP
+  #undef QUICKEN
+  #undef UNQUICKEN
+  #undef COMPARE_OP
+  #undef NUM_COMPARE_OP
+  #undef ENTER_NATIVE
+  #undef TRACE_LOOP
+  #undef PUSH
+  #undef POP
+  #undef PEEK
+  #undef DROP
+  #undef STORE_STACK
+  #undef LOAD_STACK
+  #undef TRACE_EXEC
+  #undef PROFILE_OP
+  #undef CASE
+  #undef DISPATCH
+  #undef INTERPRET_LOOP
 }
 
 InterpretResult interpret(const char* source) {
@@ -852,10 +2789,26 @@ InterpretResult interpret(const char* source) {
   if (func == NULL) {
     return INTERPRET_COMPILE_ERROR;
   }
+  return interpretFunc(func);
+}
+
+InterpretResult interpretFunc(ObjFunc* func) {
   push(OBJ_VAL(func));
   ObjClosure* closure = newClosure(func);
   pop();
   push(OBJ_VAL(closure));
   call(closure, 0);
-  return run();
+  #ifdef NATIVE_CODE
+  // Only a script from `resin --emit-c` has native code to start
+  // in.
+  if (canEnterNative()) {
+    JitResult result = enterNative();
+    if (result == JIT_RETURNED) {
+      pop();
+      return INTERPRET_OK;
+    }
+    return jitFinish(result) ? INTERPRET_OK : INTERPRET_RUNTIME_ERROR;
+  }
+  #endif
+  return run(0);
 }
\ No newline at end of file